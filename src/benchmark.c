@@ -0,0 +1,670 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+
+#include <math.h>
+#include <poll.h>
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "util.h"
+#include "client.h"
+#include "histogram.h"
+
+/*
+ * Load generator, drives a server through a number of connections spread
+ * over a number of threads, each one keeping up to a pipeline of requests in
+ * flight. With a rate set the load is open-loop: requests are scheduled at a
+ * fixed interval on each connection, whatever the replies, and their latency
+ * is measured from the time they were scheduled at, not from the time they
+ * could actually be sent, so a server stalling doesn't hide the requests
+ * which should have been sent meanwhile (coordinated omission). Without a
+ * rate the load is closed-loop, as fast as the server replies.
+ */
+
+/* Time allowed to the requests in flight at the end of the run to complete */
+#define DRAIN_TIMEOUT   (5 * 1000000000ULL)
+
+/* Number of keys put in a single MPUT by the preload */
+#define PRELOAD_BATCH   512
+
+/* Zipfian skew, the same of YCSB */
+#define ZIPFIAN_THETA   0.99
+
+enum bench_op {
+    OP_GET,
+    OP_PUT,
+    OP_DEL,
+    OP_INC,
+    OP_PGET,
+    OP_PDEL,
+    OP_PINC,
+    OP_PING,
+    OPS
+};
+
+static const char *op_names[OPS] = {
+    "get", "put", "del", "inc", "pget", "pdel", "pinc", "ping"
+};
+
+enum bench_dist {
+    DIST_UNIFORM,
+    DIST_ZIPFIAN,
+    DIST_SEQUENTIAL
+};
+
+static const char *dist_names[] = { "uniform", "zipfian", "sequential" };
+
+static struct {
+    const char *host;
+    const char *port;
+    int family;
+    unsigned connections;
+    unsigned pipeline;
+    unsigned threads;
+    double duration;
+    bool duration_set;
+    uint64_t requests;
+    double rate;
+    uint64_t keyspace;
+    enum bench_dist dist;
+    unsigned keysize;
+    unsigned valsize;
+    unsigned prefix_cut;
+    unsigned mix[OPS];
+    unsigned mix_total;
+    bool preload;
+    char *value;
+    /* Zipfian constants, computed once over the keyspace */
+    double zetan;
+    double eta;
+    double alpha;
+} bench = {
+    .host = DEFAULT_HOSTNAME,
+    .port = DEFAULT_PORT,
+    .family = INET,
+    .connections = 50,
+    .pipeline = 1,
+    .threads = 1,
+    .duration = 10,
+    .keyspace = 100000,
+    .dist = DIST_UNIFORM,
+    .keysize = 16,
+    .valsize = 64,
+    .prefix_cut = 2,
+    .mix = { [OP_GET] = 90, [OP_PUT] = 10 },
+    .mix_total = 100
+};
+
+/* A request in flight, the time it was scheduled at and its command */
+struct inflight {
+    uint64_t start;
+    enum bench_op op;
+};
+
+struct bench_thread;
+
+struct bench_conn {
+    struct triedb_conn *conn;
+    struct bench_thread *thread;
+    /* Time the next request is scheduled at, open-loop only */
+    uint64_t next;
+    /* Requests in flight, in order, a circular buffer of pipeline size */
+    struct inflight *inflight;
+    unsigned head;
+    unsigned count;
+};
+
+struct bench_thread {
+    pthread_t id;
+    struct bench_conn *conns;
+    unsigned nconns;
+    /* Max number of requests to send, 0 for no limit */
+    uint64_t limit;
+    uint64_t rng;
+    uint64_t seq;
+    /* Time of the last wake up, replies are timed against it */
+    uint64_t now;
+    uint64_t issued;
+    uint64_t completed;
+    uint64_t errors;
+    uint64_t noks;
+    char *key;
+    struct histogram latency[OPS];
+};
+
+static uint64_t start_time;
+
+
+/* xorshift64*, each thread has its own state */
+static inline uint64_t rnd(uint64_t *s) {
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 2685821657736338717ULL;
+}
+
+
+static inline double rnd01(uint64_t *s) {
+    return (rnd(s) >> 11) * 0x1.0p-53;
+}
+
+/* FNV-1a of a rank, to scatter the hottest zipfian keys over the keyspace */
+static inline uint64_t fnv64(uint64_t v) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < 8; ++i) {
+        h ^= v & 0xff;
+        h *= 0x100000001b3ULL;
+        v >>= 8;
+    }
+    return h;
+}
+
+
+static void zipfian_init(uint64_t n) {
+    double zeta2 = 1 + pow(0.5, ZIPFIAN_THETA);
+    bench.zetan = 0;
+    for (uint64_t i = 1; i <= n; ++i)
+        bench.zetan += 1 / pow((double) i, ZIPFIAN_THETA);
+    bench.alpha = 1 / (1 - ZIPFIAN_THETA);
+    bench.eta = (1 - pow(2.0 / n, 1 - ZIPFIAN_THETA)) / (1 - zeta2 / bench.zetan);
+}
+
+/* Rank of a zipfian distributed key, following Gray et al. as YCSB does */
+static uint64_t zipfian_next(uint64_t *s) {
+    double u = rnd01(s);
+    double uz = u * bench.zetan;
+    if (uz < 1)
+        return 0;
+    if (uz < 1 + pow(0.5, ZIPFIAN_THETA))
+        return 1;
+    uint64_t rank = bench.keyspace * pow(bench.eta * u - bench.eta + 1, bench.alpha);
+    return rank < bench.keyspace ? rank : bench.keyspace - 1;
+}
+
+
+static uint64_t next_key(struct bench_thread *t) {
+    switch (bench.dist) {
+        case DIST_ZIPFIAN:
+            return fnv64(zipfian_next(&t->rng)) % bench.keyspace;
+        case DIST_SEQUENTIAL:
+            return t->seq++ % bench.keyspace;
+        default:
+            return rnd(&t->rng) % bench.keyspace;
+    }
+}
+
+/*
+ * Keys are the index zero padded to the key size, after a "key:" prefix,
+ * so that prefix commands on a key with the last digits cut cover a range of
+ * consecutive keys
+ */
+static void format_key(char *buf, uint64_t index) {
+    snprintf(buf, bench.keysize + 1, "key:%0*llu",
+             (int) bench.keysize - 4, (unsigned long long) index);
+}
+
+
+static void on_reply(const struct triedb_reply *reply, void *arg) {
+
+    struct bench_conn *bc = arg;
+    struct bench_thread *t = bc->thread;
+    struct inflight *in = &bc->inflight[bc->head];
+
+    bc->head = (bc->head + 1) % bench.pipeline;
+    bc->count--;
+    t->completed++;
+
+    if (!reply) {
+        t->errors++;
+        return;
+    }
+
+    if (triedb_reply_rc(reply) != OK)
+        t->noks++;
+
+    histogram_record(&t->latency[in->op],
+                     t->now > in->start ? t->now - in->start : 0);
+}
+
+
+static void issue(struct bench_conn *bc, uint64_t start) {
+
+    struct bench_thread *t = bc->thread;
+    struct triedb_conn *c = bc->conn;
+    char *key = t->key;
+    unsigned w = rnd(&t->rng) % bench.mix_total;
+    enum bench_op op = 0;
+
+    while (w >= bench.mix[op])
+        w -= bench.mix[op++];
+
+    format_key(key, next_key(t));
+
+    // Prefix commands cover all the keys sharing the digits left
+    if (op == OP_PGET || op == OP_PDEL || op == OP_PINC)
+        key[bench.keysize - bench.prefix_cut] = '\0';
+
+    switch (op) {
+        case OP_GET:
+        case OP_PGET:
+            triedb_get(c, key, op == OP_PGET, on_reply, bc);
+            break;
+        case OP_PUT:
+            triedb_put(c, key, bench.value, bench.valsize, -1, on_reply, bc);
+            break;
+        case OP_DEL:
+        case OP_PDEL:
+            triedb_del(c, key, op == OP_PDEL, on_reply, bc);
+            break;
+        case OP_INC:
+        case OP_PINC:
+            triedb_incr(c, key, 1, op == OP_PINC, on_reply, bc);
+            break;
+        default:
+            triedb_ping(c, on_reply, bc);
+            break;
+    }
+
+    bc->inflight[(bc->head + bc->count) % bench.pipeline] =
+        (struct inflight) { .start = start, .op = op };
+    bc->count++;
+    t->issued++;
+}
+
+
+static void *bench_thread(void *arg) {
+
+    struct bench_thread *t = arg;
+    uint64_t interval = bench.rate > 0 ?
+        (uint64_t) (1e9 * bench.connections / bench.rate) : 0;
+    uint64_t end = bench.duration_set || !bench.requests ?
+        start_time + (uint64_t) (bench.duration * 1e9) : UINT64_MAX;
+    uint64_t deadline = UINT64_MAX;
+    struct pollfd *pfds = tcalloc(t->nconns, sizeof(*pfds));
+
+    for (unsigned i = 0; i < t->nconns; ++i)
+        pfds[i] = (struct pollfd) { .fd = t->conns[i].conn->fd,
+                                    .events = POLLIN };
+
+    for (;;) {
+
+        uint64_t now = nanotime();
+        uint64_t wake = UINT64_MAX;
+        unsigned inflight = 0;
+        bool sending = now < end && (!t->limit || t->issued < t->limit);
+
+        t->now = now;
+
+        for (unsigned i = 0; i < t->nconns; ++i) {
+            struct bench_conn *bc = &t->conns[i];
+            while (sending && bc->count < bench.pipeline
+                   && (!interval || bc->next <= now)
+                   && (!t->limit || t->issued < t->limit)) {
+                /*
+                 * Open-loop requests are timed from their schedule, late or
+                 * not, closed-loop ones from the time they're sent
+                 */
+                issue(bc, interval ? bc->next : now);
+                bc->next += interval;
+            }
+            if (triedb_flush(bc->conn) < 0) {
+                fprintf(stderr, "Connection lost\n");
+                goto exit;
+            }
+            if (interval && bc->count < bench.pipeline && bc->next < wake)
+                wake = bc->next;
+            inflight += bc->count;
+        }
+
+        if (!sending && deadline == UINT64_MAX)
+            deadline = now + DRAIN_TIMEOUT;
+
+        if (!sending && (inflight == 0 || now > deadline))
+            break;
+
+        /*
+         * Sleep till the next request is due, or some reply comes in; a
+         * connection with a full pipeline is due as soon as it gets a reply
+         */
+        uint64_t until = sending ? (wake < end ? wake : end) : deadline;
+        uint64_t ns = until > now ? until - now : 0;
+        struct timespec ts = { .tv_sec = ns / 1000000000ULL,
+                               .tv_nsec = ns % 1000000000ULL };
+
+        if (ppoll(pfds, t->nconns, &ts, NULL) <= 0)
+            continue;
+
+        t->now = nanotime();
+
+        for (unsigned i = 0; i < t->nconns; ++i)
+            if (pfds[i].revents && triedb_poll(t->conns[i].conn, 0) < 0) {
+                fprintf(stderr, "Connection lost\n");
+                goto exit;
+            }
+    }
+
+exit:
+
+    tfree(pfds);
+
+    return NULL;
+}
+
+
+static int preload(void) {
+
+    struct triedb_conn *c = triedb_connect(bench.host, bench.port,
+                                           bench.family);
+    if (!c)
+        return -1;
+
+    struct tuple tuples[PRELOAD_BATCH];
+    char *keys = tmalloc(PRELOAD_BATCH * (bench.keysize + 1));
+    int rc = 0;
+
+    for (uint64_t i = 0; i < bench.keyspace; i += PRELOAD_BATCH) {
+        unsigned short n = 0;
+        for (; n < PRELOAD_BATCH && i + n < bench.keyspace; ++n) {
+            char *key = keys + n * (bench.keysize + 1);
+            format_key(key, i + n);
+            tuples[n] = (struct tuple) {
+                .ttl = -1,
+                .key = (unsigned char *) key,
+                .keylen = bench.keysize,
+                .val = (unsigned char *) bench.value,
+                .vallen = bench.valsize
+            };
+        }
+        // Batches are packed right away, the keys buffer can be reused
+        triedb_mput(c, tuples, n, NULL, NULL);
+        if (triedb_wait(c) < 0) {
+            rc = -1;
+            break;
+        }
+    }
+
+    tfree(keys);
+    triedb_close(c);
+
+    return rc;
+}
+
+
+static int parse_mix(char *mix) {
+
+    char *saveptr = NULL;
+
+    memset(bench.mix, 0, sizeof(bench.mix));
+    bench.mix_total = 0;
+
+    for (char *tok = strtok_r(mix, ",", &saveptr); tok;
+         tok = strtok_r(NULL, ",", &saveptr)) {
+        char *eq = strchr(tok, '=');
+        if (!eq)
+            return -1;
+        *eq = '\0';
+        int op = 0;
+        while (op < OPS && strcmp(op_names[op], tok) != 0)
+            op++;
+        if (op == OPS)
+            return -1;
+        bench.mix[op] = atoi(eq + 1);
+        bench.mix_total += bench.mix[op];
+    }
+
+    return bench.mix_total > 0 ? 0 : -1;
+}
+
+
+static void print_results(struct bench_thread *threads, uint64_t elapsed) {
+
+    struct histogram total[OPS + 1];
+    uint64_t issued = 0, completed = 0, errors = 0, noks = 0;
+    double secs = elapsed / 1e9;
+
+    for (int op = 0; op <= OPS; ++op)
+        histogram_init(&total[op]);
+
+    for (unsigned i = 0; i < bench.threads; ++i) {
+        issued += threads[i].issued;
+        completed += threads[i].completed;
+        errors += threads[i].errors;
+        noks += threads[i].noks;
+        for (int op = 0; op < OPS; ++op) {
+            histogram_merge(&total[op], &threads[i].latency[op]);
+            histogram_merge(&total[OPS], &threads[i].latency[op]);
+        }
+    }
+
+    printf("\n%u connections, pipeline %u, %u threads, ", bench.connections,
+           bench.pipeline, bench.threads);
+    if (bench.rate > 0)
+        printf("open-loop at %.0f req/s\n", bench.rate);
+    else
+        printf("closed-loop\n");
+    printf("%llu keys %s, keys %u bytes, values %u bytes\n",
+           (unsigned long long) bench.keyspace, dist_names[bench.dist],
+           bench.keysize, bench.valsize);
+    printf("%llu requests sent, %llu completed in %.2fs, %.2f req/s\n",
+           (unsigned long long) issued, (unsigned long long) completed,
+           secs, completed / secs);
+    printf("%llu NOK, %llu errors\n\n",
+           (unsigned long long) noks, (unsigned long long) errors);
+
+    printf("%-6s %10s %12s %10s %10s %10s %10s %10s\n", "op", "count",
+           "req/s", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+
+    for (int op = 0; op <= OPS; ++op) {
+        const struct histogram *h = &total[op];
+        if (h->count == 0)
+            continue;
+        printf("%-6s %10llu %12.2f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+               op < OPS ? op_names[op] : "all",
+               (unsigned long long) h->count, h->count / secs,
+               histogram_percentile(h, 50) / 1e3,
+               histogram_percentile(h, 90) / 1e3,
+               histogram_percentile(h, 99) / 1e3,
+               histogram_percentile(h, 99.9) / 1e3, h->max / 1e3);
+    }
+}
+
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [-a addr] [-p port] [-s unix socket] [-c connections]\n"
+            "       [-P pipeline] [-T threads] [-d seconds] [-n requests]\n"
+            "       [-r req/s] [-k keyspace] [-D uniform|zipfian|sequential]\n"
+            "       [-K key size] [-V value size] [-x prefix cut] [-m mix] [-l]\n"
+            "\n"
+            "Mix is a list of op=weight, ops being %s",
+            name, op_names[0]);
+    for (int op = 1; op < OPS; ++op)
+        fprintf(stderr, ", %s", op_names[op]);
+    fprintf(stderr, "\ne.g. -m get=80,put=15,pget=5\n");
+    exit(EXIT_FAILURE);
+}
+
+
+int main(int argc, char **argv) {
+
+    int opt;
+
+    while ((opt = getopt(argc, argv, "a:p:s:c:P:T:d:n:r:k:D:K:V:x:m:l")) != -1) {
+        switch (opt) {
+            case 'a':
+                bench.host = optarg;
+                break;
+            case 'p':
+                bench.port = optarg;
+                break;
+            case 's':
+                bench.host = optarg;
+                bench.port = NULL;
+                bench.family = UNIX;
+                break;
+            case 'c':
+                bench.connections = atoi(optarg);
+                break;
+            case 'P':
+                bench.pipeline = atoi(optarg);
+                break;
+            case 'T':
+                bench.threads = atoi(optarg);
+                break;
+            case 'd':
+                bench.duration = atof(optarg);
+                bench.duration_set = true;
+                break;
+            case 'n':
+                bench.requests = strtoull(optarg, NULL, 10);
+                break;
+            case 'r':
+                bench.rate = atof(optarg);
+                break;
+            case 'k':
+                bench.keyspace = strtoull(optarg, NULL, 10);
+                break;
+            case 'D':
+                if (strcmp(optarg, "uniform") == 0)
+                    bench.dist = DIST_UNIFORM;
+                else if (strcmp(optarg, "zipfian") == 0)
+                    bench.dist = DIST_ZIPFIAN;
+                else if (strcmp(optarg, "sequential") == 0)
+                    bench.dist = DIST_SEQUENTIAL;
+                else
+                    usage(argv[0]);
+                break;
+            case 'K':
+                bench.keysize = atoi(optarg);
+                break;
+            case 'V':
+                bench.valsize = atoi(optarg);
+                break;
+            case 'x':
+                bench.prefix_cut = atoi(optarg);
+                break;
+            case 'm':
+                if (parse_mix(optarg) < 0)
+                    usage(argv[0]);
+                break;
+            case 'l':
+                bench.preload = true;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    if (bench.connections == 0 || bench.pipeline == 0 || bench.threads == 0
+        || bench.keyspace == 0 || bench.valsize == 0 || bench.duration <= 0)
+        usage(argv[0]);
+
+    if (bench.threads > bench.connections)
+        bench.threads = bench.connections;
+
+    // Room for the "key:" prefix and all the digits of the keyspace
+    unsigned digits = number_len(bench.keyspace - 1);
+    if (bench.keysize < digits + 4)
+        bench.keysize = digits + 4;
+    if (bench.prefix_cut >= bench.keysize - 4)
+        bench.prefix_cut = bench.keysize - 5;
+
+    bench.value = tmalloc(bench.valsize);
+    memset(bench.value, 'x', bench.valsize);
+
+    if (bench.dist == DIST_ZIPFIAN)
+        zipfian_init(bench.keyspace);
+
+    if (bench.preload) {
+        printf("Preloading %llu keys\n", (unsigned long long) bench.keyspace);
+        if (preload() < 0) {
+            fprintf(stderr, "Preload failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    struct bench_thread *threads = tcalloc(bench.threads, sizeof(*threads));
+    struct bench_conn *conns = tcalloc(bench.connections, sizeof(*conns));
+
+    // Connections are opened up front, out of the measured time
+    for (unsigned i = 0; i < bench.connections; ++i) {
+        conns[i].conn = triedb_connect(bench.host, bench.port, bench.family);
+        if (!conns[i].conn) {
+            perror("Unable to connect");
+            exit(EXIT_FAILURE);
+        }
+        conns[i].inflight = tcalloc(bench.pipeline, sizeof(struct inflight));
+    }
+
+    start_time = nanotime();
+
+    for (unsigned i = 0, c = 0; i < bench.threads; ++i) {
+        struct bench_thread *t = &threads[i];
+        t->nconns = bench.connections / bench.threads
+            + (i < bench.connections % bench.threads);
+        t->conns = conns + c;
+        t->limit = bench.requests / bench.threads
+            + (i < bench.requests % bench.threads);
+        t->rng = nanotime() ^ fnv64(i + 1);
+        t->seq = bench.keyspace / bench.threads * i;
+        t->key = tmalloc(bench.keysize + 1);
+        for (int op = 0; op < OPS; ++op)
+            histogram_init(&t->latency[op]);
+        for (unsigned j = 0; j < t->nconns; ++j, ++c) {
+            t->conns[j].thread = t;
+            // Schedules are staggered, not to send all the requests at once
+            t->conns[j].next = start_time
+                + (uint64_t) (1e9 * c / (bench.rate > 0 ? bench.rate : 1e9));
+        }
+    }
+
+    for (unsigned i = 0; i < bench.threads; ++i)
+        pthread_create(&threads[i].id, NULL, bench_thread, &threads[i]);
+
+    for (unsigned i = 0; i < bench.threads; ++i)
+        pthread_join(threads[i].id, NULL);
+
+    print_results(threads, nanotime() - start_time);
+
+    for (unsigned i = 0; i < bench.connections; ++i) {
+        triedb_close(conns[i].conn);
+        tfree(conns[i].inflight);
+    }
+
+    for (unsigned i = 0; i < bench.threads; ++i)
+        tfree(threads[i].key);
+
+    tfree(conns);
+    tfree(threads);
+    tfree(bench.value);
+
+    return 0;
+}
@@ -29,9 +29,9 @@
 #include "bst.h"
 
 
-#define MAX(a, b) a > b ? a : b
-#define HEIGHT(n) !n ? 0 : n->height
-#define BALANCE(n) !n ? 0 : (HEIGHT(n->left)) - (HEIGHT(n->right))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define HEIGHT(n) (!(n) ? 0 : (n)->height)
+#define BALANCE(n) (!(n) ? 0 : HEIGHT((n)->left) - HEIGHT((n)->right))
 
 
 struct bst_node *bst_new(unsigned char key, const void *data) {
@@ -60,11 +60,11 @@ static struct bst_node *bst_rotate_right(struct bst_node *y) {
 
 
 static struct bst_node *bst_rotate_left(struct bst_node *x) {
-    struct bst_node *y = x->left;
-    struct bst_node *t2 = y->right;
+    struct bst_node *y = x->right;
+    struct bst_node *t2 = y->left;
 
-    y->right = x;
-    x->left = t2;
+    y->left = x;
+    x->right = t2;
 
     x->height = MAX(HEIGHT(x->left), HEIGHT(x->right)) + 1;
     y->height = MAX(HEIGHT(y->left), HEIGHT(y->right)) + 1;
@@ -183,7 +183,7 @@ struct bst_node *bst_delete(struct bst_node *node, unsigned char key) {
         return node;
     if (key < node->key)
         node->left = bst_delete(node->left, key);
-    if (key > node->key)
+    else if (key > node->key)
         node->right = bst_delete(node->right, key);
     else {
         if (!node->left || !node->right) {
@@ -197,6 +197,7 @@ struct bst_node *bst_delete(struct bst_node *node, unsigned char key) {
         } else {
             struct bst_node *tmp = bst_min(node->right);
             node->key = tmp->key;
+            node->data = tmp->data;
             node->right = bst_delete(node->right, tmp->key);
         }
     }
@@ -0,0 +1,784 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <poll.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "util.h"
+#include "pack.h"
+#include "client.h"
+
+
+/*
+ * Fail all the requests still pending, calling their callbacks with a NULL
+ * reply, the connection refuses any other request from then on
+ */
+static void conn_fail(struct triedb_conn *conn) {
+
+    if (conn->failed)
+        return;
+
+    conn->failed = true;
+    conn->olen = conn->osent = 0;
+
+    while (conn->pcount > 0) {
+        struct triedb_pending p = conn->pending[conn->phead];
+        conn->phead = (conn->phead + 1) % conn->pcap;
+        conn->pcount--;
+        if (p.callback)
+            p.callback(NULL, p.arg);
+    }
+}
+
+/*
+ * Hand the complete replies in the read buffer to their callbacks, in order,
+ * keeping the bytes of the last one if it's not complete yet. Return -1 on
+ * malformed or unexpected replies.
+ */
+static int conn_dispatch(struct triedb_conn *conn) {
+
+    size_t pos = 0;
+
+    while (conn->ilen - pos >= 2) {
+
+        /*
+         * The remaining length takes at most MAX_LEN_BYTES, it can be decoded
+         * only once all of its bytes are there
+         */
+        size_t avail = conn->ilen - pos - 1, lenbytes = 0;
+        while (lenbytes < avail && lenbytes < MAX_LEN_BYTES
+               && conn->ibuf[pos + 1 + lenbytes] & 0x80)
+            lenbytes++;
+
+        if (lenbytes == MAX_LEN_BYTES)
+            return -1;
+
+        if (lenbytes == avail)
+            break;
+
+        unsigned steps = 0;
+        const unsigned char *p = conn->ibuf + pos + 1;
+        size_t len = decode_length(&p, &steps);
+
+        if (conn->ilen - pos - 1 - steps < len)
+            break;
+
+        struct triedb_reply reply = {
+            .header = { .byte = conn->ibuf[pos] },
+            .len = len,
+            .payload = conn->ibuf + pos + 1 + steps
+        };
+
+        pos += 1 + steps + len;
+
+        // NOTIFY is pushed at any time, it's not the reply to any request
+        if (reply.header.bits.opcode == EXT && len > 1
+            && reply.payload[0] == NOTIFY) {
+            if (conn->on_notify)
+                conn->on_notify(&reply, conn->notify_arg);
+            continue;
+        }
+
+        if (conn->pcount == 0)
+            return -1;
+
+        struct triedb_pending pending = conn->pending[conn->phead];
+        conn->phead = (conn->phead + 1) % conn->pcap;
+        conn->pcount--;
+
+        if (pending.callback)
+            pending.callback(&reply, pending.arg);
+    }
+
+    if (pos > 0) {
+        memmove(conn->ibuf, conn->ibuf + pos, conn->ilen - pos);
+        conn->ilen -= pos;
+    }
+
+    return 0;
+}
+
+/*
+ * Read and dispatch all the replies already arrived, without blocking.
+ * Return -1 on disconnection or on errors.
+ */
+static int conn_read(struct triedb_conn *conn) {
+
+    ssize_t n;
+
+    for (;;) {
+
+        if (conn->icap - conn->ilen < CLIENT_READ_SIZE) {
+            conn->icap = conn->icap * 2 + CLIENT_READ_SIZE;
+            conn->ibuf = trealloc(conn->ibuf, conn->icap);
+        }
+
+        size_t space = conn->icap - conn->ilen;
+
+        n = recv(conn->fd, conn->ibuf + conn->ilen, space, MSG_DONTWAIT);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+
+        if (n == 0)
+            return -1;
+
+        conn->ilen += n;
+
+        if (conn_dispatch(conn) < 0)
+            return -1;
+
+        if ((size_t) n < space)
+            return 0;
+    }
+}
+
+/*
+ * Write out as many of the requests queued as possible, without blocking.
+ * Return -1 on errors.
+ */
+static int conn_write(struct triedb_conn *conn) {
+
+    ssize_t n;
+
+    while (conn->osent < conn->olen) {
+
+        n = send(conn->fd, conn->obuf + conn->osent, conn->olen - conn->osent,
+                 MSG_NOSIGNAL | MSG_DONTWAIT);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+
+        conn->osent += n;
+    }
+
+    conn->olen = conn->osent = 0;
+
+    return 0;
+}
+
+/*
+ * Append a packed request to the write buffer and its callback to the
+ * pending ones, the buffer is written out once it's big enough to be worth a
+ * syscall
+ */
+static int conn_queue(struct triedb_conn *conn, bstring raw,
+                      triedb_callback *callback, void *arg) {
+
+    size_t len = bstring_len(raw);
+
+    if (conn->ocap - conn->olen < len) {
+        conn->ocap = (conn->olen + len) * 2;
+        conn->obuf = trealloc(conn->obuf, conn->ocap);
+    }
+
+    memcpy(conn->obuf + conn->olen, raw, len);
+    conn->olen += len;
+
+    bstring_destroy(raw);
+
+    // Grow the circular buffer unrolling it from the head
+    if (conn->pcount == conn->pcap) {
+        size_t cap = conn->pcap ? conn->pcap * 2 : 64;
+        struct triedb_pending *p = tmalloc(cap * sizeof(*p));
+        for (size_t i = 0; i < conn->pcount; ++i)
+            p[i] = conn->pending[(conn->phead + i) % conn->pcap];
+        tfree(conn->pending);
+        conn->pending = p;
+        conn->phead = 0;
+        conn->pcap = cap;
+    }
+
+    conn->pending[(conn->phead + conn->pcount) % conn->pcap] =
+        (struct triedb_pending) { .callback = callback, .arg = arg };
+    conn->pcount++;
+
+    /*
+     * Replies are not read here, callbacks can queue requests while the read
+     * buffer is being dispatched, a full socket just leaves the rest queued
+     */
+    if (conn->olen - conn->osent >= CLIENT_FLUSH_SIZE && conn_write(conn) < 0)
+        conn_fail(conn);
+
+    return 0;
+}
+
+
+struct triedb_conn *triedb_connect(const char *host,
+                                   const char *port, int family) {
+
+    int fd = open_connection(host, port, family);
+
+    if (fd < 0)
+        return NULL;
+
+    struct triedb_conn *conn = tcalloc(1, sizeof(*conn));
+    conn->fd = fd;
+
+    return conn;
+}
+
+
+void triedb_close(struct triedb_conn *conn) {
+    conn_fail(conn);
+    close(conn->fd);
+    tfree(conn->obuf);
+    tfree(conn->ibuf);
+    tfree(conn->pending);
+    tfree(conn);
+}
+
+
+void triedb_on_notify(struct triedb_conn *conn,
+                      triedb_callback *callback, void *arg) {
+    conn->on_notify = callback;
+    conn->notify_arg = arg;
+}
+
+
+int triedb_request(struct triedb_conn *conn, const union triedb_request *req,
+                   triedb_callback *callback, void *arg) {
+
+    if (conn->failed)
+        return -1;
+
+    bstring raw = pack_triedb_request(req, req->header.bits.opcode);
+
+    if (!raw)
+        return -1;
+
+    return conn_queue(conn, raw, callback, arg);
+}
+
+
+int triedb_put(struct triedb_conn *conn, const char *key, const void *val,
+               size_t vallen, int ttl, triedb_callback *callback, void *arg) {
+
+    size_t keylen = strlen(key);
+
+    if (keylen > UINT16_MAX)
+        return -1;
+
+    union triedb_request req = {
+        .put = {
+            .header = { .byte = PUT << 4 },
+            .ttl = ttl,
+            .keylen = keylen,
+            .vallen = vallen,
+            .key = (unsigned char *) key,
+            .val = (unsigned char *) val
+        }
+    };
+
+    return triedb_request(conn, &req, callback, arg);
+}
+
+
+static int triedb_key_request(struct triedb_conn *conn, unsigned char opcode,
+                              const char *key, bool prefix,
+                              triedb_callback *callback, void *arg) {
+
+    size_t keylen = strlen(key);
+
+    if (keylen > UINT16_MAX)
+        return -1;
+
+    union triedb_request req = {
+        .get = {
+            .header = { .byte = opcode << 4 },
+            .keylen = keylen,
+            .key = (unsigned char *) key
+        }
+    };
+
+    req.header.bits.prefix = prefix;
+
+    return triedb_request(conn, &req, callback, arg);
+}
+
+
+int triedb_get(struct triedb_conn *conn, const char *key, bool prefix,
+               triedb_callback *callback, void *arg) {
+    return triedb_key_request(conn, GET, key, prefix, callback, arg);
+}
+
+
+int triedb_del(struct triedb_conn *conn, const char *key, bool prefix,
+               triedb_callback *callback, void *arg) {
+    return triedb_key_request(conn, DEL, key, prefix, callback, arg);
+}
+
+
+int triedb_incr(struct triedb_conn *conn, const char *key, int64_t delta,
+                bool prefix, triedb_callback *callback, void *arg) {
+
+    size_t keylen = strlen(key);
+
+    if (keylen > UINT16_MAX)
+        return -1;
+
+    union triedb_request req = {
+        .incr = {
+            .header = { .byte = INC << 4 },
+            .delta = delta,
+            .keylen = keylen,
+            .key = (unsigned char *) key
+        }
+    };
+
+    req.header.bits.prefix = prefix;
+
+    return triedb_request(conn, &req, callback, arg);
+}
+
+
+int triedb_ping(struct triedb_conn *conn,
+                triedb_callback *callback, void *arg) {
+    union triedb_request req = { .header = { .byte = PING << 4 } };
+    return triedb_request(conn, &req, callback, arg);
+}
+
+
+int triedb_ext(struct triedb_conn *conn, unsigned char opcode, bool prefix,
+               const unsigned char *data, size_t len,
+               triedb_callback *callback, void *arg) {
+
+    union triedb_request req = {
+        .ext = {
+            .header = { .byte = EXT << 4 },
+            .opcode = opcode,
+            .len = len,
+            .data = (unsigned char *) data
+        }
+    };
+
+    req.header.bits.prefix = prefix;
+
+    return triedb_request(conn, &req, callback, arg);
+}
+
+
+static int triedb_batch(struct triedb_conn *conn, unsigned char opcode,
+                        const struct tuple *tuples, unsigned short n,
+                        triedb_callback *callback, void *arg) {
+
+    // The server refuses empty batches
+    if (conn->failed || n == 0)
+        return -1;
+
+    return conn_queue(conn, pack_batch(opcode, tuples, n), callback, arg);
+}
+
+
+static int triedb_keys_batch(struct triedb_conn *conn, unsigned char opcode,
+                             const char *const *keys, unsigned short n,
+                             triedb_callback *callback, void *arg) {
+
+    if (n == 0)
+        return -1;
+
+    struct tuple *tuples = tcalloc(n, sizeof(*tuples));
+    int rc = 0;
+
+    for (unsigned short i = 0; i < n; ++i) {
+        size_t keylen = strlen(keys[i]);
+        if (keylen > UINT16_MAX) {
+            rc = -1;
+            goto exit;
+        }
+        tuples[i].key = (unsigned char *) keys[i];
+        tuples[i].keylen = keylen;
+    }
+
+    rc = triedb_batch(conn, opcode, tuples, n, callback, arg);
+
+exit:
+
+    tfree(tuples);
+
+    return rc;
+}
+
+
+int triedb_mget(struct triedb_conn *conn, const char *const *keys,
+                unsigned short n, triedb_callback *callback, void *arg) {
+    return triedb_keys_batch(conn, MGET, keys, n, callback, arg);
+}
+
+
+int triedb_mdel(struct triedb_conn *conn, const char *const *keys,
+                unsigned short n, triedb_callback *callback, void *arg) {
+    return triedb_keys_batch(conn, MDEL, keys, n, callback, arg);
+}
+
+
+int triedb_mput(struct triedb_conn *conn, const struct tuple *tuples,
+                unsigned short n, triedb_callback *callback, void *arg) {
+    return triedb_batch(conn, MPUT, tuples, n, callback, arg);
+}
+
+
+int triedb_flush(struct triedb_conn *conn) {
+
+    while (!conn->failed && conn->osent < conn->olen) {
+
+        if (conn_write(conn) < 0) {
+            conn_fail(conn);
+            break;
+        }
+
+        if (conn->osent == conn->olen)
+            break;
+
+        /*
+         * The socket is full, keep reading the replies meanwhile, the server
+         * could be waiting for them to be read before reading any further
+         */
+        struct pollfd pfd = { .fd = conn->fd, .events = POLLIN | POLLOUT };
+
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            conn_fail(conn);
+            break;
+        }
+
+        if (pfd.revents & (POLLIN | POLLERR | POLLHUP) && conn_read(conn) < 0)
+            conn_fail(conn);
+    }
+
+    return conn->failed ? -1 : 0;
+}
+
+
+int triedb_poll(struct triedb_conn *conn, int timeout) {
+
+    if (conn->failed)
+        return -1;
+
+    struct pollfd pfd = { .fd = conn->fd, .events = POLLIN };
+
+    if (conn->osent < conn->olen)
+        pfd.events |= POLLOUT;
+
+    if (poll(&pfd, 1, timeout) < 0) {
+        if (errno != EINTR)
+            conn_fail(conn);
+        goto exit;
+    }
+
+    if (pfd.revents & POLLOUT && conn_write(conn) < 0)
+        conn_fail(conn);
+
+    if (pfd.revents & (POLLIN | POLLERR | POLLHUP) && conn_read(conn) < 0)
+        conn_fail(conn);
+
+exit:
+
+    return conn->failed ? -1 : (int) conn->pcount;
+}
+
+
+int triedb_wait(struct triedb_conn *conn) {
+
+    if (triedb_flush(conn) < 0)
+        return -1;
+
+    while (conn->pcount > 0)
+        if (triedb_poll(conn, -1) < 0)
+            return -1;
+
+    return 0;
+}
+
+
+int triedb_reply_rc(const struct triedb_reply *reply) {
+
+    if (reply->header.bits.opcode != ACK)
+        return OK;
+
+    if (reply->len == 1)
+        return reply->payload[0];
+
+    if (reply->len > 1 && (reply->payload[0] == CAS
+                           || reply->payload[0] == CDEL))
+        return reply->payload[1];
+
+    return OK;
+}
+
+
+long long triedb_reply_count(const struct triedb_reply *reply) {
+
+    switch (reply->header.bits.opcode) {
+        case CNT:
+        case INC:
+        case DEC:
+            if (reply->len == sizeof(uint64_t))
+                return (long long) unpacku64(reply->payload);
+            break;
+        case EXT:
+            if (reply->len == 1 + sizeof(uint64_t)
+                && reply->payload[0] == MDEL)
+                return (long long) unpacku64(reply->payload + 1);
+            break;
+    }
+
+    return -1;
+}
+
+
+int triedb_reply_tuple(const struct triedb_reply *reply, struct tuple *t) {
+
+    // TTL, version and key length
+    size_t hlen = sizeof(int32_t) + sizeof(uint64_t) + sizeof(uint16_t);
+
+    if (reply->header.bits.opcode != GET || reply->header.bits.prefix == 1
+        || reply->len < hlen)
+        return -1;
+
+    unsigned char *p = reply->payload;
+
+    t->ttl = unpacki32(p);
+    t->version = unpacku64(p + sizeof(int32_t));
+    t->keylen = unpacku16(p + sizeof(int32_t) + sizeof(uint64_t));
+
+    if (reply->len - hlen < t->keylen)
+        return -1;
+
+    t->key = p + hlen;
+    t->val = t->key + t->keylen;
+    t->vallen = reply->len - hlen - t->keylen;
+
+    return 0;
+}
+
+/*
+ * Prefix GET tuples, each one is made of TTL, key length, key, value length
+ * on 32 bits and value
+ */
+static int unpack_prefix_tuples(const struct triedb_reply *reply,
+                                struct tuple *t, unsigned short n) {
+
+    unsigned char *p = reply->payload;
+    size_t len = reply->len, pos = sizeof(uint16_t);
+
+    for (unsigned short i = 0; i < n; ++i) {
+
+        if (len - pos < sizeof(int32_t) + sizeof(uint16_t))
+            return -1;
+
+        t[i].ttl = unpacki32(p + pos);
+        t[i].keylen = unpacku16(p + pos + sizeof(int32_t));
+        pos += sizeof(int32_t) + sizeof(uint16_t);
+
+        if (len - pos < t[i].keylen + sizeof(uint32_t))
+            return -1;
+
+        t[i].key = p + pos;
+        pos += t[i].keylen;
+        t[i].vallen = unpacku32(p + pos);
+        pos += sizeof(uint32_t);
+
+        if (len - pos < t[i].vallen)
+            return -1;
+
+        t[i].val = p + pos;
+        pos += t[i].vallen;
+    }
+
+    return 0;
+}
+
+/*
+ * MGET entries, a return code followed by TTL, version, value length and
+ * value for the keys found
+ */
+static int unpack_mget_tuples(const struct triedb_reply *reply,
+                              struct tuple *t, unsigned short n) {
+
+    unsigned char *p = reply->payload;
+    size_t len = reply->len, pos = 1 + sizeof(uint16_t);
+    size_t hlen = sizeof(int32_t) + sizeof(uint64_t) + sizeof(uint32_t);
+
+    for (unsigned short i = 0; i < n; ++i) {
+
+        if (len - pos < 1)
+            return -1;
+
+        t[i].ttl = -1;
+
+        if (p[pos++] != OK)
+            continue;
+
+        if (len - pos < hlen)
+            return -1;
+
+        t[i].ttl = unpacki32(p + pos);
+        t[i].version = unpacku64(p + pos + sizeof(int32_t));
+        t[i].vallen = unpacku32(p + pos + sizeof(int32_t) + sizeof(uint64_t));
+        pos += hlen;
+
+        if (len - pos < t[i].vallen)
+            return -1;
+
+        t[i].val = p + pos;
+        pos += t[i].vallen;
+    }
+
+    return 0;
+}
+
+
+int triedb_reply_tuples(const struct triedb_reply *reply,
+                        struct tuple **tuples) {
+
+    bool mget = reply->header.bits.opcode == EXT
+        && reply->len >= 1 + sizeof(uint16_t) && reply->payload[0] == MGET;
+    bool prefix = reply->header.bits.opcode == GET
+        && reply->header.bits.prefix == 1 && reply->len >= sizeof(uint16_t);
+
+    if (!mget && !prefix)
+        return -1;
+
+    unsigned short n = unpacku16(reply->payload + (mget ? 1 : 0));
+
+    *tuples = NULL;
+
+    if (n == 0)
+        return 0;
+
+    struct tuple *t = tcalloc(n, sizeof(*t));
+
+    int rc = mget ? unpack_mget_tuples(reply, t, n)
+        : unpack_prefix_tuples(reply, t, n);
+
+    if (rc < 0) {
+        tfree(t);
+        return -1;
+    }
+
+    *tuples = t;
+
+    return n;
+}
+
+
+struct triedb_pool *triedb_pool_new(const char *host, const char *port,
+                                    int family, size_t size) {
+
+    struct triedb_pool *pool = tcalloc(1, sizeof(*pool));
+
+    snprintf(pool->host, sizeof(pool->host), "%s", host);
+    if (port)
+        snprintf(pool->port, sizeof(pool->port), "%s", port);
+    pool->family = family;
+    pool->size = size;
+    pool->idle = tcalloc(size, sizeof(struct triedb_conn *));
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    return pool;
+}
+
+
+void triedb_pool_destroy(struct triedb_pool *pool) {
+    for (size_t i = 0; i < pool->nidle; ++i)
+        triedb_close(pool->idle[i]);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    tfree(pool->idle);
+    tfree(pool);
+}
+
+
+struct triedb_conn *triedb_pool_acquire(struct triedb_pool *pool) {
+
+    struct triedb_conn *conn = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+
+    while (pool->nidle == 0 && pool->nconns == pool->size)
+        pthread_cond_wait(&pool->cond, &pool->lock);
+
+    if (pool->nidle > 0) {
+        conn = pool->idle[--pool->nidle];
+        pthread_mutex_unlock(&pool->lock);
+        return conn;
+    }
+
+    // Take the slot before connecting, outside of the lock
+    pool->nconns++;
+
+    pthread_mutex_unlock(&pool->lock);
+
+    conn = triedb_connect(pool->host, pool->family == UNIX ? NULL : pool->port,
+                          pool->family);
+
+    if (!conn) {
+        pthread_mutex_lock(&pool->lock);
+        pool->nconns--;
+        pthread_cond_signal(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return conn;
+}
+
+
+void triedb_pool_release(struct triedb_pool *pool, struct triedb_conn *conn) {
+
+    bool failed = triedb_wait(conn) < 0;
+
+    // Callbacks of a connection are bound to the user who took it
+    conn->on_notify = NULL;
+    conn->notify_arg = NULL;
+
+    if (failed)
+        triedb_close(conn);
+
+    pthread_mutex_lock(&pool->lock);
+
+    if (failed)
+        pool->nconns--;
+    else
+        pool->idle[pool->nidle++] = conn;
+
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,231 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include <stdbool.h>
+#include <pthread.h>
+#include "network.h"
+#include "protocol.h"
+
+/*
+ * Native client, requests are packed with the same encoders of the server
+ * and buffered on the connection, they're written out all together as soon
+ * as the buffer grows past CLIENT_FLUSH_SIZE or it's flushed, saving a round
+ * trip per request. Replies come back in the same order, each one is handed
+ * to the callback set with its request, NOTIFY pushes to the notify callback
+ * instead, at any time between them.
+ *
+ * A connection is not thread-safe, each thread is meant to take its own from
+ * a pool. Callbacks can queue new requests on the connection they're called
+ * for but can't flush, poll or wait on it, the reply they get points into its
+ * read buffer and is valid only till they return.
+ */
+
+/* Size of the pending requests buffer which triggers a write */
+#define CLIENT_FLUSH_SIZE   (64 * 1024)
+
+/* Size of the socket reads */
+#define CLIENT_READ_SIZE    (16 * 1024)
+
+/* A reply as received, header and payload not decoded yet */
+struct triedb_reply {
+    union header header;
+    size_t len;
+    unsigned char *payload;
+};
+
+/*
+ * Called with the reply to a request, NULL if the connection failed before it
+ * came, and an opaque argument
+ */
+typedef void triedb_callback(const struct triedb_reply *, void *);
+
+struct triedb_pending {
+    triedb_callback *callback;
+    void *arg;
+};
+
+struct triedb_conn {
+    int fd;
+    /* Set once the connection failed, every request is refused from then on */
+    bool failed;
+    /* Requests packed and not yet written out, and bytes of them sent */
+    unsigned char *obuf;
+    size_t olen;
+    size_t osent;
+    size_t ocap;
+    /* Bytes received and not yet consumed by a complete reply */
+    unsigned char *ibuf;
+    size_t ilen;
+    size_t icap;
+    /* Callbacks of the requests not yet replied, a circular buffer */
+    struct triedb_pending *pending;
+    size_t phead;
+    size_t pcount;
+    size_t pcap;
+    /* Called with each NOTIFY pushed by the server */
+    triedb_callback *on_notify;
+    void *notify_arg;
+};
+
+/*
+ * Fixed size pool of connections to the same server, shared among threads,
+ * connections are opened lazily as they're acquired
+ */
+struct triedb_pool {
+    char host[256];
+    char port[6];
+    int family;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* Idle connections, a stack */
+    struct triedb_conn **idle;
+    size_t nidle;
+    /* Connections opened, idle or taken */
+    size_t nconns;
+    size_t size;
+};
+
+/*
+ * Connect to a server, host and port for TCP connections, the socket path
+ * and no port for UNIX ones, family is either UNIX or INET. Return NULL on
+ * failure.
+ */
+struct triedb_conn *triedb_connect(const char *, const char *, int);
+
+/* Close a connection, the requests still pending are failed */
+void triedb_close(struct triedb_conn *);
+
+/* Set the callback called with each NOTIFY pushed by the server */
+void triedb_on_notify(struct triedb_conn *, triedb_callback *, void *);
+
+/*
+ * Queue a request, packed by pack_triedb_request, with the callback to call
+ * with its reply, it can be NULL to ignore it. Return -1 if the connection
+ * failed or the command can't be packed.
+ */
+int triedb_request(struct triedb_conn *, const union triedb_request *,
+                   triedb_callback *, void *);
+
+/* Helpers to queue the single commands, with the prefix flag where it fits */
+int triedb_put(struct triedb_conn *, const char *, const void *,
+               size_t, int, triedb_callback *, void *);
+
+int triedb_get(struct triedb_conn *, const char *, bool,
+               triedb_callback *, void *);
+
+int triedb_del(struct triedb_conn *, const char *, bool,
+               triedb_callback *, void *);
+
+int triedb_incr(struct triedb_conn *, const char *, int64_t, bool,
+                triedb_callback *, void *);
+
+int triedb_ping(struct triedb_conn *, triedb_callback *, void *);
+
+/*
+ * Queue an extended command, selected by its opcode, with a payload already
+ * packed
+ */
+int triedb_ext(struct triedb_conn *, unsigned char, bool,
+               const unsigned char *, size_t, triedb_callback *, void *);
+
+/*
+ * Batching helpers, a single MGET, MDEL or MPUT request for a number of
+ * keys, or of tuples carrying key, value and TTL for MPUT
+ */
+int triedb_mget(struct triedb_conn *, const char *const *, unsigned short,
+                triedb_callback *, void *);
+
+int triedb_mdel(struct triedb_conn *, const char *const *, unsigned short,
+                triedb_callback *, void *);
+
+int triedb_mput(struct triedb_conn *, const struct tuple *, unsigned short,
+                triedb_callback *, void *);
+
+/*
+ * Write out all the requests queued, handling the replies coming back in the
+ * meantime. Return -1 if the connection failed.
+ */
+int triedb_flush(struct triedb_conn *);
+
+/*
+ * Write out and read in as much as possible without blocking for more than a
+ * timeout in milliseconds, -1 meaning forever, handling the replies received.
+ * Meant to drive a connection from an event loop, polling on its descriptor.
+ * Return the number of requests still pending, -1 if the connection failed.
+ */
+int triedb_poll(struct triedb_conn *, int);
+
+/*
+ * Write out all the requests queued and wait for all their replies. Return
+ * -1 if the connection failed.
+ */
+int triedb_wait(struct triedb_conn *);
+
+/*
+ * Decoding helpers, keys and values of the tuples point into the reply:
+ *
+ * - triedb_reply_rc: the return code of an ACK, a CAS or a CDEL, OK for any
+ *   other reply
+ * - triedb_reply_count: the value of a CNT, an INC or a DEC, or the number of
+ *   keys deleted by a MDEL, -1 for any other reply
+ * - triedb_reply_tuple: the tuple of a single GET or of a WAIT, -1 for any
+ *   other reply, like a NOK
+ * - triedb_reply_tuples: the tuples of a prefix GET or of a MGET, allocated
+ *   and returned through the last argument, to be released with tfree; MGET
+ *   tuples carry no key, the missing ones no value either. Return their
+ *   number, -1 for any other reply.
+ */
+int triedb_reply_rc(const struct triedb_reply *);
+
+long long triedb_reply_count(const struct triedb_reply *);
+
+int triedb_reply_tuple(const struct triedb_reply *, struct tuple *);
+
+int triedb_reply_tuples(const struct triedb_reply *, struct tuple **);
+
+/* Create a pool of connections to a server, see triedb_connect */
+struct triedb_pool *triedb_pool_new(const char *, const char *, int, size_t);
+
+void triedb_pool_destroy(struct triedb_pool *);
+
+/*
+ * Take a connection from a pool, opening it if none is idle, waiting for one
+ * to be released if all of them are taken. Return NULL if it can't connect.
+ */
+struct triedb_conn *triedb_pool_acquire(struct triedb_pool *);
+
+/*
+ * Give a connection back to its pool, waiting for the replies of its pending
+ * requests first, a failed connection is closed
+ */
+void triedb_pool_release(struct triedb_pool *, struct triedb_conn *);
+
+
+#endif
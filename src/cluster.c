@@ -28,33 +28,17 @@
 #include "util.h"
 #include "list.h"
 #include "cluster.h"
-#include "hashtable.h"
+#include "hash.h"
 #include <stdlib.h>
 #include <string.h>
 
 
-/* Borrowed from hashtable.c, TODO refactor */
 uint16_t hash(const char *keystr) {
 
     if (!keystr)
         return -1;
 
-    uint64_t key = crc32((const uint8_t *) keystr, strlen(keystr));
-
-    /* Robert Jenkins' 32 bit Mix Function */
-    key += (key << 12);
-    key ^= (key >> 22);
-    key += (key << 4);
-    key ^= (key >> 9);
-    key += (key << 10);
-    key ^= (key >> 2);
-    key += (key << 7);
-    key ^= (key >> 12);
-
-    /* Knuth's Multiplicative Method */
-    key = (key >> 3) * KPRIME;
-
-    return key % RING_SIZE;
+    return hash_stable(keystr, strlen(keystr)) % RING_SIZE;
 }
 
 
@@ -96,9 +80,9 @@ static void insert_node(struct cluster *cluster,
 /*
  * To create our consitent hash ring for now we just distribute randomly around
  * the circle our nodes by getting a random value in range [0, RING_SIZE),
- * obtained by generating a hash with CRC32 of the node address:
+ * obtained by hashing the node address:
  *
- *      uint16_t hash = CRC32(host + port) % RING_SIZE.
+ *      uint16_t hash = hash_stable(host + port) % RING_SIZE.
  *
  * Further development will make sure that nodes will be distributed more
  * evenly around by using virtual nodes, in other words by replicating each
@@ -183,7 +167,7 @@ int cluster_add_new_node(struct cluster *cluster, int fd,
 
 /*
  * Retrieve the cluster node which a given hash belong to, the hash is
- * obtained by doing CRC32(key) % RING_SIZE and represents a point in
+ * obtained by doing hash_stable(key) % RING_SIZE and represents a point in
  * the consistent hash ring
  */
 struct cluster_node *cluster_get_node(struct cluster *cluster,
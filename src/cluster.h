@@ -33,8 +33,6 @@
 
 #define RING_SIZE 4096
 
-#define KPRIME 2654435761
-
 /*
  * Contains the max index in the ring size handled by the node and a link to
  * the client referring to the node
@@ -55,7 +53,10 @@ struct cluster {
     List *nodes;
 };
 
-/* Compute a hash of a string by using CRC32 function mod RING_SIZE */
+/*
+ * Compute a hash of a string mod RING_SIZE, the same on every node, see
+ * hash_stable
+ */
 uint16_t hash(const char *);
 
 /*
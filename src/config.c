@@ -89,6 +89,9 @@ static size_t read_time_with_mul(const char *time_string) {
         case 'm':
             mul = 60;
             break;
+        case 'h':
+            mul = 60 * 60;
+            break;
         case 'd':
             mul = 60 * 60 * 24;
             break;
@@ -210,6 +213,27 @@ static void add_config_value(const char *key, const char *value) {
     } else if (STREQ("mode", key, klen) == true) {
         int mode = STREQ(value, "STANDALONE", 10) ? STANDALONE : CLUSTER;
         config.mode = mode;
+    } else if (STREQ("io_backend", key, klen) == true) {
+        int backend = STREQ(value, "io_uring", 8) || STREQ(value, "uring", 5)
+            ? URING_BACKEND : EPOLL_BACKEND;
+        config.io_backend = backend;
+    } else if (STREQ("slowlog_threshold", key, klen) == true) {
+        config.slowlog_threshold = parse_int(value);
+    } else if (STREQ("slowlog_max_len", key, klen) == true) {
+        config.slowlog_max_len = parse_int(value);
+    } else if (STREQ("max_client_requests", key, klen) == true) {
+        int max_requests = parse_int(value);
+        config.max_client_requests = max_requests > 0 ? max_requests : 1;
+    } else if (STREQ("max_queued_requests", key, klen) == true) {
+        config.max_queued_requests = parse_int(value);
+    } else if (STREQ("idle_timeout", key, klen) == true) {
+        config.idle_timeout = read_time_with_mul(value);
+    } else if (STREQ("max_wait_timeout", key, klen) == true) {
+        config.max_wait_timeout = read_time_with_mul(value);
+    } else if (STREQ("max_tracked_keys", key, klen) == true) {
+        config.max_tracked_keys = parse_int(value);
+    } else if (STREQ("compression_threshold", key, klen) == true) {
+        config.compression_threshold = read_memory_with_mul(value);
     }
 }
 
@@ -306,6 +330,16 @@ void config_set_default(void) {
     config.mem_reclaim_time = read_time_with_mul(DEFAULT_MEM_RECLAIM_TIME);
     config.max_request_size = read_memory_with_mul(DEFAULT_MAX_REQUEST_SIZE);
     config.tcp_backlog = SOMAXCONN;
+    config.io_backend = DEFAULT_IO_BACKEND;
+    config.slowlog_threshold = DEFAULT_SLOWLOG_THRESHOLD;
+    config.slowlog_max_len = DEFAULT_SLOWLOG_MAX_LEN;
+    config.max_client_requests = DEFAULT_MAX_CLIENT_REQUESTS;
+    config.max_queued_requests = DEFAULT_MAX_QUEUED_REQUESTS;
+    config.idle_timeout = read_time_with_mul(DEFAULT_IDLE_TIMEOUT);
+    config.max_wait_timeout = read_time_with_mul(DEFAULT_MAX_WAIT_TIMEOUT);
+    config.max_tracked_keys = DEFAULT_MAX_TRACKED_KEYS;
+    config.compression_threshold =
+        read_memory_with_mul(DEFAULT_COMPRESSION_THRESHOLD);
 }
 
 
@@ -328,8 +362,28 @@ void config_print(void) {
             tinfo("\tPort: %s", config.port);
             tinfo("\tTcp backlog: %d", config.tcp_backlog);
         }
+        tinfo("\tIO backend: %s",
+              config.io_backend == URING_BACKEND ? "io_uring" : "epoll");
         const char *human_rsize = memory_to_string(config.max_request_size);
         tinfo("\tMax request size: %s", human_rsize);
+        tinfo("\tMax requests in flight per client: %zu",
+              config.max_client_requests);
+        tinfo("\tMax requests queued: %zu", config.max_queued_requests);
+        if (config.idle_timeout > 0) {
+            const char *human_idle = time_to_string(config.idle_timeout);
+            tinfo("\tIdle clients timeout: %s", human_idle);
+            tfree((char *) human_idle);
+        } else {
+            tinfo("\tIdle clients timeout: never");
+        }
+        if (config.max_wait_timeout > 0) {
+            const char *human_wait = time_to_string(config.max_wait_timeout);
+            tinfo("\tMax WAIT timeout: %s", human_wait);
+            tfree((char *) human_wait);
+        } else {
+            tinfo("\tMax WAIT timeout: never");
+        }
+        tinfo("\tMax keys tracked per client: %zu", config.max_tracked_keys);
         tinfo("Logging:");
         tinfo("\tlevel: %s", llevel);
         tinfo("\tlogpath: %s", config.logpath);
@@ -337,6 +391,16 @@ void config_print(void) {
         const char *human_time = time_to_string(config.mem_reclaim_time);
         tinfo("Max memory: %s", human_memory);
         tinfo("Memory reclaim time: %s", human_time);
+        tinfo("Slow log: %zu entries, threshold %zuus",
+              config.slowlog_max_len, config.slowlog_threshold);
+        if (config.compression_threshold > 0) {
+            const char *human_compress =
+                memory_to_string(config.compression_threshold);
+            tinfo("Compression threshold: %s", human_compress);
+            tfree((char *) human_compress);
+        } else {
+            tinfo("Compression threshold: disabled");
+        }
         tfree((char *) human_time);
         tfree((char *) human_memory);
         tfree((char *) human_rsize);
@@ -37,6 +37,11 @@
 #define STANDALONE                  0x00
 #define CLUSTER                     0x01
 
+// IO backend
+
+#define EPOLL_BACKEND               0x00
+#define URING_BACKEND               0x01
+
 // Default parameters
 
 #define VERSION                     "0.6.11"
@@ -50,6 +55,15 @@
 #define DEFAULT_MAX_MEMORY          "4GB"
 #define DEFAULT_MEM_RECLAIM_TIME    "1d"
 #define DEFAULT_MAX_REQUEST_SIZE    "2MB"
+#define DEFAULT_IO_BACKEND          EPOLL_BACKEND
+#define DEFAULT_SLOWLOG_THRESHOLD   10000
+#define DEFAULT_SLOWLOG_MAX_LEN     128
+#define DEFAULT_MAX_CLIENT_REQUESTS 256
+#define DEFAULT_MAX_QUEUED_REQUESTS 1024
+#define DEFAULT_IDLE_TIMEOUT        "0"
+#define DEFAULT_MAX_WAIT_TIMEOUT    "1h"
+#define DEFAULT_MAX_TRACKED_KEYS    65536
+#define DEFAULT_COMPRESSION_THRESHOLD "0"
 
 
 struct config {
@@ -84,6 +98,32 @@ struct config {
     size_t max_request_size;
     /* TCP backlog size */
     int tcp_backlog;
+    /* IO backend, EPOLL_BACKEND or URING_BACKEND, the latter falls back to
+     * the former if the running kernel doesn't support it */
+    int io_backend;
+    /* Execution time in microseconds after which a command is recorded to
+     * the slow log */
+    size_t slowlog_threshold;
+    /* Max number of entries kept by the slow log, 0 disables it */
+    size_t slowlog_max_len;
+    /* Max number of requests of a single client decoded and not yet replied,
+     * after which its connection is not read anymore */
+    size_t max_client_requests;
+    /* Max number of requests waiting for the worker pool, after which new
+     * ones are refused with a BUSY reply */
+    size_t max_queued_requests;
+    /* Seconds of inactivity after which a client is disconnected, 0 means
+     * never */
+    size_t idle_timeout;
+    /* Max seconds a WAIT is parked for, a longer timeout, or none, is cut
+     * down to it, 0 means no limit */
+    size_t max_wait_timeout;
+    /* Max number of keys and prefixes tracked for a single client, after
+     * which the oldest one is invalidated, 0 means no limit */
+    size_t max_tracked_keys;
+    /* Min size in bytes of the values to be stored compressed, 0 disables
+     * compression */
+    size_t compression_threshold;
 };
 
 extern struct config *conf;
@@ -25,17 +25,298 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <math.h>
+#include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
 #include <assert.h>
 #include "db.h"
+#include "lzf.h"
 #include "trie.h"
 #include "util.h"
 
 
+struct db_value *db_value_new(const void *data, size_t len) {
+    struct db_value *value = tmalloc(sizeof(*value) + len + 1);
+    value->refcount = 1;
+    value->rawlen = 0;
+    value->len = len;
+    memcpy(value->data, data, len);
+    value->data[len] = '\0';
+    return value;
+}
+
+
+struct db_value *db_value_ref(struct db_value *value) {
+    __atomic_add_fetch(&value->refcount, 1, __ATOMIC_RELAXED);
+    return value;
+}
+
+
+void db_value_release(struct db_value *value) {
+    if (!value || __atomic_sub_fetch(&value->refcount, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    tfree(value);
+}
+
+
+struct db_value *db_value_uncompress(struct db_value *value) {
+
+    if (value->rawlen == 0)
+        return value;
+
+    struct db_value *raw = tmalloc(sizeof(*raw) + value->rawlen + 1);
+    raw->refcount = 1;
+    raw->rawlen = 0;
+    raw->len = lzf_decompress(value->data, value->len,
+                              raw->data, value->rawlen);
+    raw->data[raw->len] = '\0';
+
+    db_value_release(value);
+
+    return raw;
+}
+
+/* Version of the last write to any item */
+static uint64_t last_version = 0;
+
+/* Original and compressed size of the values stored compressed */
+static uint64_t compressed_rawlen = 0;
+static uint64_t compressed_len = 0;
+
+
+/*
+ * Parse an integer in canonical form, an optional minus followed by digits
+ * without leading zeros, the only one rendered back identical by
+ * db_item_format
+ */
+static bool parse_canonical_int64(const unsigned char *data,
+                                  size_t len, int64_t *n) {
+
+    bool negative = len > 0 && data[0] == '-';
+    size_t i = negative;
+
+    if (len == i || len > 20 || (data[i] == '0' && (negative || len > 1)))
+        return false;
+
+    int64_t value = 0;
+
+    for (; i < len; ++i) {
+        if (data[i] < '0' || data[i] > '9')
+            return false;
+        int digit = data[i] - '0';
+        if (__builtin_mul_overflow(value, 10, &value)
+            || __builtin_add_overflow(value, negative ? -digit : digit, &value))
+            return false;
+    }
+
+    *n = value;
+
+    return true;
+}
+
+/*
+ * Render a double in its shortest form which is parsed back to the same
+ * value, return the number of bytes written
+ */
+static int format_double(double real, char *buf) {
+    int len = 0;
+    for (int precision = 15; precision <= 17; ++precision) {
+        len = snprintf(buf, DB_FORMAT_MAX, "%.*g", precision, real);
+        if (strtod(buf, NULL) == real)
+            break;
+    }
+    return len;
+}
+
+/*
+ * Parse a floating point number which is rendered back identical by
+ * db_item_format, e.g. 0.1 but not 0.10 or 1e1
+ */
+static bool parse_canonical_double(const unsigned char *data,
+                                   size_t len, double *real) {
+
+    char tmp[DB_FORMAT_MAX], out[DB_FORMAT_MAX];
+
+    if (len >= DB_FORMAT_MAX)
+        return false;
+
+    memcpy(tmp, data, len);
+    tmp[len] = '\0';
+
+    char *end = NULL;
+    double value = strtod(tmp, &end);
+
+    if (end != tmp + len || !isfinite(value)
+        || format_double(value, out) != (int) len || memcmp(out, tmp, len))
+        return false;
+
+    *real = value;
+
+    return true;
+}
+
+/* Release the value of an item, if it's not stored in the item itself */
+static inline void db_item_clear(struct db_item *item) {
+    if (item->encoding == DB_COMPRESSED) {
+        __atomic_sub_fetch(&compressed_rawlen,
+                           item->val->rawlen, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&compressed_len, item->val->len, __ATOMIC_RELAXED);
+    }
+    // Values could be pinned by replies in flight, just drop the reference
+    if (item->encoding == DB_BLOB || item->encoding == DB_COMPRESSED)
+        db_value_release(item->val);
+}
+
+/* Mark an item as just written, bumping its version */
+static inline void db_item_touch(struct db_item *item) {
+    item->version = __atomic_add_fetch(&last_version, 1, __ATOMIC_RELAXED);
+    item->lstime = time(NULL);
+}
+
+
+void db_item_update(struct db_item *item, const void *data, size_t len) {
+
+    int64_t number;
+    double real;
+
+    db_item_clear(item);
+
+    if (parse_canonical_int64(data, len, &number)) {
+        item->encoding = DB_INTEGER;
+        item->number = number;
+    } else if (len <= DB_EMBSTR_MAX) {
+        item->encoding = DB_EMBSTR;
+        item->len = len;
+        memcpy(item->str, data, len);
+        item->str[len] = '\0';
+    } else if (parse_canonical_double(data, len, &real)) {
+        item->encoding = DB_DOUBLE;
+        item->real = real;
+    } else {
+        item->encoding = DB_BLOB;
+        item->val = db_value_new(data, len);
+    }
+
+    db_item_touch(item);
+}
+
+/* Store a value compressed by database_compress, adding a reference to it */
+static void db_item_update_compressed(struct db_item *item,
+                                      struct db_value *value) {
+    db_item_clear(item);
+    item->encoding = DB_COMPRESSED;
+    item->val = db_value_ref(value);
+    __atomic_add_fetch(&compressed_rawlen, value->rawlen, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&compressed_len, value->len, __ATOMIC_RELAXED);
+    db_item_touch(item);
+}
+
+
+const unsigned char *db_item_format(const struct db_item *item,
+                                    unsigned char *buf, size_t *len) {
+
+    switch (item->encoding) {
+        case DB_INTEGER:
+            *len = snprintf((char *) buf, DB_FORMAT_MAX,
+                            "%" PRId64, item->number);
+            return buf;
+        case DB_DOUBLE:
+            *len = format_double(item->real, (char *) buf);
+            return buf;
+        case DB_EMBSTR:
+            memcpy(buf, item->str, item->len + 1);
+            *len = item->len;
+            return buf;
+        case DB_COMPRESSED:
+            *len = lzf_decompress(item->val->data, item->val->len,
+                                  buf, item->val->rawlen);
+            buf[*len] = '\0';
+            return buf;
+        default:
+            *len = item->val->len;
+            return item->val->data;
+    }
+}
+
+
+size_t db_item_format_size(const struct db_item *item) {
+    if (item->encoding == DB_COMPRESSED)
+        return item->val->rawlen + 1;
+    return DB_FORMAT_MAX;
+}
+
+
+bool db_item_add(struct db_item *item, int64_t delta) {
+
+    int64_t n = item->number;
+
+    // Strings are parsed with leading zeros too, e.g. 007
+    if (item->encoding == DB_EMBSTR) {
+        if (!parse_int64((const char *) item->str, &n))
+            return false;
+    } else if (item->encoding == DB_BLOB) {
+        if (!parse_int64((const char *) item->val->data, &n))
+            return false;
+    } else if (item->encoding != DB_INTEGER) {
+        return false;
+    }
+
+    if (__builtin_add_overflow(n, delta, &n))
+        return false;
+
+    db_item_clear(item);
+    item->encoding = DB_INTEGER;
+    item->number = n;
+    db_item_touch(item);
+
+    return true;
+}
+
+
+void db_item_free(struct db_item *item) {
+    db_item_clear(item);
+    tfree(item);
+}
+
+
 void database_init(struct database *db, const char *name,
                    trie_destructor *destructor) {
     db->name = name;
     db->data = trie_new(destructor);
+    db->compress_min = 0;
+    db->subscribers = NULL;
+    db->waiters = NULL;
+    db->tracking = NULL;
+}
+
+/*
+ * Compress a value if the database is configured to and if it saves at least
+ * 1/8 of its size, return NULL otherwise
+ */
+static struct db_value *database_compress(const struct database *db,
+                                          const void *data, size_t len) {
+
+    if (db->compress_min == 0 || len < db->compress_min || len > UINT32_MAX)
+        return NULL;
+
+    size_t max = len - len / 8;
+    struct db_value *value = tmalloc(sizeof(*value) + max + 1);
+    size_t n = lzf_compress(data, len, value->data, max);
+
+    if (n == 0) {
+        tfree(value);
+        return NULL;
+    }
+
+    // Give back the space not used
+    value = trealloc(value, sizeof(*value) + n + 1);
+    value->refcount = 1;
+    value->rawlen = len;
+    value->len = n;
+    value->data[n] = '\0';
+
+    return value;
 }
 
 
@@ -44,17 +325,37 @@ size_t database_size(const struct database *db) {
 }
 
 /*
- * Insert a new key-value pair in the Trie structure, returning a pointer to
- * the new inserted data in order to simplify some operations as the addition
- * of expiring keys with a set TTL.
+ * Insert a new key-value pair in the Trie structure, copying the value. If
+ * the key already exists, its value is replaced, readers still holding a
+ * reference to the old one are unaffected.
  */
-void database_insert(struct database *db, const char *key,
-                     const void *data, short ttl) {
-    struct db_item *item = tmalloc(sizeof(*item));
+struct db_item *database_insert(struct database *db, const char *key,
+                                const void *data, size_t len, short ttl) {
+
+    void *ret = NULL;
+    struct db_item *item = NULL;
+    struct db_value *compressed = database_compress(db, data, len);
+
+    if (trie_find(db->data, key, &ret) && ret) {
+        item = ret;
+    } else {
+        item = tmalloc(sizeof(*item));
+        item->encoding = DB_INTEGER;
+        item->expiry = 0;
+        trie_insert(db->data, key, item);
+    }
+
+    if (compressed) {
+        db_item_update_compressed(item, compressed);
+        db_value_release(compressed);
+    } else {
+        db_item_update(item, data, len);
+    }
+
     item->ttl = ttl;
-    item->lstime = item->ctime = time(NULL);
-    item->data = (void *) data;
-    trie_insert(db->data, key, item);
+    item->ctime = item->lstime;
+
+    return item;
 }
 
 
@@ -116,52 +417,45 @@ Vector *database_prefix_search(const struct database *db, const char *prefix) {
 }
 
 
-static void trie_node_integer_mod(struct trie_node *, int, bool);
+static void trie_node_integer_mod(struct trie_node *, int64_t);
 
 
-static void bst_node_integer_mod(struct bst_node *node, int value, bool inc) {
+static void bst_node_integer_mod(struct bst_node *node, int64_t delta) {
     if (!node)
         return;
     if (node->left)
-        bst_node_integer_mod(node->left, value, inc);
+        bst_node_integer_mod(node->left, delta);
     if (node->right)
-        bst_node_integer_mod(node->right, value, inc);
-    trie_node_integer_mod(node->data, value, inc);
+        bst_node_integer_mod(node->right, delta);
+    trie_node_integer_mod(node->data, delta);
 }
 
 
 /*
  * Auxiliary function to modify trie values only if they're effectively
- * integers, by adding a quantity or subtracting it
+ * integers, by adding a quantity, negative to subtract it
  */
-static void trie_node_integer_mod(struct trie_node *node,
-                                  int value, bool inc) {
+static void trie_node_integer_mod(struct trie_node *node, int64_t delta) {
 
     if (!node)
         return;
 
+    trie_visited++;
+
     if (trie_is_free_node(node) && !node->data)
         return;
 
     struct db_item *item = node->data;
 
-    if (item && item->data && is_integer(item->data)) {
-        int n = parse_int(item->data);
-        n = inc == true ? n + 1 : n - 1;
-        // Check for realloc if the new value is "larger" then previous
-        char tmp[12];  // max size in bytes
-        sprintf(tmp, "%d", n);  // XXX Unsafe
-        size_t len = strlen(tmp);
-        item->data = trealloc(item->data, len + 1);
-        strncpy(item->data, tmp, len + 1);
-        item->lstime = time(NULL);
-    }
+    if (item)
+        db_item_add(item, delta);
 
-    bst_node_integer_mod(node->children, value, inc);
+    bst_node_integer_mod(node->children, delta);
 }
 
-// Add 1 to all integer values matching a given prefix
-void database_prefix_inc(struct database *db, const char *prefix) {
+// Add a value to all integer values matching a given prefix
+void database_prefix_inc(struct database *db,
+                         const char *prefix, int64_t delta) {
 
     assert(db && db->data && prefix);
 
@@ -173,11 +467,12 @@ void database_prefix_inc(struct database *db, const char *prefix) {
         return;
 
     // Check all possible sub-paths and add to count where there is a leaf
-    trie_node_integer_mod(node, 1, true);
+    trie_node_integer_mod(node, delta);
 }
 
-// Subtract 1 to all integer values matching a given prefix
-void database_prefix_dec(struct database *db, const char *prefix) {
+// Subtract a value to all integer values matching a given prefix
+void database_prefix_dec(struct database *db,
+                         const char *prefix, int64_t delta) {
 
     assert(db && db->data && prefix);
 
@@ -189,15 +484,25 @@ void database_prefix_dec(struct database *db, const char *prefix) {
         return;
 
     // Check all possible sub-paths and add to count where there is a leaf
-    trie_node_integer_mod(node, 1, false);
+    if (delta != INT64_MIN)
+        trie_node_integer_mod(node, -delta);
 }
 
 
-static void trie_node_prefix_set(struct trie_node *, const void *, short);
+/* Value to set on all the keys matching a prefix, compressed just once */
+struct prefix_value {
+    const void *data;
+    size_t len;
+    struct db_value *compressed;
+};
+
+
+static void trie_node_prefix_set(struct trie_node *,
+                                 const struct prefix_value *, short);
 
 
 static void bst_node_prefix_set(struct bst_node *node,
-                                const void *val, short ttl) {
+                                const struct prefix_value *val, short ttl) {
     if (!node)
         return;
     if (node->left)
@@ -209,26 +514,31 @@ static void bst_node_prefix_set(struct bst_node *node,
 
 
 static void trie_node_prefix_set(struct trie_node *node,
-                                 const void *val, short ttl) {
+                                 const struct prefix_value *val, short ttl) {
 
     if (!node)
         return;
 
+    trie_visited++;
+
     bst_node_prefix_set(node->children, val, ttl);
 
     struct db_item *item = node->data;
     // mark last node as leaf
     if (item) {
-        tfree(item->data);
-        item->data = tstrdup(val);
+        // A compressed value is shared by all the items
+        if (val->compressed)
+            db_item_update_compressed(item, val->compressed);
+        else
+            db_item_update(item, val->data, val->len);
         item->ttl = ttl;
-        item->lstime = time(NULL);
+        item->ctime = item->lstime;
     }
 }
 
 
 void database_prefix_set(struct database *db, const char *prefix,
-                         const void *val, short ttl) {
+                         const void *val, size_t len, short ttl) {
 
     assert(db && db->data && prefix);
 
@@ -239,8 +549,17 @@ void database_prefix_set(struct database *db, const char *prefix,
     if (!node)
         return;
 
+    struct prefix_value value = {
+        .data = val,
+        .len = len,
+        .compressed = database_compress(db, val, len)
+    };
+
     // Check all possible sub-paths and add to count where there is a leaf
-    trie_node_prefix_set(node, val, ttl);
+    trie_node_prefix_set(node, &value, ttl);
+
+    if (value.compressed)
+        db_value_release(value.compressed);
 }
 
 
@@ -263,11 +582,13 @@ static void trie_node_prefix_ttl(struct trie_node *node, short ttl) {
     if (!node)
         return;
 
+    trie_visited++;
+
     bst_node_prefix_ttl(node->children, ttl);
 
     struct db_item *item = node->data;
     // mark last node as leaf
-    if (item && item->data) {
+    if (item) {
         item->ttl = ttl;
         item->lstime = time(NULL);
     }
@@ -294,3 +615,9 @@ void database_flush(struct database *db) {
     assert(db);
     trie_node_destroy(db->data->root, &db->data->size, db->data->destructor);
 }
+
+
+void database_compression_stats(uint64_t *rawlen, uint64_t *len) {
+    *rawlen = __atomic_load_n(&compressed_rawlen, __ATOMIC_RELAXED);
+    *len = __atomic_load_n(&compressed_len, __ATOMIC_RELAXED);
+}
@@ -29,16 +29,127 @@
 #define DB_H
 
 #include <time.h>
+#include <stdint.h>
 #include "trie.h"
 
 
+/*
+ * Stored values are reference counted, this way a reply can point straight to
+ * the bytes in the database and pin them till they're written out, even if
+ * the key is updated or removed in the meanwhile. Values are never modified
+ * in place once stored, updates swap them with a new one.
+ */
+struct db_value {
+    unsigned refcount;
+    /* Length of the original value if compressed, 0 otherwise */
+    uint32_t rawlen;
+    size_t len;
+    /*
+     * Stored right after the value header, in a single allocation; NUL
+     * terminated, the terminator is not accounted in len
+     */
+    unsigned char data[];
+};
+
+/* Max length of a string value stored inside the item itself */
+#define DB_EMBSTR_MAX   15
+
+/*
+ * Size of the buffer to render the values not stored as blobs, enough for
+ * the longest int64 and double, NUL terminator included
+ */
+#define DB_FORMAT_MAX   32
+
+/*
+ * Encodings of the values, chosen on every write by db_item_update:
+ *
+ * - DB_INTEGER: integers in canonical form, no leading zeros or sign, and
+ *   values incremented or decremented, stored as a native int64
+ * - DB_DOUBLE: floating point numbers too long to be embedded, which can be
+ *   rendered back identical, stored as a native double
+ * - DB_EMBSTR: strings up to DB_EMBSTR_MAX bytes, stored inside the item
+ * - DB_BLOB: everything else, stored in a reference counted db_value
+ * - DB_COMPRESSED: blobs at least as long as the compression threshold of the
+ *   database, stored LZF compressed if it saves at least 1/8 of their size
+ */
+enum db_encoding {
+    DB_INTEGER,
+    DB_DOUBLE,
+    DB_EMBSTR,
+    DB_BLOB,
+    DB_COMPRESSED
+};
+
 struct db_item {
     short ttl;
-    void *data;
+    unsigned char encoding;
+    /* Length of an embedded string */
+    unsigned char len;
+    /* Timer expiring the item if it has a TTL, 0 if none, set by the server */
+    uint32_t expiry;
+    union {
+        int64_t number;
+        double real;
+        /* NUL terminated, the terminator is not accounted in len */
+        unsigned char str[DB_EMBSTR_MAX + 1];
+        struct db_value *val;
+    };
+    /*
+     * Version of the last write, taken from a counter shared by all the
+     * databases, this way it only grows even if the key is deleted and
+     * inserted again
+     */
+    uint64_t version;
     time_t ctime;
     time_t lstime;
 };
 
+/* Create a new value with a single reference, copying len bytes of data */
+struct db_value *db_value_new(const void *, size_t);
+
+/* Add a reference to a value, returning it */
+struct db_value *db_value_ref(struct db_value *);
+
+/* Drop a reference to a value, releasing it when no longer referenced */
+void db_value_release(struct db_value *);
+
+/*
+ * Return the uncompressed form of a value, taking over the reference passed,
+ * values not compressed are returned as they are
+ */
+struct db_value *db_value_uncompress(struct db_value *);
+
+/*
+ * Replace the value of an item with a copy of len bytes of data, bumping its
+ * version and choosing the most compact encoding for it. Readers still
+ * holding a reference to the old value are unaffected.
+ */
+void db_item_update(struct db_item *, const void *, size_t);
+
+/*
+ * Return the bytes of the value of an item, NUL terminated, and set their
+ * length. Blobs are returned as they are, all the other encodings are copied,
+ * rendered or decompressed in the buffer supplied, at least as long as
+ * db_item_format_size, so they're still readable once the item changes.
+ */
+const unsigned char *db_item_format(const struct db_item *,
+                                    unsigned char *, size_t *);
+
+/* Size of the buffer needed by db_item_format for the value of an item */
+size_t db_item_format_size(const struct db_item *);
+
+/*
+ * Add a delta to the integer value of an item, a string value is parsed just
+ * the first time. Return false, leaving the item untouched, if the value is
+ * not an integer or if the result would overflow 64 bits.
+ */
+bool db_item_add(struct db_item *, int64_t);
+
+/* Release an item along with its value */
+void db_item_free(struct db_item *);
+
+struct pubsub;
+
 /*
  * Simple database abstraction, provide some namespacing to keyspace for each
  * client
@@ -46,6 +157,14 @@ struct db_item {
 struct database {
     const char *name;
     Trie *data;
+    /* Min length of the values to be stored compressed, 0 disables it */
+    size_t compress_min;
+    /* Subscribers to the changes of the keys, NULL till the first one */
+    struct pubsub *subscribers;
+    /* Blocking reads parked on the keys, NULL till the first one */
+    struct pubsub *waiters;
+    /* Keys read by the tracking clients, NULL till the first one */
+    struct pubsub *tracking;
 };
 
 
@@ -54,11 +173,11 @@ void database_init(struct database *, const char *, trie_destructor *);
 size_t database_size(const struct database *);
 
 /*
- * Insert a new key-value pair in the Trie structure, returning a pointer to
- * the new inserted data in order to simplify some operations as the addition
- * of expiring keys with a set TTL.
+ * Insert a new key-value pair in the Trie structure, copying the value. If
+ * the key already exists, its value is replaced. Return the item stored.
  */
-void database_insert(struct database *, const char *, const void *, short);
+struct db_item *database_insert(struct database *, const char *,
+                                const void *, size_t, short);
 
 /*
  * Returns true if key is present in trie, else false. Also for lookup the
@@ -98,19 +217,22 @@ Vector *database_prefix_search(const struct database *, const char *);
  * Set value to all keys matching a given prefix in a less than linear time
  * complexity
  */
-void database_prefix_set(struct database *, const char *, const void *, short);
+void database_prefix_set(struct database *, const char *,
+                         const void *, size_t, short);
 
 /*
  * Integer modifying function. Check if a subset of the trie matching a given
- * prefix contains integer and increment it by a value
+ * prefix contains integer and increment it by a value, values which would
+ * overflow are left untouched
  */
-void database_prefix_inc(struct database *, const char *);
+void database_prefix_inc(struct database *, const char *, int64_t);
 
 /*
  * Integer modifying function. Check if a subset of the trie matching a given
- * prefix contains integer and decrement it by a value
+ * prefix contains integer and decrement it by a value, values which would
+ * overflow are left untouched
  */
-void database_prefix_dec(struct database *, const char *);
+void database_prefix_dec(struct database *, const char *, int64_t);
 
 /*
  * Set TTL to all keys matching a given prefix in a less than linear time
@@ -121,4 +243,10 @@ void database_prefix_ttl(struct database *, const char *, short);
 
 void database_flush(struct database *);
 
+/*
+ * Original and compressed size in bytes of all the values currently stored
+ * compressed, across all the databases
+ */
+void database_compression_stats(uint64_t *, uint64_t *);
+
 #endif
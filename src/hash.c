@@ -0,0 +1,207 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include "hash.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define HAVE_CRC32C
+#endif
+
+/* Constants of the multiply-fold hash, from wyhash */
+#define P0  0xa0761d6478bd642fULL
+#define P1  0xe7037ed1a0b428dbULL
+#define P2  0x8ebc6af09c88c6e3ULL
+
+/* Seed of hash_stable, changing it moves every key on the cluster ring */
+#define STABLE_SEED 0x9e3779b97f4a7c15ULL
+
+/*
+ * Little endian reads whatever the host, for hash_stable to give the same
+ * values everywhere
+ */
+static inline uint64_t read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static inline uint64_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+/* 64x64 bits multiplication, folding the 128 bits product with a xor */
+static inline uint64_t mum(uint64_t a, uint64_t b) {
+#ifdef __SIZEOF_INT128__
+    __uint128_t r = (__uint128_t) a * b;
+    return (uint64_t) r ^ (uint64_t) (r >> 64);
+#else
+    uint64_t ha = a >> 32, la = (uint32_t) a;
+    uint64_t hb = b >> 32, lb = (uint32_t) b;
+    uint64_t hh = ha * hb, hl = ha * lb, lh = la * hb, ll = la * lb;
+    uint64_t mid = (ll >> 32) + (uint32_t) hl + (uint32_t) lh;
+    uint64_t lo = (mid << 32) | (uint32_t) ll;
+    uint64_t hi = hh + (hl >> 32) + (lh >> 32) + (mid >> 32);
+    return lo ^ hi;
+#endif
+}
+
+/*
+ * Multiply-fold hash, wyhash stripped of the unrolled loop for long inputs,
+ * keys here being mostly short: 16 bytes per round, the shorter inputs read
+ * with overlapping loads instead of byte by byte
+ */
+static uint64_t hash_wy(const void *data, size_t len, uint64_t seed) {
+
+    const unsigned char *p = data;
+    uint64_t a, b;
+
+    seed ^= mum(seed ^ P0, P1);
+
+    if (len <= 16) {
+        if (len >= 4) {
+            size_t off = (len >> 3) << 2;
+            a = (read32(p) << 32) | read32(p + off);
+            b = (read32(p + len - 4) << 32) | read32(p + len - 4 - off);
+        } else if (len > 0) {
+            a = ((uint64_t) p[0] << 16) | ((uint64_t) p[len >> 1] << 8)
+                | p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        while (i > 16) {
+            seed = mum(read64(p) ^ P1, read64(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = read64(p + i - 16);
+        b = read64(p + i - 8);
+    }
+
+    a ^= P1;
+    b ^= seed;
+    return mum(P1 ^ len, mum(a, b) ^ P2);
+}
+
+
+static uint64_t hash_bytes_wy(const void *data, size_t len) {
+    return hash_wy(data, len, P2);
+}
+
+#ifdef HAVE_CRC32C
+
+/*
+ * CRC32C of the input on two lanes, 8 bytes per instruction, the second one
+ * fed with the words multiplied by a constant: CRC is linear, two lanes of the
+ * same words would carry just 32 bits, the product breaks that. The 64 bits
+ * of the lanes are mixed by a final multiply-fold.
+ */
+__attribute__((target("sse4.2")))
+static uint64_t hash_bytes_crc32c(const void *data, size_t len) {
+
+    const unsigned char *p = data;
+    uint64_t a = (uint32_t) P0, b = (uint32_t) P1;
+    uint64_t w;
+    size_t n = len;
+
+    while (len >= 8) {
+        w = read64(p);
+        a = _mm_crc32_u64(a, w);
+        b = _mm_crc32_u64(b, w * P2);
+        p += 8;
+        len -= 8;
+    }
+
+    /* Tail, up to 7 bytes, read with overlapping loads */
+    if (len > 0) {
+        if (len >= 4)
+            w = read32(p) | (read32(p + len - 4) << 32);
+        else
+            w = p[0] | ((uint64_t) p[len >> 1] << 8)
+                | ((uint64_t) p[len - 1] << 16);
+        a = _mm_crc32_u64(a, w);
+        b = _mm_crc32_u64(b, w * P2);
+    }
+
+    return mum((a << 32 | b) ^ P0 ^ n, P1);
+}
+
+#endif
+
+typedef uint64_t hash_func(const void *, size_t);
+
+static hash_func *hash_selected;
+
+
+static hash_func *hash_select(void) {
+#ifdef HAVE_CRC32C
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+        return hash_bytes_crc32c;
+#endif
+    return hash_bytes_wy;
+}
+
+
+uint64_t hash_bytes(const void *data, size_t len) {
+
+    hash_func *f = __atomic_load_n(&hash_selected, __ATOMIC_RELAXED);
+
+    /* Racing first calls select the same function, any of them can store it */
+    if (!f) {
+        f = hash_select();
+        __atomic_store_n(&hash_selected, f, __ATOMIC_RELAXED);
+    }
+
+    return f(data, len);
+}
+
+
+uint64_t hash_stable(const void *data, size_t len) {
+    return hash_wy(data, len, STABLE_SEED);
+}
+
+
+const char *hash_bytes_impl(void) {
+#ifdef HAVE_CRC32C
+    if (hash_select() == hash_bytes_crc32c)
+        return "crc32c";
+#endif
+    return "wyhash";
+}
@@ -31,118 +31,264 @@
 #include <string.h>
 #include <unistd.h>
 #include <assert.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "util.h"
+#include "hash.h"
 #include "hashtable.h"
 
+/*
+ * Swiss table layout: the entries are split in groups of GROUP_SIZE slots,
+ * each slot has a control byte telling whether it's empty, deleted or full,
+ * and in the last case the 7 lowest bits of the hash of its key. A lookup
+ * compares the control bytes of a whole group at once against those 7 bits,
+ * touching the entries only on a match, and stops at the first group with an
+ * empty slot. Groups are probed in triangular sequence, which visits them
+ * all being their number a power of 2.
+ */
+#define GROUP_SIZE      16
+
+#define CTRL_EMPTY      0x80
+#define CTRL_DELETED    0xfe
+
+/* Max load factor, full and deleted slots over all of them, 7/8 */
+#define MAX_LOAD(n)     ((n) - (n) / 8)
+
+/*
+ * Number of groups of slots moved by each write while resizing, it bounds
+ * the work done by a single write; the writes needed to complete a resize are
+ * always few enough to not fill up the new slots meanwhile
+ */
+#define REHASH_STEP     4
+
+#define H1(hash) ((hash) >> 7)
+#define H2(hash) ((hash) & 0x7f)
 
-const unsigned int INITIAL_SIZE = 4;
+/*
+ * Hashing function for a string, folded in the 32 bits cached in the
+ * entries
+ */
+static inline uint32_t hashtable_hash_int(const uint8_t *keystr, size_t len) {
 
-const unsigned int MAX_CHAIN_LENGTH = 8;
+    assert(keystr);
 
-const unsigned long KNUTH_PRIME = 2654435761;
+    uint64_t hash = hash_bytes(keystr, len);
+
+    return hash ^ (hash >> 32);
+}
 
 /*
- * Hashing function for a string
+ * Group matching, each one returns a mask with a bit set for each slot of the
+ * group satisfying it:
+ *
+ * - group_match: full with the given 7 bits of hash
+ * - group_match_empty: empty
+ * - group_match_free: empty or deleted, both with the highest bit set
  */
-static uint64_t hashtable_hash_int(HashTable *m, const uint8_t *keystr) {
+#ifdef __SSE2__
 
-    assert(m && keystr);
+static inline unsigned group_match(const unsigned char *ctrl, unsigned char h2) {
+    __m128i group = _mm_loadu_si128((const __m128i *) ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(h2)));
+}
 
-    uint64_t key = crc32(keystr, strlen((const char *) keystr));
+static inline unsigned group_match_empty(const unsigned char *ctrl) {
+    __m128i group = _mm_loadu_si128((const __m128i *) ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group,
+                                            _mm_set1_epi8((char) CTRL_EMPTY)));
+}
 
-    /* Robert Jenkins' 32 bit Mix Function */
-    key += (key << 12);
-    key ^= (key >> 22);
-    key += (key << 4);
-    key ^= (key >> 9);
-    key += (key << 10);
-    key ^= (key >> 2);
-    key += (key << 7);
-    key ^= (key >> 12);
+static inline unsigned group_match_free(const unsigned char *ctrl) {
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) ctrl));
+}
 
-    /* Knuth's Multiplicative Method */
-    key = (key >> 3) * KNUTH_PRIME;
+#else
 
-    return key % m->table_size;
+static inline unsigned group_match(const unsigned char *ctrl, unsigned char h2) {
+    unsigned mask = 0;
+    for (int i = 0; i < GROUP_SIZE; ++i)
+        mask |= (unsigned) (ctrl[i] == h2) << i;
+    return mask;
 }
 
+static inline unsigned group_match_empty(const unsigned char *ctrl) {
+    return group_match(ctrl, CTRL_EMPTY);
+}
+
+static inline unsigned group_match_free(const unsigned char *ctrl) {
+    unsigned mask = 0;
+    for (int i = 0; i < GROUP_SIZE; ++i)
+        mask |= (unsigned) (ctrl[i] >> 7) << i;
+    return mask;
+}
+
+#endif
+
+/* Index of the first slot of a mask, consuming it */
+static inline unsigned next_slot(unsigned *mask) {
+    unsigned i = __builtin_ctz(*mask);
+    *mask &= *mask - 1;
+    return i;
+}
+
+
 /*
- * Return the integer of the location in entries to store the point to the item
- * or -HASHTABLE_FULL.
+ * Return the index of the entry of a key, or -1 if it's not in the
+ * slots
  */
-static int hashtable_hash(HashTable *table, const uint8_t *key) {
+static ssize_t slots_find(const struct hashtable_slots *slots,
+                          const char *key, size_t len, uint32_t hash) {
 
-    assert(table && key);
+    size_t groups_mask = slots->table_size / GROUP_SIZE - 1;
+    size_t group = H1(hash) & groups_mask;
 
-    /* If full, return immediately */
-    if (table->size >= (table->table_size / 2))
-        return -HASHTABLE_FULL;
+    for (size_t i = 1; ; ++i) {
 
-    /* Find the best index */
-    uint64_t curr = hashtable_hash_int(table, key);
-    char *k, *currk;
+        const unsigned char *ctrl = slots->ctrl + group * GROUP_SIZE;
+        unsigned mask = group_match(ctrl, H2(hash));
 
-    /* Linear probing */
-    for (int i = 0; i < MAX_CHAIN_LENGTH; ++i) {
+        while (mask) {
+            size_t index = group * GROUP_SIZE + next_slot(&mask);
+            const struct hashtable_entry *e = &slots->entries[index];
+            if (e->hash == hash && e->keylen == len
+                && memcmp(e->key, key, len) == 0)
+                return index;
+        }
 
-        if (table->entries[curr].taken == false)
-            return curr;
+        /* An empty slot ends the probing, the key would have been there */
+        if (group_match_empty(ctrl))
+            return -1;
 
-        k = (char *) table->entries[curr].key;
-        currk = (char *) key;
+        group = (group + i) & groups_mask;
+    }
+}
 
-        if (table->entries[curr].taken == true &&
-            STREQ(k, currk, strlen(k)) == true)
-            return curr;
+/*
+ * Place an entry in the first free slot, empty or deleted, on the probing
+ * sequence of its hash; there's always one, the load factor being below 1
+ */
+static void slots_insert(struct hashtable_slots *slots,
+                         const struct hashtable_entry *entry) {
+
+    size_t groups_mask = slots->table_size / GROUP_SIZE - 1;
+    size_t group = H1(entry->hash) & groups_mask;
+    unsigned mask;
+
+    for (size_t i = 1; ; ++i) {
+        mask = group_match_free(slots->ctrl + group * GROUP_SIZE);
+        if (mask)
+            break;
+        group = (group + i) & groups_mask;
+    }
 
-        curr = (curr + 1) % table->table_size;
+    size_t index = group * GROUP_SIZE + next_slot(&mask);
+
+    if (slots->ctrl[index] == CTRL_DELETED)
+        slots->deleted--;
+
+    slots->ctrl[index] = H2(entry->hash);
+    slots->entries[index] = *entry;
+    slots->used++;
+}
+
+/*
+ * Free the slot of an entry. A group with an empty slot ends all the
+ * probings passing through it, no key was placed past it, so the slot can be
+ * emptied as well; otherwise it must be marked as deleted to keep the
+ * probings going.
+ */
+static void slots_erase(struct hashtable_slots *slots, size_t index) {
+
+    unsigned char *group = slots->ctrl + index / GROUP_SIZE * GROUP_SIZE;
+
+    if (group_match_empty(group)) {
+        slots->ctrl[index] = CTRL_EMPTY;
+    } else {
+        slots->ctrl[index] = CTRL_DELETED;
+        slots->deleted++;
+    }
+
+    slots->used--;
+}
+
+
+static int slots_init(struct hashtable_slots *slots, size_t table_size) {
+
+    unsigned char *ctrl = tmalloc(table_size);
+    struct hashtable_entry *entries =
+        tmalloc(table_size * sizeof(struct hashtable_entry));
+
+    if (!ctrl || !entries) {
+        tfree(ctrl);
+        tfree(entries);
+        return -HASHTABLE_OOM;
     }
 
-    return -HASHTABLE_FULL;
+    memset(ctrl, CTRL_EMPTY, table_size);
+
+    slots->table_size = table_size;
+    slots->used = 0;
+    slots->deleted = 0;
+    slots->ctrl = ctrl;
+    slots->entries = entries;
+
+    return HASHTABLE_OK;
+}
+
+
+static void slots_release(struct hashtable_slots *slots) {
+    tfree(slots->ctrl);
+    tfree(slots->entries);
+    memset(slots, 0, sizeof(*slots));
 }
 
 /*
- * Doubles the size of the hashtable, and rehashes all the elements
+ * Start resizing the hashtable to a number of slots, a power of 2 multiple
+ * of GROUP_SIZE: the current slots are kept aside and their entries are moved
+ * to the new ones a few groups at a time, by the following writes or by
+ * hashtable_rehash_step. A resize still going on is completed first. The
+ * hashtable is left untouched if it runs out of memory.
  */
-static int hashtable_rehash(HashTable *table) {
+static int hashtable_resize(HashTable *table, size_t table_size) {
 
     assert(table);
 
-    size_t old_size;
-    struct hashtable_entry *curr;
+    struct hashtable_slots slots;
 
-    /* Setup the new elements */
-    struct hashtable_entry *temp =
-        tcalloc(2 * table->table_size, sizeof(*temp));
+    while (hashtable_rehash_step(table, table->old.table_size));
 
-    if (!temp)
-        return -HASHTABLE_ERR;
+    int status = slots_init(&slots, table_size);
+    if (status != HASHTABLE_OK)
+        return status;
 
-    /* Update the array */
-    curr = table->entries;
-    table->entries = temp;
+    table->old = table->slots;
+    table->slots = slots;
+    table->rehash_index = 0;
 
-    /* Update the size */
-    old_size = table->table_size;
-    table->table_size = 2 * table->table_size;
-    table->size = 0;
+    return HASHTABLE_OK;
+}
 
-    int status;
+/*
+ * Return the entry of a key, looking into the slots being resized as well,
+ * where it's found only if it wasn't moved yet
+ */
+static struct hashtable_entry *hashtable_find(HashTable *table,
+                                              const char *key, size_t len,
+                                              uint32_t hash) {
 
-    /* Rehash the elements */
-    for (size_t i = 0; i < old_size; ++i) {
+    ssize_t index = slots_find(&table->slots, key, len, hash);
 
-        if (curr[i].taken == false)
-            continue;
+    if (index >= 0)
+        return &table->slots.entries[index];
 
-        if ((status = hashtable_put(table, curr[i].key,
-                                    curr[i].val)) != HASHTABLE_OK)
-            return status;
+    if (table->old.ctrl) {
+        index = slots_find(&table->old, key, len, hash);
+        if (index >= 0)
+            return &table->old.entries[index];
     }
 
-    tfree(curr);
-
-    return HASHTABLE_OK;
+    return NULL;
 }
 
 /* callback function used with iterate to clean up the hashtable */
@@ -173,16 +319,17 @@ HashTable *hashtable_new(int (*destructor)(struct hashtable_entry *)) {
     if(!table)
         return NULL;
 
-    table->entries = tcalloc(INITIAL_SIZE, sizeof(struct hashtable_entry));
-    if(!table->entries) {
-        hashtable_destroy(table);
+    if (slots_init(&table->slots, GROUP_SIZE) != HASHTABLE_OK) {
+        tfree(table);
         return NULL;
     }
 
+    memset(&table->old, 0, sizeof(table->old));
+
     table->destructor = destructor ? destructor : destroy_entry;
 
-    table->table_size = INITIAL_SIZE;
     table->size = 0;
+    table->rehash_index = 0;
 
     return table;
 }
@@ -192,58 +339,95 @@ size_t hashtable_size(const HashTable *table) {
     return table->size;
 }
 
-/* Add a new key-value pair into the hashtable entries array, use chaining in
-   case of collision. */
-int hashtable_put(HashTable *table, const char *key, void *val) {
 
-    assert(table && key);
+bool hashtable_rehashing(const HashTable *table) {
+    return table->old.ctrl != NULL;
+}
+
+/*
+ * Move the entries of up to n groups of the slots being resized to the new
+ * ones, releasing the old slots once they're all moved. Return true if
+ * there's still something to move.
+ */
+bool hashtable_rehash_step(HashTable *table, size_t n) {
+
+    assert(table);
 
-    /* Find a place to put our value */
-    int index = hashtable_hash(table, (const uint8_t *) key);
+    struct hashtable_slots *old = &table->old;
 
-    while (index == -HASHTABLE_FULL){
+    if (!old->ctrl)
+        return false;
 
-        if (hashtable_rehash(table) == -HASHTABLE_ERR)
-            return -HASHTABLE_ERR;
+    size_t end = old->table_size;
 
-        index = hashtable_hash(table, (const uint8_t *) key);
-    }
+    if (n < (end - table->rehash_index) / GROUP_SIZE)
+        end = table->rehash_index + n * GROUP_SIZE;
 
-    /* Set the entries */
-    table->entries[index].val = val;
-    table->entries[index].key = key;
+    for (size_t i = table->rehash_index; i < end && old->used > 0; ++i) {
 
-    /* Update taken flag, if it was false, update the size also */
-    if (table->entries[index].taken == false) {
-        table->entries[index].taken = true;
-        table->size++;
+        if (old->ctrl[i] & 0x80)
+            continue;
+
+        slots_insert(&table->slots, &old->entries[i]);
+        slots_erase(old, i);
     }
 
-    return HASHTABLE_OK;
-}
+    table->rehash_index = end;
 
+    if (old->used > 0)
+        return true;
+
+    slots_release(old);
+    table->rehash_index = 0;
+
+    return false;
+}
 
 /*
- * Get the value void pointer out of the hashtable associated to a key
+ * Add a new key-value pair into the hashtable entries array, an existing key
+ * gets both its key and value pointers replaced, without destroying the old
+ * ones, still owned by the caller.
  */
-void *hashtable_get(HashTable *table, const char *key) {
+int hashtable_put(HashTable *table, const char *key, void *val) {
 
     assert(table && key);
 
-    /* Find data location */
-    uint64_t curr = hashtable_hash_int(table, (const uint8_t *) key);
+    hashtable_rehash_step(table, REHASH_STEP);
 
-    /* Linear probing, if necessary */
-    for (int i = 0; i < MAX_CHAIN_LENGTH; ++i){
-        if (table->entries[curr].taken == true) {
-            if (STREQ(table->entries[curr].key, key, strlen(key)) == true)
-                return table->entries[curr].val;
-        }
-        curr = (curr + 1) % table->table_size;
+    size_t len = strlen(key);
+    uint32_t hash = hashtable_hash_int((const uint8_t *) key, len);
+    struct hashtable_entry *entry = hashtable_find(table, key, len, hash);
+
+    if (entry) {
+        entry->key = key;
+        entry->val = val;
+        return HASHTABLE_OK;
     }
 
-    /* Not found */
-    return NULL;
+    struct hashtable_slots *slots = &table->slots;
+
+    /*
+     * Past the max load, double the slots, or just drop the deleted ones if
+     * they're at least half of the load
+     */
+    if (slots->used + slots->deleted + 1 > MAX_LOAD(slots->table_size)) {
+        size_t table_size = table->size + 1 > MAX_LOAD(slots->table_size) / 2
+            ? slots->table_size * 2 : slots->table_size;
+        int status = hashtable_resize(table, table_size);
+        if (status != HASHTABLE_OK)
+            return status;
+        hashtable_rehash_step(table, REHASH_STEP);
+    }
+
+    slots_insert(slots, &(struct hashtable_entry) {
+        .key = key,
+        .val = val,
+        .hash = hash,
+        .keylen = len
+    });
+    table->size++;
+
+    return HASHTABLE_OK;
 }
 
 
@@ -255,21 +439,21 @@ struct hashtable_entry *hashtable_get_entry(HashTable *table,
 
     assert(table && key);
 
-    /* Find data location */
-    uint64_t curr = hashtable_hash_int(table, (const uint8_t *) key);
+    size_t len = strlen(key);
 
-    /* Linear probing, if necessary */
-    for (int i = 0; i < MAX_CHAIN_LENGTH; ++i) {
-        if (table->entries[curr].taken == true) {
-            if (STREQ(table->entries[curr].key, key, strlen(key)) == true)
-                return &table->entries[curr];
-        }
+    return hashtable_find(table, key, len,
+                          hashtable_hash_int((const uint8_t *) key, len));
+}
 
-        curr = (curr + 1) % table->table_size;
-    }
 
-    /* Not found */
-    return NULL;
+/*
+ * Get the value void pointer out of the hashtable associated to a key
+ */
+void *hashtable_get(HashTable *table, const char *key) {
+
+    struct hashtable_entry *entry = hashtable_get_entry(table, key);
+
+    return entry ? entry->val : NULL;
 }
 
 
@@ -280,34 +464,31 @@ int hashtable_del(HashTable *table, const char *key) {
 
     assert(table && key);
 
-    /* Find key */
-    uint64_t curr = hashtable_hash_int(table, (const uint8_t *) key);
-
-    /* Linear probing, if necessary */
-    for (int i = 0; i < MAX_CHAIN_LENGTH; ++i) {
+    hashtable_rehash_step(table, REHASH_STEP);
 
-        // check wether the position in array is in use
-        if (table->entries[curr].taken == true) {
-            if (STREQ(table->entries[curr].key, key, strlen(key)) == true) {
+    size_t len = strlen(key);
+    uint32_t hash = hashtable_hash_int((const uint8_t *) key, len);
+    struct hashtable_slots *slots = &table->slots;
+    ssize_t index = slots_find(slots, key, len, hash);
 
-                /* Blank out the fields */
-                table->entries[curr].taken = false;
+    if (index < 0 && table->old.ctrl) {
+        slots = &table->old;
+        index = slots_find(slots, key, len, hash);
+    }
 
-                /* Reduce the size */
-                table->size--;
+    /* Data not found */
+    if (index < 0)
+        return -HASHTABLE_ERR;
 
-                /* Destroy the entry */
-                table->destructor(&table->entries[curr]);
+    slots_erase(slots, index);
 
-                return HASHTABLE_OK;
-            }
-        }
+    /* Reduce the size */
+    table->size--;
 
-        curr = (curr + 1) % table->table_size;
-    }
+    /* Destroy the entry */
+    table->destructor(&slots->entries[index]);
 
-    /* Data not found */
-    return -HASHTABLE_ERR;
+    return HASHTABLE_OK;
 }
 
 /*
@@ -323,18 +504,22 @@ int hashtable_map(HashTable *table, int (*func)(struct hashtable_entry *)) {
     if (!table || table->size <= 0)
         return -HASHTABLE_ERR;
 
-    /* Linear probing */
-    for (size_t i = 0; i < table->table_size; ++i) {
+    /* The slots being resized too, if any */
+    const struct hashtable_slots *all[2] = { &table->old, &table->slots };
+
+    for (int s = 0; s < 2; ++s) {
+
+        for (size_t i = 0; i < all[s]->table_size; ++i) {
 
-        if (table->entries[i].taken == true) {
+            if (all[s]->ctrl[i] & 0x80)
+                continue;
 
             /* Apply function to the key-value entry */
-            struct hashtable_entry data = table->entries[i];
+            struct hashtable_entry data = all[s]->entries[i];
             int status = func(&data);
 
             if (status != HASHTABLE_OK)
                 return status;
-
         }
     }
 
@@ -355,18 +540,22 @@ int hashtable_map2(HashTable *table,
     if (!table || table->size <= 0)
         return -HASHTABLE_ERR;
 
-    /* Linear probing */
-    for (size_t i = 0; i < table->table_size; ++i) {
+    /* The slots being resized too, if any */
+    const struct hashtable_slots *all[2] = { &table->old, &table->slots };
+
+    for (int s = 0; s < 2; ++s) {
 
-        if (table->entries[i].taken == true) {
+        for (size_t i = 0; i < all[s]->table_size; ++i) {
+
+            if (all[s]->ctrl[i] & 0x80)
+                continue;
 
             /* Apply function to the key-value entry */
-            struct hashtable_entry data = table->entries[i];
+            struct hashtable_entry data = all[s]->entries[i];
             int status = func(&data, param);
 
             if (status != HASHTABLE_OK)
                 return status;
-
         }
     }
 
@@ -384,120 +573,7 @@ void hashtable_destroy(HashTable *table){
 
     hashtable_map(table, table->destructor);
 
-    if (!table || !table->entries)
-        return;
-
-    tfree(table->entries);
+    slots_release(&table->old);
+    slots_release(&table->slots);
     tfree(table);
 }
-
-/* The implementation here was originally done by Gary S. Brown. Slighltly
- * modified by Pete Warden, without any imposition on the reuse of the code.
- */
-
-/* ============================================================= */
-/*  COPYRIGHT (C) 1986 Gary S. Brown.  You may use this program, or       */
-/*  code or tables extracted from it, as desired without restriction.     */
-/*                                                                        */
-/*  First, the polynomial itself and its table of feedback terms.  The    */
-/*  polynomial is                                                         */
-/*  X^32+X^26+X^23+X^22+X^16+X^12+X^11+X^10+X^8+X^7+X^5+X^4+X^2+X^1+X^0   */
-/*                                                                        */
-/*  Note that we take it "backwards" and put the highest-order term in    */
-/*  the lowest-order bit.  The X^32 term is "implied"; the LSB is the     */
-/*  X^31 term, etc.  The X^0 term (usually shown as "+1") results in      */
-/*  the MSB being 1.                                                      */
-/*                                                                        */
-/*  Note that the usual hardware shift register implementation, which     */
-/*  is what we're using (we're merely optimizing it by doing eight-bit    */
-/*  chunks at a time) shifts bits into the lowest-order term.  In our     */
-/*  implementation, that means shifting towards the right.  Why do we     */
-/*  do it this way?  Because the calculated CRC must be transmitted in    */
-/*  order from highest-order term to lowest-order term.  UARTs transmit   */
-/*  characters in order from LSB to MSB.  By storing the CRC this way,    */
-/*  we hand it to the UART in the order low-byte to high-byte; the UART   */
-/*  sends each low-bit to hight-bit; and the result is transmission bit   */
-/*  by bit from highest- to lowest-order term without requiring any bit   */
-/*  shuffling on our part.  Reception works similarly.                    */
-/*                                                                        */
-/*  The feedback terms table consists of 256, 32-bit entries.  Notes:     */
-/*                                                                        */
-/*      The table can be generated at runtime if desired; code to do so   */
-/*      is shown later.  It might not be obvious, but the feedback        */
-/*      terms simply represent the results of eight shift/xor opera-      */
-/*      tions for all combinations of data and CRC register values.       */
-/*                                                                        */
-/*      The values must be right-shifted by eight bits by the "updcrc"    */
-/*      logic; the shift must be unsigned (bring in zeroes).  On some     */
-/*      hardware you could probably optimize the shift in assembler by    */
-/*      using byte-swap instructions.                                     */
-/*      polynomial $edb88320                                              */
-/*                                                                        */
-/*  --------------------------------------------------------------------  */
-
-static unsigned long crc32_tab[] = {
-    0x00000000L, 0x77073096L, 0xee0e612cL, 0x990951baL, 0x076dc419L,
-    0x706af48fL, 0xe963a535L, 0x9e6495a3L, 0x0edb8832L, 0x79dcb8a4L,
-    0xe0d5e91eL, 0x97d2d988L, 0x09b64c2bL, 0x7eb17cbdL, 0xe7b82d07L,
-    0x90bf1d91L, 0x1db71064L, 0x6ab020f2L, 0xf3b97148L, 0x84be41deL,
-    0x1adad47dL, 0x6ddde4ebL, 0xf4d4b551L, 0x83d385c7L, 0x136c9856L,
-    0x646ba8c0L, 0xfd62f97aL, 0x8a65c9ecL, 0x14015c4fL, 0x63066cd9L,
-    0xfa0f3d63L, 0x8d080df5L, 0x3b6e20c8L, 0x4c69105eL, 0xd56041e4L,
-    0xa2677172L, 0x3c03e4d1L, 0x4b04d447L, 0xd20d85fdL, 0xa50ab56bL,
-    0x35b5a8faL, 0x42b2986cL, 0xdbbbc9d6L, 0xacbcf940L, 0x32d86ce3L,
-    0x45df5c75L, 0xdcd60dcfL, 0xabd13d59L, 0x26d930acL, 0x51de003aL,
-    0xc8d75180L, 0xbfd06116L, 0x21b4f4b5L, 0x56b3c423L, 0xcfba9599L,
-    0xb8bda50fL, 0x2802b89eL, 0x5f058808L, 0xc60cd9b2L, 0xb10be924L,
-    0x2f6f7c87L, 0x58684c11L, 0xc1611dabL, 0xb6662d3dL, 0x76dc4190L,
-    0x01db7106L, 0x98d220bcL, 0xefd5102aL, 0x71b18589L, 0x06b6b51fL,
-    0x9fbfe4a5L, 0xe8b8d433L, 0x7807c9a2L, 0x0f00f934L, 0x9609a88eL,
-    0xe10e9818L, 0x7f6a0dbbL, 0x086d3d2dL, 0x91646c97L, 0xe6635c01L,
-    0x6b6b51f4L, 0x1c6c6162L, 0x856530d8L, 0xf262004eL, 0x6c0695edL,
-    0x1b01a57bL, 0x8208f4c1L, 0xf50fc457L, 0x65b0d9c6L, 0x12b7e950L,
-    0x8bbeb8eaL, 0xfcb9887cL, 0x62dd1ddfL, 0x15da2d49L, 0x8cd37cf3L,
-    0xfbd44c65L, 0x4db26158L, 0x3ab551ceL, 0xa3bc0074L, 0xd4bb30e2L,
-    0x4adfa541L, 0x3dd895d7L, 0xa4d1c46dL, 0xd3d6f4fbL, 0x4369e96aL,
-    0x346ed9fcL, 0xad678846L, 0xda60b8d0L, 0x44042d73L, 0x33031de5L,
-    0xaa0a4c5fL, 0xdd0d7cc9L, 0x5005713cL, 0x270241aaL, 0xbe0b1010L,
-    0xc90c2086L, 0x5768b525L, 0x206f85b3L, 0xb966d409L, 0xce61e49fL,
-    0x5edef90eL, 0x29d9c998L, 0xb0d09822L, 0xc7d7a8b4L, 0x59b33d17L,
-    0x2eb40d81L, 0xb7bd5c3bL, 0xc0ba6cadL, 0xedb88320L, 0x9abfb3b6L,
-    0x03b6e20cL, 0x74b1d29aL, 0xead54739L, 0x9dd277afL, 0x04db2615L,
-    0x73dc1683L, 0xe3630b12L, 0x94643b84L, 0x0d6d6a3eL, 0x7a6a5aa8L,
-    0xe40ecf0bL, 0x9309ff9dL, 0x0a00ae27L, 0x7d079eb1L, 0xf00f9344L,
-    0x8708a3d2L, 0x1e01f268L, 0x6906c2feL, 0xf762575dL, 0x806567cbL,
-    0x196c3671L, 0x6e6b06e7L, 0xfed41b76L, 0x89d32be0L, 0x10da7a5aL,
-    0x67dd4accL, 0xf9b9df6fL, 0x8ebeeff9L, 0x17b7be43L, 0x60b08ed5L,
-    0xd6d6a3e8L, 0xa1d1937eL, 0x38d8c2c4L, 0x4fdff252L, 0xd1bb67f1L,
-    0xa6bc5767L, 0x3fb506ddL, 0x48b2364bL, 0xd80d2bdaL, 0xaf0a1b4cL,
-    0x36034af6L, 0x41047a60L, 0xdf60efc3L, 0xa867df55L, 0x316e8eefL,
-    0x4669be79L, 0xcb61b38cL, 0xbc66831aL, 0x256fd2a0L, 0x5268e236L,
-    0xcc0c7795L, 0xbb0b4703L, 0x220216b9L, 0x5505262fL, 0xc5ba3bbeL,
-    0xb2bd0b28L, 0x2bb45a92L, 0x5cb36a04L, 0xc2d7ffa7L, 0xb5d0cf31L,
-    0x2cd99e8bL, 0x5bdeae1dL, 0x9b64c2b0L, 0xec63f226L, 0x756aa39cL,
-    0x026d930aL, 0x9c0906a9L, 0xeb0e363fL, 0x72076785L, 0x05005713L,
-    0x95bf4a82L, 0xe2b87a14L, 0x7bb12baeL, 0x0cb61b38L, 0x92d28e9bL,
-    0xe5d5be0dL, 0x7cdcefb7L, 0x0bdbdf21L, 0x86d3d2d4L, 0xf1d4e242L,
-    0x68ddb3f8L, 0x1fda836eL, 0x81be16cdL, 0xf6b9265bL, 0x6fb077e1L,
-    0x18b74777L, 0x88085ae6L, 0xff0f6a70L, 0x66063bcaL, 0x11010b5cL,
-    0x8f659effL, 0xf862ae69L, 0x616bffd3L, 0x166ccf45L, 0xa00ae278L,
-    0xd70dd2eeL, 0x4e048354L, 0x3903b3c2L, 0xa7672661L, 0xd06016f7L,
-    0x4969474dL, 0x3e6e77dbL, 0xaed16a4aL, 0xd9d65adcL, 0x40df0b66L,
-    0x37d83bf0L, 0xa9bcae53L, 0xdebb9ec5L, 0x47b2cf7fL, 0x30b5ffe9L,
-    0xbdbdf21cL, 0xcabac28aL, 0x53b39330L, 0x24b4a3a6L, 0xbad03605L,
-    0xcdd70693L, 0x54de5729L, 0x23d967bfL, 0xb3667a2eL, 0xc4614ab8L,
-    0x5d681b02L, 0x2a6f2b94L, 0xb40bbe37L, 0xc30c8ea1L, 0x5a05df1bL,
-    0x2d02ef8dL
-};
-
-/* Return a 32-bit CRC of the contents of the buffer. */
-unsigned long crc32(const uint8_t *s, unsigned int len) {
-    unsigned int i;
-    uint64_t crc32val;
-
-    crc32val = 0LL;
-    for (i = 0;  i < len;  ++i) {
-        crc32val = crc32_tab[(crc32val ^ s[i]) & 0xff] ^ (crc32val >> 8);
-    }
-    return crc32val;
-}
@@ -41,23 +41,45 @@
 #define HASHTABLE_FULL 3
 
 
-/* We need to keep keys and values */
+/*
+ * We need to keep keys and values, along with the hash and the length of the
+ * key, cached to not compute them again on lookups and on resizes
+ */
 struct hashtable_entry {
     const char *key;
     void *val;
-    bool taken;
+    uint32_t hash;
+    uint32_t keylen;
 };
 
 
+/*
+ * Slots of an HashTable, each entry has a control byte telling whether it's
+ * taken, see hashtable.c
+ */
+struct hashtable_slots {
+    size_t table_size;
+    /* Slots of entries, and slots of deleted ones still counted in the load */
+    size_t used;
+    size_t deleted;
+    unsigned char *ctrl;
+    struct hashtable_entry *entries;
+};
+
 /*
  * An HashTable has some maximum size and current size, as well as the data to
- * hold.
+ * hold; keys are compared case-sensitive. Resizes are incremental, the old
+ * slots are kept aside till all their entries are moved to the new ones, a
+ * few at each write.
  */
 typedef struct {
-    size_t table_size;
     size_t size;
     int (*destructor)(struct hashtable_entry *);
-    struct hashtable_entry *entries;
+    struct hashtable_slots slots;
+    /* Slots being resized, with no ctrl if there's no resize going on */
+    struct hashtable_slots old;
+    /* Next old slot to move */
+    size_t rehash_index;
 } HashTable;
 
 
@@ -80,16 +102,33 @@ size_t hashtable_size(const HashTable *);
 
 /*
  * Insert a new key-value pair into the hashtable, accept a const char * as
- * key and a void * for value
+ * key and a void * for value; on an existing key both pointers are replaced,
+ * the old ones are left to the caller
  */
 int hashtable_put(HashTable *, const char *, void *);
 
 /* Retrieve a value from the hashtable, accept a const char * as key. */
 void *hashtable_get(HashTable *, const char *);
 
+/*
+ * Retrieve the key-value pair of a key, valid till the next write to the
+ * hashtable
+ */
+struct hashtable_entry *hashtable_get_entry(HashTable *, const char *);
+
 /* Remove a key-value pair from the hashtable, accept a const char * as key. */
 int hashtable_del(HashTable *, const char *);
 
+/* Return true if there's a resize going on */
+bool hashtable_rehashing(const HashTable *);
+
+/*
+ * Move the entries of a number of groups of slots being resized, to complete
+ * a resize out of the writes, e.g. on a timer; return true if there's still
+ * something to move
+ */
+bool hashtable_rehash_step(HashTable *, size_t);
+
 /*
  * Iterate through all key-value pairs in the hashtable, accept a functor as
  * parameter to apply function to each pair
@@ -104,7 +143,4 @@ int hashtable_map2(HashTable *,
         int (*func)(struct hashtable_entry *, void *), void *);
 
 
-uint64_t crc32(const uint8_t *, const uint32_t);
-
-
 #endif
@@ -0,0 +1,114 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include "histogram.h"
+
+
+#define SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+
+/* Single writer increment, readers on other threads never see torn values */
+#define STORE_ADD(ptr, n) \
+    __atomic_store_n((ptr), __atomic_load_n((ptr), __ATOMIC_RELAXED) + (n), \
+                     __ATOMIC_RELAXED)
+
+
+static inline unsigned bucket_index(uint64_t value) {
+
+    if (value < SUB_BUCKETS)
+        return value;
+
+    unsigned exp = 63 - __builtin_clzll(value);
+
+    if (exp >= HISTOGRAM_MAX_EXP)
+        return HISTOGRAM_BUCKETS - 1;
+
+    /* The bits right after the most significant one select the sub-bucket */
+    unsigned sub = (value >> (exp - HISTOGRAM_SUB_BITS)) & (SUB_BUCKETS - 1);
+
+    return ((exp - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) + sub;
+}
+
+/* Highest value which would be recorded in a given bucket */
+static inline uint64_t bucket_value(unsigned index) {
+
+    if (index < SUB_BUCKETS)
+        return index;
+
+    unsigned exp = (index >> HISTOGRAM_SUB_BITS) + HISTOGRAM_SUB_BITS - 1;
+    uint64_t sub = index & (SUB_BUCKETS - 1);
+
+    return ((SUB_BUCKETS + sub + 1) << (exp - HISTOGRAM_SUB_BITS)) - 1;
+}
+
+
+void histogram_init(struct histogram *h) {
+    memset(h, 0x00, sizeof(*h));
+}
+
+
+void histogram_record(struct histogram *h, uint64_t value) {
+    STORE_ADD(&h->buckets[bucket_index(value)], 1);
+    STORE_ADD(&h->count, 1);
+    if (value > __atomic_load_n(&h->max, __ATOMIC_RELAXED))
+        __atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+}
+
+
+void histogram_merge(struct histogram *dst, const struct histogram *src) {
+    for (unsigned i = 0; i < HISTOGRAM_BUCKETS; ++i)
+        dst->buckets[i] += __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+    dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+    if (max > dst->max)
+        dst->max = max;
+}
+
+
+uint64_t histogram_percentile(const struct histogram *h, double percentile) {
+
+    if (h->count == 0)
+        return 0;
+
+    /* Rank of the value, rounding up, the first one is at rank 1 */
+    double r = percentile / 100.0 * h->count;
+    uint64_t rank = (uint64_t) r;
+    uint64_t seen = 0;
+
+    if (rank < r || rank == 0)
+        rank++;
+
+    for (unsigned i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            uint64_t value = bucket_value(i);
+            return value < h->max ? value : h->max;
+        }
+    }
+
+    return h->max;
+}
@@ -0,0 +1,72 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+/*
+ * Log-linear histogram, in the fashion of HdrHistogram: values are grouped
+ * by their power of two, each one split in 2^HISTOGRAM_SUB_BITS linear
+ * buckets, which gives a relative error of at most 1 / 2^HISTOGRAM_SUB_BITS
+ * (~6%) over the whole range, with constant time recording. Values beyond
+ * 2^HISTOGRAM_MAX_EXP are recorded in the last bucket, with nanoseconds it
+ * means ~68 seconds.
+ *
+ * A histogram is meant to be written by a single thread, counters are
+ * updated with relaxed atomic stores, so other threads can read or merge it
+ * at any time without locking.
+ */
+#define HISTOGRAM_SUB_BITS  4
+#define HISTOGRAM_MAX_EXP   36
+#define HISTOGRAM_BUCKETS   \
+    ((HISTOGRAM_MAX_EXP - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+
+struct histogram {
+    uint64_t count;
+    uint64_t max;
+    uint32_t buckets[HISTOGRAM_BUCKETS];
+};
+
+
+void histogram_init(struct histogram *);
+
+void histogram_record(struct histogram *, uint64_t);
+
+/* Add all the values recorded by the second histogram to the first one */
+void histogram_merge(struct histogram *, const struct histogram *);
+
+/*
+ * Return the value at a given percentile (e.g. 99.9), as the highest value
+ * equivalent to the bucket it falls in, 0 if no values were recorded
+ */
+uint64_t histogram_percentile(const struct histogram *, double);
+
+
+#endif
@@ -0,0 +1,164 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "lzf.h"
+
+
+static inline uint32_t hash3(const unsigned char *p) {
+    uint32_t v = (p[0] << 16) | (p[1] << 8) | p[2];
+    return (v * 2654435761u) >> (32 - LZF_HASH_BITS);
+}
+
+/* Write out literal runs, at most LZF_MAX_LIT bytes long each */
+static bool flush_literals(const unsigned char *lit, size_t len,
+                           unsigned char *out, size_t outlen, size_t *op) {
+
+    while (len > 0) {
+        size_t n = len > LZF_MAX_LIT ? LZF_MAX_LIT : len;
+        if (*op + 1 + n > outlen)
+            return false;
+        out[(*op)++] = n - 1;
+        memcpy(out + *op, lit, n);
+        *op += n;
+        lit += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+
+size_t lzf_compress(const unsigned char *in, size_t len,
+                    unsigned char *out, size_t outlen) {
+
+    // Last position + 1 where each hash was seen, 0 means never
+    uint32_t htab[1 << LZF_HASH_BITS];
+    memset(htab, 0x00, sizeof(htab));
+
+    size_t ip = 0, op = 0, lit = 0;
+
+    while (ip + 2 < len) {
+
+        uint32_t h = hash3(in + ip);
+        size_t ref = htab[h];
+        htab[h] = ip + 1;
+
+        if (ref == 0 || ip - (ref - 1) > LZF_MAX_OFF
+            || memcmp(in + ref - 1, in + ip, 3) != 0) {
+            lit++;
+            ip++;
+            continue;
+        }
+
+        ref--;
+
+        size_t max = len - ip < LZF_MAX_REF ? len - ip : LZF_MAX_REF;
+        size_t mlen = 3;
+
+        while (mlen < max && in[ref + mlen] == in[ip + mlen])
+            mlen++;
+
+        if (!flush_literals(in + ip - lit, lit, out, outlen, &op)
+            || op + 3 > outlen)
+            return 0;
+
+        lit = 0;
+
+        size_t off = ip - ref - 1;
+        size_t l = mlen - 2;
+
+        if (l < 7) {
+            out[op++] = (l << 5) | (off >> 8);
+        } else {
+            out[op++] = (7 << 5) | (off >> 8);
+            out[op++] = l - 7;
+        }
+
+        out[op++] = off & 0xff;
+
+        // Index the positions covered by the match too, for the next ones
+        for (size_t i = ip + 1; i < ip + mlen && i + 2 < len; ++i)
+            htab[hash3(in + i)] = i + 1;
+
+        ip += mlen;
+    }
+
+    lit += len - ip;
+
+    if (!flush_literals(in + len - lit, lit, out, outlen, &op))
+        return 0;
+
+    return op;
+}
+
+
+size_t lzf_decompress(const unsigned char *in, size_t len,
+                      unsigned char *out, size_t outlen) {
+
+    size_t ip = 0, op = 0;
+
+    while (ip < len) {
+
+        unsigned ctrl = in[ip++];
+
+        if (ctrl < LZF_MAX_LIT) {
+            size_t n = ctrl + 1;
+            if (ip + n > len || op + n > outlen)
+                return 0;
+            memcpy(out + op, in + ip, n);
+            ip += n;
+            op += n;
+            continue;
+        }
+
+        size_t l = ctrl >> 5;
+
+        if (l == 7) {
+            if (ip >= len)
+                return 0;
+            l += in[ip++];
+        }
+
+        if (ip >= len)
+            return 0;
+
+        size_t off = ((ctrl & 0x1f) << 8) + in[ip++] + 1;
+        l += 2;
+
+        if (off > op || op + l > outlen)
+            return 0;
+
+        // Byte by byte, a match can overlap the bytes it produces
+        for (size_t i = 0; i < l; ++i, ++op)
+            out[op] = out[op - off];
+    }
+
+    return op;
+}
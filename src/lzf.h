@@ -0,0 +1,62 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LZF_H
+#define LZF_H
+
+#include <stddef.h>
+
+/*
+ * Small LZ77 codec in the LZF format, fast on both ends and needing no
+ * state but a hash table on the stack, the stream is a sequence of:
+ *
+ * - literal runs, a control byte 000LLLLL followed by L + 1 bytes
+ * - back references, a control byte LLLOOOOO, for L < 7 a match L + 2 bytes
+ *   long, otherwise followed by a byte to add to it, then a byte with the
+ *   low bits of the offset, going back at most 8192 bytes
+ *
+ * Matches are found through a hash table of the last position where each 3
+ * bytes sequence was seen, a single probe, which favours speed over ratio.
+ */
+#define LZF_HASH_BITS   13
+#define LZF_MAX_LIT     (1 << 5)
+#define LZF_MAX_OFF     (1 << 13)
+#define LZF_MAX_REF     ((1 << 8) + (1 << 3))
+
+/*
+ * Compress len bytes of input to the output buffer, return the number of
+ * bytes written, 0 if they don't fit in outlen
+ */
+size_t lzf_compress(const unsigned char *, size_t, unsigned char *, size_t);
+
+/*
+ * Decompress len bytes of input to the output buffer, return the number of
+ * bytes written, 0 if they don't fit in outlen or if the input is corrupted
+ */
+size_t lzf_decompress(const unsigned char *, size_t, unsigned char *, size_t);
+
+#endif
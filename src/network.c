@@ -32,6 +32,7 @@
 #include <netdb.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <arpa/inet.h>
 #include <sys/un.h>
 #include <sys/epoll.h>
@@ -40,6 +41,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/eventfd.h>
+#include <linux/errqueue.h>
 #include "util.h"
 #include "config.h"
 #include "network.h"
@@ -71,6 +73,12 @@ int set_tcp_nodelay(int fd) {
 }
 
 
+/* Enable MSG_ZEROCOPY sends, supported only by TCP sockets */
+int set_zerocopy(int fd) {
+    return setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &(int) {1}, sizeof(int));
+}
+
+
 static int create_and_bind_unix(const char *sockpath) {
 
     struct sockaddr_un addr;
@@ -225,6 +233,64 @@ int make_listen(const char *host, const char *port, int socket_family) {
 }
 
 
+/*
+ * Connect a blocking socket to the specified address and port, or to a UNIX
+ * socket path ignoring the port. TCP_NODELAY is set on TCP connections, the
+ * requests of a client are expected to be pipelined already.
+ */
+int open_connection(const char *host, const char *port, int socket_family) {
+
+    int sfd;
+
+    if (socket_family == UNIX) {
+
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+        if ((sfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+            return -1;
+
+        strncpy(addr.sun_path, host, sizeof(addr.sun_path) - 1);
+
+        if (connect(sfd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+            close(sfd);
+            return -1;
+        }
+
+        return sfd;
+    }
+
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM
+    };
+
+    struct addrinfo *result, *rp;
+
+    if (getaddrinfo(host, port, &hints, &result) != 0)
+        return -1;
+
+    for (rp = result; rp != NULL; rp = rp->ai_next) {
+        sfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+
+        if (sfd == -1) continue;
+
+        if (connect(sfd, rp->ai_addr, rp->ai_addrlen) == 0)
+            break;
+
+        close(sfd);
+    }
+
+    freeaddrinfo(result);
+
+    if (rp == NULL)
+        return -1;
+
+    set_tcp_nodelay(sfd);
+
+    return sfd;
+}
+
+
 int accept_connection(int serversock) {
 
     int clientsock;
@@ -278,6 +344,88 @@ err:
     return -1;
 }
 
+/*
+ * Send the bytes described by an iovec array, till the socket is full, the
+ * iovecs are advanced past the bytes sent. Return the number of bytes sent,
+ * it's up to the caller to write out the rest once the socket is writable
+ * again. `nsends` is set to the number of sendmsg calls succeeded, each one
+ * is a MSG_ZEROCOPY completion to wait for.
+ */
+ssize_t send_iov(int fd, struct iovec *iov, int iovcnt,
+                 int flags, unsigned *nsends) {
+
+    size_t total = 0;
+    ssize_t n = 0;
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+
+    *nsends = 0;
+
+    while (msg.msg_iovlen > 0) {
+        n = sendmsg(fd, &msg, flags | MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            /* ENOBUFS if the zerocopy notifications limit is reached */
+            if (errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+                flags &= ~MSG_ZEROCOPY;
+                continue;
+            }
+            goto err;
+        }
+        if (flags & MSG_ZEROCOPY)
+            (*nsends)++;
+        total += n;
+        /* Skip the iovecs entirely sent */
+        while (msg.msg_iovlen > 0 && (size_t) n >= msg.msg_iov->iov_len) {
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *) msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+
+    return total;
+
+err:
+
+    fprintf(stderr, "sendmsg(2) - error sending data: %s\n", strerror(errno));
+    return -1;
+}
+
+/*
+ * Read a MSG_ZEROCOPY completion notification from the error queue of a
+ * socket, a range of sends identified by their sequence number
+ */
+int recv_zerocopy_notification(int fd, uint32_t *lo, uint32_t *hi) {
+
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+    struct msghdr msg = {
+        .msg_control = control,
+        .msg_controllen = sizeof(control)
+    };
+
+    if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    if (!cm)
+        return -1;
+
+    struct sock_extended_err *err = (struct sock_extended_err *) CMSG_DATA(cm);
+    if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+        return -1;
+
+    *lo = err->ee_info;
+    *hi = err->ee_data;
+
+    return 0;
+}
+
 /*
  * Receive a given number of bytes on the descriptor fd, storing the stream of
  * data into a 2 Mb capped buffer
@@ -311,6 +459,42 @@ err:
     return -1;
 }
 
+/*
+ * Receive exactly `len` bytes, waiting for the socket to be readable again if
+ * the data is not all there yet, meant to complete packets already started.
+ * Return 0 on disconnection.
+ */
+ssize_t recv_all(int fd, unsigned char *buf, size_t len) {
+
+    ssize_t n = 0;
+    size_t total = 0;
+
+    while (total < len) {
+
+        if ((n = read(fd, buf + total, len - total)) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                poll(&(struct pollfd) { .fd = fd, .events = POLLIN }, 1, -1);
+                continue;
+            }
+            goto err;
+        }
+
+        if (n == 0)
+            return 0;
+
+        total += n;
+    }
+
+    return total;
+
+err:
+
+    fprintf(stderr, "read(2) - error reading data: %s", strerror(errno));
+    return -1;
+}
+
 
 int epoll_add(int efd, int fd, int evs, void *data) {
 
@@ -32,6 +32,7 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <sys/uio.h>
 #include <sys/types.h>
 #include <sys/timerfd.h>
 #include "util.h"
@@ -51,6 +52,9 @@ int set_nonblocking(int);
  */
 int set_tcp_nodelay(int);
 
+/* Enable MSG_ZEROCOPY sends, supported only by TCP sockets */
+int set_zerocopy(int);
+
 /* Auxiliary function for creating epoll server */
 int create_and_bind(const char *, const char *, int);
 
@@ -60,6 +64,12 @@ int create_and_bind(const char *, const char *, int);
  */
 int make_listen(const char *, const char *, int);
 
+/*
+ * Connect a blocking socket to an address and port, or to a UNIX socket path,
+ * return -1 on failure
+ */
+int open_connection(const char *, const char *, int);
+
 /* Accept a connection and add it to the right epollfd */
 int accept_connection(int);
 
@@ -87,12 +97,34 @@ int epoll_del(int, int);
  */
 ssize_t send_bytes(int, const unsigned char *, size_t);
 
+/*
+ * Send data described by an iovec array without ever waiting, stopping as
+ * soon as the socket is full and returning the number of bytes sent, the
+ * iovecs are advanced past them. Flags are passed to sendmsg, the last
+ * argument is set to the number of MSG_ZEROCOPY sends issued, each one will
+ * be notified on the error queue of the socket once completed.
+ */
+ssize_t send_iov(int, struct iovec *, int, int, unsigned *);
+
+/*
+ * Read a MSG_ZEROCOPY completion from the error queue of a socket, setting
+ * the range of completed sends. Return 0 on success, 1 if there's nothing to
+ * read, -1 on socket errors.
+ */
+int recv_zerocopy_notification(int, uint32_t *, uint32_t *);
+
 /*
  * Receive (read) an arbitrary number of bytes from a file descriptor and
  * store them in a buffer
  */
 ssize_t recv_bytes(int, unsigned char *, size_t);
 
+/*
+ * Receive exactly the given number of bytes, waiting for them if needed,
+ * return 0 on disconnection
+ */
+ssize_t recv_all(int, unsigned char *, size_t);
+
 /*
  * Register a timer descriptor to an epoll fd, struct itimerspec defines the
  * interval of activation of the descriptor, which can be used to trigger
@@ -40,30 +40,45 @@
 
 /* Unpack prototypes */
 
-typedef size_t unpack_handler(const unsigned char *,
+typedef int unpack_handler(unsigned char *,
+                           union header *,
+                           union triedb_request *,
+                           size_t);
+
+static int unpack_triedb_put(unsigned char *,
+                             union header *,
+                             union triedb_request *,
+                             size_t);
+
+static int unpack_triedb_get(unsigned char *,
+                             union header *,
+                             union triedb_request *,
+                             size_t);
+
+static int unpack_triedb_ttl(unsigned char *,
+                             union header *,
+                             union triedb_request *,
+                             size_t);
+
+static int unpack_triedb_incr(unsigned char *,
                               union header *,
                               union triedb_request *,
                               size_t);
 
-static size_t unpack_triedb_put(const unsigned char *,
-                                 union header *,
-                                 union triedb_request *,
-                                 size_t);
+static int unpack_triedb_ack(unsigned char *,
+                             union header *,
+                             union triedb_request *,
+                             size_t);
 
-static size_t unpack_triedb_get(const unsigned char *,
-                                 union header *,
-                                 union triedb_request *,
-                                 size_t);
+static int unpack_triedb_ext(unsigned char *,
+                             union header *,
+                             union triedb_request *,
+                             size_t);
 
-static size_t unpack_triedb_ack(const unsigned char *,
-                                union header *,
-                                union triedb_request *,
-                                size_t);
-
-static size_t unpack_triedb_join(const unsigned char *,
-                                 union header *,
-                                 union triedb_request *,
-                                 size_t);
+static int unpack_triedb_join(unsigned char *,
+                              union header *,
+                              union triedb_request *,
+                              size_t);
 
 // FIXME hack
 static size_t unpack_triedb_join_res(const unsigned char *,
@@ -75,19 +90,19 @@ static size_t unpack_triedb_join_res(const unsigned char *,
  * on message type
  */
 static unpack_handler *unpack_handlers[16] = {
-    NULL,
+    unpack_triedb_ext,
     unpack_triedb_put,
     unpack_triedb_get,
     unpack_triedb_get,
+    unpack_triedb_ttl,
+    unpack_triedb_incr,
+    unpack_triedb_incr,
     NULL,
     NULL,
     NULL,
-    NULL,
-    NULL,
-    NULL,
-    NULL,
-    NULL,
-    NULL,
+    unpack_triedb_ack,
+    unpack_triedb_ack,
+    unpack_triedb_ack,
     unpack_triedb_ack,
     unpack_triedb_ack,
     unpack_triedb_join
@@ -129,9 +144,6 @@ static pack_handler *pack_handlers[15] = {
 };
 
 
-static const int MAX_LEN_BYTES = 4;
-
-
 /*
  * Encode Remaining Length on a packet header. It does not take into account
  * the bytes required to store itself. Refer to MQTT v3.1.1 algorithm for the
@@ -160,6 +172,16 @@ int encode_length(unsigned char *buf, size_t len) {
     return bytes;
 }
 
+/* Return the number of bytes required to encode a Remaining Length */
+static inline int length_bytes(size_t len) {
+    int bytes = 1;
+    while (len >= 128 && bytes < MAX_LEN_BYTES) {
+        len /= 128;
+        bytes++;
+    }
+    return bytes;
+}
+
 /*
  * Decode Remaining Length comprised of Payload if present. It does not take
  * into account the bytes for storing length. Refer to MQTT v3.1.1 algorithm
@@ -186,85 +208,168 @@ size_t decode_length(const unsigned char **buf, unsigned *pos) {
 }
 
 
-static size_t unpack_triedb_put(const unsigned char *raw,
-                                union header *hdr,
-                                union triedb_request *pkt,
-                                size_t len) {
+static int unpack_triedb_put(unsigned char *raw,
+                             union header *hdr,
+                             union triedb_request *pkt,
+                             size_t len) {
 
     struct put put = { .header = *hdr };
     pkt->put = put;
 
+    size_t hlen = sizeof(int32_t) + sizeof(uint16_t);
+
+    if (len < hlen)
+        return -1;
+
     /* Read TTL and key len */
-    unpack((unsigned char *) raw, "iH", &pkt->put.ttl, &pkt->put.keylen);
+    unpack(raw, "iH", &pkt->put.ttl, &pkt->put.keylen);
 
-    size_t pkt_len = len;
+    /* The key must fit in the payload, the value can be empty */
+    if (len - hlen < pkt->put.keylen)
+        return -1;
 
     /*
      * Value len is calculated subtracting the length of the variable header
      * from the Remaining Length field that is in the Fixed Header
      */
-    pkt_len -= (sizeof(int32_t) + sizeof(uint16_t) + pkt->put.keylen);
-
-    char fmt[32];
-    sprintf(fmt, "%ds%lds", pkt->put.keylen, pkt_len);
-
-    pkt->put.key = tmalloc(pkt->put.keylen + 1);
-    pkt->put.val = tmalloc(pkt_len + 1);
+    pkt->put.vallen = len - hlen - pkt->put.keylen;
 
     /*
-     * Move pointer forward of sizeof int + sizeof unsigned short, which
-     * is the already read and unpacked bytes
+     * Key and value are not copied, they point into the raw buffer. The key
+     * is moved over the already unpacked key len, to make room for its NUL
+     * terminator without touching the value that follows it.
      */
-    unpack((unsigned char *) raw + 6, fmt, pkt->put.key, pkt->put.val);
+    memmove(raw + sizeof(int32_t), raw + hlen, pkt->put.keylen);
+    raw[sizeof(int32_t) + pkt->put.keylen] = '\0';
 
-    return len;
+    pkt->put.key = raw + sizeof(int32_t);
+    pkt->put.val = raw + hlen + pkt->put.keylen;
+
+    return 0;
 }
 
 
-static size_t unpack_triedb_get(const unsigned char *raw,
-                                union header *hdr,
-                                union triedb_request *pkt,
-                                size_t len) {
+static int unpack_triedb_get(unsigned char *raw,
+                             union header *hdr,
+                             union triedb_request *pkt,
+                             size_t len) {
 
     struct get get = { .header = *hdr };
     pkt->get = get;
 
-    /* Read key length and key of the soon-to-be-read value */
-    pkt->get.key = tmalloc(len + 1);
-    char fmt[10];
-    sprintf(fmt, "%lds", len);
-    unpack((unsigned char *) raw, fmt, pkt->get.key);
+    /* Longer keys can't be told by their 16 bits length */
+    if (len > UINT16_MAX)
+        return -1;
 
-    return len;
+    /*
+     * The key is the whole payload, it's NUL terminated in place, the raw
+     * buffer is expected to have room for an additional byte
+     */
+    raw[len] = '\0';
+    pkt->get.key = raw;
+    pkt->get.keylen = len;
+
+    return 0;
+}
+
+
+static int unpack_triedb_ttl(unsigned char *raw,
+                             union header *hdr,
+                             union triedb_request *pkt,
+                             size_t len) {
+
+    struct ttl ttl = { .header = *hdr, .ttl = -1, .key = NULL };
+    pkt->ttl = ttl;
+
+    if (len < sizeof(int32_t) || len - sizeof(int32_t) > UINT16_MAX)
+        return -1;
+
+    pkt->ttl.ttl = unpacki32(raw);
+
+    /* The key is the rest of the payload, NUL terminated in place */
+    raw[len] = '\0';
+    pkt->ttl.key = raw + sizeof(int32_t);
+    pkt->ttl.keylen = len - sizeof(int32_t);
+
+    return 0;
+}
+
+
+static int unpack_triedb_incr(unsigned char *raw,
+                              union header *hdr,
+                              union triedb_request *pkt,
+                              size_t len) {
+
+    struct incr incr = { .header = *hdr, .delta = 0, .key = NULL };
+    pkt->incr = incr;
+
+    if (len < sizeof(int64_t) || len - sizeof(int64_t) > UINT16_MAX)
+        return -1;
+
+    pkt->incr.delta = unpacki64(raw);
+
+    /* The key is the rest of the payload, NUL terminated in place */
+    raw[len] = '\0';
+    pkt->incr.key = raw + sizeof(int64_t);
+    pkt->incr.keylen = len - sizeof(int64_t);
+
+    return 0;
 }
 
 
-static size_t unpack_triedb_ack(const unsigned char *raw,
-                                union header *hdr,
-                                union triedb_request *pkt,
-                                size_t len) {
+static int unpack_triedb_ack(unsigned char *raw,
+                             union header *hdr,
+                             union triedb_request *pkt,
+                             size_t len) {
 
-    struct ack info = { .header = *hdr };
+    struct ack info = { .header = *hdr, .rc = 0 };
     pkt->info = info;
 
-    unpack((unsigned char *) raw, "BB", &(unsigned char){0}, &pkt->info.rc);
+    /* Commands like PING can be sent with no payload at all */
+    if (len >= 2)
+        unpack(raw, "BB",
+               &(unsigned char){0}, &pkt->info.rc);
 
-    return len;
+    return 0;
+}
+
+
+static int unpack_triedb_ext(unsigned char *raw,
+                             union header *hdr,
+                             union triedb_request *pkt,
+                             size_t len) {
+
+    struct ext ext = { .header = *hdr, .opcode = 0, .len = 0, .data = raw };
+    pkt->ext = ext;
+
+    /* An empty payload is left with an invalid opcode to be refused */
+    if (len == 0) {
+        pkt->ext.opcode = EXT_OPCODES;
+        return 0;
+    }
+
+    pkt->ext.opcode = raw[0];
+    pkt->ext.data = raw + 1;
+    pkt->ext.len = len - 1;
+
+    return 0;
 }
 
 
-static size_t unpack_triedb_join(const unsigned char *raw,
-                                 union header *hdr,
-                                 union triedb_request *pkt,
-                                 size_t len) {
+static int unpack_triedb_join(unsigned char *raw,
+                              union header *hdr,
+                              union triedb_request *pkt,
+                              size_t len) {
 
     struct ack join = { .header = *hdr };
     pkt->join_cluster = join;
 
-    unpack((unsigned char *) raw, "BB",
-           &(unsigned char){0}, &pkt->join_cluster.rc);
+    if (len < 2)
+        return -1;
 
-    return len;
+    unpack(raw, "BB", &(unsigned char){0}, &pkt->join_cluster.rc);
+
+    return 0;
 }
 
 // FIXME hack
@@ -279,6 +384,7 @@ static size_t unpack_triedb_join_res(const unsigned char *raw,
     unpack((unsigned char *) raw, "H", &response->tuples_len);
 
     response->tuples = tmalloc(sizeof(struct tuple) * response->tuples_len);
+    response->values = NULL;
     int keylen, vallen;
     char fmt[5];
 
@@ -295,18 +401,287 @@ static size_t unpack_triedb_join_res(const unsigned char *raw,
 }
 
 
-int unpack_triedb_request(const unsigned char *raw,
+int unpack_triedb_request(unsigned char *raw,
                           union triedb_request *pkt,
                           unsigned char opcode,
                           size_t len) {
-    int rc = 0;
-
     union header header = { .byte = opcode };
 
+    /* Commands with no decoder are left with their header only */
+    if (!unpack_handlers[header.bits.opcode]) {
+        pkt->header = header;
+        return -1;
+    }
+
     /* Call the appropriate unpack handler based on the message type */
-    rc = unpack_handlers[header.bits.opcode](raw, &header, pkt, len);
+    return unpack_handlers[header.bits.opcode](raw, &header, pkt, len);
+}
 
-    return rc;
+
+/*
+ * Check the layout of a batch, keys for MGET and MDEL or tuples for MPUT,
+ * without touching it; return the number of entries, -1 if it's malformed
+ */
+static int check_batch(unsigned char *raw, size_t len, unsigned char opcode) {
+
+    if (len < sizeof(uint16_t))
+        return -1;
+
+    unsigned short n = unpacku16(raw);
+    if (n == 0)
+        return -1;
+
+    size_t pos = sizeof(uint16_t);
+
+    for (unsigned short i = 0; i < n; ++i) {
+
+        if (opcode == MPUT) {
+            if (len - pos < sizeof(int32_t))
+                return -1;
+            pos += sizeof(int32_t);
+        }
+
+        if (len - pos < sizeof(uint16_t))
+            return -1;
+
+        size_t keylen = unpacku16(raw + pos);
+        pos += sizeof(uint16_t);
+
+        if (len - pos < keylen)
+            return -1;
+
+        pos += keylen;
+
+        if (opcode == MPUT) {
+            if (len - pos < sizeof(uint32_t))
+                return -1;
+            size_t vallen = unpacku32(raw + pos);
+            pos += sizeof(uint32_t);
+            if (len - pos < vallen)
+                return -1;
+            pos += vallen;
+        }
+    }
+
+    return n;
+}
+
+
+int unpack_batch(unsigned char *raw, size_t len,
+                 unsigned char opcode, struct tuple **tuples) {
+
+    int n = check_batch(raw, len, opcode);
+    if (n < 0)
+        return -1;
+
+    struct tuple *t = tcalloc(n, sizeof(struct tuple));
+    size_t pos = sizeof(uint16_t);
+
+    for (int i = 0; i < n; ++i) {
+
+        t[i].ttl = -1;
+
+        if (opcode == MPUT) {
+            t[i].ttl = unpacki32(raw + pos);
+            pos += sizeof(int32_t);
+        }
+
+        t[i].keylen = unpacku16(raw + pos);
+
+        /*
+         * Move the key over its length to make room for the NUL terminator,
+         * the same as a single PUT request does
+         */
+        memmove(raw + pos, raw + pos + sizeof(uint16_t), t[i].keylen);
+        raw[pos + t[i].keylen] = '\0';
+        t[i].key = raw + pos;
+        pos += sizeof(uint16_t) + t[i].keylen;
+
+        if (opcode == MPUT) {
+            t[i].vallen = unpacku32(raw + pos);
+            pos += sizeof(uint32_t);
+            t[i].val = raw + pos;
+            pos += t[i].vallen;
+        }
+    }
+
+    *tuples = t;
+
+    return n;
+}
+
+/*
+ * Check the layout of a CAS or a CDEL without touching it, return the offset
+ * of the key length, -1 if it's malformed
+ */
+static ssize_t check_cas(unsigned char *raw, size_t len, unsigned char opcode) {
+
+    size_t pos = sizeof(uint64_t);
+
+    if (opcode == CAS)
+        pos += sizeof(int32_t);
+
+    if (len < pos || len - pos < sizeof(uint16_t))
+        return -1;
+
+    if (len - pos - sizeof(uint16_t) < unpacku16(raw + pos))
+        return -1;
+
+    return pos;
+}
+
+
+int unpack_cas(unsigned char *raw, size_t len, unsigned char opcode,
+               uint64_t *version, struct tuple *t) {
+
+    ssize_t pos = check_cas(raw, len, opcode);
+    if (pos < 0)
+        return -1;
+
+    *version = unpacku64(raw);
+    t->ttl = opcode == CAS ? unpacki32(raw + sizeof(uint64_t)) : -1;
+    t->keylen = unpacku16(raw + pos);
+
+    // Move the key over its length to make room for the NUL terminator
+    memmove(raw + pos, raw + pos + sizeof(uint16_t), t->keylen);
+    raw[pos + t->keylen] = '\0';
+    t->key = raw + pos;
+    pos += sizeof(uint16_t) + t->keylen;
+
+    /* The value is the rest of the payload */
+    t->val = opcode == CAS ? raw + pos : NULL;
+    t->vallen = len - pos;
+
+    return 0;
+}
+
+/*
+ * Check the payload of an extended command carried by a transaction, those
+ * decoded only once executed; the others are refused by the server anyway
+ */
+static int check_ext(const struct ext *ext) {
+
+    switch (ext->opcode) {
+        case MGET:
+        case MPUT:
+        case MDEL:
+            return check_batch(ext->data, ext->len, ext->opcode) < 0 ? -1 : 0;
+        case CAS:
+        case CDEL:
+            return check_cas(ext->data, ext->len, ext->opcode) < 0 ? -1 : 0;
+        default:
+            return 0;
+    }
+}
+
+
+int unpack_subscribe(unsigned char *raw, size_t len, struct tuple *t) {
+
+    if (len < sizeof(uint16_t))
+        return -1;
+
+    t->keylen = unpacku16(raw);
+
+    if (len - sizeof(uint16_t) != t->keylen)
+        return -1;
+
+    // Move the key over its length to make room for the NUL terminator
+    memmove(raw, raw + sizeof(uint16_t), t->keylen);
+    raw[t->keylen] = '\0';
+    t->key = raw;
+    t->ttl = -1;
+    t->val = NULL;
+    t->vallen = 0;
+
+    return 0;
+}
+
+
+int unpack_wait(unsigned char *raw, size_t len, uint64_t *version,
+                uint32_t *timeout, struct tuple *t) {
+
+    size_t pos = sizeof(uint64_t) + sizeof(uint32_t);
+
+    if (len < pos)
+        return -1;
+
+    *version = unpacku64(raw);
+    *timeout = unpacku32(raw + sizeof(uint64_t));
+
+    return unpack_subscribe(raw + pos, len - pos, t);
+}
+
+
+int unpack_transaction(unsigned char *raw, size_t len,
+                       union triedb_request **reqs) {
+
+    if (len < sizeof(uint16_t))
+        return -1;
+
+    unsigned short n = unpacku16(raw);
+    if (n == 0)
+        return -1;
+
+    union triedb_request *r = tcalloc(n, sizeof(union triedb_request));
+    size_t pos = sizeof(uint16_t);
+    unsigned char byte = pos < len ? raw[pos] : 0;
+
+    for (unsigned short i = 0; i < n; ++i) {
+
+        if (pos >= len)
+            goto err;
+
+        pos++;
+
+        /* Remaining Length, bounded by the transaction payload */
+        size_t plen = 0;
+        int steps = 0;
+        unsigned char c;
+
+        do {
+            if (pos >= len || steps == MAX_LEN_BYTES)
+                goto err;
+            c = raw[pos++];
+            plen |= (size_t) (c & 127) << (7 * steps++);
+        } while (c & 128);
+
+        if (len - pos < plen)
+            goto err;
+
+        union header header = { .byte = byte };
+        if (!unpack_handlers[header.bits.opcode])
+            goto err;
+
+        /*
+         * Keys are NUL terminated in place, overwriting the byte following
+         * the payload, which is the header byte of the next command
+         */
+        if (pos + plen < len)
+            byte = raw[pos + plen];
+
+        /* A single malformed command fails the whole transaction */
+        if (unpack_handlers[header.bits.opcode](raw + pos, &header,
+                                                &r[i], plen) < 0)
+            goto err;
+
+        if (header.bits.opcode == EXT && check_ext(&r[i].ext) < 0)
+            goto err;
+
+        pos += plen;
+    }
+
+    if (pos != len)
+        goto err;
+
+    *reqs = r;
+
+    return n;
+
+err:
+
+    tfree(r);
+
+    return -1;
 }
 
 
@@ -326,24 +701,6 @@ int unpack_triedb_response(const unsigned char *raw,
 }
 
 
-void triedb_request_destroy(union triedb_request *pkt) {
-
-    switch (pkt->header.bits.opcode) {
-        case PUT:
-            tfree(pkt->put.key);
-            break;
-        case GET:
-            tfree(pkt->get.key);
-            break;
-        case DEL:
-            tfree(pkt->get.key);
-            break;
-    }
-
-    tfree(pkt);
-}
-
-
 struct ack_response *ack_response(unsigned char byte, unsigned char rc) {
     struct ack_response *response = tmalloc(sizeof(*response));
     response->header.byte = byte;
@@ -360,6 +717,76 @@ struct cnt_response *cnt_response(unsigned char byte, unsigned long long val) {
 }
 
 
+/*
+ * Fill the tuples of a prefix response with the keys found, and their values.
+ * Blobs are pinned and read in place, compressed values pinned as well and
+ * left to prefix_tuples_expand, all the other values are rendered in the
+ * memory following the tuples, this way the response stays readable once the
+ * items change or go away.
+ */
+static struct tuple *prefix_tuples(const Vector *v, struct db_value ***pins) {
+
+    size_t size = v->size * sizeof(struct tuple);
+    for (int i = 0; i < vector_size(v); ++i) {
+        const struct kv_obj *kv = vector_get(v, i);
+        const struct db_item *item = kv->data;
+        if (item->encoding != DB_BLOB && item->encoding != DB_COMPRESSED)
+            size += db_item_format_size(item);
+    }
+
+    struct tuple *tuples = tmalloc(size);
+    struct db_value **values = tcalloc(v->size, sizeof(*values));
+    unsigned char *buf = (unsigned char *) (tuples + v->size);
+
+    for (int i = 0; i < vector_size(v); ++i) {
+        struct kv_obj *kv = vector_get(v, i);
+        const struct db_item *item = kv->data;
+        tuples[i].key = (unsigned char *) kv->key;
+        tuples[i].keylen = strlen(kv->key);
+        tuples[i].ttl = item->ttl;
+        if (item->encoding == DB_BLOB) {
+            values[i] = db_value_ref(item->val);
+            tuples[i].val = values[i]->data;
+            tuples[i].vallen = values[i]->len;
+        } else if (item->encoding == DB_COMPRESSED) {
+            values[i] = db_value_ref(item->val);
+            tuples[i].val = NULL;
+            tuples[i].vallen = 0;
+        } else {
+            tuples[i].val = (unsigned char *)
+                db_item_format(item, buf, &tuples[i].vallen);
+            buf += db_item_format_size(item);
+        }
+    }
+
+    *pins = values;
+
+    return tuples;
+}
+
+
+/* Expand the compressed values pinned, out of the lock of the database */
+static void prefix_tuples_expand(struct tuple *tuples,
+                                 struct db_value **values, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        if (!values[i] || values[i]->rawlen == 0)
+            continue;
+        values[i] = db_value_uncompress(values[i]);
+        tuples[i].val = values[i]->data;
+        tuples[i].vallen = values[i]->len;
+    }
+}
+
+
+static void prefix_tuples_release(struct tuple *tuples,
+                                  struct db_value **values, size_t n) {
+    for (size_t i = 0; values && i < n; ++i)
+        db_value_release(values[i]);
+    tfree(values);
+    tfree(tuples);
+}
+
+
 struct get_response *get_response(unsigned char byte, const void *arg) {
 
     struct get_response *response = tmalloc(sizeof(*response));
@@ -372,21 +799,15 @@ struct get_response *get_response(unsigned char byte, const void *arg) {
      */
     if (response->header.bits.prefix == 1) {
         Vector *tuples = (Vector *) arg;
-        response->tuples_len = tuples->size;
-        response->tuples = tmalloc(tuples->size * sizeof(struct tuple));
 
-        /*
-         * Create the tuples array containing required informations from the
-         * vector returned from the range query on the Trie
-         */
-        for (int i = 0; i < vector_size(tuples); ++i) {
-            struct kv_obj *kv = vector_get(tuples, i);
-            const struct db_item *item = kv->data;
-            response->tuples[i].key = (unsigned char *) kv->key;
-            response->tuples[i].val = item->data;
-            response->tuples[i].keylen = strlen(kv->key);
-            response->tuples[i].ttl = item->ttl;
+        // No key left under the prefix, e.g. all deleted or expired
+        if (vector_size(tuples) == 0) {
+            tfree(response);
+            return NULL;
         }
+
+        response->tuples_len = tuples->size;
+        response->tuples = prefix_tuples(tuples, &response->values);
     } else {
         // Single response here
         struct tuple *tuple = (struct tuple *) arg;
@@ -401,6 +822,9 @@ struct get_response *get_response(unsigned char byte, const void *arg) {
 
 struct join_response *join_response(unsigned char byte, const Vector *v) {
 
+    if (vector_size(v) == 0)
+        return NULL;
+
     struct join_response *response = tmalloc(sizeof(*response));
     response->header.byte = byte;
 
@@ -409,34 +833,36 @@ struct join_response *join_response(unsigned char byte, const Vector *v) {
      * each item corresponds to an existing key in the database
      */
     response->tuples_len = v->size;
-    response->tuples = tmalloc(v->size * sizeof(struct tuple));
-
-    /*
-     * Create the tuples array containing required informations from the
-     * vector returned from the range query on the Trie
-     */
-    for (int i = 0; i < vector_size(v); ++i) {
-        struct kv_obj *kv = vector_get(v, i);
-        const struct db_item *item = kv->data;
-        response->tuples[i].key = (unsigned char *) kv->key;
-        response->tuples[i].val = item->data;
-        response->tuples[i].keylen = strlen(kv->key);
-        response->tuples[i].ttl = item->ttl;
-    }
+    response->tuples = prefix_tuples(v, &response->values);
 
     return response;
 }
 
 
+void get_response_expand(struct get_response *response) {
+    if (response->header.bits.prefix == 1)
+        prefix_tuples_expand(response->tuples, response->values,
+                             response->tuples_len);
+}
+
+
+void join_response_expand(struct join_response *response) {
+    prefix_tuples_expand(response->tuples, response->values,
+                         response->tuples_len);
+}
+
+
 void get_response_destroy(struct get_response *response) {
     if (response->header.bits.prefix == 1)
-        tfree(response->tuples);
+        prefix_tuples_release(response->tuples, response->values,
+                              response->tuples_len);
     tfree(response);
 }
 
 
 void join_response_destroy(struct join_response *response) {
-    tfree(response->tuples);
+    prefix_tuples_release(response->tuples, response->values,
+                          response->tuples_len);
     tfree(response);
 }
 
@@ -455,6 +881,40 @@ static unsigned char *pack_response_cnt(const union triedb_response *res) {
 }
 
 
+/*
+ * Length of a list of tuples on the wire, each one made of TTL, key length,
+ * key, value length and value. Values are binary, they're sized like the
+ * ones of MGET, on 32 bits.
+ */
+static size_t tuples_length(const struct tuple *tuples, unsigned short n) {
+
+    size_t length = 0;
+
+    for (int i = 0; i < n; ++i)
+        length += tuples[i].keylen
+            + tuples[i].vallen
+            + sizeof(int32_t)
+            + sizeof(uint16_t)
+            + sizeof(uint32_t);
+
+    return length;
+}
+
+
+static void pack_tuples(unsigned char *p,
+                        const struct tuple *tuples, unsigned short n) {
+
+    for (int i = 0; i < n; ++i) {
+        p += pack(p, "iH", tuples[i].ttl, tuples[i].keylen);
+        memcpy(p, tuples[i].key, tuples[i].keylen);
+        p += tuples[i].keylen;
+        p += pack(p, "I", (unsigned long) tuples[i].vallen);
+        memcpy(p, tuples[i].val, tuples[i].vallen);
+        p += tuples[i].vallen;
+    }
+}
+
+
 static unsigned char *pack_response_get(const union triedb_response *res) {
 
     unsigned char *raw = NULL;
@@ -464,16 +924,10 @@ static unsigned char *pack_response_get(const union triedb_response *res) {
     if (res->get_res.header.bits.prefix == 1) {
 
         /* Init length with the size of the tuples_len field (u16) */
-        length = sizeof(unsigned short);
-
-        /* Pre-compute the total length of the entire packet and encode it */
-        for (int i = 0; i < res->get_res.tuples_len; ++i)
-            length += res->get_res.tuples[i].keylen
-                + strlen((const char *) res->get_res.tuples[i].val)
-                + sizeof(int)
-                + sizeof(unsigned short) * 2;
+        length = sizeof(unsigned short)
+            + tuples_length(res->get_res.tuples, res->get_res.tuples_len);
 
-        raw = tmalloc(length + 2);
+        raw = tmalloc(length + 1 + length_bytes(length));
 
         /* Encode the byte, the length and the tuples len */
         pack(raw, "B", res->get_res.header.byte);
@@ -485,38 +939,25 @@ static unsigned char *pack_response_get(const union triedb_response *res) {
          * (bytes required to store packet length, max 4), the portion of the
          * packet already written and packed
          */
-        unsigned char *p = raw + 3 + steps;
-
-        /* Start encoding the tuples */
-        int pos = 0;
-        for (int i = 0; i < res->get_res.tuples_len; ++i) {
-            pack(p + pos, "iHsHs", res->get_res.tuples[i].ttl,
-                 res->get_res.tuples[i].keylen,
-                 res->get_res.tuples[i].key,
-                 strlen((const char *) res->get_res.tuples[i].val),
-                 res->get_res.tuples[i].val);
-            /* Update position index */
-            pos += res->get_res.tuples[i].keylen
-                + strlen((const char *) res->get_res.tuples[i].val)
-                + sizeof(int)
-                + sizeof(unsigned short) * 2;
-        }
+        pack_tuples(raw + 3 + steps,
+                    res->get_res.tuples, res->get_res.tuples_len);
 
     } else {
 
         length = res->get_res.val.keylen
-            + strlen((const char *) res->get_res.val.val)
+            + res->get_res.val.vallen
             + sizeof(int)
             + sizeof(unsigned short);
 
-        raw = tmalloc(length + 2);
+        raw = tmalloc(length + 1 + length_bytes(length));
 
         pack(raw, "B", res->get_res.header.byte);
         int steps = encode_length(raw + 1, length);
-        pack(raw + steps + 1, "iHss", res->get_res.val.ttl,
-             res->get_res.val.keylen,
-             res->get_res.val.key,
-             res->get_res.val.val);
+        unsigned char *p = raw + steps + 1;
+        p += pack(p, "iH", res->get_res.val.ttl, res->get_res.val.keylen);
+        memcpy(p, res->get_res.val.key, res->get_res.val.keylen);
+        memcpy(p + res->get_res.val.keylen,
+               res->get_res.val.val, res->get_res.val.vallen);
     }
 
     return raw;
@@ -528,16 +969,10 @@ static unsigned char *pack_response_join(const union triedb_response *res) {
     unsigned char *raw = NULL;
 
     /* Init length with the size of the tuples_len field (u16) */
-    size_t length = sizeof(unsigned short);
+    size_t length = sizeof(unsigned short)
+        + tuples_length(res->join_res.tuples, res->join_res.tuples_len);
 
-    /* Pre-compute the total length of the entire packet and encode it */
-    for (int i = 0; i < res->join_res.tuples_len; ++i)
-        length += res->join_res.tuples[i].keylen
-            + strlen((const char *) res->join_res.tuples[i].val)
-            + sizeof(int)
-            + sizeof(unsigned short) * 2;
-
-    raw = tmalloc(length + 2);
+    raw = tmalloc(length + 1 + length_bytes(length));
 
     /* Encode the byte, the length and the tuples len */
     pack(raw, "B", res->join_res.header.byte);
@@ -549,27 +984,33 @@ static unsigned char *pack_response_join(const union triedb_response *res) {
      * (bytes required to store packet length, max 4), the portion of the
      * packet already written and packed
      */
-    unsigned char *p = raw + 3 + steps;
-
-    /* Start encoding the tuples */
-    int pos = 0;
-    for (int i = 0; i < res->join_res.tuples_len; ++i) {
-        pack(p + pos, "iHsHs", res->join_res.tuples[i].ttl,
-             res->join_res.tuples[i].keylen,
-             res->join_res.tuples[i].key,
-             strlen((const char *) res->join_res.tuples[i].val),
-             res->join_res.tuples[i].val);
-        /* Update position index */
-        pos += res->join_res.tuples[i].keylen
-            + strlen((const char *) res->join_res.tuples[i].val)
-            + sizeof(int)
-            + sizeof(unsigned short) * 2;
-    }
+    pack_tuples(raw + 3 + steps,
+                res->join_res.tuples, res->join_res.tuples_len);
 
     return raw;
 }
 
 
+int pack_get_header(unsigned char *raw, unsigned char byte, int ttl,
+                    uint64_t version, unsigned short keylen, size_t vallen) {
+
+    size_t length = sizeof(int) + sizeof(uint64_t)
+        + sizeof(unsigned short) + keylen + vallen;
+    int steps = length_bytes(length);
+
+    /*
+     * Byte + remaining length + TTL + version + key len, key and value
+     * excluded
+     */
+    pack(raw, "B", byte);
+    encode_length(raw + 1, length);
+    pack(raw + steps + 1, "iQH", (long) ttl,
+         (unsigned long long) version, (unsigned) keylen);
+
+    return 1 + steps + sizeof(int) + sizeof(uint64_t) + sizeof(unsigned short);
+}
+
+
 bstring pack_ack(unsigned char byte, unsigned char rc) {
     unsigned char raw[3];
     pack(raw, "BBB", byte, 1, rc);
@@ -615,12 +1056,44 @@ bstring pack_info(const struct config *conf,
         + sizeof(infos->bytes_sent)
         + sizeof(infos->nkeys);
 
+    size_t fixed = size;
+
+    /*
+     * Latency percentiles of each opcode served at least once, for each one
+     * the number of requests followed by p50, p99 and p999 of every phase,
+     * in nanoseconds
+     */
+    unsigned char nops = 0;
+    for (int i = 0; infos->latency && i < STATS_OPCODES; ++i)
+        if (infos->latency[i][PHASE_DECODE].count > 0)
+            nops++;
+
+    size += sizeof(unsigned char)
+        + nops * (sizeof(unsigned char) + sizeof(uint64_t) * (1 + PHASES * 3));
+
+    /*
+     * Original and compressed size of the values stored compressed, their
+     * ratio is the compression ratio
+     */
+    size += sizeof(infos->compressed_rawlen) + sizeof(infos->compressed_len);
+
+#ifdef TRACK_ALLOCS
+    /* Debug builds append the number of allocations done so far */
+    size += sizeof(uint64_t);
+#endif
+
+    int steps = length_bytes(size);
+
     /* Add +1 to store the code INFO on the header */
-    bstring raw = bstring_empty(size + 1);
+    bstring raw = bstring_empty(size + 1 + steps);
 
     /* 0xd0 == dec(208) == 11010000 == INFO opcode */
-    pack(raw, "BIIQQIQQQBBBQQQiBsBsBsBs",
-         0xd0,
+    pack(raw, "B", 0xd0);
+    encode_length(raw + 1, size);
+
+    unsigned char *p = raw + 1 + steps;
+
+    pack(p, "IIQQIQQQBBBQQQiBsBsBsBs",
          infos->nclients,
          infos->nconnections,
          infos->start_time,
@@ -645,6 +1118,328 @@ bstring pack_info(const struct config *conf,
          plen,
          conf->port);
 
+    p += fixed;
+    p += pack(p, "B", nops);
+
+    for (int i = 0; infos->latency && i < STATS_OPCODES; ++i) {
+        const struct histogram *h = infos->latency[i];
+        if (h[PHASE_DECODE].count == 0)
+            continue;
+        p += pack(p, "BQ", i, h[PHASE_DECODE].count);
+        for (int j = 0; j < PHASES; ++j)
+            p += pack(p, "QQQ",
+                      histogram_percentile(&h[j], 50.0),
+                      histogram_percentile(&h[j], 99.0),
+                      histogram_percentile(&h[j], 99.9));
+    }
+
+    p += pack(p, "QQ", infos->compressed_rawlen, infos->compressed_len);
+
+#ifdef TRACK_ALLOCS
+    pack(p, "Q", (uint64_t) alloc_count());
+#endif
+
+    return raw;
+}
+
+
+/*
+ * Helper function to create a bytearray with all the slow log entries, oldest
+ * first: after the EXT header and the SLOWLOG opcode the number of entries,
+ * then for each one id, timestamp, duration in nanoseconds, number of trie
+ * nodes visited, opcode, prefix flag, client connection id and key, preceded
+ * by its length. Keys are truncated, the original length is sent anyway.
+ */
+bstring pack_slowlog(const struct slowlog *log) {
+
+    size_t len = slowlog_len(log);
+    size_t size = sizeof(unsigned char) + sizeof(uint16_t);
+
+    for (size_t i = 0; i < len; ++i) {
+        const struct slowlog_entry *e = slowlog_get(log, i);
+        size += sizeof(uint64_t) * 5
+            + sizeof(unsigned char) * 2
+            + sizeof(uint16_t)
+            + (e->keylen < SLOWLOG_KEY_MAX ? e->keylen : SLOWLOG_KEY_MAX);
+    }
+
+    int steps = length_bytes(size);
+
+    bstring raw = bstring_empty(size + 1 + steps);
+
+    pack(raw, "B", EXT << 4);
+    encode_length(raw + 1, size);
+
+    unsigned char *p = raw + 1 + steps;
+
+    p += pack(p, "BH", SLOWLOG, (unsigned) len);
+
+    for (size_t i = 0; i < len; ++i) {
+        const struct slowlog_entry *e = slowlog_get(log, i);
+        size_t klen = e->keylen < SLOWLOG_KEY_MAX ? e->keylen : SLOWLOG_KEY_MAX;
+        p += pack(p, "QQQQBBQH", e->id, e->timestamp, e->duration,
+                  e->visited, e->opcode, e->prefix, e->client, e->keylen);
+        memcpy(p, e->key, klen);
+        p += klen;
+    }
+
+    return raw;
+}
+
+
+/*
+ * Pack the results of a MGET, after the EXT header and the MGET opcode the
+ * number of entries, then for each requested key, in the same order, a
+ * return code, OK if the key was found and NOK otherwise. Found keys are
+ * followed by their TTL, their version and their value, preceded by its
+ * length.
+ */
+bstring pack_mget(const struct tuple *tuples, unsigned short n) {
+
+    size_t size = sizeof(unsigned char) + sizeof(uint16_t);
+
+    for (unsigned short i = 0; i < n; ++i) {
+        size += sizeof(unsigned char);
+        if (tuples[i].val)
+            size += sizeof(int32_t) + sizeof(uint64_t)
+                + sizeof(uint32_t) + tuples[i].vallen;
+    }
+
+    int steps = length_bytes(size);
+
+    bstring raw = bstring_empty(size + 1 + steps);
+
+    pack(raw, "B", EXT << 4);
+    encode_length(raw + 1, size);
+
+    unsigned char *p = raw + 1 + steps;
+
+    p += pack(p, "BH", MGET, (unsigned) n);
+
+    for (unsigned short i = 0; i < n; ++i) {
+        if (!tuples[i].val) {
+            p += pack(p, "B", NOK);
+            continue;
+        }
+        p += pack(p, "BiQI", OK, (long) tuples[i].ttl,
+                  (unsigned long long) tuples[i].version,
+                  (unsigned long) tuples[i].vallen);
+        memcpy(p, tuples[i].val, tuples[i].vallen);
+        p += tuples[i].vallen;
+    }
+
+    return raw;
+}
+
+
+bstring pack_mdel(unsigned long long deleted) {
+
+    size_t size = sizeof(unsigned char) + sizeof(uint64_t);
+
+    bstring raw = bstring_empty(size + 2);
+
+    pack(raw, "BBBQ", EXT << 4, (unsigned) size, MDEL, deleted);
+
+    return raw;
+}
+
+
+bstring pack_cas(unsigned char opcode, unsigned char rc, uint64_t version) {
+
+    size_t size = sizeof(unsigned char) * 2 + sizeof(uint64_t);
+
+    bstring raw = bstring_empty(size + 2);
+
+    pack(raw, "BBBBQ", EXT << 4, (unsigned) size, (unsigned) opcode,
+         (unsigned) rc, (unsigned long long) version);
+
+    return raw;
+}
+
+
+/*
+ * Pack a NOTIFY, after the EXT header and the NOTIFY opcode the number of
+ * events, then the events as they're passed, each one made of its type, the
+ * length of its key and the key itself
+ */
+bstring pack_notify(const unsigned char *events, size_t len, unsigned short n) {
+
+    size_t size = sizeof(unsigned char) + sizeof(uint16_t) + len;
+    int steps = length_bytes(size);
+
+    bstring raw = bstring_empty(size + 1 + steps);
+
+    pack(raw, "B", EXT << 4);
+    encode_length(raw + 1, size);
+
+    unsigned char *p = raw + 1 + steps;
+
+    p += pack(p, "BH", NOTIFY, (unsigned) n);
+    memcpy(p, events, len);
+
+    return raw;
+}
+
+
+/*
+ * Allocate a request of a given header byte and payload length, encoding the
+ * fixed header, return the position where the payload starts
+ */
+static unsigned char *pack_request_header(bstring *raw, unsigned char byte,
+                                          size_t length) {
+    int steps = length_bytes(length);
+    *raw = bstring_empty(1 + steps + length);
+    pack(*raw, "B", byte);
+    encode_length(*raw + 1, length);
+    return *raw + 1 + steps;
+}
+
+
+static bstring pack_request_put(const union triedb_request *req) {
+
+    bstring raw = NULL;
+    size_t length = sizeof(int32_t) + sizeof(uint16_t)
+        + req->put.keylen + req->put.vallen;
+
+    unsigned char *p = pack_request_header(&raw, req->header.byte, length);
+
+    p += pack(p, "iH", (long) req->put.ttl, (unsigned) req->put.keylen);
+    memcpy(p, req->put.key, req->put.keylen);
+    memcpy(p + req->put.keylen, req->put.val, req->put.vallen);
+
+    return raw;
+}
+
+
+/* GET and DEL, the key is the whole payload */
+static bstring pack_request_get(const union triedb_request *req) {
+
+    bstring raw = NULL;
+
+    unsigned char *p = pack_request_header(&raw, req->header.byte,
+                                           req->get.keylen);
+    memcpy(p, req->get.key, req->get.keylen);
+
+    return raw;
+}
+
+
+static bstring pack_request_ttl(const union triedb_request *req) {
+
+    bstring raw = NULL;
+    size_t length = sizeof(int32_t) + req->ttl.keylen;
+
+    unsigned char *p = pack_request_header(&raw, req->header.byte, length);
+
+    p += pack(p, "i", (long) req->ttl.ttl);
+    memcpy(p, req->ttl.key, req->ttl.keylen);
+
+    return raw;
+}
+
+
+static bstring pack_request_incr(const union triedb_request *req) {
+
+    bstring raw = NULL;
+    size_t length = sizeof(int64_t) + req->incr.keylen;
+
+    unsigned char *p = pack_request_header(&raw, req->header.byte, length);
+
+    p += pack(p, "q", (long long) req->incr.delta);
+    memcpy(p, req->incr.key, req->incr.keylen);
+
+    return raw;
+}
+
+
+/* PING, QUIT, DB and INFO, no payload at all */
+static bstring pack_request_ack(const union triedb_request *req) {
+    bstring raw = NULL;
+    pack_request_header(&raw, req->header.byte, 0);
+    return raw;
+}
+
+
+static bstring pack_request_ext(const union triedb_request *req) {
+
+    bstring raw = NULL;
+
+    unsigned char *p = pack_request_header(&raw, req->header.byte,
+                                           1 + req->ext.len);
+    p += pack(p, "B", (unsigned) req->ext.opcode);
+    if (req->ext.len > 0)
+        memcpy(p, req->ext.data, req->ext.len);
+
+    return raw;
+}
+
+/*
+ * Request packing functions, positioned in the array based on the opcode,
+ * the commands the server doesn't decode are left NULL
+ */
+static bstring (*pack_request_handlers[16])(const union triedb_request *) = {
+    pack_request_ext,
+    pack_request_put,
+    pack_request_get,
+    pack_request_get,
+    pack_request_ttl,
+    pack_request_incr,
+    pack_request_incr,
+    NULL,
+    NULL,
+    NULL,
+    pack_request_ack,
+    pack_request_ack,
+    pack_request_ack,
+    pack_request_ack,
+    NULL,
+    NULL
+};
+
+
+bstring pack_triedb_request(const union triedb_request *req, unsigned type) {
+
+    if (type > JOIN || !pack_request_handlers[type])
+        return NULL;
+
+    return pack_request_handlers[type](req);
+}
+
+
+/*
+ * Pack a MGET, a MPUT or a MDEL request, after the EXT header and the opcode
+ * the number of entries, then the entries in the same layout unpack_batch
+ * expects
+ */
+bstring pack_batch(unsigned char opcode,
+                   const struct tuple *tuples, unsigned short n) {
+
+    size_t length = sizeof(unsigned char) + sizeof(uint16_t);
+
+    for (unsigned short i = 0; i < n; ++i) {
+        length += sizeof(uint16_t) + tuples[i].keylen;
+        if (opcode == MPUT)
+            length += sizeof(int32_t) + sizeof(uint32_t) + tuples[i].vallen;
+    }
+
+    bstring raw = NULL;
+    unsigned char *p = pack_request_header(&raw, EXT << 4, length);
+
+    p += pack(p, "BH", (unsigned) opcode, (unsigned) n);
+
+    for (unsigned short i = 0; i < n; ++i) {
+        if (opcode == MPUT)
+            p += pack(p, "i", (long) tuples[i].ttl);
+        p += pack(p, "H", (unsigned) tuples[i].keylen);
+        memcpy(p, tuples[i].key, tuples[i].keylen);
+        p += tuples[i].keylen;
+        if (opcode == MPUT) {
+            p += pack(p, "I", (unsigned long) tuples[i].vallen);
+            memcpy(p, tuples[i].val, tuples[i].vallen);
+            p += tuples[i].vallen;
+        }
+    }
+
     return raw;
 }
 
@@ -33,16 +33,27 @@
 #include "config.h"
 #include "server.h"
 #include "vector.h"
+#include "slowlog.h"
 
 /* Error codes */
 #define OK                      0x00
 #define NOK                     0x01
 #define EOOM                    0x01
+#define BUSY                    0x02
 
 
 #define HEADER_LEN 2
 #define ACK_LEN    2
 
+/* Max number of bytes used to encode the Remaining Length of a packet */
+#define MAX_LEN_BYTES 4
+
+/*
+ * Max length of a single key GET reply header: byte, length, TTL, version,
+ * key len
+ */
+#define GET_HEADER_LEN (1 + MAX_LEN_BYTES + 4 + 8 + 2)
+
 /*
  * Command opcode, each TrieDB command is identified by the 7-4 bits of every
  * header which can be summarized by the following table:
@@ -91,6 +102,101 @@ enum opcode {
     JOIN  = 15
 };
 
+/*
+ * Extended commands, all the opcodes are taken so they're carried by the ACK
+ * opcode, which is never sent by clients, as EXT. The first byte of the
+ * payload selects the command:
+ *
+ * EXT OPCODE | HEX
+ * -----------|------
+ *  SLOWLOG   | 0x00
+ *  MGET      | 0x01
+ *  MPUT      | 0x02
+ *  MDEL      | 0x03
+ *  TXN       | 0x04
+ *  CAS       | 0x05
+ *  CDEL      | 0x06
+ *  SUBSCRIBE | 0x07
+ *  UNSUBSCR. | 0x08
+ *  NOTIFY    | 0x09
+ *  WAIT      | 0x0a
+ *  TRACKING  | 0x0b
+ *
+ * Batch commands MGET, MPUT and MDEL carry the number of entries as a 16 bit
+ * integer, followed by the entries themselves:
+ *
+ * - MGET, MDEL: key length (u16), key
+ * - MPUT: TTL (i32), key length (u16), key, value length (u32), value
+ *
+ * TXN carries the number of commands as a 16 bit integer as well, followed by
+ * the commands as complete request packets, header byte and remaining length
+ * included. They're executed atomically, in order, and their replies are
+ * sent back in a single packet, after the TXN opcode and their count.
+ *
+ * CAS and CDEL are a PUT and a DEL executed only if the version of the key
+ * matches the one expected, 0 meaning that the key must not exist:
+ *
+ * - CAS: version (u64), TTL (i32), key length (u16), key, value
+ * - CDEL: version (u64), key length (u16), key
+ *
+ * Both reply with the CAS or CDEL opcode, OK or NOK and a version, the new
+ * one of the key if a CAS succeeded, the current one if the check failed.
+ *
+ * SUBSCRIBE and UNSUBSCRIBE carry a key length (u16) and a key, with the
+ * prefix bit of the header set to cover all the keys under it, in the
+ * database selected by the client. They reply with an ACK.
+ *
+ * NOTIFY is only sent by the server, to the subscribers, at any time between
+ * the replies. It carries the number of events as a 16 bit integer, followed
+ * by the events, in the order they happened:
+ *
+ * - event type (u8), key length (u16), key
+ *
+ * The type has the NOTIFY_PREFIX bit set if the event concerns all the keys
+ * under the key, like a prefix PUT or DEL.
+ *
+ * WAIT is a blocking GET, it carries a version (u64), a timeout in
+ * milliseconds (u32), 0 to wait forever, a key length (u16) and a key. It's
+ * answered as a GET of the key as soon as its version differs from the one
+ * carried, 0 meaning that the key must exist, right away if it already does.
+ * With the prefix bit set the version is ignored and it's answered as a GET
+ * of the first key written under the prefix. A NOK is sent on timeout.
+ *
+ * TRACKING carries a single byte, 1 to start tracking the keys read by the
+ * client and 0 to stop. Each key read, or prefix read by a prefix GET, is
+ * invalidated once, on its next change, by a NOTIFY_INVALIDATE event pushed
+ * in a NOTIFY; it's tracked again on the next read. It replies with an ACK.
+ */
+#define EXT ACK
+
+enum ext_opcode {
+    SLOWLOG = 0,
+    MGET    = 1,
+    MPUT    = 2,
+    MDEL    = 3,
+    TXN     = 4,
+    CAS     = 5,
+    CDEL    = 6,
+    SUBSCRIBE   = 7,
+    UNSUBSCRIBE = 8,
+    NOTIFY      = 9,
+    WAIT        = 10,
+    TRACKING    = 11
+};
+
+/* Number of extended commands, NOTIFY is never accepted from the clients */
+#define EXT_OPCODES 12
+
+/* Types of the keyspace events carried by NOTIFY */
+enum notify_event {
+    NOTIFY_PUT        = 0,
+    NOTIFY_DEL        = 1,
+    NOTIFY_EXPIRED    = 2,
+    NOTIFY_INVALIDATE = 3
+};
+
+#define NOTIFY_PREFIX 0x80
+
 /*
  * Definition of the common header, for now it simply define the operation
  * code, the total size of the packet including the body and uses a bitflag to
@@ -134,6 +240,7 @@ struct put {
 
     int ttl;
     unsigned short keylen;
+    size_t vallen;
     unsigned char *key;
     unsigned char *val;
 };
@@ -143,15 +250,29 @@ struct get {
 
     union header header;
 
+    unsigned short keylen;
     unsigned char *key;
 };
 
 
 typedef struct get del;
 
-typedef struct get inc;
+/*
+ * INC and DEC carry the quantity to add or subtract as a signed 64 bit
+ * integer followed by the key
+ */
+struct incr {
+
+    union header header;
+
+    int64_t delta;
+    unsigned short keylen;
+    unsigned char *key;
+};
 
-typedef struct get dec;
+typedef struct incr inc;
+
+typedef struct incr dec;
 
 typedef struct get cnt;
 
@@ -165,10 +286,21 @@ struct ttl {
     union header header;
 
     int ttl;
+    unsigned short keylen;
     unsigned char *key;
 };
 
 
+struct ext {
+
+    union header header;
+
+    unsigned char opcode;
+    size_t len;
+    unsigned char *data;
+};
+
+
 struct ack {
 
     union header header;
@@ -202,6 +334,7 @@ union triedb_request {
     struct put put;
     struct get get;
     struct ttl ttl;
+    struct ext ext;
 
     inc incr;
     cnt count;
@@ -221,8 +354,10 @@ union triedb_request {
 
 struct tuple {
     int ttl;
+    uint64_t version;
     unsigned short keylen;
     unsigned char *key;
+    size_t vallen;
     unsigned char *val;
 };
 
@@ -244,6 +379,8 @@ struct get_response {
         struct {
             unsigned short tuples_len;
             struct tuple *tuples;
+            /* Blobs pinned by the tuples, NULL for the other values */
+            struct db_value **values;
         };
 
         struct tuple val;
@@ -266,6 +403,9 @@ struct join_response {
     unsigned short tuples_len;
 
     struct tuple *tuples;
+
+    /* Blobs pinned by the tuples, NULL for the other values */
+    struct db_value **values;
 };
 
 /*
@@ -296,27 +436,96 @@ int encode_length(unsigned char *, size_t);
 size_t decode_length(const unsigned char **, unsigned *);
 
 /*
- * Unpack a response from network byteorder (a big-endian) bytestream into a
- * response struct
+ * Unpack a request from network byteorder (a big-endian) bytestream into a
+ * request struct. Keys and values are not copied, they point into the
+ * bytestream, which must outlive the request and have room for an additional
+ * byte after the payload, used to NUL terminate the last key. Return -1 if
+ * the payload doesn't match the command, e.g. a key longer than the payload,
+ * or the command can't be decoded, 0 otherwise.
  */
-int unpack_triedb_request(const unsigned char *,
+int unpack_triedb_request(unsigned char *,
                           union triedb_request *, unsigned char, size_t);
 
 int unpack_triedb_response(const unsigned char *,
                            union triedb_response *, unsigned char, size_t);
 
-unsigned char *pack_triedb_request(const union triedb_request *, unsigned);
+/*
+ * Pack a request into a bytestring ready to be sent out, the inverse of
+ * unpack_triedb_request, selected by the opcode passed. Return NULL for the
+ * commands the server can't decode, TTL, CNT, USE, KEYS, FLUSH and JOIN.
+ */
+bstring pack_triedb_request(const union triedb_request *, unsigned);
 
-void triedb_request_destroy(union triedb_request *);
+/*
+ * Unpack the entries of a batch command payload into an array of tuples,
+ * allocated and returned through the last argument, only keys are set for
+ * MGET and MDEL. As for single key requests keys and values are not copied,
+ * keys are NUL terminated in place. Return the number of entries, -1 if the
+ * payload is malformed or empty.
+ */
+int unpack_batch(unsigned char *, size_t, unsigned char, struct tuple **);
+
+/*
+ * Pack a MGET, a MPUT or a MDEL request out of an array of tuples, only keys
+ * are read for MGET and MDEL, TTLs and values as well for MPUT
+ */
+bstring pack_batch(unsigned char, const struct tuple *, unsigned short);
+
+/*
+ * Unpack the commands of a transaction payload into an array of requests,
+ * allocated and returned through the last argument. Return the number of
+ * commands, -1 if the payload is malformed or empty.
+ */
+int unpack_transaction(unsigned char *, size_t, union triedb_request **);
+
+/*
+ * Unpack a CAS or a CDEL payload into the expected version and a tuple, the
+ * value is set only for CAS. Return -1 if the payload is malformed.
+ */
+int unpack_cas(unsigned char *, size_t, unsigned char,
+               uint64_t *, struct tuple *);
+
+/*
+ * Unpack a SUBSCRIBE or an UNSUBSCRIBE payload into a tuple carrying only
+ * the key. Return -1 if the payload is malformed.
+ */
+int unpack_subscribe(unsigned char *, size_t, struct tuple *);
+
+/*
+ * Unpack a WAIT payload into the version, the timeout in milliseconds and a
+ * tuple carrying only the key. Return -1 if the payload is malformed.
+ */
+int unpack_wait(unsigned char *, size_t, uint64_t *,
+                uint32_t *, struct tuple *);
 
 struct ack_response *ack_response(unsigned char , unsigned char);
 
+/*
+ * Build a GET response, out of a tuple, or of the vector of the keys found
+ * under a prefix if the prefix bit is set, NULL if the vector is empty. A
+ * prefix response is to be built while holding the lock of the database: the
+ * blobs and the compressed values are pinned, the other values copied, so it
+ * can be packed after the lock is released, once get_response_expand has
+ * expanded the compressed ones. The pins are dropped by get_response_destroy.
+ */
 struct get_response *get_response(unsigned char, const void *);
 
 struct cnt_response *cnt_response(unsigned char, unsigned long long);
 
+/*
+ * Build a JOIN response out of a vector of keys, NULL if it's empty, while
+ * holding the lock of the database like a prefix GET response
+ */
 struct join_response *join_response(unsigned char, const Vector *);
 
+/*
+ * Expand the compressed values pinned by a prefix response, to be called
+ * after releasing the lock of the database and before packing it
+ */
+void get_response_expand(struct get_response *);
+
+void join_response_expand(struct join_response *);
+
 void get_response_destroy(struct get_response *);
 
 void join_response_destroy(struct join_response *);
@@ -330,6 +539,15 @@ int unpack_join_response(unsigned char *, union triedb_response *,
  */
 unsigned char *pack_response(const union triedb_response *, unsigned);
 
+/*
+ * Pack the header of a single key GET response into a buffer of at least
+ * GET_HEADER_LEN bytes, returning its length. Key and value are expected to
+ * follow it on the wire, this way they can be sent straight from where they
+ * are stored without being copied.
+ */
+int pack_get_header(unsigned char *, unsigned char,
+                    int, uint64_t, unsigned short, size_t);
+
 /* Helper function to create a bytearray with a ACK code */
 bstring pack_ack(unsigned char, unsigned char);
 
@@ -339,4 +557,25 @@ bstring pack_cnt(unsigned char, unsigned long long);
 /* Helper function to create a bytearray with all informations stored in */
 bstring pack_info(const struct config *, const struct informations *);
 
+/* Helper function to create a bytearray with all the slow log entries */
+bstring pack_slowlog(const struct slowlog *);
+
+/*
+ * Helper function to create a bytearray with the results of a MGET, tuples
+ * without a value are sent as missing
+ */
+bstring pack_mget(const struct tuple *, unsigned short);
+
+/* Helper function to create a bytearray with the number of keys deleted */
+bstring pack_mdel(unsigned long long);
+
+/* Helper function to create a bytearray with the outcome of a CAS or CDEL */
+bstring pack_cas(unsigned char, unsigned char, uint64_t);
+
+/*
+ * Helper function to create a bytearray with a NOTIFY carrying a number of
+ * events already packed
+ */
+bstring pack_notify(const unsigned char *, size_t, unsigned short);
+
 #endif
@@ -0,0 +1,353 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bst.h"
+#include "util.h"
+#include "pubsub.h"
+
+/*
+ * Data of the trie nodes of the subscribed patterns, released as soon as
+ * they're left without subscriptions, together with the path of the pattern
+ */
+struct pubsub_node {
+    struct pubsub *pubsub;
+    struct trie_node *tnode;
+    char *pattern;
+    struct subscription *exact;
+    struct subscription *prefix;
+    struct pubsub_node *next;
+};
+
+
+static bool pubsub_node_destructor(struct trie_node *node, bool dataonly) {
+
+    bool ret = false;
+    struct pubsub_node *pn = node->data;
+
+    if (pn) {
+        struct subscription *lists[2] = { pn->exact, pn->prefix };
+        for (int i = 0; i < 2; ++i) {
+            while (lists[i]) {
+                struct subscription *next = lists[i]->next;
+                tfree(lists[i]);
+                lists[i] = next;
+            }
+        }
+        tfree(pn->pattern);
+        tfree(pn);
+        node->data = NULL;
+        ret = true;
+    }
+
+    if (dataonly == false)
+        tfree(node);
+
+    return ret;
+}
+
+
+struct pubsub *pubsub_new(void) {
+    struct pubsub *pubsub = tmalloc(sizeof(*pubsub));
+    pubsub->patterns = trie_new(pubsub_node_destructor);
+    pubsub->size = 0;
+    pubsub->released = NULL;
+    return pubsub;
+}
+
+
+void pubsub_destroy(struct pubsub *pubsub) {
+
+    if (!pubsub)
+        return;
+
+    trie_destroy(pubsub->patterns);
+    tfree(pubsub);
+}
+
+
+static inline struct subscription **pubsub_node_list(struct pubsub_node *pn,
+                                                     bool prefix) {
+    return prefix ? &pn->prefix : &pn->exact;
+}
+
+/*
+ * Release a pattern node once it's left without subscriptions, pruning the
+ * nodes of its path not leading to other patterns
+ */
+static void pubsub_node_release(struct pubsub_node *pn) {
+
+    if (pn->exact || pn->prefix)
+        return;
+
+    Trie *patterns = pn->pubsub->patterns;
+
+    pn->tnode->data = NULL;
+    patterns->size--;
+    trie_prune(patterns, pn->pattern);
+
+    tfree(pn->pattern);
+    tfree(pn);
+}
+
+/* Unlink a subscription from its pattern and from its subscriber and free it */
+static void subscription_free(struct subscription *s) {
+
+    if (s->prev)
+        s->prev->next = s->next;
+    else
+        *pubsub_node_list(s->node, s->prefix) = s->next;
+    if (s->next)
+        s->next->prev = s->prev;
+
+    struct subscription *head = *s->list;
+
+    if (s == head)
+        *s->list = s->snext;
+    else
+        s->sprev->snext = s->snext;
+    if (s->snext)
+        s->snext->sprev = s->sprev;
+    else if (s != head)
+        head->sprev = s->sprev;
+
+    s->node->pubsub->size--;
+
+    tfree(s);
+}
+
+
+static struct subscription *pubsub_find(struct pubsub_node *pn,
+                                        bool prefix, void *subscriber) {
+    struct subscription *s = *pubsub_node_list(pn, prefix);
+    while (s && s->subscriber != subscriber)
+        s = s->next;
+    return s;
+}
+
+
+bool pubsub_subscribe(struct pubsub *pubsub, const char *pattern,
+                      bool prefix, void *subscriber,
+                      struct subscription **list) {
+
+    struct trie_node *tnode = trie_node_find(pubsub->patterns->root, pattern);
+    struct pubsub_node *pn = tnode ? tnode->data : NULL;
+
+    if (!pn) {
+        pn = tcalloc(1, sizeof(*pn));
+        pn->pubsub = pubsub;
+        pn->pattern = tstrdup(pattern);
+        trie_insert(pubsub->patterns, pattern, pn);
+        pn->tnode = trie_node_find(pubsub->patterns->root, pattern);
+    } else if (pubsub_find(pn, prefix, subscriber)) {
+        return false;
+    }
+
+    struct subscription *s = tmalloc(sizeof(*s));
+    struct subscription **head = pubsub_node_list(pn, prefix);
+
+    s->subscriber = subscriber;
+    s->prefix = prefix;
+    s->node = pn;
+
+    s->prev = NULL;
+    s->next = *head;
+    if (*head)
+        (*head)->prev = s;
+    *head = s;
+
+    s->list = list;
+    s->snext = *list;
+    s->sprev = *list ? (*list)->sprev : s;
+    if (*list)
+        (*list)->sprev = s;
+    *list = s;
+
+    pubsub->size++;
+
+    return true;
+}
+
+
+bool pubsub_unsubscribe(struct pubsub *pubsub, const char *pattern,
+                        bool prefix, void *subscriber) {
+
+    struct trie_node *tnode = trie_node_find(pubsub->patterns->root, pattern);
+    struct pubsub_node *pn = tnode ? tnode->data : NULL;
+    struct subscription *s = pn ? pubsub_find(pn, prefix, subscriber) : NULL;
+
+    if (!s)
+        return false;
+
+    subscription_free(s);
+    pubsub_node_release(pn);
+
+    return true;
+}
+
+
+void pubsub_drop(struct subscription *s) {
+    struct pubsub_node *pn = s->node;
+    subscription_free(s);
+    pubsub_node_release(pn);
+}
+
+
+struct subscription *pubsub_oldest(struct subscription *list) {
+    return list ? list->sprev : NULL;
+}
+
+
+const char *pubsub_pattern(const struct subscription *s) {
+    return s->node->pattern;
+}
+
+
+void pubsub_unsubscribe_all(struct subscription **list) {
+    while (*list)
+        pubsub_drop(*list);
+}
+
+
+bool pubsub_covered(const struct pubsub *pubsub,
+                    const char *key, void *subscriber) {
+
+    const struct trie_node *node = pubsub->patterns->root;
+
+    while (1) {
+
+        struct pubsub_node *pn = node->data;
+
+        if (pn && pubsub_find(pn, true, subscriber))
+            return true;
+
+        if (!*key)
+            return false;
+
+        struct bst_node *child = bst_search(node->children, *key++);
+        if (!child)
+            return false;
+
+        node = child->data;
+    }
+}
+
+/*
+ * Call the function on a list of subscriptions, dropping those it rejects,
+ * the next one is taken in advance as the current one could be released
+ */
+static void publish_list(struct subscription *s,
+                         pubsub_callback *fn, void *arg) {
+    while (s) {
+        struct subscription *next = s->next;
+        if (!fn(s, arg))
+            subscription_free(s);
+        s = next;
+    }
+}
+
+/*
+ * Publish to all the subscriptions of a pattern node, prefix ones if `all`.
+ * A node emptied is released after the walk, pruning it would free the nodes
+ * being walked.
+ */
+static void publish_node(struct trie_node *node, bool all,
+                         pubsub_callback *fn, void *arg) {
+
+    struct pubsub_node *pn = node->data;
+
+    if (!pn)
+        return;
+
+    publish_list(pn->prefix, fn, arg);
+    if (all)
+        publish_list(pn->exact, fn, arg);
+
+    if (!pn->exact && !pn->prefix) {
+        pn->next = pn->pubsub->released;
+        pn->pubsub->released = pn;
+    }
+}
+
+
+static void publish_subtree(struct bst_node *, pubsub_callback *, void *);
+
+
+static void publish_children(struct trie_node *node,
+                             pubsub_callback *fn, void *arg) {
+    trie_visited++;
+    publish_node(node, true, fn, arg);
+    publish_subtree(node->children, fn, arg);
+}
+
+
+static void publish_subtree(struct bst_node *node,
+                            pubsub_callback *fn, void *arg) {
+    if (!node)
+        return;
+    publish_children(node->data, fn, arg);
+    publish_subtree(node->left, fn, arg);
+    publish_subtree(node->right, fn, arg);
+}
+
+
+static void publish_walk(struct trie_node *node, const char *key,
+                         bool prefix, pubsub_callback *fn, void *arg) {
+
+    /* Subscriptions to the prefixes of the key, root included */
+    for (; *key; ++key) {
+
+        if (node->data)
+            publish_node(node, false, fn, arg);
+
+        struct bst_node *child = bst_search(node->children, *key);
+        if (!child)
+            return;
+
+        node = child->data;
+        trie_visited++;
+    }
+
+    /* The key itself, and everything under it if it's a prefix */
+    if (node->data)
+        publish_node(node, true, fn, arg);
+
+    if (prefix)
+        publish_subtree(node->children, fn, arg);
+}
+
+
+void pubsub_publish(struct pubsub *pubsub, const char *key, bool prefix,
+                    pubsub_callback *fn, void *arg) {
+
+    publish_walk(pubsub->patterns->root, key, prefix, fn, arg);
+
+    while (pubsub->released) {
+        struct pubsub_node *pn = pubsub->released;
+        pubsub->released = pn->next;
+        pubsub_node_release(pn);
+    }
+}
@@ -0,0 +1,125 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PUBSUB_H
+#define PUBSUB_H
+
+#include <stdbool.h>
+#include "trie.h"
+
+/*
+ * Subscriptions to the changes of the keys, to a single key or to all the
+ * keys under a prefix, indexed by their pattern in a trie of their own. The
+ * subscribers of a key are found walking the path of the key only, meeting
+ * the ones subscribed to its prefixes along the way and the ones subscribed
+ * to the key itself at its end, so publishing costs O(key length) whatever
+ * the number of patterns.
+ *
+ * Each subscription is linked to the other ones on the same pattern and to
+ * the other ones of the same subscriber, this way dropping a subscriber
+ * doesn't need any lookup. A pattern left without subscriptions is pruned
+ * from the trie, which only holds the patterns subscribed. It's not
+ * thread-safe.
+ */
+struct pubsub_node;
+
+struct subscription {
+    void *subscriber;
+    bool prefix;
+    struct pubsub_node *node;
+    /* Subscriptions to the same pattern */
+    struct subscription *prev;
+    struct subscription *next;
+    /*
+     * Subscriptions of the same subscriber, newest first, and the head of
+     * their list, whose previous one is the oldest
+     */
+    struct subscription **list;
+    struct subscription *sprev;
+    struct subscription *snext;
+};
+
+struct pubsub {
+    Trie *patterns;
+    /* Number of subscriptions */
+    size_t size;
+    /* Patterns emptied by a publish, pruned once out of the trie walk */
+    struct pubsub_node *released;
+};
+
+/*
+ * Called on each subscription matching a published key, with an opaque
+ * argument, returning false drops the subscription
+ */
+typedef bool pubsub_callback(struct subscription *, void *);
+
+
+struct pubsub *pubsub_new(void);
+
+void pubsub_destroy(struct pubsub *);
+
+/*
+ * Subscribe to a key or to a prefix, linking the subscription to the list of
+ * the subscriber as well. Return false if it's already subscribed.
+ */
+bool pubsub_subscribe(struct pubsub *, const char *, bool,
+                      void *, struct subscription **);
+
+/* Drop a subscription, return false if it's not subscribed */
+bool pubsub_unsubscribe(struct pubsub *, const char *, bool, void *);
+
+/*
+ * Drop a subscription found by other means than its pattern, not to be called
+ * from a publish callback, which drops it returning false
+ */
+void pubsub_drop(struct subscription *);
+
+/* Return the oldest subscription of a list, NULL if it's empty */
+struct subscription *pubsub_oldest(struct subscription *);
+
+/* Return the key, or the prefix, a subscription is subscribed to */
+const char *pubsub_pattern(const struct subscription *);
+
+/* Drop all the subscriptions of a list, emptying it */
+void pubsub_unsubscribe_all(struct subscription **);
+
+/*
+ * Return true if a subscriber is subscribed to a prefix of a key, the key
+ * itself included, i.e. if it already gets all the events of the key
+ */
+bool pubsub_covered(const struct pubsub *, const char *, void *);
+
+/*
+ * Call a function on all the subscriptions matching a key, those to the key
+ * itself and to its prefixes; a prefix event concerns all the keys under it,
+ * so in that case the subscriptions below it in the trie match as well
+ */
+void pubsub_publish(struct pubsub *, const char *, bool,
+                    pubsub_callback *, void *);
+
+
+#endif
@@ -27,19 +27,21 @@
 
 #include <time.h>
 #include <fcntl.h>
+#include <assert.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <poll.h>
 #include <sys/epoll.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <sys/eventfd.h>
-#include <uuid/uuid.h>
 #include "list.h"
 #include "pack.h"
 #include "util.h"
@@ -47,6 +49,9 @@
 #include "config.h"
 #include "network.h"
 #include "protocol.h"
+#include "slowlog.h"
+#include "pubsub.h"
+#include "uring.h"
 
 
 /*
@@ -84,15 +89,72 @@
  * The main Trie data strucure accessed on the worker thread pool is guarded by
  * a spinlock, and being generally fast operations it shouldn't suffer high
  * contentions by the threads and thus being really fast.
+ *
+ * Cheap commands (PING, DB, single key GET and small PUT) skip the worker pool
+ * entirely: they're executed by the IO thread right after the decoding and
+ * the reply is written back immediately, avoiding two EPOLL hops.
+ *
+ * On Linux 6.0+ the IO thread pool can optionally run on io_uring instead of
+ * EPOLL (see `io_backend` configuration), in that case each IO thread owns a
+ * ring which accepts connections, receives and sends data, while the main
+ * thread just waits for the shutdown.
  */
 
 
 /*
  * Guards the access to the main database structure, the trie underlying the
- * DB
+ * DB. Being cheap commands executed inline on the IO threads as well, the
+ * trie can be accessed concurrently by both thread pools.
  */
 static pthread_spinlock_t spinlock;
 
+/*
+ * Depth of the acquisitions of the global lock by the calling thread, the
+ * lock is taken only by the outermost one, this way a transaction can hold it
+ * across all of its commands, which acquire it as usual
+ */
+static _Thread_local unsigned lock_depth = 0;
+
+/*
+ * Clients with keyspace events collected by the holder of the global lock,
+ * they're pushed out on its release, this way all the events of a command,
+ * or of a transaction, reach each subscriber in a single NOTIFY
+ */
+static struct client *notify_clients = NULL;
+
+/*
+ * Blocking reads answered by the holder of the global lock, they're handed
+ * back to the IO threads right after its release, see wait_handler
+ */
+static struct waiter *waiters_answered = NULL;
+
+static void notify_flush(void);
+
+static void waiters_resume(struct waiter *);
+
+static inline void db_lock(void) {
+#if WORKERPOOLSIZE + IOPOOLSIZE > 1
+    if (lock_depth == 0)
+        pthread_spin_lock(&spinlock);
+#endif
+    lock_depth++;
+}
+
+static inline void db_unlock(void) {
+    if (--lock_depth > 0)
+        return;
+    if (notify_clients)
+        notify_flush();
+    struct waiter *answered = waiters_answered;
+    if (answered)
+        waiters_answered = NULL;
+#if WORKERPOOLSIZE + IOPOOLSIZE > 1
+    pthread_spin_unlock(&spinlock);
+#endif
+    if (answered)
+        waiters_resume(answered);
+}
+
 /*
  * IO event strucuture, it's the main information that will be communicated
  * between threads, every request packet will be wrapped into an IO event and
@@ -105,15 +167,109 @@ struct io_event {
     eventfd_t io_event;
     struct client *client;
     bstring reply;
-    union triedb_request *payload;
+    /*
+     * Single key GET replies are written out as the packed header followed
+     * by the requested key and by the value, a blob pinned till written out
+     * or any other encoding rendered in valbuf
+     */
+    unsigned char header[GET_HEADER_LEN];
+    unsigned char headerlen;
+    struct db_value *value;
+    const unsigned char *val;
+    size_t vallen;
+    unsigned char valbuf[DB_FORMAT_MAX];
+    /* Decoded request, keys and values point into the request buffer */
+    union triedb_request payload;
+    unsigned char *buf;
+    /* Timestamps in nanoseconds of the phases of the request */
+    uint64_t recv_time;
+    uint64_t decode_time;
+    uint64_t exec_time;
+    uint64_t done_time;
+    uint64_t reply_time;
+    /* Owner ring of the event, NULL if it comes from the EPOLL backend */
+    struct uring_loop *loop;
+    /* A NOTIFY pushed by the server, not the reply of a request */
+    bool push;
+    struct io_event *next;
 };
 
 /* Global information structure */
 static struct informations info;
 
+/*
+ * Statistics blocks of the threads, each thread registers its own on first
+ * use and it's the only one writing to it, INFO sums them all up
+ */
+#define STATS_MAX_THREADS (IOPOOLSIZE + WORKERPOOLSIZE + 1)
+
+static struct thread_stats *stats_blocks[STATS_MAX_THREADS];
+
+static unsigned stats_nblocks = 0;
+
+static _Thread_local struct thread_stats *stats = NULL;
+
+
+static struct thread_stats *stats_block(void) {
+    if (!stats) {
+        unsigned i = __atomic_fetch_add(&stats_nblocks, 1, __ATOMIC_RELAXED);
+        assert(i < STATS_MAX_THREADS);
+        stats = tmalloc(sizeof(*stats));
+        memset(stats, 0x00, sizeof(*stats));
+        __atomic_store_n(&stats_blocks[i], stats, __ATOMIC_RELEASE);
+    }
+    return stats;
+}
+
+/* Single writer increment, readers on other threads never see torn values */
+static inline void stats_add(uint64_t *counter, uint64_t n) {
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+/*
+ * Account a request whose reply has been written out, on the stats block of
+ * the thread which wrote it
+ */
+static void stats_request(const struct io_event *event, uint64_t now) {
+
+    struct thread_stats *s = stats_block();
+    struct histogram *h = s->latency[event->payload.header.bits.opcode];
+
+    histogram_record(&h[PHASE_DECODE], event->decode_time - event->recv_time);
+    histogram_record(&h[PHASE_QUEUE],
+                     (event->exec_time - event->decode_time)
+                     + (event->reply_time - event->done_time));
+    histogram_record(&h[PHASE_EXECUTE], event->done_time - event->exec_time);
+    histogram_record(&h[PHASE_WRITE], now - event->reply_time);
+
+    stats_add(&s->nrequests, 1);
+}
+
 /* The main triedb instance */
 static struct triedb triedb;
 
+/*
+ * Commands which took longer than `slowlog_threshold` to execute, recorded by
+ * any thread executing commands, guarded by its own lock being hit only by
+ * slow commands
+ */
+static struct slowlog slowlog;
+
+static pthread_spinlock_t slowlog_lock;
+
+/*
+ * Timing wheel of the connected clients, ticking every second, to disconnect
+ * those idle for longer than `idle_timeout`. Clients are not moved on every
+ * request, when their slot comes up the active ones are just re-added
+ * according to their last action time. Guarded by its own lock.
+ */
+static struct wheel idle_wheel;
+
+static pthread_spinlock_t idle_lock;
+
+/* Last connection id assigned, ids start from 1 */
+static uint64_t last_client_id;
+
 /*
  * Shared epoll object, contains the IO epoll and Worker epoll descriptors,
  * as well as the server descriptor and the timer fd for repeated routines.
@@ -131,6 +287,22 @@ struct epoll {
 
 static void init_info(void);
 static void expire_keys(void);
+static void rehash_databases(void);
+static void reap_idle_clients(void);
+static void client_close(struct client *);
+static void client_free(struct client *);
+static void client_push(struct client *, bstring);
+static void push_queue_purge(struct client *);
+static void client_outbox_queue(struct client *, const struct iovec *,
+                                int, size_t);
+static bool client_outbox_flush(struct client *);
+static void uring_loop_done(struct uring_loop *, struct io_event *);
+static void io_event_done(struct io_event *);
+static struct db_item *lookup_item(struct database *, const char *);
+static void prefix_search_free(Vector *);
+static int io_event_iov(struct io_event *, struct iovec *);
+static inline void reply_destroy(bstring);
+static inline unsigned char *buf_reserve(unsigned char *, size_t);
 static inline bool trie_node_destructor(struct trie_node *, bool);
 
 /* Prototype for a command handler */
@@ -169,9 +341,33 @@ static int info_handler(struct io_event *);
 
 static int flush_handler(struct io_event *);
 
+static int ext_handler(struct io_event *);
+
+static int slowlog_handler(struct io_event *);
+
+static int mget_handler(struct io_event *);
+
+static int mput_handler(struct io_event *);
+
+static int mdel_handler(struct io_event *);
+
+static int txn_handler(struct io_event *);
+
+static int cas_handler(struct io_event *);
+
+static int cdel_handler(struct io_event *);
+
+static int subscribe_handler(struct io_event *);
+
+static int unsubscribe_handler(struct io_event *);
+
+static int wait_handler(struct io_event *);
+
+static int tracking_handler(struct io_event *);
+
 /* Command handler mapped usign their position paired with their type */
 static handler *handlers[15] = {
-    NULL,
+    ext_handler,
     put_handler,
     get_handler,
     del_handler,
@@ -188,642 +384,2667 @@ static handler *handlers[15] = {
     flush_handler
 };
 
-/* OK, NOK and RESERVED return codes, pre-packed ACK responses */
+/* Extended command handlers, selected by the first byte of the payload */
+static handler *ext_handlers[EXT_OPCODES] = {
+    slowlog_handler,
+    mget_handler,
+    mput_handler,
+    mdel_handler,
+    txn_handler,
+    cas_handler,
+    cdel_handler,
+    subscribe_handler,
+    unsubscribe_handler,
+    NULL,
+    wait_handler,
+    tracking_handler
+};
+
+/* OK, NOK and BUSY return codes, pre-packed ACK responses */
 static bstring ack_replies[3];
 
 
 /********************************/
-/*      COMMAND HANDLERS        */
+/*    KEYSPACE NOTIFICATIONS    */
 /********************************/
 
-/* Get the current selected DB of the requesting client */
-static int db_handler(struct io_event *event) {
-
-    // TODO set DB response
-    event->reply = bstring_new(event->client->db->name);
-
-    return 0;
-}
-
+/* A keyspace event being published, see notify */
+struct notification {
+    const char *key;
+    size_t keylen;
+    unsigned char type;
+    uint64_t seq;
+};
 
-static int put_handler(struct io_event *event) {
+/*
+ * Sequence number of the last event published, guarded by the global lock, a
+ * client subscribed more than once to a key gets each event just once
+ */
+static uint64_t notify_seq = 0;
 
-    union triedb_request *packet = event->payload;
-    struct client *c = event->client;
+/* Push the events collected for a client so far */
+static void notify_client(struct client *c) {
 
-#if WORKERPOOLSIZE > 1
-    pthread_spin_lock(&spinlock);
-#endif
+    client_push(c, pack_notify(c->notify, c->notify_len, c->notify_count));
 
-    if (packet->header.bits.prefix == 1) {
-        database_prefix_set(c->db, (const char *) packet->put.key,
-                            packet->put.val, packet->put.ttl);
-    } else {
-        database_insert(c->db, (const char *) packet->put.key,
-                        packet->put.val, packet->put.ttl);
-        // Update total counter of keys
-        triedb.keyspace_size++;
+    // Don't retain the memory of big batches
+    if (malloc_size(c->notify) > IO_EVENT_BUFSIZE) {
+        tfree(c->notify);
+        c->notify = NULL;
     }
 
-#if WORKERPOOLSIZE > 1
-    pthread_spin_unlock(&spinlock);
-#endif
-    event->reply = ack_replies[OK];
+    c->notify_len = 0;
+    c->notify_count = 0;
+}
 
-    return 0;
+/* Push out the events collected, called on the release of the global lock */
+static void notify_flush(void) {
+    while (notify_clients) {
+        struct client *c = notify_clients;
+        notify_clients = c->notify_next;
+        c->notify_pending = false;
+        notify_client(c);
+    }
 }
 
 
-static int get_handler(struct io_event *event) {
+static bool notify_subscriber(struct subscription *s, void *arg) {
 
-    union triedb_request *packet = event->payload;
-    struct client *c = event->client;
-    struct get_response *response = NULL;
+    struct notification *n = arg;
+    struct client *c = s->subscriber;
 
-    void *val = NULL;
-    Vector *v = NULL;
+    if (c->notify_seq == n->seq)
+        return true;
 
-    if (packet->get.header.bits.prefix == 0) {
+    c->notify_seq = n->seq;
 
-        // Single value response
+    if (!c->notify_pending) {
+        c->notify_pending = true;
+        c->notify_next = notify_clients;
+        notify_clients = c;
+    } else if (c->notify_count == UINT16_MAX) {
+        notify_client(c);
+    }
 
-#if WORKERPOOLSIZE > 1
-        pthread_spin_lock(&spinlock);
-#endif
-        // Test for the presence of the key in the trie structure
-        bool found = database_search(c->db, (const char *) packet->get.key, &val);
-#if WORKERPOOLSIZE > 1
-        pthread_spin_unlock(&spinlock);
-#endif
+    size_t len = c->notify_len + sizeof(unsigned char)
+        + sizeof(uint16_t) + n->keylen;
 
-        if (found == false || val == NULL)
-            goto nok;
+    c->notify = c->notify ? buf_reserve(c->notify, len) : tmalloc(len);
 
-        // XXX Lot of boilerplate, to be refactored
+    unsigned char *p = c->notify + c->notify_len;
+    p += pack(p, "BH", (unsigned) n->type, (unsigned) n->keylen);
+    memcpy(p, n->key, n->keylen);
 
-        struct db_item *item = val;
+    c->notify_len = len;
+    c->notify_count++;
 
-        /*
-         * Check for TTL, in case of no ttl (-1) go on, otherwise the key is
-         * flagged as expired and we delete it from the database, in a lazy
-         * check behaviour
-         */
-        if (item->ttl != -1) {
+    return true;
+}
 
-            time_t now = time(NULL);
-            time_t delta = (item->ctime + item->ttl) - now;
+static void wake_waiters(struct database *, const char *, bool);
 
-            if (delta <= 0) {
+/*
+ * Invalidate a key read by a tracking client, the entry is dropped, the key
+ * is tracked again on the next read
+ */
+static bool invalidate_tracker(struct subscription *s, void *arg) {
+    notify_subscriber(s, arg);
+    ((struct client *) s->subscriber)->ntracked--;
+    return false;
+}
 
-#if WORKERPOOLSIZE > 1
-                pthread_spin_lock(&spinlock);
-#endif
-                // we're in the expired state
-                database_remove(c->db, (const char *) packet->get.key);
+/*
+ * Publish a keyspace event to the subscribers of the key, or of any key under
+ * it if it's a prefix, must be called with the global lock held; the change
+ * wakes up the blocking reads waiting for it and invalidates the key to the
+ * clients tracking it as well. It costs nothing till someone subscribes to,
+ * waits on or tracks the database.
+ */
+static void notify(struct database *db, const char *key,
+                   bool prefix, unsigned char type) {
 
-                /*
-                 * Linearly search for index of the key in the expiring_keys
-                 * vector, binary search would be better here
-                 */
-                for (size_t i = 0; i < vector_size(triedb.expiring_keys); ++i) {
-                    struct expiring_key *ek =
-                        vector_get(triedb.expiring_keys, i);
-                    if (ek->item == item) {
-                        vector_delete(triedb.expiring_keys, i);
-                        tfree((char *) ek->key);
-                        tfree(ek);
-                        break;
-                    }
-                }
+    bool subscribed = db->subscribers && db->subscribers->size > 0;
+    bool tracked = db->tracking && db->tracking->size > 0;
 
-                triedb.keyspace_size--;
+    if (subscribed || tracked) {
 
-#if WORKERPOOLSIZE > 1
-                pthread_spin_unlock(&spinlock);
-#endif
+        struct notification n = {
+            .key = key,
+            .keylen = strlen(key),
+            .type = type | (prefix ? NOTIFY_PREFIX : 0),
+            .seq = ++notify_seq
+        };
 
-                // Finally return a NOK
-                event->reply = ack_replies[NOK];
+        if (subscribed)
+            pubsub_publish(db->subscribers, key, prefix,
+                           notify_subscriber, &n);
 
-                return 0;
-            }
+        if (tracked) {
+            n.type = NOTIFY_INVALIDATE | (prefix ? NOTIFY_PREFIX : 0);
+            n.seq = ++notify_seq;
+            pubsub_publish(db->tracking, key, prefix, invalidate_tracker, &n);
         }
+    }
 
-        struct tuple t = {
-            .ttl = item->ttl,
-            .keylen = strlen((const char *) packet->get.key),
-            .key = packet->get.key,
-            .val = item->data
-        };
+    // Last, the waiters answered start tracking the key written
+    if (type == NOTIFY_PUT && db->waiters && db->waiters->size > 0)
+        wake_waiters(db, key, prefix);
+}
 
-        response = get_response(packet->get.header.byte, &t);
+/*
+ * Remember a key, or a prefix, read by a tracking client, to invalidate it
+ * on its next change. Keys under a prefix already tracked for the client are
+ * covered by it and not recorded on their own. Past `max_tracked_keys` the
+ * oldest one is invalidated right away and forgotten, the memory taken by a
+ * client reading a lot of keys stays bounded. Must be called with the global
+ * lock held.
+ */
+static void track(struct client *c, const char *key, bool prefix) {
 
-    } else {
+    if (!c->tracking)
+        return;
 
-        /*
-         * Multiple values response
-         * In this case we have to check for TTL of each returned item from
-         * the query and discard all those who have expired their time which
-         * are not already being removed by the system itself through timerfd
-         * routine on worker threads
-         */
+    if (!c->db->tracking)
+        c->db->tracking = pubsub_new();
+    else if (pubsub_covered(c->db->tracking, key, c))
+        return;
 
-#if WORKERPOOLSIZE > 1
-        pthread_spin_lock(&spinlock);
-#endif
+    if (!pubsub_subscribe(c->db->tracking, key, prefix, c, &c->tracked))
+        return;
 
-        v = database_prefix_search(c->db, (const char *) packet->get.key);
+    c->ntracked++;
+    if (conf->max_tracked_keys == 0 || c->ntracked <= conf->max_tracked_keys)
+        return;
 
-#if WORKERPOOLSIZE > 1
-        pthread_spin_unlock(&spinlock);
-#endif
+    struct subscription *oldest = pubsub_oldest(c->tracked);
+    const char *pattern = pubsub_pattern(oldest);
+    struct notification n = {
+        .key = pattern,
+        .keylen = strlen(pattern),
+        .type = NOTIFY_INVALIDATE | (oldest->prefix ? NOTIFY_PREFIX : 0),
+        .seq = ++notify_seq
+    };
+
+    notify_subscriber(oldest, &n);
+    pubsub_drop(oldest);
+    c->ntracked--;
+}
 
-        time_t now = time(NULL);
-        time_t delta = 0;
+/*
+ * Drop all the subscriptions of a client and the keys it tracks, nothing is
+ * pushed to it after
+ */
+static void client_unsubscribe(struct client *c) {
 
-        struct kv_obj *cur = NULL;
-        struct db_item *item = NULL;
-        for (int i = 0; i < vector_size(v); ++i) {
-            cur = vector_get(v, i);
-            item = (struct db_item *) cur->data;
+    if (!c->subscriptions && !c->tracked)
+        return;
 
-            if (item->ttl != -1) {
+    db_lock();
+    pubsub_unsubscribe_all(&c->subscriptions);
+    pubsub_unsubscribe_all(&c->tracked);
+    c->ntracked = 0;
+    db_unlock();
+}
 
-                delta = (item->ctime + item->ttl) - now;
 
-                if (delta <= 0) {
+/********************************/
+/*        BLOCKING READS        */
+/********************************/
 
-#if WORKERPOOLSIZE > 1
-                    pthread_spin_lock(&spinlock);
-#endif
-                    // we're in the expired state
-                    database_remove(c->db, (const char *) packet->get.key);
+/*
+ * A WAIT request parked till a write of its key, or of any key under its
+ * prefix, or till its timeout. Parked requests are subscribed to their key
+ * among the waiters of the database, this way writes find them walking the
+ * path of the key as they find the subscribers, and their timeouts are linked
+ * in a wheel ticking every millisecond, advanced by the expiration cron. All
+ * guarded by the global lock.
+ */
+struct waiter {
+    struct io_event *event;
+    struct database *db;
+    const char *key;
+    uint64_t version;
+    /* Deadline in milliseconds, 0 to wait forever */
+    uint64_t deadline;
+    struct wheel_node timer;
+    struct subscription *subscription;
+    struct waiter *prev;
+    struct waiter *next;
+};
 
-                    /*
-                     * Linearly search for index of the key in the expiring_keys
-                     * vector, binary search would be better here
-                     */
-                    for (size_t i = 0; i < vector_size(triedb.expiring_keys); ++i) {
-                        struct expiring_key *ek =
-                            vector_get(triedb.expiring_keys, i);
-                        if (ek->item == item) {
-                            vector_delete(triedb.expiring_keys, i);
-                            tfree((char *) ek->key);
-                            tfree(ek);
-                            break;
-                        }
-                    }
+static struct waiter *waiters = NULL;
 
-                    triedb.keyspace_size--;
+/* Number of requests parked, read by the cron without the lock */
+static size_t nwaiters = 0;
 
-#if WORKERPOOLSIZE > 1
-                    pthread_spin_unlock(&spinlock);
-#endif
+static struct wheel waiters_wheel;
 
-                    vector_delete(v, i);
-                }
-            }
-        }
+/* A write published to the waiters, see wake_waiter */
+struct wakeup {
+    const char *key;
+    bool prefix;
+};
 
-        /*
-         * Prefix request can return either a populated vector with at least
-         * one match, or a NULL pointer, in this case we'd change our response
-         * to a simple NOK
-         */
-        if (v)
-            response = get_response(packet->get.header.byte, v);
-        else {
-            event->reply = ack_replies[NOK];
-            return 0;
-        }
-    }
+/*
+ * Set the reply of a WAIT to the one of a GET of a key, pinning or copying
+ * the value of the item like GET does, must be called with the global lock
+ * held. The key is copied in the request buffer, which it may already point
+ * to; a compressed value is expanded later by wait_reply_done, out of the
+ * lock.
+ */
+static void wait_reply(struct io_event *event,
+                       const char *key, const struct db_item *item) {
 
-    // XXX Lot of boilerplate, to be refactored
+    size_t keylen = strlen(key);
+    size_t len = 0;
 
-    union triedb_response r = { .get_res = *response };
+    event->buf = buf_reserve(event->buf, keylen + 1);
+    memmove(event->buf, key, keylen + 1);
+    event->payload.get.key = event->buf;
+    event->payload.get.keylen = keylen;
 
-    event->reply = pack_response(&r, packet->get.header.bits.opcode);
+    track(event->client, (const char *) event->buf, false);
 
-    // TODO destroy response
-    if (v) {
-        struct kv_obj *current = NULL;
-        for (int i = 0; i < vector_size(v); ++i) {
-            current = vector_get(v, i);
-            tfree((void *) current->key);
-            tfree(current);
-        }
-        tfree(v->items);
-        tfree(v);
+    if (item->encoding == DB_BLOB || item->encoding == DB_COMPRESSED) {
+        event->value = db_value_ref(item->val);
+        event->val = event->value->data;
+        len = event->value->rawlen ? event->value->rawlen : event->value->len;
+    } else {
+        event->val = db_item_format(item, event->valbuf, &len);
     }
 
-    if (r.get_res.header.bits.prefix == 1)
-        tfree(response->tuples);
-    tfree(response);
+    event->vallen = len;
+    event->headerlen = pack_get_header(event->header, GET << 4, item->ttl,
+                                       item->version, keylen, len);
+}
 
-    return 0;
 
-nok:
+static void wait_reply_done(struct io_event *event) {
+    if (event->value) {
+        event->value = db_value_uncompress(event->value);
+        event->val = event->value->data;
+    }
+}
 
-    event->reply = ack_replies[NOK];
+/*
+ * Take an answered request off the waiters, it's resumed as soon as the
+ * global lock is released. Its subscription is left to the caller.
+ */
+static void waiter_answer(struct waiter *w) {
 
-    return 0;
+    wheel_del(&w->timer);
+
+    if (w->prev)
+        w->prev->next = w->next;
+    else
+        waiters = w->next;
+    if (w->next)
+        w->next->prev = w->prev;
 
+    __atomic_store_n(&nwaiters, nwaiters - 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&w->event->client->waiter, NULL, __ATOMIC_RELAXED);
+
+    w->next = waiters_answered;
+    waiters_answered = w;
 }
 
+/* Hand the answered requests back to the IO threads serving their clients */
+static void waiters_resume(struct waiter *w) {
+    while (w) {
+        struct waiter *next = w->next;
+        wait_reply_done(w->event);
+        w->event->done_time = nanotime();
+        io_event_done(w->event);
+        tfree(w);
+        w = next;
+    }
+}
 
-static int del_handler(struct io_event *event) {
+/*
+ * Answer a waiter if the write published changed the key it waits for, or
+ * wrote a key under its prefix. A prefix write doesn't name a single key to
+ * reply with, so it only wakes up the waiters on the keys under it.
+ */
+static bool wake_waiter(struct subscription *s, void *arg) {
 
-    union triedb_request *packet = event->payload;
-    struct client *c = event->client;
+    struct wakeup *wk = arg;
+    struct waiter *w = s->subscriber;
 
-    size_t currsize = 0;
+    if (s->prefix && wk->prefix)
+        return true;
 
-    /*
-     * For each key in the keys array, check for presence and try to remove it,
-     * if the `is_prefix` flag is a set the key will be treated as a prefix
-     * wildcard (*) and we'll remove all keys below it in the trie
-     */
-    if (packet->get.header.bits.prefix == 1) {
+    const char *key = s->prefix ? wk->key : w->key;
+    struct db_item *item = lookup_item(w->db, key);
 
-        currsize = database_size(c->db);
+    if (!item || (!s->prefix && item->version == w->version))
+        return true;
 
-#if WORKERPOOLSIZE > 1
-        pthread_spin_lock(&spinlock);
-#endif
-        /*
-         * We are dealing with a wildcard, so we apply the deletion
-         * to all keys below the wildcard
-         */
-        database_prefix_remove(c->db, (const char *) packet->get.key);
+    wait_reply(w->event, key, item);
+    waiter_answer(w);
 
-#if WORKERPOOLSIZE > 1
-        pthread_spin_unlock(&spinlock);
-#endif
+    return false;
+}
 
-        // Update total keyspace counter
-        triedb.keyspace_size -= currsize - database_size(c->db);
 
-        event->reply = ack_replies[OK];
+static void wake_waiters(struct database *db, const char *key, bool prefix) {
+    struct wakeup wk = { .key = key, .prefix = prefix };
+    pubsub_publish(db->waiters, key, prefix, wake_waiter, &wk);
+}
 
-    } else {
 
-#if WORKERPOOLSIZE > 1
-        pthread_spin_lock(&spinlock);
-#endif
-        bool found = database_remove(c->db, (const char *) packet->get.key);
-#if WORKERPOOLSIZE > 1
-        pthread_spin_unlock(&spinlock);
-#endif
-        if (found == false)
-            event->reply = ack_replies[NOK];
-        else {
-            // Update total keyspace counter
-            triedb.keyspace_size--;
-            event->reply = ack_replies[OK];
-        }
+static void waiter_timeout(struct wheel_node *node, uint64_t now, void *arg) {
+
+    (void) arg;
+
+    struct waiter *w = container_of(node, struct waiter, timer);
+
+    // Farther than a whole turn of the wheel, not yet expired
+    if (w->deadline > now) {
+        wheel_add(&waiters_wheel, node, w->deadline);
+        return;
     }
 
-    return 0;
+    pubsub_unsubscribe_all(&w->subscription);
+    w->event->reply = ack_replies[NOK];
+    waiter_answer(w);
 }
 
-/*
- * Utility function, compare TTL of two database items and return a bool value
- * based on the order of them, true if the first item has a lower delta (e.g.
- * difference between current time and the time of creation) the the second
- * one. Meant to be passed in to a sort function below
- */
-static bool compare_ttl(void *arg1, void *arg2) {
-
-    time_t now = time(NULL);
+/* Answer with a NOK the requests parked past their timeout */
+static void expire_waiters(void) {
 
-    /* cast to db_item */
-    const struct db_item *n1 = ((struct expiring_key *) arg1)->item;
-    const struct db_item *n2 = ((struct expiring_key *) arg2)->item;
+    if (__atomic_load_n(&nwaiters, __ATOMIC_RELAXED) == 0)
+        return;
 
-    time_t delta_l1 = (n1->ctime + n1->ttl) - now;
-    time_t delta_l2 = (n2->ctime + n2->ttl) - now;
+    uint64_t now = nanotime() / 1000000;
 
-    return delta_l1 <= delta_l2;
+    db_lock();
+    if (waiters_wheel.now < now)
+        wheel_advance(&waiters_wheel, now, waiter_timeout, NULL);
+    db_unlock();
 }
 
+/* Answer with a NOK the request parked by a client going away */
+static void client_unwait(struct client *c) {
 
-static int ttl_handler(struct io_event *event) {
+    if (!__atomic_load_n(&c->waiter, __ATOMIC_RELAXED))
+        return;
 
-    union triedb_request *packet = event->payload;
-    struct client *c = event->client;
-    void *val = NULL;
+    db_lock();
 
-    // Check for key presence in the trie structure
-    bool found = trie_find(c->db->data, (const char *) packet->ttl.key, &val);
+    struct waiter *w = c->waiter;
 
-    if (found == false || val == NULL) {
-        event->reply = ack_replies[NOK];
-    } else {
-        struct db_item *item = val;
-        bool has_ttl = !(item->ttl < 0);
-        item->ttl = packet->ttl.ttl;
+    if (w) {
+        pubsub_unsubscribe_all(&w->subscription);
+        w->event->reply = ack_replies[NOK];
+        waiter_answer(w);
+    }
 
-        /*
-         * It's a new TTL, so we update creation_time to now in order to
-         * calculate the effective expiration of the key
-         */
-        item->ctime = item->lstime = time(NULL);
-        struct expiring_key *ek = tmalloc(sizeof(*ek));
-        ek->item = item;
-        ek->key = tstrdup((const char *) packet->ttl.key);
-        ek->data_ptr = c->db->data;
+    db_unlock();
+}
 
-        /*
-         * Push into the expiring keys list and merge sort it shortly after,
-         * this way we have a mostly updated list of expiring keys at each
-         * insert, making it simpler and more efficient to cycle through them
-         * and remove it later.
-         */
-        if (!has_ttl)
-            vector_append(triedb.expiring_keys, ek);
 
-        vector_qsort(triedb.expiring_keys,
-                     compare_ttl, sizeof(struct expiring_key));
+/********************************/
+/*        KEY EXPIRATION        */
+/********************************/
 
-        event->reply = ack_replies[OK];
+/*
+ * Timers of the keys with a TTL, linked in a wheel ticking every second,
+ * advanced by the expiration cron, this way keys are deleted and their
+ * expiration published even if nobody reads them anymore. Each item refers to
+ * its timer by the id stored in it, its index in a table plus one: a write
+ * changing the TTL re-arms the timer already there and a key deleted drops it
+ * with the item, there's never more than a timer per key. All guarded by the
+ * global lock.
+ */
+static struct wheel expiry_wheel;
+
+static struct {
+    struct expiring_key **timers;
+    /* Ids of the timers released, reused before growing the table */
+    uint32_t *unused;
+    uint32_t nunused;
+    uint32_t len;
+    uint32_t cap;
+} expiring;
+
+/* Number of keys with a timer, read by the cron without the lock */
+static size_t nexpiring = 0;
+
+
+static uint32_t expiring_id(struct expiring_key *ek) {
+
+    uint32_t id;
+
+    if (expiring.nunused > 0) {
+        id = expiring.unused[--expiring.nunused];
+    } else {
+        if (expiring.len == expiring.cap) {
+            expiring.cap = expiring.cap ? expiring.cap * 2 : 64;
+            expiring.timers = trealloc(expiring.timers,
+                                       expiring.cap * sizeof(ek));
+            expiring.unused = trealloc(expiring.unused,
+                                       expiring.cap * sizeof(id));
+        }
+        id = ++expiring.len;
     }
 
-    return 0;
+    expiring.timers[id - 1] = ek;
+    __atomic_store_n(&nexpiring, nexpiring + 1, __ATOMIC_RELAXED);
+
+    return id;
+}
+
+/* Drop the timer of an item, if it has one */
+static void expire_drop(struct db_item *item) {
+
+    if (item->expiry == 0)
+        return;
+
+    struct expiring_key *ek = expiring.timers[item->expiry - 1];
+
+    expiring.timers[item->expiry - 1] = NULL;
+    expiring.unused[expiring.nunused++] = item->expiry;
+    __atomic_store_n(&nexpiring, nexpiring - 1, __ATOMIC_RELAXED);
+    item->expiry = 0;
+
+    wheel_del(&ek->timer);
+    tfree((char *) ek->key);
+    tfree(ek);
 }
 
 /*
- * Increment an integer value by 1. If the string value doesn't contain a
- * proper integer return a NOK.
- *
- * XXX check for bounds
+ * Arm the timer of a key just written, or whose TTL just changed, dropping it
+ * if the key has no TTL anymore
  */
-static int inc_handler(struct io_event *event) {
+static void expire_set(struct database *db, const char *key,
+                       struct db_item *item) {
 
-    union triedb_request *packet = event->payload;
-    struct client *c = event->client;
+    if (item->ttl == -1) {
+        expire_drop(item);
+        return;
+    }
 
-    if (packet->incr.header.bits.prefix == 1) {
-        database_prefix_inc(c->db, (const char *) packet->incr.key);
-    } else {
+    struct expiring_key *ek = NULL;
 
-        bool found = false;
-        void *val = NULL;
+    if (item->expiry) {
+        ek = expiring.timers[item->expiry - 1];
+        wheel_del(&ek->timer);
+    } else {
+        ek = tmalloc(sizeof(*ek));
+        ek->db = db;
+        ek->key = tstrdup(key);
+        wheel_node_init(&ek->timer);
+        item->expiry = expiring_id(ek);
+    }
 
-        /* check for presence and increment it by one */
-        found = database_search(c->db, (const char *) packet->incr.key, &val);
+    wheel_add(&expiry_wheel, &ek->timer, item->ctime + item->ttl);
+}
 
-        if (found == false || !val) {
-            event->reply = ack_replies[NOK];
-        } else {
+/* Arm the timers of all the keys under a prefix just written */
+static void expire_set_prefix(struct database *db, const char *prefix) {
 
-            struct db_item *item = val;
+    Vector *v = database_prefix_search(db, prefix);
 
-            if (!is_integer(item->data))
-                event->reply = ack_replies[NOK];
-            else
-                item->data = update_integer_string(item->data, 1);
-        }
+    for (int i = 0; v && i < vector_size(v); ++i) {
+        struct kv_obj *kv = vector_get(v, i);
+        expire_set(db, kv->key, (struct db_item *) kv->data);
     }
 
-    event->reply = ack_replies[OK];
-
-    return 0;
+    prefix_search_free(v);
 }
 
 /*
- * Decrement an integer value by 1. If the string value doesn't contain a
- * proper integer return a NOK.
- *
- * XXX check for bounds
+ * Delete a key if its TTL is over, publishing its expiration, its timer goes
+ * with it. Must be called with the global lock held, return true if the key
+ * expired.
  */
-static int dec_handler(struct io_event *event) {
+static bool expire_key(struct database *db, const char *key) {
 
-    union triedb_request *packet = event->payload;
-    struct client *c = event->client;
+    void *val = NULL;
 
-    if (packet->incr.header.bits.prefix == 1) {
-        database_prefix_dec(c->db, (const char *) packet->incr.key);
-    } else {
+    if (!trie_find(db->data, key, &val) || !val)
+        return false;
 
-        bool found = false;
-        void *val = NULL;
+    struct db_item *item = val;
 
-        /* check for presence and increment it by one */
-        found = database_search(c->db, (const char *) packet->incr.key, &val);
+    if (item->ttl == -1 || item->ctime + item->ttl > time(NULL))
+        return false;
 
-        if (found == false || !val) {
-            event->reply = ack_replies[NOK];
-        } else {
+    trie_delete(db->data, key);
+    triedb.keyspace_size--;
 
-            struct db_item *item = val;
+    notify(db, key, false, NOTIFY_EXPIRED);
 
-            if (!is_integer(item->data))
-                event->reply = ack_replies[NOK];
-            else
-                item->data = update_integer_string(item->data, -1);
-        }
+    tdebug("%s expired", key);
+
+    return true;
+}
+
+
+static void expire_timer(struct wheel_node *node, uint64_t now, void *arg) {
+
+    (void) arg;
+
+    struct expiring_key *ek = container_of(node, struct expiring_key, timer);
+    struct db_item *item = NULL;
+
+    trie_find(ek->db->data, ek->key, (void **) &item);
+
+    // Farther than a whole turn of the wheel, not yet expired
+    time_t deadline = item->ctime + item->ttl;
+    if (deadline > (time_t) now) {
+        wheel_add(&expiry_wheel, node, deadline);
+        return;
     }
 
-    event->reply = ack_replies[OK];
+    // The key is taken over, the timer is released together with the item
+    struct database *db = ek->db;
+    const char *key = ek->key;
+    ek->key = NULL;
 
-    return 0;
+    expire_key(db, key);
+    tfree((char *) key);
 }
 
 
-static int cnt_handler(struct io_event *event) {
+/********************************/
+/*      COMMAND HANDLERS        */
+/********************************/
 
-    unsigned long long count = 0;
-    union triedb_request *packet = event->payload;
-    struct client *c = event->client;
+/*
+ * Find the item stored at a key, NULL if it doesn't exist or it's expired,
+ * expired items are left to the expiration routine. Must be called with the
+ * lock held.
+ */
+static struct db_item *lookup_item(struct database *db, const char *key) {
 
-    /*
-     * Prefix operation by default, get the size of each key below the
-     * requested one, glob operation or the entire trie size in case of NULL
-     * key
-     */
-    count = !packet->count.key ? database_size(c->db) :
-        database_prefix_count(c->db, (const char *) packet->count.key);
+    void *val = NULL;
 
-    event->reply = pack_cnt(CNT, count);
+    if (!database_search(db, key, &val) || !val)
+        return NULL;
+
+    struct db_item *item = val;
+
+    if (item->ttl != -1 && item->ctime + item->ttl <= time(NULL))
+        return NULL;
+
+    return item;
+}
+
+/* Release the vector of the keys found by a prefix search */
+static void prefix_search_free(Vector *v) {
+
+    if (!v)
+        return;
+
+    for (int i = 0; i < vector_size(v); ++i) {
+        struct kv_obj *kv = vector_get(v, i);
+        tfree((void *) kv->key);
+        tfree(kv);
+    }
+
+    tfree(v->items);
+    tfree(v);
+}
+
+/* Get the current selected DB of the requesting client */
+static int db_handler(struct io_event *event) {
+
+    // TODO set DB response
+    event->reply = bstring_new(event->client->db->name);
 
     return 0;
 }
 
-/* Set the current selected namespace for the connected client. */
-static int use_handler(struct io_event *event) {
 
-    union triedb_request *packet = event->payload;
-    struct client *c = event->client;
+static int put_handler(struct io_event *event) {
 
-    /* Check for presence first */
-    struct database *database =
-        hashtable_get(triedb.dbs, (const char *) packet->usec.key);
+    union triedb_request *packet = &event->payload;
+    struct client *c = event->client;
 
-    /*
-     * It doesn't exist, we create a new database with the given name,
-     * otherwise just assign it to the current db of the client
-     */
-    if (!database) {
-        // TODO check for OOM
-        database = tmalloc(sizeof(*database));
-        database_init(database, tstrdup((const char *) packet->usec.key),
-                      trie_node_destructor);
+    db_lock();
 
-        // Add it to the databases table
-        hashtable_put(triedb.dbs, tstrdup(database->name), database);
-        c->db = database;
+    if (packet->header.bits.prefix == 1) {
+        database_prefix_set(c->db, (const char *) packet->put.key,
+                            packet->put.val, packet->put.vallen,
+                            packet->put.ttl);
+        if (packet->put.ttl != -1 || nexpiring > 0)
+            expire_set_prefix(c->db, (const char *) packet->put.key);
     } else {
-        c->db = database;
+        size_t size = database_size(c->db);
+        // The value is copied straight from the request buffer
+        struct db_item *item =
+            database_insert(c->db, (const char *) packet->put.key,
+                            packet->put.val, packet->put.vallen,
+                            packet->put.ttl);
+        expire_set(c->db, (const char *) packet->put.key, item);
+        // Update total counter of keys, updates don't change it
+        triedb.keyspace_size += database_size(c->db) - size;
     }
 
+    notify(c->db, (const char *) packet->put.key,
+           packet->header.bits.prefix == 1, NOTIFY_PUT);
+
+    db_unlock();
     event->reply = ack_replies[OK];
 
     return 0;
 }
 
 
-static int keys_handler(struct io_event *event) {
+static int get_handler(struct io_event *event) {
 
-    union triedb_request *packet = event->payload;
+    union triedb_request *packet = &event->payload;
     struct client *c = event->client;
     struct get_response *response = NULL;
 
-#if WORKERPOOLSIZE > 1
-        pthread_spin_lock(&spinlock);
-#endif
+    void *val = NULL;
+    Vector *v = NULL;
 
-        Vector *v = database_prefix_search(c->db,
-                                           (const char *) packet->get.key);
+    if (packet->get.header.bits.prefix == 0) {
 
-#if WORKERPOOLSIZE > 1
-        pthread_spin_unlock(&spinlock);
-#endif
+        // Single value response
+        struct db_value *value = NULL;
+        const unsigned char *data = NULL;
+        size_t len = 0;
+        short ttl = -1;
+        time_t ctime = 0;
+        uint64_t version = 0;
+
+        db_lock();
+        // Test for the presence of the key in the trie structure
+        bool found = database_search(c->db, (const char *) packet->get.key, &val);
+        track(c, (const char *) packet->get.key, false);
 
         /*
-         * Prefix request can return either a populated vector with at least
-         * one match, or a NULL pointer, in this case we'd change our response
-         * to a simple NOK
+         * Pin the value while still holding the lock, the reply will point
+         * directly to it and it'll be released once written out, values
+         * not stored as blobs are small and just copied
          */
-        if (v)
-            response = get_response(packet->get.header.byte, v);
-        else {
-            event->reply = ack_replies[NOK];
-            return 0;
+        if (found == true && val) {
+            struct db_item *item = val;
+            ttl = item->ttl;
+            ctime = item->ctime;
+            version = item->version;
+            if (item->encoding == DB_BLOB || item->encoding == DB_COMPRESSED)
+                value = db_value_ref(item->val);
+            else
+                data = db_item_format(item, event->valbuf, &len);
         }
+        db_unlock();
 
-        // XXX Lot of boilerplate, to be refactored
+        // Compressed values are expanded out of the lock
+        if (value) {
+            value = db_value_uncompress(value);
+            data = value->data;
+            len = value->len;
+        }
 
-        union triedb_response r = { .get_res = *response };
+        if (found == false || val == NULL)
+            goto nok;
 
-        event->reply = pack_response(&r, packet->get.header.bits.opcode);
+        /*
+         * Check for TTL, in case of no ttl (-1) go on, otherwise the key is
+         * flagged as expired and we delete it from the database, in a lazy
+         * check behaviour
+         */
+        if (ttl != -1) {
 
-        // TODO destroy response
-        if (v) {
-            struct kv_obj *current = NULL;
-            for (int i = 0; i < vector_size(v); ++i) {
-                current = vector_get(v, i);
-                tfree((void *) current->key);
-                tfree(current);
-            }
-            tfree(v->items);
-            tfree(v);
-        }
+            time_t now = time(NULL);
+            time_t delta = (ctime + ttl) - now;
 
-        tfree(response->tuples);
-        tfree(response);
+            if (delta <= 0) {
 
-        return 0;
-}
+                db_value_release(value);
 
+                // we're in the expired state, unless it's just been written
+                db_lock();
+                expire_key(c->db, (const char *) packet->get.key);
+                db_unlock();
 
-static int ping_handler(struct io_event *event) {
+                // Finally return a NOK
+                event->reply = ack_replies[NOK];
 
-    // TODO send out a PONG
-    event->reply = ack_replies[OK];
+                return 0;
+            }
+        }
 
-    return 0;
-}
+        /*
+         * Only the header is packed, key and value follow it on the wire
+         * straight from the request and from the database
+         */
+        event->headerlen = pack_get_header(event->header,
+                                           packet->get.header.byte, ttl,
+                                           version, packet->get.keylen,
+                                           len);
+        event->value = value;
+        event->val = data;
+        event->vallen = len;
 
+        return 0;
 
-static int quit_handler(struct io_event *event) {
+    } else {
 
-    close(event->client->fd);
-    info.nclients--;
+        /*
+         * Multiple values response
+         * In this case we have to check for TTL of each returned item from
+         * the query and discard all those who have expired their time which
+         * are not already being removed by the expiration routine. The
+         * response is built holding the lock, the items could change or go
+         * away right after, blobs are pinned and all the other values copied.
+         */
 
-#if WORKERPOOLSIZE > 1
-    pthread_spin_lock(&spinlock);
-#endif
+        db_lock();
 
-    // Remove client from the clients map
-    hashtable_del(triedb.clients, event->client->uuid);
+        v = database_prefix_search(c->db, (const char *) packet->get.key);
+        track(c, (const char *) packet->get.key, true);
+
+        for (int i = 0; v && i < vector_size(v); ++i) {
+            struct kv_obj *cur = vector_get(v, i);
+            // we're in the expired state
+            if (expire_key(c->db, cur->key)) {
+                vector_delete(v, i--);
+                tfree((void *) cur->key);
+                tfree(cur);
+            }
+        }
 
-#if WORKERPOOLSIZE > 1
-    pthread_spin_unlock(&spinlock);
-#endif
+        /*
+         * Prefix request can return either a populated vector with at least
+         * one match, or a NULL pointer or an empty vector if no key is left
+         * under the prefix, in this case we'd change our response to a
+         * simple NOK
+         */
+        if (v)
+            response = get_response(packet->get.header.byte, v);
 
-    return -1;
-}
+        db_unlock();
 
+        if (!response) {
+            prefix_search_free(v);
+            event->reply = ack_replies[NOK];
+            return 0;
+        }
 
-static int info_handler(struct io_event *event) {
+        // Compressed values are expanded out of the lock
+        get_response_expand(response);
+    }
 
-    // XXX placeholder
-    // TODO
-    event->reply = pack_info(conf, &info);
+    // XXX Lot of boilerplate, to be refactored
 
-    return 0;
-}
+    union triedb_response r = { .get_res = *response };
 
+    event->reply = pack_response(&r, packet->get.header.bits.opcode);
 
-static int flush_handler(struct io_event *event) {
+    prefix_search_free(v);
+    get_response_destroy(response);
 
-#if WORKERPOOLSIZE > 1
-    pthread_spin_lock(&spinlock);
-#endif
+    return 0;
 
-    // Flush the entire DB
-    database_flush(event->client->db);
+nok:
 
-#if WORKERPOOLSIZE > 1
-    pthread_spin_unlock(&spinlock);
-#endif
+    event->reply = ack_replies[NOK];
 
     return 0;
-}
 
-/* Utility macro to handle base case on each EPOLL loop */
-#define EPOLL_ERR(e) if ((e.events & EPOLLERR) || (e.events & EPOLLHUP) || \
-                         (!(e.events & EPOLLIN) && !(e.events & EPOLLOUT)))
+}
 
-/*
- * Handle incoming connections, create a a fresh new struct client structure
- * and link it to the fd, ready to be set in EPOLLIN event, then pass the
- * connection to the IO EPOLL loop, waited by the IO thread pool.
- */
-static void accept_loop(struct epoll *epoll) {
 
-    int events = 0;
+static int del_handler(struct io_event *event) {
 
-    struct epoll_event *e_events =
-        tmalloc(sizeof(struct epoll_event) * EPOLL_MAX_EVENTS);
+    union triedb_request *packet = &event->payload;
+    struct client *c = event->client;
 
-    int epollfd = epoll_create1(0);
+    size_t currsize = 0;
 
     /*
-     * We want to watch for events incoming on the server descriptor (e.g. new
-     * connections)
+     * For each key in the keys array, check for presence and try to remove it,
+     * if the `is_prefix` flag is a set the key will be treated as a prefix
+     * wildcard (*) and we'll remove all keys below it in the trie
      */
-    epoll_add(epollfd, epoll->serverfd, EPOLLIN | EPOLLONESHOT, NULL);
+    if (packet->get.header.bits.prefix == 1) {
 
-    /*
-     * And also to the global event fd, this one is useful to gracefully
-     * interrupt polling and thread execution
-     */
-    epoll_add(epollfd, conf->run, EPOLLIN, NULL);
+        currsize = database_size(c->db);
+
+        db_lock();
+        /*
+         * We are dealing with a wildcard, so we apply the deletion
+         * to all keys below the wildcard
+         */
+        database_prefix_remove(c->db, (const char *) packet->get.key);
+
+        notify(c->db, (const char *) packet->get.key, true, NOTIFY_DEL);
+
+        db_unlock();
+
+        // Update total keyspace counter
+        triedb.keyspace_size -= currsize - database_size(c->db);
+
+        event->reply = ack_replies[OK];
+
+    } else {
+
+        db_lock();
+        bool found = database_remove(c->db, (const char *) packet->get.key);
+        if (found)
+            notify(c->db, (const char *) packet->get.key, false, NOTIFY_DEL);
+        db_unlock();
+        if (found == false)
+            event->reply = ack_replies[NOK];
+        else {
+            // Update total keyspace counter
+            triedb.keyspace_size--;
+            event->reply = ack_replies[OK];
+        }
+    }
+
+    return 0;
+}
+
+static int ttl_handler(struct io_event *event) {
+
+    union triedb_request *packet = &event->payload;
+    struct client *c = event->client;
+    void *val = NULL;
+
+    db_lock();
+
+    /*
+     * Check for key presence in the trie structure, a key already past its
+     * TTL is gone and can't get a new one
+     */
+    bool found = !expire_key(c->db, (const char *) packet->ttl.key)
+        && trie_find(c->db->data, (const char *) packet->ttl.key, &val);
+
+    if (found == false || val == NULL) {
+        event->reply = ack_replies[NOK];
+    } else {
+        struct db_item *item = val;
+        item->ttl = packet->ttl.ttl;
+
+        /*
+         * It's a new TTL, so we update creation_time to now in order to
+         * calculate the effective expiration of the key
+         */
+        item->ctime = item->lstime = time(NULL);
+        expire_set(c->db, (const char *) packet->ttl.key, item);
+
+        event->reply = ack_replies[OK];
+    }
+
+    db_unlock();
+
+    return 0;
+}
+
+/*
+ * Add a quantity to an integer value, or subtract it, replying with the new
+ * value. If the value is not an integer, or the result would overflow, it's
+ * left untouched and a NOK is returned. Prefix operations apply it to all the
+ * integers below the key, skipping those which would overflow, replying OK.
+ */
+static int incr_handler(struct io_event *event, bool subtract) {
+
+    union triedb_request *packet = &event->payload;
+    struct client *c = event->client;
+    const char *key = (const char *) packet->incr.key;
+    int64_t delta = packet->incr.delta;
+
+    if (!key || (subtract && delta == INT64_MIN)) {
+        event->reply = ack_replies[NOK];
+        return 0;
+    }
+
+    db_lock();
+
+    if (packet->incr.header.bits.prefix == 1) {
+
+        if (subtract)
+            database_prefix_dec(c->db, key, delta);
+        else
+            database_prefix_inc(c->db, key, delta);
+
+        notify(c->db, key, true, NOTIFY_PUT);
+
+        db_unlock();
+
+        event->reply = ack_replies[OK];
+
+        return 0;
+    }
+
+    struct db_item *item = lookup_item(c->db, key);
+    bool done = item && db_item_add(item, subtract ? -delta : delta);
+    int64_t value = done ? item->number : 0;
+
+    if (done)
+        notify(c->db, key, false, NOTIFY_PUT);
+
+    db_unlock();
+
+    if (done)
+        event->reply = pack_cnt(packet->header.byte,
+                                (unsigned long long) value);
+    else
+        event->reply = ack_replies[NOK];
+
+    return 0;
+}
+
+
+static int inc_handler(struct io_event *event) {
+    return incr_handler(event, false);
+}
+
+
+static int dec_handler(struct io_event *event) {
+    return incr_handler(event, true);
+}
+
+
+static int cnt_handler(struct io_event *event) {
+
+    unsigned long long count = 0;
+    union triedb_request *packet = &event->payload;
+    struct client *c = event->client;
+
+    /*
+     * Prefix operation by default, get the size of each key below the
+     * requested one, glob operation or the entire trie size in case of NULL
+     * key
+     */
+    count = !packet->count.key ? database_size(c->db) :
+        database_prefix_count(c->db, (const char *) packet->count.key);
+
+    event->reply = pack_cnt(CNT, count);
+
+    return 0;
+}
+
+/* Set the current selected namespace for the connected client. */
+static int use_handler(struct io_event *event) {
+
+    union triedb_request *packet = &event->payload;
+    struct client *c = event->client;
+
+    db_lock();
+
+    /* Check for presence first */
+    struct database *database =
+        hashtable_get(triedb.dbs, (const char *) packet->usec.key);
+
+    /*
+     * It doesn't exist, we create a new database with the given name,
+     * otherwise just assign it to the current db of the client
+     */
+    if (!database) {
+        // TODO check for OOM
+        database = tmalloc(sizeof(*database));
+        database_init(database, tstrdup((const char *) packet->usec.key),
+                      trie_node_destructor);
+        database->compress_min = conf->compression_threshold;
+
+        // Add it to the databases table
+        hashtable_put(triedb.dbs, tstrdup(database->name), database);
+        c->db = database;
+    } else {
+        c->db = database;
+    }
+
+    db_unlock();
+
+    event->reply = ack_replies[OK];
+
+    return 0;
+}
+
+
+static int keys_handler(struct io_event *event) {
+
+    union triedb_request *packet = &event->payload;
+    struct client *c = event->client;
+    struct get_response *response = NULL;
+
+        db_lock();
+
+        Vector *v = database_prefix_search(c->db,
+                                           (const char *) packet->get.key);
+
+        /*
+         * Prefix request can return either a populated vector with at least
+         * one match, or a NULL pointer or an empty vector, in this case we'd
+         * change our response to a simple NOK. It's built while holding the
+         * lock, like the one of a prefix GET.
+         */
+        if (v)
+            response = get_response(packet->get.header.byte, v);
+
+        db_unlock();
+
+        if (!response) {
+            prefix_search_free(v);
+            event->reply = ack_replies[NOK];
+            return 0;
+        }
+
+        get_response_expand(response);
+
+        // XXX Lot of boilerplate, to be refactored
+
+        union triedb_response r = { .get_res = *response };
+
+        event->reply = pack_response(&r, packet->get.header.bits.opcode);
+
+        prefix_search_free(v);
+        get_response_destroy(response);
+
+        return 0;
+}
+
+
+static int ping_handler(struct io_event *event) {
+
+    // TODO send out a PONG
+    event->reply = ack_replies[OK];
+
+    return 0;
+}
+
+
+/*
+ * Shut the connection down, the IO thread will release the client as on any
+ * disconnection, being the only one closing client sockets
+ */
+static int quit_handler(struct io_event *event) {
+
+    shutdown(event->client->fd, SHUT_RDWR);
+
+    return -1;
+}
+
+
+static int info_handler(struct io_event *event) {
+
+    struct informations infos = info;
+    size_t size = sizeof(struct histogram) * STATS_OPCODES * PHASES;
+    struct histogram (*latency)[PHASES] = tmalloc(size);
+
+    memset(latency, 0x00, size);
+
+    infos.nclients = __atomic_load_n(&info.nclients, __ATOMIC_RELAXED);
+    infos.nconnections = __atomic_load_n(&info.nconnections, __ATOMIC_RELAXED);
+    infos.uptime = time(NULL) - info.start_time;
+    infos.nkeys = triedb.keyspace_size;
+    infos.nrequests = 0;
+    infos.bytes_recv = 0;
+    infos.bytes_sent = 0;
+    infos.latency = latency;
+    database_compression_stats(&infos.compressed_rawlen,
+                               &infos.compressed_len);
+
+    // Sum up the statistics blocks of all the threads
+    unsigned nblocks = __atomic_load_n(&stats_nblocks, __ATOMIC_RELAXED);
+
+    for (unsigned i = 0; i < nblocks && i < STATS_MAX_THREADS; ++i) {
+        struct thread_stats *s =
+            __atomic_load_n(&stats_blocks[i], __ATOMIC_ACQUIRE);
+        if (!s)
+            continue;
+        infos.nrequests += __atomic_load_n(&s->nrequests, __ATOMIC_RELAXED);
+        infos.bytes_recv += __atomic_load_n(&s->bytes_recv, __ATOMIC_RELAXED);
+        infos.bytes_sent += __atomic_load_n(&s->bytes_sent, __ATOMIC_RELAXED);
+        for (int op = 0; op < STATS_OPCODES; ++op)
+            for (int ph = 0; ph < PHASES; ++ph)
+                histogram_merge(&latency[op][ph], &s->latency[op][ph]);
+    }
+
+    event->reply = pack_info(conf, &infos);
+
+    tfree(latency);
+
+    return 0;
+}
+
+
+static int flush_handler(struct io_event *event) {
+
+    db_lock();
+
+    // Flush the entire DB
+    database_flush(event->client->db);
+
+    notify(event->client->db, "", true, NOTIFY_DEL);
+
+    db_unlock();
+
+    return 0;
+}
+
+
+static int ext_handler(struct io_event *event) {
+
+    if (event->payload.ext.opcode >= EXT_OPCODES
+        || !ext_handlers[event->payload.ext.opcode]) {
+        event->reply = ack_replies[NOK];
+        return 0;
+    }
+
+    return ext_handlers[event->payload.ext.opcode](event);
+}
+
+/* Send out all the slow commands recorded so far, resetting the log */
+static int slowlog_handler(struct io_event *event) {
+
+    pthread_spin_lock(&slowlog_lock);
+
+    event->reply = pack_slowlog(&slowlog);
+    slowlog_reset(&slowlog);
+
+    pthread_spin_unlock(&slowlog_lock);
+
+    return 0;
+}
+
+/*
+ * Batch commands, each one executes all of its keys under a single lock
+ * acquisition and sends back a single reply
+ */
+static int mget_handler(struct io_event *event) {
+
+    struct ext *ext = &event->payload.ext;
+    struct client *c = event->client;
+    struct tuple *tuples = NULL;
+
+    int n = unpack_batch(ext->data, ext->len, MGET, &tuples);
+    if (n < 0) {
+        event->reply = ack_replies[NOK];
+        return 0;
+    }
+
+    struct db_value **values = tcalloc(n, sizeof(struct db_value *));
+    unsigned char (*bufs)[DB_FORMAT_MAX] = tmalloc(n * DB_FORMAT_MAX);
+
+    db_lock();
+
+    /*
+     * Pin the blobs found while holding the lock, and copy all the other
+     * values, expired keys are missing
+     */
+    for (int i = 0; i < n; ++i) {
+        struct db_item *item = lookup_item(c->db, (const char *) tuples[i].key);
+        track(c, (const char *) tuples[i].key, false);
+        if (!item)
+            continue;
+        tuples[i].ttl = item->ttl;
+        tuples[i].version = item->version;
+        if (item->encoding == DB_BLOB || item->encoding == DB_COMPRESSED)
+            values[i] = db_value_ref(item->val);
+        else
+            tuples[i].val = (unsigned char *)
+                db_item_format(item, bufs[i], &tuples[i].vallen);
+    }
+
+    db_unlock();
+
+    // Compressed values are expanded out of the lock
+    for (int i = 0; i < n; ++i) {
+        if (!values[i])
+            continue;
+        values[i] = db_value_uncompress(values[i]);
+        tuples[i].val = values[i]->data;
+        tuples[i].vallen = values[i]->len;
+    }
+
+    event->reply = pack_mget(tuples, n);
+
+    for (int i = 0; i < n; ++i)
+        if (values[i])
+            db_value_release(values[i]);
+
+    tfree(values);
+    tfree(bufs);
+    tfree(tuples);
+
+    return 0;
+}
+
+
+static int mput_handler(struct io_event *event) {
+
+    struct ext *ext = &event->payload.ext;
+    struct client *c = event->client;
+    struct tuple *tuples = NULL;
+
+    int n = unpack_batch(ext->data, ext->len, MPUT, &tuples);
+    if (n < 0) {
+        event->reply = ack_replies[NOK];
+        return 0;
+    }
+
+    db_lock();
+
+    size_t size = database_size(c->db);
+
+    for (int i = 0; i < n; ++i) {
+        struct db_item *item =
+            database_insert(c->db, (const char *) tuples[i].key,
+                            tuples[i].val, tuples[i].vallen, tuples[i].ttl);
+        expire_set(c->db, (const char *) tuples[i].key, item);
+        notify(c->db, (const char *) tuples[i].key, false, NOTIFY_PUT);
+    }
+
+    // Update total counter of keys, updates don't change it
+    triedb.keyspace_size += database_size(c->db) - size;
+
+    db_unlock();
+
+    tfree(tuples);
+
+    event->reply = ack_replies[OK];
+
+    return 0;
+}
+
+
+static int mdel_handler(struct io_event *event) {
+
+    struct ext *ext = &event->payload.ext;
+    struct client *c = event->client;
+    struct tuple *tuples = NULL;
+    unsigned long long deleted = 0;
+
+    int n = unpack_batch(ext->data, ext->len, MDEL, &tuples);
+    if (n < 0) {
+        event->reply = ack_replies[NOK];
+        return 0;
+    }
+
+    db_lock();
+
+    for (int i = 0; i < n; ++i) {
+        if (database_remove(c->db, (const char *) tuples[i].key)) {
+            notify(c->db, (const char *) tuples[i].key, false, NOTIFY_DEL);
+            deleted++;
+        }
+    }
+
+    // Update total keyspace counter
+    triedb.keyspace_size -= deleted;
+
+    db_unlock();
+
+    tfree(tuples);
+
+    event->reply = pack_mdel(deleted);
+
+    return 0;
+}
+
+/*
+ * Conditional commands, the version of the key is checked and the command
+ * executed under the same lock acquisition. A version 0 is expected to match
+ * a missing key, being versions counted from 1.
+ */
+static int cas_handler(struct io_event *event) {
+
+    struct ext *ext = &event->payload.ext;
+    struct client *c = event->client;
+    struct tuple t;
+    uint64_t version;
+
+    if (unpack_cas(ext->data, ext->len, CAS, &version, &t) < 0) {
+        event->reply = ack_replies[NOK];
+        return 0;
+    }
+
+    db_lock();
+
+    struct db_item *item = lookup_item(c->db, (const char *) t.key);
+    uint64_t current = item ? item->version : 0;
+    bool match = current == version;
+
+    if (match) {
+        size_t size = database_size(c->db);
+        item = database_insert(c->db, (const char *) t.key,
+                               t.val, t.vallen, t.ttl);
+        expire_set(c->db, (const char *) t.key, item);
+        triedb.keyspace_size += database_size(c->db) - size;
+        current = item->version;
+        notify(c->db, (const char *) t.key, false, NOTIFY_PUT);
+    }
+
+    db_unlock();
+
+    event->reply = pack_cas(CAS, match ? OK : NOK, current);
+
+    return 0;
+}
+
+
+static int cdel_handler(struct io_event *event) {
+
+    struct ext *ext = &event->payload.ext;
+    struct client *c = event->client;
+    struct tuple t;
+    uint64_t version;
+
+    if (unpack_cas(ext->data, ext->len, CDEL, &version, &t) < 0) {
+        event->reply = ack_replies[NOK];
+        return 0;
+    }
+
+    db_lock();
+
+    struct db_item *item = lookup_item(c->db, (const char *) t.key);
+    uint64_t current = item ? item->version : 0;
+    bool match = item && current == version;
+
+    if (match) {
+        database_remove(c->db, (const char *) t.key);
+        triedb.keyspace_size--;
+        current = 0;
+        notify(c->db, (const char *) t.key, false, NOTIFY_DEL);
+    }
+
+    db_unlock();
+
+    event->reply = pack_cas(CDEL, match ? OK : NOK, current);
+
+    return 0;
+}
+
+/*
+ * Subscribe to the changes of a key, or of all the keys under a prefix, in
+ * the database selected. The events are pushed as NOTIFY from now on.
+ */
+static int subscribe_handler(struct io_event *event) {
+
+    struct ext *ext = &event->payload.ext;
+    struct client *c = event->client;
+    bool prefix = ext->header.bits.prefix == 1;
+    struct tuple t;
+
+    if (unpack_subscribe(ext->data, ext->len, &t) < 0
+        || (t.keylen == 0 && !prefix)) {
+        event->reply = ack_replies[NOK];
+        return 0;
+    }
+
+    db_lock();
+
+    if (!c->db->subscribers)
+        c->db->subscribers = pubsub_new();
+
+    pubsub_subscribe(c->db->subscribers, (const char *) t.key,
+                     prefix, c, &c->subscriptions);
+
+    db_unlock();
+
+    event->reply = ack_replies[OK];
+
+    return 0;
+}
+
+
+static int unsubscribe_handler(struct io_event *event) {
+
+    struct ext *ext = &event->payload.ext;
+    struct client *c = event->client;
+    struct tuple t;
+    bool done = false;
+
+    if (unpack_subscribe(ext->data, ext->len, &t) < 0) {
+        event->reply = ack_replies[NOK];
+        return 0;
+    }
+
+    db_lock();
+
+    if (c->db->subscribers)
+        done = pubsub_unsubscribe(c->db->subscribers, (const char *) t.key,
+                                  ext->header.bits.prefix == 1, c);
+
+    db_unlock();
+
+    event->reply = ack_replies[done ? OK : NOK];
+
+    return 0;
+}
+
+/*
+ * Blocking GET, answered right away if the key exists with a version other
+ * than the one known by the client, otherwise parked till a write changes it
+ * or till the timeout, at most `max_wait_timeout`. The client is kept busy
+ * meanwhile, as if the request was still being executed by the worker pool,
+ * only its disconnection is watched for, to answer the request and release
+ * the client.
+ */
+static int wait_handler(struct io_event *event) {
+
+    struct ext *ext = &event->payload.ext;
+    struct client *c = event->client;
+    bool prefix = ext->header.bits.prefix == 1;
+    uint64_t version;
+    uint32_t timeout;
+    uint64_t max_timeout = conf->max_wait_timeout * 1000;
+    struct tuple t;
+
+    if (unpack_wait(ext->data, ext->len, &version, &timeout, &t) < 0
+        || (t.keylen == 0 && !prefix)) {
+        event->reply = ack_replies[NOK];
+        return 0;
+    }
+
+    db_lock();
+
+    struct db_item *item =
+        prefix ? NULL : lookup_item(c->db, (const char *) t.key);
+
+    if (item && item->version != version) {
+        wait_reply(event, (const char *) t.key, item);
+        db_unlock();
+        wait_reply_done(event);
+        return 0;
+    }
+
+    struct waiter *w = tmalloc(sizeof(*w));
+    w->event = event;
+    w->db = c->db;
+    w->key = (const char *) t.key;
+    w->version = version;
+    w->deadline = timeout > 0 ? nanotime() / 1000000 + timeout : 0;
+    if (max_timeout > 0 && (timeout == 0 || timeout > max_timeout))
+        w->deadline = nanotime() / 1000000 + max_timeout;
+    w->subscription = NULL;
+    wheel_node_init(&w->timer);
+
+    if (w->deadline > 0)
+        wheel_add(&waiters_wheel, &w->timer, w->deadline);
+
+    if (!c->db->waiters)
+        c->db->waiters = pubsub_new();
+
+    pubsub_subscribe(c->db->waiters, w->key, prefix, w, &w->subscription);
+
+    w->prev = NULL;
+    w->next = waiters;
+    if (waiters)
+        waiters->prev = w;
+    waiters = w;
+
+    __atomic_store_n(&nwaiters, nwaiters + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&c->waiter, w, __ATOMIC_RELAXED);
+
+    /*
+     * Rearm the descriptor of a client of the EPOLL backend for its hang up,
+     * before the request can be answered and the reply rearms it for writing
+     */
+    if (!event->loop)
+        epoll_mod(event->epollfd, c->fd, EPOLLRDHUP, c);
+
+    /*
+     * From now on the request belongs to the waiters, it can be answered and
+     * handed back by any thread as soon as the lock is released
+     */
+    db_unlock();
+
+    return PARKED;
+}
+
+/* Start or stop tracking the keys read by the client, for client caching */
+static int tracking_handler(struct io_event *event) {
+
+    struct ext *ext = &event->payload.ext;
+    struct client *c = event->client;
+
+    if (ext->len != 1 || ext->data[0] > 1) {
+        event->reply = ack_replies[NOK];
+        return 0;
+    }
+
+    db_lock();
+
+    c->tracking = ext->data[0] == 1;
+    if (!c->tracking) {
+        pubsub_unsubscribe_all(&c->tracked);
+        c->ntracked = 0;
+    }
+
+    db_unlock();
+
+    event->reply = ack_replies[OK];
+
+    return 0;
+}
+
+/*
+ * Commands allowed in a transaction, those working on keys and replying
+ * without side effects on the connection
+ */
+static bool is_transaction_command(const union triedb_request *req) {
+
+    switch (req->header.bits.opcode) {
+        case PUT:
+        case GET:
+        case DEL:
+        case INC:
+        case DEC:
+            return true;
+        case EXT:
+            return req->ext.opcode == MGET || req->ext.opcode == MPUT
+                || req->ext.opcode == MDEL || req->ext.opcode == CAS
+                || req->ext.opcode == CDEL;
+        default:
+            return false;
+    }
+}
+
+/*
+ * Execute all the commands of a transaction in a row while holding the global
+ * lock, so no other command can interleave with them, their replies are then
+ * gathered in a single one
+ */
+static int txn_handler(struct io_event *event) {
+
+    struct ext *ext = &event->payload.ext;
+    union triedb_request *reqs = NULL;
+
+    int n = unpack_transaction(ext->data, ext->len, &reqs);
+    if (n < 0) {
+        event->reply = ack_replies[NOK];
+        return 0;
+    }
+
+    for (int i = 0; i < n; ++i) {
+        if (!is_transaction_command(&reqs[i])) {
+            tfree(reqs);
+            event->reply = ack_replies[NOK];
+            return 0;
+        }
+    }
+
+    struct io_event *cmds = tcalloc(n, sizeof(struct io_event));
+
+    db_lock();
+
+    for (int i = 0; i < n; ++i) {
+        cmds[i].client = event->client;
+        cmds[i].payload = reqs[i];
+        handlers[reqs[i].header.bits.opcode](&cmds[i]);
+    }
+
+    db_unlock();
+
+    struct iovec iov[3];
+    size_t size = sizeof(unsigned char) + sizeof(uint16_t);
+
+    for (int i = 0; i < n; ++i) {
+        int count = io_event_iov(&cmds[i], iov);
+        for (int j = 0; j < count; ++j)
+            size += iov[j].iov_len;
+    }
+
+    unsigned char length[MAX_LEN_BYTES];
+    int steps = encode_length(length, size);
+
+    event->reply = bstring_empty(size + 1 + steps);
+
+    unsigned char *p = event->reply;
+
+    p += pack(p, "B", EXT << 4);
+    memcpy(p, length, steps);
+    p += steps;
+    p += pack(p, "BH", TXN, (unsigned) n);
+
+    for (int i = 0; i < n; ++i) {
+        int count = io_event_iov(&cmds[i], iov);
+        for (int j = 0; j < count; ++j) {
+            memcpy(p, iov[j].iov_base, iov[j].iov_len);
+            p += iov[j].iov_len;
+        }
+        if (cmds[i].reply)
+            reply_destroy(cmds[i].reply);
+        db_value_release(cmds[i].value);
+    }
+
+    tfree(cmds);
+    tfree(reqs);
+
+    return 0;
+}
+
+/* Record an executed request to the slow log */
+static void slowlog_record(const struct io_event *event, size_t visited) {
+
+    const union triedb_request *req = &event->payload;
+    const char *key = NULL;
+    size_t keylen = 0;
+
+    switch (req->header.bits.opcode) {
+        case PUT:
+            key = (const char *) req->put.key;
+            keylen = req->put.keylen;
+            break;
+        case GET:
+        case DEL:
+            key = (const char *) req->get.key;
+            keylen = req->get.keylen;
+            break;
+        case TTL:
+            key = (const char *) req->ttl.key;
+            keylen = req->ttl.keylen;
+            break;
+        case INC:
+        case DEC:
+            key = (const char *) req->incr.key;
+            keylen = req->incr.keylen;
+            break;
+    }
+
+    struct slowlog_entry entry = {
+        .timestamp = time(NULL),
+        .duration = event->done_time - event->exec_time,
+        .visited = visited,
+        .opcode = req->header.bits.opcode,
+        .prefix = req->header.bits.prefix,
+        .client = event->client->id
+    };
+
+    pthread_spin_lock(&slowlog_lock);
+    slowlog_push(&slowlog, &entry, key, keylen);
+    pthread_spin_unlock(&slowlog_lock);
+}
+
+/*
+ * Execute a decoded request on the calling thread, timing it and recording
+ * it to the slow log if it took longer than the configured threshold. The
+ * handler return code is forwarded, negative if the client is gone, PARKED
+ * if the request can't be accessed anymore.
+ */
+static int execute(struct io_event *event) {
+
+    size_t visited = trie_visited;
+
+    event->exec_time = nanotime();
+    int rc = handlers[event->payload.header.bits.opcode](event);
+
+    // A parked request could be already answered and gone
+    if (rc == PARKED)
+        return rc;
+
+    event->done_time = nanotime();
+
+    if (rc == 0 && conf->slowlog_max_len > 0
+        && event->done_time - event->exec_time
+        >= conf->slowlog_threshold * 1000)
+        slowlog_record(event, trie_visited - visited);
+
+    return rc;
+}
+
+/*
+ * Account the requests of a client decoded or replied, updated only by the
+ * thread currently owning the client, read by the idle clients reaper
+ */
+static inline void client_inflight(struct client *c, int n) {
+    __atomic_store_n(&c->inflight, c->inflight + n, __ATOMIC_RELAXED);
+}
+
+/* Start tracking the inactivity of a newly connected client */
+static void client_watch(struct client *c) {
+
+    wheel_node_init(&c->idle);
+    c->inflight = 0;
+
+    if (conf->idle_timeout == 0)
+        return;
+
+    pthread_spin_lock(&idle_lock);
+    wheel_add(&idle_wheel, &c->idle, c->last_action_time + conf->idle_timeout);
+    pthread_spin_unlock(&idle_lock);
+}
+
+/*
+ * Register a newly connected client, assigning it the next connection id and
+ * the slot of its descriptor in the clients table. A descriptor belongs to a
+ * single connection at a time, so slots are never contended and no lock is
+ * needed. Fails if the descriptor doesn't fit the table, which is sized after
+ * the descriptors limit at start.
+ */
+static int client_add(struct client *c) {
+
+    if ((size_t) c->fd >= triedb.maxclients)
+        return -1;
+
+    c->id = __atomic_add_fetch(&last_client_id, 1, __ATOMIC_RELAXED);
+    c->subscriptions = NULL;
+    c->waiter = NULL;
+    c->tracking = false;
+    c->tracked = NULL;
+    c->ntracked = 0;
+    c->notify = NULL;
+    c->notify_len = 0;
+    c->notify_count = 0;
+    c->notify_pending = false;
+    c->notify_seq = 0;
+    c->pushes = 0;
+    c->push_bytes = 0;
+    c->outbox = c->outbox_tail = NULL;
+    c->outbox_sent = 0;
+    c->stalled = false;
+    c->stalled_next = NULL;
+    __atomic_store_n(&triedb.clients[c->fd], c, __ATOMIC_RELEASE);
+
+    client_watch(c);
+
+    return 0;
+}
+
+/*
+ * Close the connection of a client and release it, it's removed from the idle
+ * clients wheel and from the clients table before closing the descriptor,
+ * which could be reused right after. Its subscriptions are dropped first,
+ * with them the NOTIFY still queued.
+ */
+static void client_close(struct client *c) {
+
+    client_unsubscribe(c);
+
+    if (!c->loop)
+        push_queue_purge(c);
+
+    pthread_spin_lock(&idle_lock);
+    wheel_del(&c->idle);
+    pthread_spin_unlock(&idle_lock);
+
+    __atomic_store_n(&triedb.clients[c->fd], NULL, __ATOMIC_RELEASE);
+
+    close(c->fd);
+
+    client_free(c);
+}
+
+/*
+ * Disconnect a client idle for longer than `idle_timeout`, shutting down the
+ * socket the IO thread owning it will release it as on any disconnection
+ */
+static void reap_client(struct wheel_node *node, uint64_t now, void *arg) {
+
+    (void) arg;
+
+    struct client *c = container_of(node, struct client, idle);
+    uint64_t last = __atomic_load_n(&c->last_action_time, __ATOMIC_RELAXED);
+
+    if (last + conf->idle_timeout > now) {
+        wheel_add(&idle_wheel, node, last + conf->idle_timeout);
+        return;
+    }
+
+    /*
+     * Waiting for a reply or for keyspace events isn't being idle, check
+     * again a timeout later
+     */
+    if (__atomic_load_n(&c->inflight, __ATOMIC_RELAXED) > 0
+        || __atomic_load_n(&c->subscriptions, __ATOMIC_RELAXED)) {
+        wheel_add(&idle_wheel, node, now + conf->idle_timeout);
+        return;
+    }
+
+    tdebug("Disconnecting client %llu, idle for %llus",
+           (unsigned long long) c->id, (unsigned long long) (now - last));
+
+    shutdown(c->fd, SHUT_RDWR);
+}
+
+
+static void reap_idle_clients(void) {
+
+    if (conf->idle_timeout == 0)
+        return;
+
+    uint64_t now = time(NULL);
+
+    pthread_spin_lock(&idle_lock);
+    if (idle_wheel.now < now)
+        wheel_advance(&idle_wheel, now, reap_client, NULL);
+    pthread_spin_unlock(&idle_lock);
+}
+
+/* Utility macro to handle base case on each EPOLL loop */
+#define EPOLL_ERR(e) if ((e.events & EPOLLERR) || (e.events & EPOLLHUP) || \
+                         (!(e.events & EPOLLIN) && !(e.events & EPOLLOUT)))
+
+/*
+ * Handle incoming connections, create a a fresh new struct client structure
+ * and link it to the fd, ready to be set in EPOLLIN event, then pass the
+ * connection to the IO EPOLL loop, waited by the IO thread pool.
+ */
+static void accept_loop(struct epoll *epoll) {
+
+    int events = 0;
+
+    struct epoll_event *e_events =
+        tmalloc(sizeof(struct epoll_event) * EPOLL_MAX_EVENTS);
+
+    int epollfd = epoll_create1(0);
+
+    /*
+     * We want to watch for events incoming on the server descriptor (e.g. new
+     * connections), with io_uring the IO threads accept connections by
+     * themselves, so we just wait for the shutdown
+     */
+    if (conf->io_backend == EPOLL_BACKEND)
+        epoll_add(epollfd, epoll->serverfd, EPOLLIN | EPOLLONESHOT, NULL);
+
+    /*
+     * And also to the global event fd, this one is useful to gracefully
+     * interrupt polling and thread execution
+     */
+    epoll_add(epollfd, conf->run, EPOLLIN, NULL);
+
+    while (1) {
+
+        events = epoll_wait(epollfd, e_events, EPOLL_MAX_EVENTS, EPOLL_TIMEOUT);
+
+        if (events < 0) {
+
+            /* Signals to all threads. Ignore it for now */
+            if (errno == EINTR)
+                continue;
+
+            /* Error occured, break the loop */
+            break;
+        }
+
+        for (int i = 0; i < events; ++i) {
+
+            /* Check for errors */
+            EPOLL_ERR(e_events[i]) {
+
+                /*
+                 * An error has occured on this fd, or the socket is not
+                 * ready for reading, closing connection
+                 */
+                perror ("epoll_wait(2)");
+                close(e_events[i].data.fd);
+
+            } else if (e_events[i].data.fd == conf->run) {
+
+                /* And quit event after that */
+                eventfd_t val;
+                eventfd_read(conf->run, &val);
+
+                tdebug("Stopping epoll loop. Thread %p exiting.",
+                       (void *) pthread_self());
+
+                goto exit;
+
+            } else if (e_events[i].data.fd == epoll->serverfd) {
+
+                while (1) {
+
+                    /*
+                     * Accept a new incoming connection assigning ip address
+                     * and socket descriptor to the connection structure
+                     * pointer passed as argument
+                     */
+
+                    int fd = accept_connection(epoll->serverfd);
+                    if (fd < 0)
+                        break;
+
+                    /*
+                     * Create a client structure to handle his context
+                     * connection
+                     */
+                    struct client *client = tmalloc(sizeof(struct client));
+                    if (!client)
+                        oom("creating client during accept");
+
+                    /* Populate client structure */
+                    client->fd = fd;
+                    client->event = NULL;
+                    client->zc_seq = 0;
+                    client->zc_head = client->zc_tail = NULL;
+                    client->zerocopy = conf->socket_family == INET
+                        && set_zerocopy(fd) == 0;
+                    client->loop = NULL;
+
+                    /* Record last action as of now */
+                    client->last_action_time = (uint64_t) time(NULL);
+
+                    /* Set the default db for the current user */
+                    db_lock();
+                    client->db = hashtable_get(triedb.dbs, "db0");
+                    db_unlock();
+
+                    /* Add it to the clients table */
+                    if (client_add(client) < 0) {
+                        twarning("Too many open descriptors, dropping "
+                                 "connection %d", fd);
+                        close(fd);
+                        tfree(client);
+                        continue;
+                    }
+
+                    /* Add it to the epoll loop */
+                    epoll_add(epoll->io_epollfd, fd,
+                              EPOLLIN | EPOLLONESHOT, client);
+
+                    /* Rearm server fd to accept new connections */
+                    epoll_mod(epollfd, epoll->serverfd, EPOLLIN, NULL);
+
+                    /* Record the new client connected */
+                    __atomic_add_fetch(&info.nclients, 1, __ATOMIC_RELAXED);
+                    __atomic_add_fetch(&info.nconnections, 1,
+                                       __ATOMIC_RELAXED);
+
+                }
+            }
+        }
+    }
+
+exit:
+
+    tfree(e_events);
+}
+
+/* Handle incoming requests, after being accepted or after a reply */
+static int read_data(int fd, unsigned char **buffer,
+                     union triedb_request *pkt) {
+
+    ssize_t bytes = 0;
+    unsigned char header = 0;
+
+    /*
+     * We must read all incoming bytes till an entire packet is received. This
+     * is achieved by following the TrieDB protocol specifications, which
+     * send the size of the remaining packet as the second byte. By knowing it
+     * we know if the packet is ready to be deserialized and used.
+     */
+    bytes = recv_packet(fd, buffer, &header);
+
+    /*
+     * Looks like we got a client disconnection.
+     *
+     * TODO: Set a error_handler for ERRMAXREQSIZE instead of dropping client
+     *       connection, explicitly returning an informative error code to the
+     *       client connected.
+     */
+    if (bytes == -ERRCLIENTDC || bytes == -ERRMAXREQSIZE)
+        goto errdc;
+
+    /*
+     * If a not correct packet received, we must free the buffer and reset the
+     * handler to the request again, setting EPOLL to EPOLLIN
+     */
+    if (bytes == -ERRPACKETERR)
+        goto exit;
+
+    stats_add(&stats_block()->bytes_recv, bytes);
+
+    /*
+     * Unpack received bytes into a triedb_request structure and execute the
+     * correct handler based on the type of the operation.
+     */
+    if (unpack_triedb_request(*buffer, pkt, header, bytes) < 0)
+        return -ERRMALFORMED;
+
+    return 0;
+
+exit:
+
+    return -ERRPACKETERR;
+
+errdc:
+
+    terror("Dropping client");
+
+    __atomic_sub_fetch(&info.nclients, 1, __ATOMIC_RELAXED);
+
+    __atomic_sub_fetch(&info.nconnections, 1, __ATOMIC_RELAXED);
+
+    return -ERRCLIENTDC;
+}
+
+/* Handle incoming packets from other nodes */
+static int read_packet(unsigned char *buffer, union triedb_packet *pkt) {
+
+    unsigned char header = 0;
+    const unsigned char *p = buffer;
+    header = *p;
+    p++;
+    unsigned pos = 0;
+    size_t bytes = decode_length(&p, &pos);
+
+    // Check for second LSB, where the type of packet is stored
+    if (((header >> 7) & 1) == 1) {
+
+        // we got a request
+        union triedb_request req;
+
+        /*
+         * Unpack received bytes into a triedb_request structure and
+         * execute the correct handler based on the type of the
+         * operation.
+         */
+        unpack_triedb_request((unsigned char *) p, &req, header, bytes);
+
+        pkt->request = req;
+    } else {
+        // we got a response
+        union triedb_response res;
+
+        unpack_triedb_response(p, &res, header, bytes);
+        pkt->response = res;
+    }
+
+    return 0;
+}
+
+
+#define BUFSIZE 2048
+
+/*
+ * Check if a header byte carries an opcode accepted from clients, ACK is
+ * accepted as well as it carries the extended commands
+ */
+static inline bool is_request_opcode(unsigned char byte) {
+    return (byte >> 4) <= INFO;
+}
+
+/*
+ * Cheap commands are executed directly on the IO thread which decoded them,
+ * saving the round-trip through the worker EPOLL loop. Only constant time
+ * operations on a single key qualify, everything walking a subtree of the
+ * trie (prefix operations, KEYS, FLUSH) is still handed to the worker pool.
+ */
+static inline bool is_inline_command(const union triedb_request *req) {
+
+    switch (req->header.bits.opcode) {
+        case PING:
+        case DB:
+            return true;
+        case GET:
+            return req->header.bits.prefix == 0;
+        case PUT:
+            return req->header.bits.prefix == 0 &&
+                req->put.vallen <= INLINE_PUT_MAX_SIZE;
+        default:
+            return false;
+    }
+}
+
+/*
+ * Number of requests handed to the worker pool and not yet picked up by a
+ * worker, bounded by `max_queued_requests`
+ */
+static size_t queued_requests = 0;
+
+/*
+ * Raise an event to the worker pool EPOLL and link it with the IO event
+ * containing the decoded payload ready to be processed, return false without
+ * queueing it if the worker pool is already overloaded
+ */
+static bool dispatch_to_workers(struct epoll *epoll, struct io_event *event) {
+
+    size_t queued = __atomic_add_fetch(&queued_requests, 1, __ATOMIC_RELAXED);
+
+    if (conf->max_queued_requests > 0 && queued > conf->max_queued_requests) {
+        __atomic_sub_fetch(&queued_requests, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    eventfd_t ev = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    event->io_event = ev;
+    epoll_add(epoll->w_epollfd, ev, EPOLLIN | EPOLLONESHOT, event);
+    eventfd_write(ev, 1);
+
+    return true;
+}
+
+/*
+ * Hand a processed event back to the IO thread serving its client, as soon as
+ * the reply is written it will be free'd
+ */
+static void io_event_done(struct io_event *event) {
+    if (event->loop) {
+        uring_loop_done(event->loop, event);
+    } else {
+        __atomic_store_n(&event->client->event, event, __ATOMIC_RELEASE);
+        epoll_mod(event->epollfd, event->client->fd, EPOLLOUT, event->client);
+    }
+}
+
+/*
+ * Refuse a request without executing it, the worker pool is overloaded and
+ * queueing it would only add latency to all the requests already waiting
+ */
+static void reply_busy(struct io_event *event) {
+    event->exec_time = event->done_time = event->decode_time;
+    event->reply_time = event->decode_time;
+    event->reply = ack_replies[BUSY];
+}
+
+/* Refuse a malformed request without executing it */
+static void reply_malformed(struct io_event *event) {
+    event->exec_time = event->done_time = event->decode_time;
+    event->reply_time = event->decode_time;
+    event->reply = ack_replies[NOK];
+}
+
+/* Free a reply, ACKs are pre-packed and will be free'd closing the server */
+static inline void reply_destroy(bstring reply) {
+    if (reply != ack_replies[OK] && reply != ack_replies[NOK]
+        && reply != ack_replies[BUSY])
+        bstring_destroy(reply);
+}
+
+/* Grow a buffer allocated with tmalloc to hold at least len bytes */
+static inline unsigned char *buf_reserve(unsigned char *buf, size_t len) {
+    return malloc_size(buf) < len ? trealloc(buf, len) : buf;
+}
+
+/*
+ * IO events are recycled through a free list owned by each thread, together
+ * with their request buffer, this way in steady state serving a request
+ * doesn't hit the allocator at all. An event can be released by a thread
+ * other than the one which took it, it just moves to the other list.
+ */
+static _Thread_local struct io_event *io_event_pool = NULL;
+
+static _Thread_local unsigned io_event_pool_len = 0;
+
+
+static struct io_event *io_event_get(void) {
+
+    struct io_event *event = io_event_pool;
+
+    if (event) {
+        io_event_pool = event->next;
+        io_event_pool_len--;
+    } else {
+        event = tmalloc(sizeof(*event));
+        event->buf = tmalloc(IO_EVENT_BUFSIZE);
+    }
+
+    event->epollfd = -1;
+    event->client = NULL;
+    event->reply = NULL;
+    event->value = NULL;
+    event->val = NULL;
+    event->loop = NULL;
+    event->push = false;
+    event->next = NULL;
+
+    return event;
+}
+
+/* Release an IO event with its reply, once it's been written out */
+static void io_event_destroy(struct io_event *event) {
+
+    if (event->reply)
+        reply_destroy(event->reply);
+    db_value_release(event->value);
+
+    if (io_event_pool_len == IO_EVENT_POOL_SIZE) {
+        tfree(event->buf);
+        tfree(event);
+        return;
+    }
+
+    // Don't retain the memory of big requests
+    if (malloc_size(event->buf) > IO_EVENT_BUFSIZE)
+        event->buf = trealloc(event->buf, IO_EVENT_BUFSIZE);
+
+    event->next = io_event_pool;
+    io_event_pool = event;
+    io_event_pool_len++;
+}
+
+/* Free the IO events retained by the calling thread, before it exits */
+static void io_event_pool_clear(void) {
+    while (io_event_pool) {
+        struct io_event *next = io_event_pool->next;
+        tfree(io_event_pool->buf);
+        tfree(io_event_pool);
+        io_event_pool = next;
+    }
+    io_event_pool_len = 0;
+}
+
+/*
+ * Fill the iovecs to write out the reply of an event, a single key GET reply
+ * gathers the packed header, the requested key and the value straight from
+ * the database. Return the number of iovecs used, at most 3.
+ */
+static int io_event_iov(struct io_event *event, struct iovec *iov) {
+
+    if (!event->val) {
+        iov[0] = (struct iovec) { event->reply, bstring_len(event->reply) };
+        return 1;
+    }
+
+    iov[0] = (struct iovec) { event->header, event->headerlen };
+    iov[1] = (struct iovec) { event->payload.get.key,
+                              event->payload.get.keylen };
+    iov[2] = (struct iovec) { (void *) event->val, event->vallen };
+
+    return 3;
+}
+
+/*
+ * Keep a value sent with MSG_ZEROCOPY pinned till the send identified by
+ * `seq` completes, taking ownership of the reference
+ */
+static void zerocopy_pin(struct client *c,
+                         struct db_value *value, uint32_t seq) {
+    struct zc_pending *zc = tmalloc(sizeof(*zc));
+    zc->value = value;
+    zc->seq = seq;
+    zc->next = NULL;
+    if (c->zc_tail)
+        c->zc_tail->next = zc;
+    else
+        c->zc_head = zc;
+    c->zc_tail = zc;
+}
+
+/*
+ * Consume MSG_ZEROCOPY completions from the error queue of a client socket,
+ * releasing the values which are not referenced by the kernel anymore. TCP
+ * completions are notified in order, so each notification releases all the
+ * sends up to its upper bound. Return false if a real error occurred on the
+ * socket.
+ */
+static bool zerocopy_completions(struct client *c) {
+
+    uint32_t lo = 0, hi = 0;
+    int rc = 0;
+
+    while ((rc = recv_zerocopy_notification(c->fd, &lo, &hi)) == 0) {
+        while (c->zc_head && (int32_t) (hi - c->zc_head->seq) >= 0) {
+            struct zc_pending *zc = c->zc_head;
+            c->zc_head = zc->next;
+            db_value_release(zc->value);
+            tfree(zc);
+        }
+        if (!c->zc_head)
+            c->zc_tail = NULL;
+    }
+
+    return rc == 1;
+}
+
+/*
+ * Rearm a client descriptor, EPOLLONESHOT disabled it. With a request still
+ * owned by the worker pool, or parked, only its hang up is watched for, the
+ * reply handed back rearms it for writing. A client with bytes still to be
+ * written out waits for the socket to be writable again, its next request
+ * isn't read meanwhile, the others wait for a request.
+ */
+static void client_rearm(struct epoll *epoll, struct client *c) {
+
+    int events = c->outbox ? EPOLLOUT : EPOLLIN;
+
+    if (__atomic_load_n(&c->event, __ATOMIC_ACQUIRE))
+        events = EPOLLOUT;
+    else if (__atomic_load_n(&c->inflight, __ATOMIC_RELAXED) > 0)
+        events = EPOLLRDHUP;
+
+    epoll_mod(epoll->io_epollfd, c->fd, events, c);
+
+    // The reply could have been handed back right before the rearm
+    if (events == EPOLLRDHUP && __atomic_load_n(&c->event, __ATOMIC_ACQUIRE))
+        epoll_mod(epoll->io_epollfd, c->fd, EPOLLOUT, c);
+}
+
+/*
+ * Write out to client the reply of a processed request, re-arming the client
+ * descriptor and releasing the IO event. It never waits on a client not
+ * reading, what the socket can't take is queued to the outbox of the client.
+ */
+static void write_reply(struct epoll *epoll, struct io_event *event) {
+
+    ssize_t sent = 0;
+    unsigned nsends = 0;
+    struct client *c = event->client;
+    struct iovec iov[3], reply[3];
+    int iovcnt = io_event_iov(event, iov);
+
+    // send_iov advances the iovecs, keep the whole reply for the outbox
+    memcpy(reply, iov, sizeof(iov));
+
+    // Whatever is in the outbox goes out first, else the reply is queued
+    if (c->outbox && !client_outbox_flush(c)) {
+        sent = 0;
+    } else if (event->value && c->zerocopy
+        && event->value->len >= ZEROCOPY_THRESHOLD) {
+
+        /*
+         * Big values are sent with MSG_ZEROCOPY and stay pinned till the
+         * kernel notifies the completion of the send. The header and the key
+         * are released right after, so they're copied by a send of their
+         * own, corked till the value follows.
+         */
+        size_t hlen = 0;
+        for (int i = 0; i < iovcnt - 1; ++i)
+            hlen += iov[i].iov_len;
+
+        ssize_t n = send_iov(c->fd, iov, iovcnt - 1, MSG_MORE, &nsends);
+
+        if (n >= 0 && (size_t) n < hlen)
+            sent = n;
+        else if (n >= 0 && (sent = send_iov(c->fd, iov + iovcnt - 1, 1,
+                                            MSG_ZEROCOPY, &nsends)) >= 0)
+            sent += n;
+        else
+            sent = -1;
+
+        if (nsends > 0) {
+            c->zc_seq += nsends;
+            zerocopy_pin(c, event->value, c->zc_seq - 1);
+            event->value = NULL;
+        }
+
+    } else {
+        /*
+         * Just send out all bytes of the reply, a GET reply is gathered
+         * straight from the request and the database.
+         */
+        sent = send_iov(c->fd, iov, iovcnt, 0, &nsends);
+    }
+
+    if (sent < 0) {
+        /* Broken connection, the following read releases the client */
+        shutdown(c->fd, SHUT_RDWR);
+    } else {
+        // Update information stats
+        stats_add(&stats_block()->bytes_sent, sent);
+        stats_request(event, nanotime());
+        // Copy what's left before the value is released with the event
+        client_outbox_queue(c, reply, iovcnt, sent);
+    }
+
+    client_inflight(c, -1);
+
+    /*
+     * Rearm descriptor, we're using EPOLLONESHOT feature to avoid race
+     * condition and thundering herd issues on multithreaded EPOLL
+     */
+    client_rearm(epoll, c);
+
+    io_event_destroy(event);
+}
+
+/*
+ * NOTIFY pushed to the clients of the EPOLL backend, written out by the IO
+ * thread when woken up through the eventfd. The IO thread is the only one
+ * writing to and closing client sockets, so a NOTIFY is written out at once,
+ * even while the worker pool owns a request of the client. It never waits on
+ * a subscriber not reading, the clients whose socket is full are stalled and
+ * retried on the next drain, the expiring keys cron wakes up the IO thread
+ * meanwhile.
+ */
+static struct push_queue {
+    pthread_spinlock_t lock;
+    struct io_event *head;
+    struct io_event *tail;
+    int fd;
+    /* Clients with NOTIFY not fully written out, IO thread only */
+    struct client *stalled;
+} push_queue;
+
+/*
+ * Push a NOTIFY to a client, it's handed to the IO thread serving the client
+ * which writes it out between the replies. Must be called with the global
+ * lock held, which keeps a subscribed client from being released meanwhile.
+ * A client not keeping up with its notifications is disconnected.
+ */
+static void client_push(struct client *c, bstring notify) {
+
+    size_t len = bstring_len(notify);
+
+    if (__atomic_load_n(&c->push_bytes, __ATOMIC_RELAXED) + len
+        > NOTIFY_MAX_PENDING) {
+        bstring_destroy(notify);
+        shutdown(c->fd, SHUT_RDWR);
+        return;
+    }
+
+    __atomic_add_fetch(&c->push_bytes, len, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c->pushes, 1, __ATOMIC_RELAXED);
+
+    struct io_event *event = io_event_get();
+    event->client = c;
+    event->reply = notify;
+    event->push = true;
+
+    if (c->loop) {
+        event->loop = c->loop;
+        uring_loop_done(c->loop, event);
+        return;
+    }
+
+    pthread_spin_lock(&push_queue.lock);
+    if (push_queue.tail)
+        push_queue.tail->next = event;
+    else
+        push_queue.head = event;
+    push_queue.tail = event;
+    pthread_spin_unlock(&push_queue.lock);
+
+    eventfd_write(push_queue.fd, 1);
+}
+
+/*
+ * Queue the bytes of a reply the socket couldn't take behind the outbox of the
+ * client, `skip` bytes of the iovecs are already written out. They're copied,
+ * the value of a GET is released with the event of the request.
+ */
+static void client_outbox_queue(struct client *c,
+                                const struct iovec *iov,
+                                int iovcnt, size_t skip) {
+
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; ++i)
+        len += iov[i].iov_len;
+
+    if (skip >= len)
+        return;
+
+    struct io_event *event = io_event_get();
+    event->client = c;
+    event->reply = bstring_empty(len - skip);
+
+    unsigned char *p = event->reply;
+    for (int i = 0; i < iovcnt; ++i) {
+        if (skip >= iov[i].iov_len) {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+        memcpy(p, (unsigned char *) iov[i].iov_base + skip,
+               iov[i].iov_len - skip);
+        p += iov[i].iov_len - skip;
+        skip = 0;
+    }
+
+    if (c->outbox_tail)
+        c->outbox_tail->next = event;
+    else
+        c->outbox = event;
+    c->outbox_tail = event;
+}
+
+/*
+ * Write out what's collected in the outbox of a client, NOTIFY and replies,
+ * in order. It stops as soon as the socket is full, leaving the rest, the
+ * first one possibly partially sent, to the next call. Return true if
+ * there's nothing left to write.
+ */
+static bool client_outbox_flush(struct client *c) {
+
+    while (c->outbox) {
+
+        struct io_event *event = c->outbox;
+        size_t len = bstring_len(event->reply);
+
+        ssize_t n = send(c->fd, event->reply + c->outbox_sent,
+                         len - c->outbox_sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return false;
+            /* Broken connection, the following read releases the client */
+            shutdown(c->fd, SHUT_RDWR);
+            n = len - c->outbox_sent;
+        } else {
+            stats_add(&stats_block()->bytes_sent, n);
+        }
+
+        c->outbox_sent += n;
+        if (c->outbox_sent < len)
+            continue;
+
+        c->outbox = event->next;
+        c->outbox_sent = 0;
+        if (event->push)
+            __atomic_sub_fetch(&c->push_bytes, len, __ATOMIC_RELAXED);
+        io_event_destroy(event);
+    }
+
+    c->outbox_tail = NULL;
+
+    return true;
+}
+
+/*
+ * Write out the NOTIFY pushed to the clients of the EPOLL backend, moving them
+ * to the outbox of each client first, then retrying the stalled clients too
+ */
+static void push_queue_drain(void) {
+
+    eventfd_t val;
+    eventfd_read(push_queue.fd, &val);
+
+    pthread_spin_lock(&push_queue.lock);
+    struct io_event *event = push_queue.head;
+    push_queue.head = push_queue.tail = NULL;
+    pthread_spin_unlock(&push_queue.lock);
+
+    struct client *pending = push_queue.stalled;
+
+    while (event) {
+
+        struct io_event *next = event->next;
+        struct client *c = event->client;
+
+        event->next = NULL;
+        if (c->outbox_tail)
+            c->outbox_tail->next = event;
+        else
+            c->outbox = event;
+        c->outbox_tail = event;
+        __atomic_sub_fetch(&c->pushes, 1, __ATOMIC_RELAXED);
+
+        if (!c->stalled) {
+            c->stalled = true;
+            c->stalled_next = pending;
+            pending = c;
+        }
+
+        event = next;
+    }
+
+    struct client *stalled = NULL;
+
+    while (pending) {
+        struct client *c = pending;
+        pending = c->stalled_next;
+        if (client_outbox_flush(c)) {
+            c->stalled = false;
+        } else {
+            c->stalled_next = stalled;
+            stalled = c;
+        }
+    }
+
+    __atomic_store_n(&push_queue.stalled, stalled, __ATOMIC_RELEASE);
+}
+
+/*
+ * Drop the NOTIFY still queued for a client being closed, together with the
+ * ones collected and not yet written out
+ */
+static void push_queue_purge(struct client *c) {
+
+    if (c->stalled) {
+        struct client **prev = &push_queue.stalled;
+        while (*prev != c)
+            prev = &(*prev)->stalled_next;
+        __atomic_store_n(prev, c->stalled_next, __ATOMIC_RELEASE);
+        c->stalled = false;
+    }
+
+    struct io_event *purged = c->outbox;
+    c->outbox = c->outbox_tail = NULL;
+
+    if (__atomic_load_n(&c->pushes, __ATOMIC_RELAXED) > 0) {
+
+        pthread_spin_lock(&push_queue.lock);
+
+        struct io_event **prev = &push_queue.head;
+        push_queue.tail = NULL;
+
+        while (*prev) {
+            struct io_event *event = *prev;
+            if (event->client == c) {
+                *prev = event->next;
+                event->next = purged;
+                purged = event;
+            } else {
+                push_queue.tail = event;
+                prev = &event->next;
+            }
+        }
+
+        pthread_spin_unlock(&push_queue.lock);
+    }
+
+    while (purged) {
+        struct io_event *next = purged->next;
+        io_event_destroy(purged);
+        purged = next;
+    }
+
+    c->pushes = 0;
+}
+
+
+static void *io_worker(void *arg) {
+
+    struct epoll *epoll = arg;
+    int events = 0;
+
+    struct epoll_event *e_events =
+        tmalloc(sizeof(struct epoll_event) * EPOLL_MAX_EVENTS);
+
+    /*
+     * Raw bytes buffer to handle input from the cluster bus, requests from
+     * clients are read straight into the buffer of their IO event
+     */
+    unsigned char *buffer = tmalloc(BUFSIZE + 1);
+
+    // UDP bus communication client handler
+    struct sockaddr_in node;
+    memset(&node, 0, sizeof(node)); ;
 
     while (1) {
 
-        events = epoll_wait(epollfd, e_events, EPOLL_MAX_EVENTS, EPOLL_TIMEOUT);
+        events = epoll_wait(epoll->io_epollfd, e_events,
+                            EPOLL_MAX_EVENTS, EPOLL_TIMEOUT);
 
         if (events < 0) {
 
@@ -835,17 +3056,56 @@ static void accept_loop(struct epoll *epoll) {
             break;
         }
 
-        for (int i = 0; i < events; ++i) {
+        for (int i = 0; i < events; ++i) {
+
+            bool is_client = e_events[i].data.fd != conf->run
+                && e_events[i].data.fd != epoll->busfd
+                && e_events[i].data.fd != push_queue.fd;
+
+            /*
+             * MSG_ZEROCOPY completions are notified through the error queue
+             * of client sockets, consume them first and go on as usual if no
+             * real error occurred
+             */
+            if (is_client && (e_events[i].events & EPOLLERR)
+                && !(e_events[i].events & EPOLLHUP)
+                && zerocopy_completions(e_events[i].data.ptr)) {
+                e_events[i].events &= ~EPOLLERR;
+                if (!(e_events[i].events & (EPOLLIN | EPOLLOUT))) {
+                    client_rearm(epoll, e_events[i].data.ptr);
+                    continue;
+                }
+            }
+
+            /*
+             * A client hanging up with a request still owned by the worker
+             * pool, or parked, can't be released till the reply is handed
+             * back, a parked one is answered right away
+             */
+            if (is_client && !(e_events[i].events & (EPOLLIN | EPOLLOUT))) {
+                struct client *c = e_events[i].data.ptr;
+                if (__atomic_load_n(&c->inflight, __ATOMIC_RELAXED) > 0) {
+                    client_unwait(c);
+                    continue;
+                }
+            }
 
             /* Check for errors */
             EPOLL_ERR(e_events[i]) {
 
-                /*
-                 * An error has occured on this fd, or the socket is not
-                 * ready for reading, closing connection
-                 */
+                /* An error has occured on this fd, or the socket is not
+                   ready for reading, closing connection */
                 perror ("epoll_wait(2)");
-                close(e_events[i].data.fd);
+
+                if (is_client) {
+                    struct client *c = e_events[i].data.ptr;
+                    client_close(c);
+                    __atomic_sub_fetch(&info.nclients, 1, __ATOMIC_RELAXED);
+                    __atomic_sub_fetch(&info.nconnections, 1,
+                                       __ATOMIC_RELAXED);
+                } else {
+                    close(e_events[i].data.fd);
+                }
 
             } else if (e_events[i].data.fd == conf->run) {
 
@@ -858,56 +3118,114 @@ static void accept_loop(struct epoll *epoll) {
 
                 goto exit;
 
-            } else if (e_events[i].data.fd == epoll->serverfd) {
+            } else if (e_events[i].data.fd == push_queue.fd) {
 
-                while (1) {
+                /* Keyspace events pushed to the clients */
+                push_queue_drain();
 
-                    /*
-                     * Accept a new incoming connection assigning ip address
-                     * and socket descriptor to the connection structure
-                     * pointer passed as argument
-                     */
+            } else if (epoll->busfd > 0 && e_events[i].data.fd == epoll->busfd) {
+                // Bus communication from UDP chanel
+                int n;
+                socklen_t len;
+                n = recvfrom(e_events[i].data.fd, (char *)buffer, BUFSIZE,
+                             MSG_WAITALL, ( struct sockaddr *) &node, &len);
+                buffer[n] = '\0';
 
-                    int fd = accept_connection(epoll->serverfd);
-                    if (fd < 0)
-                        break;
+                unsigned char header = 0;
 
-                    /*
-                     * Create a client structure to handle his context
-                     * connection
-                     */
-                    struct client *client = tmalloc(sizeof(struct client));
-                    if (!client)
-                        oom("creating client during accept");
+                union triedb_request pkt;
 
-                    /* Generate random uuid */
-                    uuid_t binuuid;
-                    uuid_generate_random(binuuid);
-                    uuid_unparse(binuuid, (char *) client->uuid);
+                const unsigned char *p = buffer;
+                header = *p;
+                p++;
+                unsigned pos = 0;
+                size_t bytes = decode_length(&p, &pos);
 
-                    /* Populate client structure */
-                    client->fd = fd;
+                /*
+                 * Unpack received bytes into a triedb_request structure and
+                 * execute the correct handler based on the type of the
+                 * operation.
+                 */
+                unpack_triedb_request((unsigned char *) p, &pkt, header, bytes);
 
-                    /* Record last action as of now */
-                    client->last_action_time = (uint64_t) time(NULL);
+                info.nnodes++;
 
-                    /* Set the default db for the current user */
-                    client->db = hashtable_get(triedb.dbs, "db0");
+                // TODO: Split reception and unpacking of node based on the
+                // packet type, to handle responses and requests as well
+                tdebug("Received JOIN");
+
+            } else if (e_events[i].events & EPOLLIN) {
+                struct io_event *event = io_event_get();
+                event->epollfd = epoll->io_epollfd;
+                event->client = e_events[i].data.ptr;
+                event->recv_time = nanotime();
+                /*
+                 * Received a bunch of data from a client, after the creation
+                 * of an IO event we need to read the bytes and encoding the
+                 * content according to the protocol
+                 */
+                int rc = read_data(event->client->fd,
+                                   &event->buf, &event->payload);
 
-                    /* Add it to the db instance */
-                    hashtable_put(triedb.clients, client->uuid, client);
+                event->decode_time = nanotime();
 
-                    /* Add it to the epoll loop */
-                    epoll_add(epoll->io_epollfd, fd,
-                              EPOLLIN | EPOLLONESHOT, client);
+                /* Record last action as of now */
+                __atomic_store_n(&event->client->last_action_time,
+                                 (uint64_t) time(NULL), __ATOMIC_RELAXED);
 
-                    /* Rearm server fd to accept new connections */
-                    epoll_mod(epollfd, epoll->serverfd, EPOLLIN, NULL);
+                if (rc == 0 || rc == -ERRMALFORMED)
+                    client_inflight(event->client, 1);
 
-                    /* Record the new client connected */
-                    info.nclients++;
-                    info.nconnections++;
+                if (rc == 0 && is_inline_command(&event->payload)) {
+                    /*
+                     * Fast path, cheap command, execute it right here and
+                     * write back the reply without passing through the
+                     * worker pool
+                     */
+                    execute(event);
+                    event->reply_time = event->done_time;
+                    write_reply(epoll, event);
+                } else if (rc == 0) {
+                    /* All is ok, hand the request to the worker pool */
+                    if (!dispatch_to_workers(epoll, event)) {
+                        reply_busy(event);
+                        write_reply(epoll, event);
+                    }
+                }
+                else if (rc == -ERRMALFORMED) {
+                    reply_malformed(event);
+                    write_reply(epoll, event);
+                } else if (rc == -ERRCLIENTDC) {
+
+                    /*
+                     * We got an unexpected error or a disconnection from the
+                     * client side, remove client from the global map and
+                     * free resources allocated such as io_event structure and
+                     * paired payload
+                     */
+                    client_close(event->client);
+
+                    io_event_destroy(event);
+                } else {
+                    io_event_destroy(event);
+                }
+
+            } else if (e_events[i].events & EPOLLOUT) {
 
+                /*
+                 * Write out to client, after a request has been processed in
+                 * worker thread routine, or what's left in its outbox once
+                 * the socket is writable again.
+                 */
+                struct client *c = e_events[i].data.ptr;
+                struct io_event *event = c->event;
+                if (event) {
+                    c->event = NULL;
+                    event->reply_time = nanotime();
+                    write_reply(epoll, event);
+                } else {
+                    client_outbox_flush(c);
+                    client_rearm(epoll, c);
                 }
             }
         }
@@ -915,276 +3233,815 @@ static void accept_loop(struct epoll *epoll) {
 
 exit:
 
+    io_event_pool_clear();
     tfree(e_events);
+    tfree(buffer);
+
+    return NULL;
 }
 
-/* Handle incoming requests, after being accepted or after a reply */
-static int read_data(int fd, unsigned char *buffer, union triedb_request *pkt) {
 
-    ssize_t bytes = 0;
-    unsigned char header = 0;
+/********************************/
+/*      IO_URING BACKEND        */
+/********************************/
+
+/*
+ * With the io_uring backend every IO thread owns a ring, it accepts new
+ * connections through a multishot ACCEPT on the listening socket and keeps a
+ * multishot RECV armed on each client, selecting buffers from a provided
+ * buffer ring; this way the kernel does all the waiting and the thread just
+ * reaps completions, with a single io_uring_enter call per loop iteration
+ * covering both submission of new SENDs and waiting.
+ *
+ * Requests are decoded directly from the provided buffers, cheap commands are
+ * executed inline like in the EPOLL backend, the others are handed to the
+ * worker pool, which signals back to the ring through an eventfd once done.
+ * Pipelined requests are processed in order: while a request is owned by the
+ * worker pool the following bytes are buffered into the connection.
+ *
+ * Replies are queued on the connection and written out by a single SENDMSG
+ * gathering the packed headers and the values straight from the database;
+ * batches carrying big values use the zero-copy SENDMSG, keeping the replies
+ * alive till the kernel notifies it's done with them.
+ *
+ * Replies aren't submitted as a chain of SENDs linked with IOSQE_IO_LINK: a
+ * short send on a stream socket completes successfully, so the next link
+ * would write its bytes past the ones left out, and with MSG_WAITALL it would
+ * cancel the rest of the chain to be resubmitted from the gap anyway. One
+ * SENDMSG in flight per connection, carrying every reply queued meanwhile,
+ * keeps them in order and still takes a single SQE per batch.
+ */
+
+enum uring_op_type {
+    URING_ACCEPT,
+    URING_RECV,
+    URING_SEND,
+    URING_SEND_ZC,
+    URING_WAKEUP,
+    URING_STOP,
+    URING_CANCEL
+};
+
+/* Context of each SQE, its address is used as user_data */
+struct uring_op {
+    enum uring_op_type type;
+    struct uring_conn *conn;
+};
+
+/* A zero-copy SENDMSG in flight, with the replies it references */
+struct uring_zc {
+    struct uring_op op;
+    struct io_event *replies;
+};
+
+/* Growable byte buffer, used to store partial input */
+struct iobuf {
+    unsigned char *data;
+    size_t len;
+    size_t cap;
+};
+
+struct uring_conn {
+    /* Must be the first member, releasing the client releases the conn */
+    struct client client;
+    struct uring_op recv;
+    struct uring_op send;
+    /* Partial packets or postponed requests */
+    struct iobuf in;
+    /* Replies to be written out, in order, and bytes of the head already sent */
+    struct io_event *replies;
+    struct io_event *replies_tail;
+    size_t sent;
+    /* SENDMSG in flight, at most one to preserve the ordering */
+    struct msghdr msg;
+    struct iovec iov[URING_MAX_IOV];
+    struct uring_zc *zc;
+    /* Zero-copy SENDMSG waiting for the kernel notification */
+    unsigned zc_inflight;
+    /* A request is currently owned by the worker pool */
+    bool busy;
+    bool sending;
+    bool recv_armed;
+    /* RECV stopped as too many requests are pending, see uring_conn_pause */
+    bool paused;
+    bool closing;
+    struct uring_conn *prev;
+    struct uring_conn *next;
+};
+
+struct uring_loop {
+    struct uring ring;
+    struct uring_buf_ring br;
+    struct epoll *epoll;
+    struct uring_op accept;
+    struct uring_op wakeup;
+    struct uring_op stop;
+    struct uring_op cancel;
+    /* Signaled by the worker pool on each processed request */
+    int wakeupfd;
+    pthread_spinlock_t lock;
+    /* Events processed by the worker pool, guarded by lock */
+    struct io_event *done;
+    /* All connections owned by the ring */
+    struct uring_conn *conns;
+    /* Zero-copy SENDMSG is supported by the kernel */
+    bool zerocopy;
+    bool running;
+};
+
+
+static void iobuf_append(struct iobuf *buf,
+                         const unsigned char *data, size_t len) {
+    if (buf->len + len > buf->cap) {
+        size_t cap = buf->cap ? buf->cap : BUFSIZE;
+        while (cap < buf->len + len)
+            cap *= 2;
+        buf->data = trealloc(buf->data, cap);
+        buf->cap = cap;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
 
-    /*
-     * We must read all incoming bytes till an entire packet is received. This
-     * is achieved by following the TrieDB protocol specifications, which
-     * send the size of the remaining packet as the second byte. By knowing it
-     * we know if the packet is ready to be deserialized and used.
-     */
-    bytes = recv_packet(fd, &buffer, &header);
+
+static void iobuf_consume(struct iobuf *buf, size_t len) {
+    buf->len -= len;
+    if (buf->len > 0)
+        memmove(buf->data, buf->data + len, buf->len);
+}
+
+
+/* Return a SQE, flushing the submission queue if it is full */
+static struct io_uring_sqe *uring_loop_sqe(struct uring_loop *loop) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+    if (!sqe) {
+        uring_submit(&loop->ring, 0);
+        sqe = uring_get_sqe(&loop->ring);
+    }
+    return sqe;
+}
+
+
+static void uring_arm_accept(struct uring_loop *loop) {
+    struct io_uring_sqe *sqe = uring_loop_sqe(loop);
+    uring_prep_multishot_accept(sqe, loop->epoll->serverfd);
+    sqe->user_data = (unsigned long) &loop->accept;
+}
+
+
+static void uring_arm_poll(struct uring_loop *loop,
+                           struct uring_op *op, int fd) {
+    struct io_uring_sqe *sqe = uring_loop_sqe(loop);
+    uring_prep_poll_add(sqe, fd, POLLIN);
+    sqe->user_data = (unsigned long) op;
+}
+
+
+static void uring_arm_recv(struct uring_loop *loop, struct uring_conn *conn) {
+    struct io_uring_sqe *sqe = uring_loop_sqe(loop);
+    uring_prep_multishot_recv(sqe, conn->client.fd, loop->br.bgid);
+    sqe->user_data = (unsigned long) &conn->recv;
+    conn->recv_armed = true;
+}
+
+
+static inline size_t io_event_reply_len(const struct io_event *event) {
+    if (!event->val)
+        return bstring_len(event->reply);
+    return event->headerlen + event->payload.get.keylen + event->vallen;
+}
+
+
+/* Free a list of replies linked by their next pointer */
+static void io_event_list_destroy(struct io_event *event) {
+    while (event) {
+        struct io_event *next = event->next;
+        io_event_destroy(event);
+        event = next;
+    }
+}
+
+
+/*
+ * Send out queued replies if there's no SENDMSG already in flight, to
+ * preserve the ordering of the replies there's at most one per connection.
+ * The iovecs point directly to the packed headers and to the values pinned
+ * by the replies, skipping the bytes already sent.
+ */
+static void uring_conn_flush(struct uring_loop *loop, struct uring_conn *conn) {
+
+    if (conn->sending || !conn->replies)
+        return;
+
+    size_t skip = conn->sent;
+    bool zerocopy = false;
+    int n = 0;
+
+    for (struct io_event *e = conn->replies;
+         e && n + 3 <= URING_MAX_IOV; e = e->next) {
+
+        struct iovec segs[3];
+        int nsegs = io_event_iov(e, segs);
+
+        for (int k = 0; k < nsegs; ++k) {
+            if (skip >= segs[k].iov_len) {
+                skip -= segs[k].iov_len;
+                continue;
+            }
+            conn->iov[n].iov_base = (char *) segs[k].iov_base + skip;
+            conn->iov[n++].iov_len = segs[k].iov_len - skip;
+            skip = 0;
+        }
+
+        if (e->value && e->value->len >= ZEROCOPY_THRESHOLD)
+            zerocopy = loop->zerocopy && conn->client.zerocopy;
+    }
+
+    memset(&conn->msg, 0x00, sizeof(conn->msg));
+    conn->msg.msg_iov = conn->iov;
+    conn->msg.msg_iovlen = n;
+
+    struct io_uring_sqe *sqe = uring_loop_sqe(loop);
+
+    if (zerocopy) {
+        conn->zc = tmalloc(sizeof(*conn->zc));
+        conn->zc->op = (struct uring_op) { URING_SEND_ZC, conn };
+        conn->zc->replies = NULL;
+        uring_prep_sendmsg_zc(sqe, conn->client.fd, &conn->msg, MSG_NOSIGNAL);
+        sqe->user_data = (unsigned long) &conn->zc->op;
+    } else {
+        conn->zc = NULL;
+        uring_prep_sendmsg(sqe, conn->client.fd, &conn->msg, MSG_NOSIGNAL);
+        sqe->user_data = (unsigned long) &conn->send;
+    }
+
+    conn->sending = true;
+}
+
+
+/* Queue a processed request, its reply will be sent on the next flush */
+static void uring_conn_reply(struct uring_conn *conn, struct io_event *event) {
+
+    if (!event->reply && !event->val) {
+        client_inflight(&conn->client, -1);
+        io_event_destroy(event);
+        return;
+    }
+
+    event->next = NULL;
+    if (conn->replies_tail)
+        conn->replies_tail->next = event;
+    else
+        conn->replies = event;
+    conn->replies_tail = event;
+}
+
+
+/*
+ * Release a connection if the kernel and the worker pool don't hold any
+ * reference to it anymore
+ */
+static void uring_conn_release(struct uring_loop *loop,
+                               struct uring_conn *conn) {
+
+    if (conn->busy || conn->sending || conn->recv_armed || conn->zc_inflight)
+        return;
 
     /*
-     * Looks like we got a client disconnection.
-     *
-     * TODO: Set a error_handler for ERRMAXREQSIZE instead of dropping client
-     *       connection, explicitly returning an informative error code to the
-     *       client connected.
+     * Nothing is pushed to the client once unsubscribed, wait for the NOTIFY
+     * already handed to the ring
      */
-    if (bytes == -ERRCLIENTDC || bytes == -ERRMAXREQSIZE)
-        goto errdc;
+    client_unsubscribe(&conn->client);
+
+    if (__atomic_load_n(&conn->client.pushes, __ATOMIC_ACQUIRE) > 0)
+        return;
+
+    if (conn->prev)
+        conn->prev->next = conn->next;
+    else
+        loop->conns = conn->next;
+    if (conn->next)
+        conn->next->prev = conn->prev;
+
+    tfree(conn->in.data);
+    io_event_list_destroy(conn->replies);
+
+    client_close(&conn->client);
+
+    __atomic_sub_fetch(&info.nclients, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&info.nconnections, 1, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Close a connection, shutting down the reading side of the socket terminates
+ * the multishot RECV while the replies already queued are still sent out, the
+ * release will happen after the last completion. The connection can't be
+ * accessed after this call.
+ */
+static void uring_conn_close(struct uring_loop *loop,
+                             struct uring_conn *conn) {
+    conn->closing = true;
+    client_unwait(&conn->client);
+    if (conn->recv_armed)
+        shutdown(conn->client.fd, SHUT_RD);
+    uring_conn_release(loop, conn);
+}
+
+
+/*
+ * Check if buf starts with a complete packet, returning its total length, 0
+ * if more bytes are needed or a negative error code if the packet is not
+ * valid. `pos` is set to the length of the Fixed Header.
+ */
+static ssize_t packet_length(const unsigned char *buf,
+                             size_t len, unsigned *pos) {
+
+    if (len < 2)
+        return 0;
+
+    /* Check for OPCODE, if an unknown OPCODE is received return an error */
+    if (!is_request_opcode(*buf))
+        return -ERRPACKETERR;
+
+    /* Remaining length can be stored in at most 4 bytes */
+    unsigned long long tlen = 0, multiplier = 1;
+    unsigned i = 1;
+
+    do {
+        if (i > MAX_LEN_BYTES)
+            return -ERRPACKETERR;
+        if (i >= len)
+            return 0;
+        tlen += (buf[i] & 127) * multiplier;
+        multiplier *= 128;
+    } while ((buf[i++] & 128) != 0);
+
+    if (tlen > conf->max_request_size)
+        return -ERRMAXREQSIZE;
+
+    *pos = i;
+
+    return len < i + tlen ? 0 : (ssize_t) (i + tlen);
+}
+
+
+/*
+ * Decode and execute all complete requests in buf, stopping as soon as a
+ * request is handed to the worker pool. Return the number of bytes consumed
+ * or a negative error code if the stream is corrupted and the connection
+ * must be dropped.
+ */
+static ssize_t uring_conn_parse(struct uring_loop *loop,
+                                struct uring_conn *conn,
+                                const unsigned char *buf, size_t len) {
+
+    size_t off = 0;
+    unsigned pos = 0;
+    ssize_t plen = 0;
+
+    while (!conn->busy && !conn->closing && off < len
+           && conn->client.inflight < conf->max_client_requests) {
+
+        if ((plen = packet_length(buf + off, len - off, &pos)) <= 0)
+            break;
+
+        unsigned char header = buf[off];
+
+        off += plen;
+        stats_add(&stats_block()->bytes_recv, plen);
+
+        if ((header >> 4) == QUIT) {
+            conn->closing = true;
+            break;
+        }
+
+        /*
+         * The request is copied into the event buffer, replies are written
+         * out after the input buffer has been recycled
+         */
+        struct io_event *event = io_event_get();
+        event->loop = loop;
+        event->client = &conn->client;
+        client_inflight(&conn->client, 1);
+        event->recv_time = nanotime();
+        event->buf = buf_reserve(event->buf, plen - pos + 1);
+        memcpy(event->buf, buf + off - plen + pos, plen - pos);
+
+        int rc = unpack_triedb_request(event->buf, &event->payload,
+                                       header, plen - pos);
+
+        event->decode_time = nanotime();
+
+        if (rc < 0) {
+            reply_malformed(event);
+            uring_conn_reply(conn, event);
+        } else if (is_inline_command(&event->payload)) {
+            execute(event);
+            event->reply_time = event->done_time;
+            uring_conn_reply(conn, event);
+        } else if (dispatch_to_workers(loop->epoll, event)) {
+            conn->busy = true;
+        } else {
+            reply_busy(event);
+            uring_conn_reply(conn, event);
+        }
+    }
+
+    return plen < 0 ? plen : (ssize_t) off;
+}
+
+
+/*
+ * Feed received bytes to a connection, buffering what can't be processed yet.
+ * Malformed requests mark the connection as closing.
+ */
+/* Stop receiving from a connection, cancelling its multishot RECV */
+static void uring_conn_pause(struct uring_loop *loop,
+                             struct uring_conn *conn) {
+
+    if (conn->paused)
+        return;
+
+    conn->paused = true;
+
+    if (!conn->recv_armed)
+        return;
+
+    struct io_uring_sqe *sqe = uring_loop_sqe(loop);
+    uring_prep_cancel(sqe, (unsigned long) &conn->recv);
+    sqe->user_data = (unsigned long) &loop->cancel;
+}
+
+/*
+ * Start receiving again, unless the cancelled RECV has still to complete, in
+ * that case it will be re-armed on completion
+ */
+static void uring_conn_resume(struct uring_loop *loop,
+                              struct uring_conn *conn) {
 
-    /*
-     * If a not correct packet received, we must free the buffer and reset the
-     * handler to the request again, setting EPOLL to EPOLLIN
-     */
-    if (bytes == -ERRPACKETERR)
-        goto exit;
+    if (!conn->paused)
+        return;
 
-    info.bytes_recv += bytes;
+    conn->paused = false;
 
-    /*
-     * Unpack received bytes into a triedb_request structure and execute the
-     * correct handler based on the type of the operation.
-     */
-    unpack_triedb_request(buffer, pkt, header, bytes);
+    if (!conn->recv_armed && !conn->closing)
+        uring_arm_recv(loop, conn);
+}
 
-    return 0;
 
-exit:
+static void uring_conn_input(struct uring_loop *loop, struct uring_conn *conn,
+                             const unsigned char *buf, size_t len) {
 
-    return -ERRPACKETERR;
+    ssize_t n = 0;
 
-errdc:
+    if (conn->in.len > 0 || conn->busy) {
+        iobuf_append(&conn->in, buf, len);
+        if (conn->busy)
+            return;
+        if ((n = uring_conn_parse(loop, conn, conn->in.data, conn->in.len)) > 0)
+            iobuf_consume(&conn->in, n);
+    } else {
+        if ((n = uring_conn_parse(loop, conn, buf, len)) >= 0
+            && (size_t) n < len)
+            iobuf_append(&conn->in, buf + n, len - n);
+    }
 
-    terror("Dropping client");
-    close(fd);
+    if (n < 0) {
+        terror("Dropping client");
+        conn->closing = true;
+    }
 
-    info.nclients--;
+    /*
+     * Backpressure, stop reading a client which keeps sending requests which
+     * can't be processed yet, till its pending ones are served
+     */
+    bool throttled = conn->busy
+        || conn->client.inflight >= conf->max_client_requests;
 
-    info.nconnections--;
+    if (throttled && conn->in.len >= URING_MAX_PENDING)
+        uring_conn_pause(loop, conn);
+    else if (!throttled)
+        uring_conn_resume(loop, conn);
 
-    return -ERRCLIENTDC;
+    uring_conn_flush(loop, conn);
 }
 
-/* Handle incoming packets from other nodes */
-static int read_packet(unsigned char *buffer, union triedb_packet *pkt) {
 
-    unsigned char header = 0;
-    const unsigned char *p = buffer;
-    header = *p;
-    p++;
-    unsigned pos = 0;
-    size_t bytes = decode_length(&p, &pos);
+static void uring_on_accept(struct uring_loop *loop, int fd) {
 
-    // Check for second LSB, where the type of packet is stored
-    if (((header >> 7) & 1) == 1) {
+    if (conf->socket_family == INET)
+        set_tcp_nodelay(fd);
 
-        // we got a request
-        union triedb_request req;
+    struct uring_conn *conn = tcalloc(1, sizeof(*conn));
+    if (!conn)
+        oom("creating client during accept");
 
-        /*
-         * Unpack received bytes into a triedb_request structure and
-         * execute the correct handler based on the type of the
-         * operation.
-         */
-        unpack_triedb_request(p, &req, header, bytes);
+    conn->recv = (struct uring_op) { URING_RECV, conn };
+    conn->send = (struct uring_op) { URING_SEND, conn };
 
-        pkt->request = req;
-    } else {
-        // we got a response
-        union triedb_response res;
+    /* Populate client structure */
+    conn->client.fd = fd;
+    conn->client.last_action_time = (uint64_t) time(NULL);
+    db_lock();
+    conn->client.db = hashtable_get(triedb.dbs, "db0");
+    db_unlock();
+    conn->client.zerocopy = conf->socket_family == INET;
+    conn->client.loop = loop;
 
-        unpack_triedb_response(p, &res, header, bytes);
-        pkt->response = res;
+    if (client_add(&conn->client) < 0) {
+        twarning("Too many open descriptors, dropping connection %d", fd);
+        close(fd);
+        tfree(conn);
+        return;
     }
 
-    return 0;
+    conn->next = loop->conns;
+    if (loop->conns)
+        loop->conns->prev = conn;
+    loop->conns = conn;
+
+    uring_arm_recv(loop, conn);
+
+    /* Record the new client connected */
+    __atomic_add_fetch(&info.nclients, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&info.nconnections, 1, __ATOMIC_RELAXED);
 }
 
 
-#define BUFSIZE 2048
+static void uring_on_recv(struct uring_loop *loop, struct uring_conn *conn,
+                          int res, unsigned flags) {
 
+    if (!(flags & IORING_CQE_F_MORE))
+        conn->recv_armed = false;
 
-static void *io_worker(void *arg) {
+    if (res > 0 && (flags & IORING_CQE_F_BUFFER)) {
+        unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        __atomic_store_n(&conn->client.last_action_time,
+                         (uint64_t) time(NULL), __ATOMIC_RELAXED);
+        if (!conn->closing)
+            uring_conn_input(loop, conn, uring_buf(&loop->br, bid), res);
+        uring_buf_recycle(&loop->br, bid);
+    } else if (res != -ENOBUFS && res != -ECANCELED) {
+        /* Disconnection or error */
+        conn->closing = true;
+    }
 
-    struct epoll *epoll = arg;
-    int events = 0;
-    ssize_t sent = 0;
+    if (conn->closing)
+        uring_conn_close(loop, conn);
+    else if (!conn->recv_armed && !conn->paused)
+        uring_arm_recv(loop, conn);
+}
 
-    struct epoll_event *e_events =
-        tmalloc(sizeof(struct epoll_event) * EPOLL_MAX_EVENTS);
 
-    /* Raw bytes buffer to handle input from client */
-    unsigned char *buffer = tmalloc(conf->max_request_size);
+static void uring_on_send(struct uring_loop *loop, struct uring_conn *conn,
+                          struct uring_zc *zc, int res, unsigned flags) {
 
-    // UDP bus communication client handler
-    struct sockaddr_in node;
-    memset(&node, 0, sizeof(node)); ;
+    /* The kernel is done with the buffers of a zero-copy send */
+    if (flags & IORING_CQE_F_NOTIF) {
+        io_event_list_destroy(zc->replies);
+        tfree(zc);
+        conn->zc_inflight--;
+        if (conn->closing)
+            uring_conn_close(loop, conn);
+        return;
+    }
 
-    while (1) {
+    conn->sending = false;
 
-        events = epoll_wait(epoll->io_epollfd, e_events,
-                            EPOLL_MAX_EVENTS, EPOLL_TIMEOUT);
+    if (res <= 0) {
+        if (zc && !(flags & IORING_CQE_F_MORE))
+            tfree(zc);
+        else if (zc)
+            conn->zc_inflight++;
+        uring_conn_close(loop, conn);
+        return;
+    }
 
-        if (events < 0) {
+    stats_add(&stats_block()->bytes_sent, res);
+    conn->sent += res;
 
-            /* Signals to all threads. Ignore it for now */
-            if (errno == EINTR)
-                continue;
+    uint64_t now = nanotime();
+    bool throttled = conn->client.inflight >= conf->max_client_requests;
 
-            /* Error occured, break the loop */
-            break;
+    /*
+     * Drop the replies entirely sent, those sent with zero-copy are kept
+     * alive till the notification
+     */
+    while (conn->replies && conn->sent >= io_event_reply_len(conn->replies)) {
+        struct io_event *event = conn->replies;
+        conn->sent -= io_event_reply_len(event);
+        conn->replies = event->next;
+        if (event->push) {
+            __atomic_sub_fetch(&conn->client.push_bytes,
+                               io_event_reply_len(event), __ATOMIC_RELAXED);
+        } else {
+            client_inflight(&conn->client, -1);
+            stats_request(event, now);
+        }
+        if (zc) {
+            event->next = zc->replies;
+            zc->replies = event;
+        } else {
+            io_event_destroy(event);
         }
+    }
 
-        for (int i = 0; i < events; ++i) {
+    if (!conn->replies)
+        conn->replies_tail = NULL;
 
-            /* Check for errors */
-            EPOLL_ERR(e_events[i]) {
+    if (zc && !(flags & IORING_CQE_F_MORE)) {
+        io_event_list_destroy(zc->replies);
+        tfree(zc);
+    } else if (zc) {
+        conn->zc_inflight++;
+    }
 
-                /* An error has occured on this fd, or the socket is not
-                   ready for reading, closing connection */
-                perror ("epoll_wait(2)");
-                close(e_events[i].data.fd);
+    /*
+     * Resume the processing of the requests held back by the in flight
+     * limit, then send out the remaining bytes of a short write and the
+     * queued replies
+     */
+    if (throttled && !conn->closing)
+        uring_conn_input(loop, conn, NULL, 0);
+    else
+        uring_conn_flush(loop, conn);
 
-            } else if (e_events[i].data.fd == conf->run) {
+    if (conn->closing)
+        uring_conn_close(loop, conn);
+}
 
-                /* And quit event after that */
-                eventfd_t val;
-                eventfd_read(conf->run, &val);
 
-                tdebug("Stopping epoll loop. Thread %p exiting.",
-                       (void *) pthread_self());
+/* Collect the requests processed by the worker pool */
+static void uring_on_wakeup(struct uring_loop *loop) {
 
-                goto exit;
+    eventfd_t val;
+    eventfd_read(loop->wakeupfd, &val);
 
-            } else if (epoll->busfd > 0 && e_events[i].data.fd == epoll->busfd) {
-                // Bus communication from UDP chanel
-                int n;
-                socklen_t len;
-                n = recvfrom(e_events[i].data.fd, (char *)buffer, BUFSIZE,
-                             MSG_WAITALL, ( struct sockaddr *) &node, &len);
-                buffer[n] = '\0';
+    uring_arm_poll(loop, &loop->wakeup, loop->wakeupfd);
 
-                unsigned char header = 0;
+    pthread_spin_lock(&loop->lock);
+    struct io_event *done = loop->done;
+    loop->done = NULL;
+    pthread_spin_unlock(&loop->lock);
 
-                union triedb_request *pkt = tmalloc(sizeof(*pkt));
+    /*
+     * The events are linked in reverse, restore the order they were handed
+     * back in, the NOTIFY pushed to a client must be sent out in order
+     */
+    struct io_event *event = NULL;
 
-                const unsigned char *p = buffer;
-                header = *p;
-                p++;
-                unsigned pos = 0;
-                size_t bytes = decode_length(&p, &pos);
+    while (done) {
+        struct io_event *next = done->next;
+        done->next = event;
+        event = done;
+        done = next;
+    }
 
-                /*
-                 * Unpack received bytes into a triedb_request structure and
-                 * execute the correct handler based on the type of the
-                 * operation.
-                 */
-                unpack_triedb_request(p, pkt, header, bytes);
+    uint64_t now = nanotime();
+
+    while (event) {
+        struct io_event *next = event->next;
+        struct uring_conn *conn = (struct uring_conn *) event->client;
+        if (event->push) {
+            __atomic_sub_fetch(&conn->client.pushes, 1, __ATOMIC_RELEASE);
+            if (conn->closing) {
+                io_event_destroy(event);
+                uring_conn_close(loop, conn);
+            } else {
+                uring_conn_reply(conn, event);
+                uring_conn_flush(loop, conn);
+            }
+            event = next;
+            continue;
+        }
+        event->reply_time = now;
+        uring_conn_reply(conn, event);
+        conn->busy = false;
+        /* Resume the processing of pipelined requests */
+        if (!conn->closing)
+            uring_conn_input(loop, conn, NULL, 0);
+        if (conn->closing)
+            uring_conn_close(loop, conn);
+        event = next;
+    }
+}
 
-                info.nnodes++;
 
-                // TODO: Split reception and unpacking of node based on the
-                // packet type, to handle responses and requests as well
-                tdebug("Received JOIN");
+/* Called by the worker pool, hand a processed event back to its ring */
+static void uring_loop_done(struct uring_loop *loop, struct io_event *event) {
+    pthread_spin_lock(&loop->lock);
+    event->next = loop->done;
+    loop->done = event;
+    pthread_spin_unlock(&loop->lock);
+    eventfd_write(loop->wakeupfd, 1);
+}
 
-            } else if (e_events[i].events & EPOLLIN) {
-                struct io_event *event = tmalloc(sizeof(*event));
-                event->epollfd = epoll->io_epollfd;
-                event->payload = tmalloc(sizeof(*event->payload));
-                event->client = e_events[i].data.ptr;
-                /*
-                 * Received a bunch of data from a client, after the creation
-                 * of an IO event we need to read the bytes and encoding the
-                 * content according to the protocol
-                 */
-                int rc = read_data(event->client->fd, buffer, event->payload);
-                if (rc == 0) {
-                    /*
-                     * All is ok, raise an event to the worker poll EPOLL and
-                     * link it with the IO event containing the decode payload
-                     * ready to be processed
-                     */
-                    eventfd_t ev = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
-                    event->io_event = ev;
-                    epoll_add(epoll->w_epollfd, ev,
-                              EPOLLIN | EPOLLONESHOT, event);
-                    eventfd_write(ev, 1);
-                }
-                else if (rc == -ERRCLIENTDC) {
 
-                    /*
-                     * We got an unexpected error or a disconnection from the
-                     * client side, remove client from the global map and
-                     * free resources allocated such as io_event structure and
-                     * paired payload
-                     */
+static int uring_loop_init(struct uring_loop *loop, struct epoll *epoll) {
 
-#if WORKERPOOLSIZE > 1
-                    pthread_spin_lock(&spinlock);
-#endif
+    memset(loop, 0x00, sizeof(*loop));
 
-                    close(event->client->fd);
-                    hashtable_del(triedb.clients, event->client->uuid);
-                    tfree(event->payload);
-                    tfree(event);
+    if (uring_init(&loop->ring, URING_ENTRIES) < 0)
+        return -1;
 
-#if WORKERPOOLSIZE > 1
-                    pthread_spin_unlock(&spinlock);
-#endif
-                }
+    if (uring_buf_ring_init(&loop->ring, &loop->br, 0,
+                            URING_BUFS, URING_BUFSIZE) < 0) {
+        uring_destroy(&loop->ring);
+        return -1;
+    }
 
-                /* Record last action as of now */
-                event->client->last_action_time = (uint64_t) time(NULL);
+    loop->epoll = epoll;
+    loop->accept.type = URING_ACCEPT;
+    loop->wakeup.type = URING_WAKEUP;
+    loop->stop.type = URING_STOP;
+    loop->cancel.type = URING_CANCEL;
+    loop->wakeupfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    loop->zerocopy = uring_opcode_supported(&loop->ring, IORING_OP_SENDMSG_ZC);
+    pthread_spin_init(&loop->lock, PTHREAD_PROCESS_PRIVATE);
 
-            } else if (e_events[i].events & EPOLLOUT) {
+    return 0;
+}
 
-                struct io_event *event = e_events[i].data.ptr;
 
-                /*
-                 * Write out to client, after a request has been processed in
-                 * worker thread routine. Just send out all bytes stored in the
-                 * reply buffer to the reply file descriptor.
-                 */
-                if ((sent = send_bytes(event->client->fd,
-                                       (const unsigned char *) event->reply,
-                                       bstring_len(event->reply))) < 0) {
-                    close(event->client->fd);
-                }
+static void uring_loop_destroy(struct uring_loop *loop) {
+    uring_buf_ring_destroy(&loop->ring, &loop->br);
+    uring_destroy(&loop->ring);
+    close(loop->wakeupfd);
+    pthread_spin_destroy(&loop->lock);
+}
 
-                // Update information stats
-                info.bytes_sent += sent < 0 ? 0 : sent;
 
-                /*
-                 * Rearm descriptor, we're using EPOLLONESHOT feature to avoid
-                 * race condition and thundering herd issues on multithreaded
-                 * EPOLL
-                 */
-                epoll_mod(epoll->io_epollfd,
-                          event->client->fd, EPOLLIN, event->client);
+static void *uring_io_worker(void *arg) {
+
+    struct uring_loop *loop = arg;
+    struct io_uring_cqe *cqe = NULL;
+
+    uring_arm_accept(loop);
+    uring_arm_poll(loop, &loop->wakeup, loop->wakeupfd);
+    uring_arm_poll(loop, &loop->stop, conf->run);
+
+    loop->running = true;
+
+    while (loop->running) {
 
-                /* Free resource, ACKs will be free'd closing the server */
-                if ((*event->reply >> 4) != ACK)
-                    bstring_destroy(event->reply);
+        /* Submit all the prepared SQEs and wait for at least a completion */
+        if (uring_submit(&loop->ring, 1) < 0 && errno != EBUSY) {
+            perror("io_uring_enter(2)");
+            break;
+        }
 
-                tfree(event);
+        while (loop->running && (cqe = uring_peek_cqe(&loop->ring))) {
+
+            struct uring_op *op = (struct uring_op *) cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+
+            uring_cqe_seen(&loop->ring);
+
+            switch (op->type) {
+                case URING_ACCEPT:
+                    if (res >= 0)
+                        uring_on_accept(loop, res);
+                    if (!(flags & IORING_CQE_F_MORE))
+                        uring_arm_accept(loop);
+                    break;
+                case URING_RECV:
+                    uring_on_recv(loop, op->conn, res, flags);
+                    break;
+                case URING_SEND:
+                    uring_on_send(loop, op->conn, NULL, res, flags);
+                    break;
+                case URING_SEND_ZC:
+                    uring_on_send(loop, op->conn,
+                                  (struct uring_zc *) op, res, flags);
+                    break;
+                case URING_WAKEUP:
+                    uring_on_wakeup(loop);
+                    break;
+                case URING_CANCEL:
+                    /* The cancelled RECV completes on its own */
+                    break;
+                case URING_STOP:
+                    tdebug("Stopping io_uring loop. Thread %p exiting.",
+                           (void *) pthread_self());
+                    loop->running = false;
+                    break;
             }
         }
     }
 
-exit:
+    /*
+     * Close all remaining connections, client structures will be free'd
+     * along with the clients table
+     */
+    for (struct uring_conn *c = loop->conns; c; c = c->next) {
+        close(c->client.fd);
+        tfree(c->in.data);
+        io_event_list_destroy(c->replies);
+    }
 
-    tfree(e_events);
-    tfree(buffer);
+    io_event_pool_clear();
 
     return NULL;
 }
@@ -1241,21 +4098,44 @@ static void *worker(void *arg) {
                 (void) read(e_events[i].data.fd, &timers, sizeof(timers));
                 // Check for keys about to expire out
                 expire_keys();
+                // Answer the blocking reads timed out
+                expire_waiters();
+                // Move on the resize of the databases table, if any
+                rehash_databases();
+                // Disconnect clients idle for too long
+                reap_idle_clients();
+                // Retry the subscribers stalled on a full socket
+                if (__atomic_load_n(&push_queue.stalled, __ATOMIC_ACQUIRE))
+                    eventfd_write(push_queue.fd, 1);
             } else if (e_events[i].events & EPOLLIN) {
                 struct io_event *event = e_events[i].data.ptr;
                 eventfd_read(event->io_event, &val);
-                // TODO free client and remove it from the global map in case
-                // of QUIT command (check return code)
-                handlers[event->payload->header.bits.opcode](event);
-                epoll_mod(event->epollfd, event->client->fd, EPOLLOUT, event);
                 close(event->io_event);
-                triedb_request_destroy(event->payload);
+                __atomic_sub_fetch(&queued_requests, 1, __ATOMIC_RELAXED);
+                int rc = execute(event);
+                /* A parked request is handed back once answered */
+                if (rc == PARKED)
+                    continue;
+                /*
+                 * QUIT shut the client down, there's no reply to be written
+                 * out, re-arm it to be released by the IO thread
+                 */
+                if (rc < 0) {
+                    client_inflight(event->client, -1);
+                    epoll_mod(event->epollfd, event->client->fd,
+                              EPOLLIN, event->client);
+                    io_event_destroy(event);
+                    continue;
+                }
+                /* Hand the event back to the IO thread pool as last thing */
+                io_event_done(event);
             }
         }
     }
 
 exit:
 
+    io_event_pool_clear();
     tfree(e_events);
 
     return NULL;
@@ -1269,133 +4149,121 @@ exit:
  * This function accept a socket fd, a buffer to read incoming streams of
  * bytes and a structure formed by 2 fields:
  *
- * - buf -> a byte buffer, it will be malloc'ed in the function and it will
- *          contain the serialized bytes of the incoming packet
+ * - buf -> a byte buffer allocated with tmalloc, it will contain the payload
+ *          of the incoming packet, the Fixed Header excluded, followed by a
+ *          spare byte. It's grown in the function if needed.
  * - flags -> flags pointer, copy the flag setting of the incoming packet,
  *            again for simplicity and convenience of the caller.
  */
 ssize_t recv_packet(int clientfd, unsigned char **buf, unsigned char *header) {
 
     ssize_t nbytes = 0;
-    unsigned char *tmpbuf = *buf;
+    unsigned char lenbuf[MAX_LEN_BYTES];
+    const unsigned char *plen = lenbuf;
 
     /* Read the first byte, it should contain the message type code */
-    if ((nbytes = recv_bytes(clientfd, *buf, 4)) <= 0)
+    if ((nbytes = recv_bytes(clientfd, header, 1)) <= 0)
         return -ERRCLIENTDC;
 
-    *header = *tmpbuf;
-    tmpbuf++;
-
     /* Check for OPCODE, if an unknown OPCODE is received return an error */
-    if (INFO < (*header >> 4) || PUT > (*header >> 4))
+    if (!is_request_opcode(*header))
         return -ERRPACKETERR;
 
     /*
      * Read remaning length bytes which starts at byte 2 and can be long to 4
      * bytes based on the size stored, so byte 2-5 is dedicated to the packet
-     * length.
+     * length. They're read one by one, to not consume bytes of the following
+     * packet.
      */
-    int n = 0;
-
     unsigned pos = 0;
-    unsigned long long tlen = decode_length((const unsigned char **) &tmpbuf,
-                                            &pos);
+
+    do {
+        if (pos == MAX_LEN_BYTES || recv_all(clientfd, lenbuf + pos, 1) <= 0)
+            return -ERRCLIENTDC;
+    } while (lenbuf[pos++] & 128);
+
+    unsigned long long tlen = decode_length(&plen, &pos);
     /*
      * Set return code to -ERRMAXREQSIZE in case the total packet len exceeds
      * the configuration limit `max_request_size`
      */
-    if (tlen > conf->max_request_size) {
-        nbytes = -ERRMAXREQSIZE;
-        goto exit;
-    }
+    if (tlen > conf->max_request_size)
+        return -ERRMAXREQSIZE;
 
-    if (tlen <= 4)
-        goto exit;
+    *buf = buf_reserve(*buf, tlen + 1);
 
     /* Read remaining bytes to complete the packet */
-    if ((n = recv_bytes(clientfd, tmpbuf + pos + 1, tlen - pos)) < 0)
-        goto err;
-
-    nbytes += n - pos - 1;
-
-exit:
-
-    *buf += pos + 1;
-
-    return nbytes;
+    if (tlen > 0 && recv_all(clientfd, *buf, tlen) <= 0)
+        return -ERRCLIENTDC;
 
-err:
+    return tlen;
+}
 
-    close(clientfd);
+/*
+ * Complete a resize of the databases table a bit at a time, for it not to
+ * wait for the next USE; the check out of the lock is just a hint, like the
+ * one of expire_keys
+ */
+static void rehash_databases(void) {
 
-    return nbytes;
+    if (!hashtable_rehashing(triedb.dbs))
+        return;
 
+    db_lock();
+    hashtable_rehash_step(triedb.dbs, REHASH_TICK_STEP);
+    db_unlock();
 }
 
 /*
- * Cycle through sorted list of expiring keys and remove those which are
- * elegible. Meant to be run as a cron routine, several times per second.
+ * Delete the keys whose TTL is over, publishing their expiration. Meant to be
+ * run as a cron routine, several times per second.
  */
 static void expire_keys(void) {
 
-    if (vector_size(triedb.expiring_keys) == 0)
+    if (__atomic_load_n(&nexpiring, __ATOMIC_RELAXED) == 0)
         return;
 
-    time_t now = time(NULL);
-    time_t delta = 0LL;
-    struct expiring_key *ek = NULL;
-
-#if WORKERPOOLSIZE > 1
-    pthread_spin_lock(&spinlock);
-#endif
+    uint64_t now = time(NULL);
 
-    for (int i = 0; i < vector_size(triedb.expiring_keys); ++i) {
+    db_lock();
+    if (expiry_wheel.now < now)
+        wheel_advance(&expiry_wheel, now, expire_timer, NULL);
+    db_unlock();
+}
 
-        ek = vector_get(triedb.expiring_keys, i);
-        delta = (ek->item->ctime + ek->item->ttl) - now;
+/*
+ * Number of slots of the clients table, one for each descriptor the process
+ * can open, capped at CLIENTS_MAX_SLOTS
+ */
+static size_t clients_table_size(void) {
 
-        /*
-         * Vector *should be* sorted per time delta value, so it is futile to
-         * go on after the first positive timedelta encoutered
-         */
-        if (delta > 0)
-            break;
+    struct rlimit rl;
 
-        /*
-         * ek->data_ptr points to the trie of the client which stores the given
-         * key
-         */
-        trie_delete(ek->data_ptr, ek->key);
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur == RLIM_INFINITY
+        || rl.rlim_cur > CLIENTS_MAX_SLOTS)
+        return CLIENTS_MAX_SLOTS;
 
-        vector_delete(triedb.expiring_keys, i);
+    return rl.rlim_cur;
+}
 
-        // Update total keyspace counter
-        triedb.keyspace_size--;
+/* Release a client structure, its descriptor must be already closed */
+static void client_free(struct client *client) {
 
-        tdebug("%s expired", ek->key);
+    /* Release a pending reply and values pinned by MSG_ZEROCOPY sends */
+    if (client->event)
+        io_event_destroy(client->event);
 
-        tfree((char *) ek->key);
-        tfree(ek);
-        ek = NULL;
+    while (client->zc_head) {
+        struct zc_pending *zc = client->zc_head;
+        client->zc_head = zc->next;
+        db_value_release(zc->value);
+        tfree(zc);
     }
 
-#if WORKERPOOLSIZE > 1
-    pthread_spin_unlock(&spinlock);
-#endif
-
-}
-
-/* Hashtable destructor function for struct client objects. */
-static inline int client_destructor(struct hashtable_entry *entry) {
-
-    if (!entry || !entry->val)
-        return -HASHTABLE_ERR;
-
-    struct client *client = entry->val;
+    if (client->notify)
+        tfree(client->notify);
 
     tfree(client);
-
-    return HASHTABLE_OK;
 }
 
 /*
@@ -1413,6 +4281,12 @@ static inline int database_destructor(struct hashtable_entry *entry) {
 
     trie_destroy(db->data);
 
+    pubsub_destroy(db->subscribers);
+
+    pubsub_destroy(db->waiters);
+
+    pubsub_destroy(db->tracking);
+
     tfree(entry->val);
     tfree((char *) entry->key);
 
@@ -1441,12 +4315,8 @@ static inline bool trie_node_destructor(struct trie_node *node,
     if (!item)
         goto exit;
 
-    if (item->data) {
-        tfree(item->data);
-        item->data = NULL;
-    }
-
-    tfree(node->data);
+    expire_drop(item);
+    db_item_free(item);
     node->data = NULL;
 
     ret = true;
@@ -1459,24 +4329,6 @@ exit:
     return ret;
 }
 
-/*
- * Vector destructor function for struct expiring_key objects. It's the
- * function that will be called on Vector remove or vector_destroy
- */
-static inline void expiring_keys_destructor(void *item) {
-
-    if (!item)
-        return;
-
-    struct expiring_key *ek = item;
-
-    if (ek->key)
-        tfree((char *) ek->key);
-
-    tfree(ek);
-
-}
-
 /* Init informations structure, to be run before starting the server */
 static void init_info(void) {
     info.nclients = 0;
@@ -1503,18 +4355,27 @@ int start_server(const char *addr, const char *port, struct seednode *seed) {
     for (int i = 0; i < 3; ++i)
         ack_replies[i] = pack_ack(ACK, i);
 
-#if WORKERPOOLSIZE > 1
+#if WORKERPOOLSIZE + IOPOOLSIZE > 1
     pthread_spin_init(&spinlock, PTHREAD_PROCESS_SHARED);
 #endif
 
+    slowlog_init(&slowlog, conf->slowlog_max_len);
+    pthread_spin_init(&slowlog_lock, PTHREAD_PROCESS_PRIVATE);
+
+    wheel_init(&idle_wheel, time(NULL));
+    wheel_init(&waiters_wheel, nanotime() / 1000000);
+    wheel_init(&expiry_wheel, time(NULL));
+    pthread_spin_init(&idle_lock, PTHREAD_PROCESS_PRIVATE);
+
     /* Create default database */
     struct database *default_db = tmalloc(sizeof(struct database));
     database_init(default_db, tstrdup("db0"), trie_node_destructor);
+    default_db->compress_min = conf->compression_threshold;
 
     /* Initialize global triedb instance */
     triedb.dbs = hashtable_new(database_destructor);
-    triedb.clients = hashtable_new(client_destructor);
-    triedb.expiring_keys = vector_new(expiring_keys_destructor);
+    triedb.maxclients = clients_table_size();
+    triedb.clients = tcalloc(triedb.maxclients, sizeof(struct client *));
     triedb.cluster = &(struct cluster) { 0, 4, list_new(NULL) };
 
     /* Add it to the global map */
@@ -1552,13 +4413,49 @@ int start_server(const char *addr, const char *port, struct seednode *seed) {
     epoll_add(epoll.io_epollfd, conf->run, EPOLLIN, NULL);
     epoll_add(epoll.w_epollfd, conf->run, EPOLLIN, NULL);
 
+    /* And for the keyspace events pushed to the clients */
+    pthread_spin_init(&push_queue.lock, PTHREAD_PROCESS_PRIVATE);
+    push_queue.head = push_queue.tail = NULL;
+    push_queue.stalled = NULL;
+    push_queue.fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    epoll_add(epoll.io_epollfd, push_queue.fd, EPOLLIN, NULL);
+
     pthread_t iothreads[IOPOOLSIZE];
     pthread_t workers[WORKERPOOLSIZE];
+    struct uring_loop loops[IOPOOLSIZE];
+
+    /*
+     * Select the IO backend, io_uring requires a recent kernel and it doesn't
+     * handle the cluster bus, fallback to EPOLL in those cases
+     */
+    if (conf->io_backend == URING_BACKEND && conf->mode == CLUSTER) {
+        twarning("io_uring backend not supported in cluster mode, "
+                 "falling back to epoll");
+        conf->io_backend = EPOLL_BACKEND;
+    } else if (conf->io_backend == URING_BACKEND && !uring_supported()) {
+        twarning("io_uring not supported by the kernel, "
+                 "falling back to epoll");
+        conf->io_backend = EPOLL_BACKEND;
+    }
+
+    for (int i = 0; i < IOPOOLSIZE
+         && conf->io_backend == URING_BACKEND; ++i) {
+        if (uring_loop_init(&loops[i], &epoll) < 0) {
+            twarning("io_uring setup failed, falling back to epoll");
+            while (i-- > 0)
+                uring_loop_destroy(&loops[i]);
+            conf->io_backend = EPOLL_BACKEND;
+        }
+    }
 
     /* Start I/O thread pool */
 
-    for (int i = 0; i < IOPOOLSIZE; ++i)
-        pthread_create(&iothreads[i], NULL, &io_worker, &epoll);
+    for (int i = 0; i < IOPOOLSIZE; ++i) {
+        if (conf->io_backend == URING_BACKEND)
+            pthread_create(&iothreads[i], NULL, &uring_io_worker, &loops[i]);
+        else
+            pthread_create(&iothreads[i], NULL, &io_worker, &epoll);
+    }
 
     /* Start Worker thread pool */
 
@@ -1652,15 +4549,44 @@ int start_server(const char *addr, const char *port, struct seednode *seed) {
     for (int i = 0; i < WORKERPOOLSIZE; ++i)
         pthread_join(workers[i], NULL);
 
+    for (int i = 0; i < IOPOOLSIZE
+         && conf->io_backend == URING_BACKEND; ++i)
+        uring_loop_destroy(&loops[i]);
+
     /* Free all allocated resources */
     hashtable_destroy(triedb.dbs);
-    hashtable_destroy(triedb.clients);
-    vector_destroy(triedb.expiring_keys);
+    for (size_t i = 0; i < triedb.maxclients; ++i)
+        if (triedb.clients[i])
+            client_free(triedb.clients[i]);
+    tfree(triedb.clients);
+    tfree(expiring.timers);
+    tfree(expiring.unused);
+
+    while (waiters) {
+        struct waiter *next = waiters->next;
+        io_event_destroy(waiters->event);
+        tfree(waiters);
+        waiters = next;
+    }
+
+    while (push_queue.head) {
+        struct io_event *next = push_queue.head->next;
+        io_event_destroy(push_queue.head);
+        push_queue.head = next;
+    }
+    io_event_pool_clear();
+    close(push_queue.fd);
+    pthread_spin_destroy(&push_queue.lock);
     list_destroy(triedb.cluster->nodes, 1);
 
     for (int i = 0; i < 3; ++i)
         bstring_destroy(ack_replies[i]);
 
+    slowlog_destroy(&slowlog);
+
+    for (unsigned i = 0; i < stats_nblocks && i < STATS_MAX_THREADS; ++i)
+        tfree(stats_blocks[i]);
+
     tinfo("triedb v%s exiting", VERSION);
 
     return 0;
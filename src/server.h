@@ -35,6 +35,8 @@
 #include "vector.h"
 #include "cluster.h"
 #include "hashtable.h"
+#include "histogram.h"
+#include "wheel.h"
 
 /*
  * Epoll default settings for concurrent events monitored and timeout, -1
@@ -43,15 +45,30 @@
 #define EPOLL_MAX_EVENTS    256
 #define EPOLL_TIMEOUT       -1
 
+/*
+ * io_uring backend settings, size of the submission queue, number and size
+ * of the provided buffers for receiving, max number of iovecs coalesced in a
+ * single SENDMSG and max number of bytes buffered for a connection whose
+ * requests can't be processed yet, after which it's not read anymore
+ */
+#define URING_ENTRIES       1024
+#define URING_BUFS          1024
+#define URING_BUFSIZE       4096
+#define URING_MAX_IOV       64
+#define URING_MAX_PENDING   (64 * 1024)
+
 /* Error codes for packet reception, signaling respectively
  * - client disconnection
  * - error reading packet
  * - error packet sent exceeds size defined by configuration (generally default
  *   to 2MB)
+ * - packet received whole but its payload doesn't match its command, it's
+ *   answered with a NOK
  */
 #define ERRCLIENTDC         1
 #define ERRPACKETERR        2
 #define ERRMAXREQSIZE       3
+#define ERRMALFORMED        4
 
 /* Return code of handler functions, signaling if there's data payload to be
  * sent out or if the server just need to re-arm closure for reading incoming
@@ -60,6 +77,15 @@
 #define REARM_R             0
 #define REARM_W             1
 
+/*
+ * Return code of a handler which parked the request, the reply is handed back
+ * to the IO thread later, when the request is resumed; see wait_handler
+ */
+#define PARKED              2
+
+
+/* Groups of slots of the databases table moved on each tick while resizing */
+#define REHASH_TICK_STEP        64
 
 #define TTL_CHECK_INTERVAL      50 * 1024 * 1024
 #define STATS_PRINT_INTERVAL    15
@@ -74,16 +100,46 @@
 #define WORKERPOOLSIZE 2
 
 /*
- * Global db instance, containing some connection data, clients, expiring keys
- * and databases
+ * Max size in bytes of the value of a PUT request to be executed inline on the
+ * IO thread which decoded it, bigger values are handed to the worker pool
+ */
+#define INLINE_PUT_MAX_SIZE 1024
+
+/*
+ * Min size in bytes of a value to be sent with MSG_ZEROCOPY, below it the
+ * page pinning and the completion notification cost more than a plain copy
+ */
+#define ZEROCOPY_THRESHOLD  (16 * 1024)
+
+/*
+ * Max number of bytes of notifications pushed to a client and not yet
+ * written out, a subscriber not keeping up with them is disconnected
+ */
+#define NOTIFY_MAX_PENDING  (1024 * 1024)
+
+/*
+ * Max number of slots of the clients table, indexed by descriptor and sized
+ * after the RLIMIT_NOFILE of the process
+ */
+#define CLIENTS_MAX_SLOTS   (1 << 20)
+
+/*
+ * Max number of IO events kept for reuse by each thread, and size of the
+ * request buffer they retain, bigger buffers are shrinked back on release
+ */
+#define IO_EVENT_POOL_SIZE  256
+#define IO_EVENT_BUFSIZE    4096
+
+/*
+ * Global db instance, containing some connection data, clients and databases
  */
 struct triedb {
     /* Main epoll loop fd */
     int epollfd;
-    /* Connected clients */
-    HashTable *clients;
-    /* Expiring keys */
-    Vector *expiring_keys;
+    /* Connected clients, indexed by socket descriptor */
+    struct client **clients;
+    /* Number of client slots, the max number of descriptors of the process */
+    size_t maxclients;
     /* struct database mappings name -> db object */
     HashTable *dbs;
     /* Total count of the database keys */
@@ -110,22 +166,88 @@ struct triedb {
  * to call the correct context.
  */
 
+/*
+ * A value sent with MSG_ZEROCOPY, pinned till the kernel notifies the
+ * completion of the send identified by `seq`
+ */
+struct zc_pending {
+    struct db_value *value;
+    uint32_t seq;
+    struct zc_pending *next;
+};
+
+struct subscription;
+struct waiter;
+
 struct client {
     int fd;
     uint64_t last_action_time;
-    const char uuid[37];
+    /* Timer on the idle clients wheel, see reap_idle_clients */
+    struct wheel_node idle;
+    /* Requests decoded and not yet replied, never idle meanwhile */
+    unsigned inflight;
+    /* Connection id, progressive and never reused */
+    uint64_t id;
     struct database *db;
+    /* Reply handed back by the worker pool, waiting for EPOLLOUT */
+    struct io_event *event;
+    /* MSG_ZEROCOPY state, sends counter and values waiting for completion */
+    bool zerocopy;
+    uint32_t zc_seq;
+    struct zc_pending *zc_head;
+    struct zc_pending *zc_tail;
+    /* Ring owning the client, NULL with the EPOLL backend */
+    struct uring_loop *loop;
+    /* Keys and prefixes subscribed, guarded by the global lock */
+    struct subscription *subscriptions;
+    /* WAIT request parked, guarded by the global lock */
+    struct waiter *waiter;
+    /*
+     * Tracking of the keys read, for client side caching, and the keys and
+     * prefixes read since their last invalidation, at most max_tracked_keys;
+     * guarded by the global lock
+     */
+    bool tracking;
+    struct subscription *tracked;
+    size_t ntracked;
+    /*
+     * Keyspace events collected for the client while the global lock is
+     * held, pushed all together in a NOTIFY as soon as it's released
+     */
+    unsigned char *notify;
+    size_t notify_len;
+    unsigned short notify_count;
+    bool notify_pending;
+    uint64_t notify_seq;
+    struct client *notify_next;
+    /*
+     * NOTIFY pushed and not yet collected by the IO thread owning the
+     * client, and bytes of them not yet written out
+     */
+    unsigned pushes;
+    size_t push_bytes;
+    /*
+     * EPOLL backend only, NOTIFY collected by the IO thread and not yet fully
+     * written out, bytes of the first one already sent and link of the
+     * clients whose socket is full, retried on the next drain
+     */
+    struct io_event *outbox;
+    struct io_event *outbox_tail;
+    size_t outbox_sent;
+    bool stalled;
+    struct client *stalled_next;
 };
 
 
 /*
- * Structure to represent a key with a TTL set which is not -NOTTL, e.g. has a
- * timeout after which the key will be deleted
+ * Timer of a key with a TTL set which is not -NOTTL, e.g. has a timeout after
+ * which the key will be deleted. The item refers to it by its id, at most one
+ * per item, re-armed when the TTL changes
  */
 struct expiring_key {
-    Trie *data_ptr;
-    const struct db_item *item;
+    struct database *db;
     const char *key;
+    struct wheel_node timer;
 };
 
 
@@ -138,6 +260,37 @@ struct seednode {
     const char target[22];
 };
 
+/*
+ * Phases of a request, tracked by the latency histograms:
+ *
+ * - decode: reading and unpacking of the request
+ * - queue: hops through the worker pool, there and back, 0 when a command is
+ *   executed inline by the IO thread
+ * - execute: execution of the command
+ * - write: writing out of the reply
+ */
+enum request_phase {
+    PHASE_DECODE,
+    PHASE_QUEUE,
+    PHASE_EXECUTE,
+    PHASE_WRITE,
+    PHASES
+};
+
+/* Number of opcodes, the size of the per-opcode statistics */
+#define STATS_OPCODES       16
+
+/*
+ * Counters of a single thread, each thread updates only its own block so the
+ * hot path doesn't share any cacheline, INFO sums them all up
+ */
+struct thread_stats {
+    uint64_t nrequests;
+    uint64_t bytes_recv;
+    uint64_t bytes_sent;
+    struct histogram latency[STATS_OPCODES][PHASES];
+};
+
 /* Global informations statistics structure */
 struct informations {
     /* Number of clients currently connected */
@@ -158,6 +311,11 @@ struct informations {
     uint64_t bytes_sent;
     /* Total number of keys stored */
     uint64_t nkeys;
+    /* Latency of the requests served, by opcode and phase */
+    struct histogram (*latency)[PHASES];
+    /* Original and compressed size in bytes of the values stored compressed */
+    uint64_t compressed_rawlen;
+    uint64_t compressed_len;
 };
 
 
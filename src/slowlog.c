@@ -0,0 +1,91 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <string.h>
+#include "util.h"
+#include "slowlog.h"
+
+
+void slowlog_init(struct slowlog *log, size_t size) {
+    log->size = size;
+    log->len = 0;
+    log->head = 0;
+    log->next_id = 0;
+    log->entries = size > 0 ? tcalloc(size, sizeof(*log->entries)) : NULL;
+}
+
+
+void slowlog_push(struct slowlog *log, struct slowlog_entry *entry,
+                  const char *key, size_t keylen) {
+
+    if (log->size == 0)
+        return;
+
+    entry->id = log->next_id++;
+    entry->keylen = keylen;
+
+    size_t n = keylen < SLOWLOG_KEY_MAX ? keylen : SLOWLOG_KEY_MAX;
+    if (n > 0)
+        memcpy(entry->key, key, n);
+
+    log->entries[log->head] = *entry;
+    log->head = (log->head + 1) % log->size;
+
+    if (log->len < log->size)
+        log->len++;
+}
+
+
+const struct slowlog_entry *slowlog_get(const struct slowlog *log, size_t i) {
+
+    if (i >= log->len)
+        return NULL;
+
+    /* The oldest entry is right after the last written, once full */
+    size_t tail = (log->head + log->size - log->len) % log->size;
+
+    return &log->entries[(tail + i) % log->size];
+}
+
+
+size_t slowlog_len(const struct slowlog *log) {
+    return log->len;
+}
+
+
+void slowlog_reset(struct slowlog *log) {
+    log->len = 0;
+    log->head = 0;
+}
+
+
+void slowlog_destroy(struct slowlog *log) {
+    tfree(log->entries);
+    log->entries = NULL;
+    log->size = log->len = log->head = 0;
+}
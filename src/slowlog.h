@@ -0,0 +1,96 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef SLOWLOG_H
+#define SLOWLOG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Max number of bytes of the key stored with each entry, longer keys are
+ * truncated, their original length is kept anyway
+ */
+#define SLOWLOG_KEY_MAX     64
+
+/* A command whose execution took longer than the configured threshold */
+struct slowlog_entry {
+    /* Progressive id, never reused even after a reset */
+    uint64_t id;
+    /* Unix timestamp of the execution */
+    uint64_t timestamp;
+    /* Execution time in nanoseconds */
+    uint64_t duration;
+    /* Number of trie nodes visited by the command */
+    uint64_t visited;
+    unsigned char opcode;
+    bool prefix;
+    /* Original length of the key, 0 for commands without one */
+    unsigned short keylen;
+    /* Connection id of the client which sent the command */
+    uint64_t client;
+    char key[SLOWLOG_KEY_MAX];
+};
+
+/*
+ * Fixed size ring buffer of slow commands, once full the oldest entries are
+ * overwritten. Entries are preallocated, recording one doesn't allocate. It's
+ * not thread-safe, callers are expected to guard it.
+ */
+struct slowlog {
+    size_t size;
+    size_t len;
+    size_t head;
+    uint64_t next_id;
+    struct slowlog_entry *entries;
+};
+
+
+void slowlog_init(struct slowlog *, size_t);
+
+/*
+ * Record a new entry, overwriting the oldest one if the log is full. The id
+ * of the entry is assigned by the log, the key is copied and truncated to
+ * SLOWLOG_KEY_MAX bytes.
+ */
+void slowlog_push(struct slowlog *, struct slowlog_entry *,
+                  const char *, size_t);
+
+/* Return the i-th entry, starting from the oldest one */
+const struct slowlog_entry *slowlog_get(const struct slowlog *, size_t);
+
+size_t slowlog_len(const struct slowlog *);
+
+/* Drop all the entries, ids keep growing */
+void slowlog_reset(struct slowlog *);
+
+void slowlog_destroy(struct slowlog *);
+
+
+#endif
@@ -32,6 +32,9 @@
 #include "util.h"
 
 
+_Thread_local size_t trie_visited = 0;
+
+
 static void children_destroy(struct bst_node *, size_t *, trie_destructor *);
 
 /*
@@ -62,6 +65,7 @@ struct trie_node *trie_node_find(const struct trie_node *node,
             return NULL;
 
         retnode = child->data;
+        trie_visited++;
     }
 
     return retnode;
@@ -85,6 +89,8 @@ static int trie_node_count(const struct trie_node *node) {
     if (!node)
         return 0;
 
+    trie_visited++;
+
     if (node->data)
         return 1 + trie_children_count(node->children);
     else
@@ -171,6 +177,7 @@ static struct node_data *trie_node_insert(struct trie_node *root,
             cur_node = tmp->data;
         }
         cursor = cur_node;
+        trie_visited++;
     }
 
     /*
@@ -234,6 +241,7 @@ bool trie_delete(Trie *trie, const char *key) {
                 return false;
 
             retnode = child->data;
+            trie_visited++;
 
         }
         if (trie->destructor) {
@@ -255,6 +263,33 @@ bool trie_delete(Trie *trie, const char *key) {
 }
 
 
+static bool trie_node_prune(struct trie_node *node, const char *key,
+                            trie_destructor *destructor) {
+
+    struct bst_node *child = *key ? bst_search(node->children, *key) : NULL;
+
+    if (child && trie_node_prune(child->data, key + 1, destructor)) {
+        struct trie_node *cursor = child->data;
+        node->children = bst_delete(node->children, *key);
+        if (destructor)
+            destructor(cursor, false);
+        else
+            tfree(cursor);
+    }
+
+    trie_visited++;
+
+    return !node->data && !node->children;
+}
+
+
+void trie_prune(Trie *trie, const char *key) {
+    assert(trie && key);
+    // The root stays whatever happens
+    trie_node_prune(trie->root, key, trie->destructor);
+}
+
+
 bool trie_find(const Trie *trie, const char *key, void **ret) {
     assert(trie && key);
     return trie_node_search(trie->root, key, ret);
@@ -313,11 +348,11 @@ int trie_prefix_count(const Trie *trie, const char *prefix) {
 
 
 static void trie_node_prefix_find(const struct trie_node *,
-                                  char *, int , Vector *);
+                                  char **, int , Vector *);
 
 
 static void children_prefix_find(const struct bst_node *node,
-                                 char str[], int level, Vector *keys) {
+                                 char **str, int level, Vector *keys) {
     trie_node_prefix_find(node->data, str, level, keys);
     if (node->left)
         children_prefix_find(node->left, str, level, keys);
@@ -327,28 +362,31 @@ static void children_prefix_find(const struct bst_node *node,
 
 
 static void trie_node_prefix_find(const struct trie_node *node,
-                                  char str[], int level, Vector *keys) {
+                                  char **str, int level, Vector *keys) {
 
     if (!node)
         return;
 
+    trie_visited++;
+
     /*
      * If NON NULL child is found add parent key to str and call the function
      * recursively for child node, caring for the size of the current string,
-     * if exceed bounds, double the size of the string host
+     * if exceed bounds, double the size of the string host; it's shared by
+     * the whole recursion, so the new one is handed back through the pointer
      */
-    if (level == malloc_size(str))
-        str = trealloc(str, level * 2);
-    str[level] = node->chr;
+    if ((size_t) level + 2 > malloc_size(*str))
+        *str = trealloc(*str, malloc_size(*str) * 2);
+    (*str)[level] = node->chr;
 
     /*
      * If node is leaf node, it indicates end of string, so a null charcter is
      * added and string is added to the keys list
      */
     if (node->data) {
-        str[level + 1] = '\0';
+        (*str)[level + 1] = '\0';
         struct kv_obj *kv = tmalloc(sizeof(*kv));
-        kv->key = tstrdup(str);
+        kv->key = tstrdup(*str);
         kv->data = node->data;
         vector_append(keys, kv);
     }
@@ -372,8 +410,8 @@ Vector *trie_prefix_find(const Trie *trie, const char *prefix) {
     Vector *keys = vector_new(NULL);
 
     // Check all possible sub-paths and add the resulting key to the result
-    char *str = tmalloc(32);
     size_t plen = strlen(prefix);
+    char *str = tmalloc(plen < 32 ? 32 : plen * 2);
     memcpy(str, prefix, plen);
     str[plen] = '\0';
 
@@ -381,7 +419,7 @@ Vector *trie_prefix_find(const Trie *trie, const char *prefix) {
      * Recursive function call, starting from index - 1, starting saving nodes
      * from the last character explored
      */
-    trie_node_prefix_find(node, str, plen - 1, keys);
+    trie_node_prefix_find(node, &str, plen - 1, keys);
 
     tfree(str);
 
@@ -409,6 +447,8 @@ void trie_node_destroy(struct trie_node *node,
     if (!node)
         return;
 
+    trie_visited++;
+
     // Recursive call to all children of the node
     children_destroy(node->children, size, destructor);
     node->children = NULL;
@@ -60,6 +60,13 @@ struct Trie {
     size_t size;
 };
 
+/*
+ * Number of trie nodes visited by the calling thread, it only grows, the
+ * difference between two reads gives the cost of the operations done in
+ * between, e.g. to account it to the slow log
+ */
+extern _Thread_local size_t trie_visited;
+
 /* Key val abstraction, useful for range queries like GET with prefix */
 struct kv_obj {
     const char *key;
@@ -107,6 +114,12 @@ void trie_node_destroy(struct trie_node *, size_t *, trie_destructor *);
 
 void trie_destroy(Trie *);
 
+/*
+ * Release the nodes along the path of a key left without data and without
+ * children, deepest first, so that a trie shrinks back as its keys go away
+ */
+void trie_prune(Trie *, const char *);
+
 /*
  * Remove all keys matching a given prefix in a less than linear time
  * complexity
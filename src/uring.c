@@ -0,0 +1,371 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2018, 2019 Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include "util.h"
+#include "uring.h"
+
+/*
+ * Multishot receive, the most recent feature we rely on, landed on Linux 6.0
+ * and it can't be probed through IORING_REGISTER_PROBE being just a flag
+ */
+#define URING_MIN_KERNEL_MAJOR 6
+
+
+static inline int io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+
+static inline int io_uring_enter(int fd, unsigned to_submit,
+                                 unsigned min_complete, unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit,
+                         min_complete, flags, NULL, 0);
+}
+
+
+static inline int io_uring_register(int fd, unsigned opcode,
+                                    void *arg, unsigned nr_args) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+
+bool uring_supported(void) {
+
+    struct utsname uts;
+
+    if (uname(&uts) < 0 || atoi(uts.release) < URING_MIN_KERNEL_MAJOR)
+        return false;
+
+    struct uring ring;
+    struct uring_buf_ring br;
+
+    /* Could be disabled by sysctl or seccomp filtered out */
+    if (uring_init(&ring, 8) < 0)
+        return false;
+
+    bool ok = uring_buf_ring_init(&ring, &br, 0, 8, 64) == 0;
+
+    if (ok)
+        uring_buf_ring_destroy(&ring, &br);
+
+    uring_destroy(&ring);
+
+    return ok;
+}
+
+
+int uring_init(struct uring *ring, unsigned entries) {
+
+    struct io_uring_params p;
+    memset(&p, 0x00, sizeof(p));
+    memset(ring, 0x00, sizeof(*ring));
+
+    int fd = io_uring_setup(entries, &p);
+    if (fd < 0)
+        return -1;
+
+    ring->fd = fd;
+    ring->features = p.features;
+
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size =
+        p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    /* Both rings can be mapped with a single mmap call on recent kernels */
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+        goto err;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED)
+            goto errsq;
+    }
+
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto errcq;
+
+    unsigned char *sq = ring->sq_ring;
+    unsigned char *cq = ring->cq_ring;
+
+    ring->sq_entries = p.sq_entries;
+    ring->sq_head = (unsigned *) (sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    ring->sq_mask = *(unsigned *) (sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + p.sq_off.array);
+
+    ring->cq_head = (unsigned *) (cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    ring->cq_mask = *(unsigned *) (cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    /* Identity mapping, SQE index i always lives at slot i of the array */
+    for (unsigned i = 0; i < ring->sq_entries; ++i)
+        ring->sq_array[i] = i;
+
+    ring->sqe_head = ring->sqe_tail = *ring->sq_tail;
+
+    return 0;
+
+errcq:
+
+    if (ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+
+errsq:
+
+    munmap(ring->sq_ring, ring->sq_ring_size);
+
+err:
+
+    close(fd);
+    return -1;
+}
+
+
+void uring_destroy(struct uring *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+
+/* Return the number of free slots on the submission queue */
+static inline unsigned uring_sq_space(const struct uring *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    return ring->sq_entries - (ring->sqe_tail - head);
+}
+
+
+struct io_uring_sqe *uring_get_sqe(struct uring *ring) {
+
+    if (uring_sq_space(ring) == 0)
+        return NULL;
+
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+    ring->sqe_tail++;
+
+    memset(sqe, 0x00, sizeof(*sqe));
+
+    return sqe;
+}
+
+
+bool uring_opcode_supported(struct uring *ring, unsigned char op) {
+
+    size_t size = sizeof(struct io_uring_probe)
+        + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = tcalloc(1, size);
+
+    bool ok = io_uring_register(ring->fd, IORING_REGISTER_PROBE,
+                                probe, 256) == 0
+        && op <= probe->last_op
+        && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+
+    tfree(probe);
+
+    return ok;
+}
+
+
+int uring_submit(struct uring *ring, unsigned wait_nr) {
+
+    unsigned submitted = ring->sqe_tail - ring->sqe_head;
+    unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    int rc;
+
+    /* Publish the new SQEs to the kernel */
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    ring->sqe_head = ring->sqe_tail;
+
+    if (submitted == 0 && wait_nr == 0)
+        return 0;
+
+    /*
+     * Retrying with the same count is safe, the kernel never consumes more
+     * SQEs than those effectively published on the ring
+     */
+    do {
+        rc = io_uring_enter(ring->fd, submitted, wait_nr, flags);
+    } while (rc < 0 && errno == EINTR);
+
+    return rc;
+}
+
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring) {
+
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    if (head == tail)
+        return NULL;
+
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+
+void uring_cqe_seen(struct uring *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+
+int uring_buf_ring_init(struct uring *ring, struct uring_buf_ring *br,
+                        unsigned short bgid, unsigned entries,
+                        unsigned bufsize) {
+
+    size_t ringsize = entries * sizeof(struct io_uring_buf);
+
+    /* The ring must be page aligned */
+    br->ring = mmap(NULL, ringsize, PROT_READ | PROT_WRITE,
+                    MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (br->ring == MAP_FAILED)
+        return -1;
+
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (unsigned long) br->ring,
+        .ring_entries = entries,
+        .bgid = bgid
+    };
+
+    if (io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        munmap(br->ring, ringsize);
+        return -1;
+    }
+
+    br->bufs = tmalloc(entries * bufsize);
+    if (!br->bufs)
+        oom("allocating io_uring provided buffers");
+
+    br->entries = entries;
+    br->bufsize = bufsize;
+    br->bgid = bgid;
+    br->tail = 0;
+
+    for (unsigned i = 0; i < entries; ++i)
+        uring_buf_recycle(br, i);
+
+    return 0;
+}
+
+
+void uring_buf_ring_destroy(struct uring *ring, struct uring_buf_ring *br) {
+    struct io_uring_buf_reg reg = { .bgid = br->bgid };
+    io_uring_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    munmap(br->ring, br->entries * sizeof(struct io_uring_buf));
+    tfree(br->bufs);
+}
+
+
+unsigned char *uring_buf(const struct uring_buf_ring *br, unsigned short bid) {
+    return br->bufs + (size_t) bid * br->bufsize;
+}
+
+
+void uring_buf_recycle(struct uring_buf_ring *br, unsigned short bid) {
+
+    struct io_uring_buf *buf = &br->ring->bufs[br->tail & (br->entries - 1)];
+
+    buf->addr = (unsigned long) uring_buf(br, bid);
+    buf->len = br->bufsize;
+    buf->bid = bid;
+
+    br->tail++;
+
+    __atomic_store_n(&br->ring->tail, br->tail, __ATOMIC_RELEASE);
+}
+
+
+void uring_prep_multishot_accept(struct io_uring_sqe *sqe, int fd) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio |= IORING_ACCEPT_MULTISHOT;
+}
+
+
+void uring_prep_multishot_recv(struct io_uring_sqe *sqe,
+                               int fd, unsigned short bgid) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio |= IORING_RECV_MULTISHOT;
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = bgid;
+}
+
+
+void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd,
+                        const struct msghdr *msg, int flags) {
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) msg;
+    sqe->len = 1;
+    sqe->msg_flags = flags;
+}
+
+
+void uring_prep_sendmsg_zc(struct io_uring_sqe *sqe, int fd,
+                           const struct msghdr *msg, int flags) {
+    uring_prep_sendmsg(sqe, fd, msg, flags);
+    sqe->opcode = IORING_OP_SENDMSG_ZC;
+}
+
+
+void uring_prep_poll_add(struct io_uring_sqe *sqe, int fd, unsigned events) {
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+}
+
+
+void uring_prep_cancel(struct io_uring_sqe *sqe, unsigned long user_data) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = user_data;
+}
@@ -0,0 +1,155 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2018, 2019 Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+/*
+ * Minimal io_uring wrapper, built directly on top of the raw syscalls, as
+ * we only need a handful of operations:
+ *
+ * - multishot ACCEPT on the listening socket
+ * - multishot RECV selecting buffers from a provided buffer ring
+ * - SENDMSG, optionally zero-copy
+ * - POLL, used to wait on eventfd descriptors
+ * - ASYNC_CANCEL, to stop a multishot RECV
+ *
+ * Nothing is thread-safe, every IO thread is supposed to own its ring.
+ */
+struct uring {
+    int fd;
+    unsigned features;
+    /* Submission queue */
+    unsigned sq_entries;
+    unsigned sq_mask;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    /* Local tail, SQEs prepared but not yet submitted */
+    unsigned sqe_tail;
+    unsigned sqe_head;
+    struct io_uring_sqe *sqes;
+    /* Completion queue */
+    unsigned cq_mask;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    struct io_uring_cqe *cqes;
+    /* Mapped memory regions, to be released on destroy */
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+/*
+ * Provided buffer ring, a group of equally sized buffers the kernel picks
+ * from on every multishot receive, must be recycled back once consumed
+ */
+struct uring_buf_ring {
+    struct io_uring_buf_ring *ring;
+    unsigned char *bufs;
+    unsigned entries;
+    unsigned bufsize;
+    unsigned short bgid;
+    unsigned short tail;
+};
+
+/*
+ * Probe the running kernel for all the features required by the server,
+ * return false if io_uring can't be used and we should stick to epoll
+ */
+bool uring_supported(void);
+
+int uring_init(struct uring *, unsigned);
+
+void uring_destroy(struct uring *);
+
+/* Return a zero'ed SQE ready to be prepared or NULL if the SQ is full */
+struct io_uring_sqe *uring_get_sqe(struct uring *);
+
+/* Check if the running kernel supports an opcode */
+bool uring_opcode_supported(struct uring *, unsigned char);
+
+/*
+ * Submit all prepared SQEs and wait for at least `n` completions, 0 means
+ * don't wait at all
+ */
+int uring_submit(struct uring *, unsigned);
+
+/* Return the next CQE if any, without waiting, NULL otherwise */
+struct io_uring_cqe *uring_peek_cqe(struct uring *);
+
+/* Mark the last CQE returned by uring_peek_cqe as consumed */
+void uring_cqe_seen(struct uring *);
+
+/*
+ * Register a provided buffer ring of `entries` buffers of `bufsize` bytes
+ * each, entries must be a power of 2
+ */
+int uring_buf_ring_init(struct uring *, struct uring_buf_ring *,
+                        unsigned short, unsigned, unsigned);
+
+void uring_buf_ring_destroy(struct uring *, struct uring_buf_ring *);
+
+/* Return the buffer identified by a buffer ID */
+unsigned char *uring_buf(const struct uring_buf_ring *, unsigned short);
+
+/* Give a consumed buffer back to the kernel */
+void uring_buf_recycle(struct uring_buf_ring *, unsigned short);
+
+/* SQE preparation helpers */
+
+void uring_prep_multishot_accept(struct io_uring_sqe *, int);
+
+void uring_prep_multishot_recv(struct io_uring_sqe *, int, unsigned short);
+
+/*
+ * Gathering SENDMSG, used in place of linked SENDs: the server keeps at most
+ * one in flight per connection, see the io_uring loop in server.c
+ */
+void uring_prep_sendmsg(struct io_uring_sqe *, int, const struct msghdr *, int);
+
+/*
+ * Zero-copy SENDMSG, besides the usual completion a second one flagged with
+ * IORING_CQE_F_NOTIF is posted once the kernel doesn't reference the buffers
+ * anymore
+ */
+void uring_prep_sendmsg_zc(struct io_uring_sqe *, int,
+                           const struct msghdr *, int);
+
+void uring_prep_poll_add(struct io_uring_sqe *, int, unsigned);
+
+/* Cancel the operation submitted with a given user_data */
+void uring_prep_cancel(struct io_uring_sqe *, unsigned long);
+
+#endif
@@ -32,13 +32,17 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdarg.h>
-#include <uuid/uuid.h>
 #include "util.h"
 #include "config.h"
 
 
 static size_t memory = 0;
 
+#ifdef TRACK_ALLOCS
+/* Number of calls to the allocator, to spot allocations on the hot paths */
+static size_t allocations = 0;
+#endif
+
 static FILE *fh = NULL;
 
 
@@ -117,21 +121,35 @@ int parse_int(const char *string) {
 }
 
 
-char *update_integer_string(char *str, int num) {
+/*
+ * Parse a whole string as a signed 64 bit integer, an optional minus sign
+ * followed by digits only. Return false if the string is not an integer or
+ * if it doesn't fit 64 bits.
+ */
+bool parse_int64(const char *string, int64_t *n) {
+
+    bool negative = *string == '-';
+    uint64_t limit = negative ? (uint64_t) INT64_MAX + 1 : INT64_MAX;
+    uint64_t value = 0;
+
+    if (negative)
+        string++;
 
-    int n = parse_int(str);
-    n += num;
-    /*
-     * Check for realloc if the new value is "larger" then
-     * previous
-     */
-    char tmp[number_len(n) + 1];  // max size in bytes
-    sprintf(tmp, "%d", n);  // XXX Unsafe
-    size_t len = strlen(tmp);
-    str = trealloc(str, len + 1);
-    sprintf(str, "%s", tmp);
+    if (!*string)
+        return false;
+
+    for (; *string; ++string) {
+        if (!isdigit(*string))
+            return false;
+        unsigned digit = *string - '0';
+        if (value > (limit - digit) / 10)
+            return false;
+        value = value * 10 + digit;
+    }
 
-    return str;
+    *n = negative ? (int64_t) (0 - value) : (int64_t) value;
+
+    return true;
 }
 
 /*
@@ -148,14 +166,10 @@ int number_len(size_t number) {
 }
 
 
-int generate_uuid(char *uuid_placeholder) {
-
-    /* Generate random uuid */
-    uuid_t binuuid;
-    uuid_generate_random(binuuid);
-    uuid_unparse(binuuid, uuid_placeholder);
-
-    return 0;
+uint64_t nanotime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
 /* Out of memory print, for now it just output on stderr and exit */
@@ -181,6 +195,10 @@ void *tmalloc(size_t size) {
     if (!ptr)
         return NULL;
 
+#ifdef TRACK_ALLOCS
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+#endif
+
     memory += size + sizeof(size_t);
 
     *((size_t *) ptr) = size;
@@ -201,6 +219,10 @@ void *tcalloc(size_t len, size_t size) {
     if (!ptr)
         return NULL;
 
+#ifdef TRACK_ALLOCS
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+#endif
+
     *((size_t *) ptr) = size;
 
     memory += len * (size + sizeof(size_t));
@@ -231,6 +253,10 @@ void *trealloc(void *ptr, size_t size) {
     if (!newptr)
         return NULL;
 
+#ifdef TRACK_ALLOCS
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+#endif
+
     *((size_t *) newptr) = size;
 
     memory += (-curr_size) + size + sizeof(size_t);
@@ -307,3 +333,10 @@ char *tstrdup(const char *s) {
 size_t memory_used(void) {
     return memory;
 }
+
+
+#ifdef TRACK_ALLOCS
+size_t alloc_count(void) {
+    return __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+}
+#endif
@@ -29,16 +29,19 @@
 #define UTIL_H
 
 #include <stdio.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
 
-#define UUID_LEN     37
-
 #define MAX_LOG_SIZE 119
 
 #define RANDBETWEEN(A,B) A + rand()/(RAND_MAX/(B - A))
 
+/* Get the structure embedding a given member from a pointer to the latter */
+#define container_of(ptr, type, member) \
+    ((type *) ((char *) (ptr) - offsetof(type, member)))
+
 
 enum { DEBUG, INFORMATION, WARNING, ERROR };
 
@@ -46,8 +49,11 @@ enum { DEBUG, INFORMATION, WARNING, ERROR };
 void oom(const char *);
 bool is_integer(const char *);
 int parse_int(const char *);
+bool parse_int64(const char *, int64_t *);
 int number_len(size_t);
-int generate_uuid(char *);
+
+/* Monotonic clock in nanoseconds, to measure elapsed time */
+uint64_t nanotime(void);
 
 /* Logging */
 void t_log_init(const char *);
@@ -61,10 +67,14 @@ void *trealloc(void *, size_t);
 size_t malloc_size(void *);
 void tfree(void *);
 char *tstrdup(const char *);
-char *update_integer_string(char *, int);
 
 size_t memory_used(void);
 
+#ifdef TRACK_ALLOCS
+/* Total number of allocations, only tracked by debug builds */
+size_t alloc_count(void);
+#endif
+
 
 #define log(...) t_log( __VA_ARGS__ )
 #define tdebug(...) log(DEBUG, __VA_ARGS__)
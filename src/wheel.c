@@ -0,0 +1,107 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stddef.h>
+#include "wheel.h"
+
+
+void wheel_init(struct wheel *wheel, uint64_t now) {
+    wheel->now = now;
+    for (int i = 0; i < WHEEL_SLOTS; ++i)
+        wheel->slots[i].prev = wheel->slots[i].next = &wheel->slots[i];
+}
+
+
+void wheel_node_init(struct wheel_node *node) {
+    node->prev = node->next = NULL;
+    node->expire = 0;
+}
+
+
+void wheel_add(struct wheel *wheel, struct wheel_node *node, uint64_t expire) {
+
+    if (expire <= wheel->now)
+        expire = wheel->now + 1;
+
+    struct wheel_node *slot = &wheel->slots[expire % WHEEL_SLOTS];
+
+    node->expire = expire;
+    node->prev = slot->prev;
+    node->next = slot;
+    slot->prev->next = node;
+    slot->prev = node;
+}
+
+
+void wheel_del(struct wheel_node *node) {
+
+    if (!node->next)
+        return;
+
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = node->next = NULL;
+}
+
+
+bool wheel_pending(const struct wheel_node *node) {
+    return node->next != NULL;
+}
+
+
+void wheel_advance(struct wheel *wheel, uint64_t now,
+                   wheel_callback *callback, void *arg) {
+
+    /* Past a whole turn every slot has come up already */
+    uint64_t ticks = now > wheel->now ? now - wheel->now : 0;
+    if (ticks > WHEEL_SLOTS)
+        ticks = WHEEL_SLOTS;
+
+    uint64_t tick = now - ticks;
+    wheel->now = now;
+
+    while (tick++ < now) {
+
+        struct wheel_node *slot = &wheel->slots[tick % WHEEL_SLOTS];
+
+        /*
+         * Detach the whole slot first, timers re-added by the callback land
+         * on a fresh list and are not visited again in this pass
+         */
+        struct wheel_node *node = slot->next;
+        slot->prev->next = NULL;
+        slot->prev = slot->next = slot;
+
+        while (node && node != slot) {
+            struct wheel_node *next = node->next;
+            node->prev = node->next = NULL;
+            callback(node, now, arg);
+            node = next;
+        }
+    }
+}
@@ -0,0 +1,81 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef WHEEL_H
+#define WHEEL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Number of slots of the wheel, each one covering a tick */
+#define WHEEL_SLOTS 64
+
+/*
+ * Hashed timing wheel, timers are linked into the slot of their expiration
+ * tick modulo WHEEL_SLOTS, so adding, removing and advancing by a tick are
+ * all constant time operations. Timers farther than a whole turn just come
+ * up earlier than their expiration, it's up to the callback to check and
+ * re-add them. Nodes are meant to be embedded in the timed structures, it's
+ * not thread-safe.
+ */
+struct wheel_node {
+    struct wheel_node *prev;
+    struct wheel_node *next;
+    uint64_t expire;
+};
+
+struct wheel {
+    uint64_t now;
+    /* Sentinels of the circular list of each slot */
+    struct wheel_node slots[WHEEL_SLOTS];
+};
+
+/* Called on each timer whose slot comes up, already removed from the wheel */
+typedef void wheel_callback(struct wheel_node *, uint64_t, void *);
+
+
+void wheel_init(struct wheel *, uint64_t);
+
+void wheel_node_init(struct wheel_node *);
+
+/* Add a timer expiring at a given tick, past ticks fire on the next one */
+void wheel_add(struct wheel *, struct wheel_node *, uint64_t);
+
+/* Remove a timer, does nothing if it's not on the wheel */
+void wheel_del(struct wheel_node *);
+
+bool wheel_pending(const struct wheel_node *);
+
+/*
+ * Move the wheel forward to a given tick, calling the callback on every timer
+ * of the slots passed by, with the current tick and an opaque argument
+ */
+void wheel_advance(struct wheel *, uint64_t, wheel_callback *, void *);
+
+
+#endif
@@ -0,0 +1,464 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../../src/util.h"
+#include "../../src/trie.h"
+#include "../../src/vector.h"
+
+/*
+ * Trie microbenchmarks, each operation is run over a number of keys of a few
+ * datasets with different shapes:
+ *
+ * - uuid: random UUIDs, long keys sharing almost no prefix
+ * - url: URL paths, long keys sharing long prefixes
+ * - words: dictionary words, read from a file or generated out of syllables,
+ *   short keys with a natural language distribution of their prefixes
+ * - seq: sequential numbers, short keys densely packed
+ *
+ * Results are printed in JSON: nanoseconds, allocations per operation and
+ * bytes per key stored. Allocations are counted by the allocator, the target
+ * is built with TRACK_ALLOCS.
+ */
+
+#define DEFAULT_KEYS        100000
+#define DEFAULT_PREFIXES    1000
+#define DEFAULT_WORDS_PATH  "/usr/share/dict/words"
+
+struct dataset {
+    const char *name;
+    char **keys;
+    size_t nkeys;
+    /* Prefixes of existing keys, for the prefix operations */
+    char **prefixes;
+    size_t nprefixes;
+};
+
+struct result {
+    uint64_t ns;
+    size_t allocs;
+    size_t ops;
+};
+
+static uint64_t rng = 0x9e3779b97f4a7c15ULL;
+
+
+static inline uint64_t rnd(void) {
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return rng * 2685821657736338717ULL;
+}
+
+
+static void shuffle(char **keys, size_t n) {
+    for (size_t i = n - 1; i > 0; --i) {
+        size_t j = rnd() % (i + 1);
+        char *tmp = keys[i];
+        keys[i] = keys[j];
+        keys[j] = tmp;
+    }
+}
+
+
+static char *gen_uuid(size_t i) {
+    (void) i;
+    char *key = tmalloc(37);
+    uint64_t hi = rnd(), lo = rnd();
+    snprintf(key, 37, "%08x-%04x-4%03x-%04x-%012llx",
+             (unsigned) (hi >> 32), (unsigned) (hi >> 16) & 0xffff,
+             (unsigned) hi & 0xfff, (unsigned) (0x8000 | (lo >> 48 & 0x3fff)),
+             (unsigned long long) lo & 0xffffffffffffULL);
+    return key;
+}
+
+
+static char *gen_url(size_t i) {
+
+    static const char *resources[] = {
+        "users", "orders", "products", "carts", "invoices", "reviews",
+        "sessions", "accounts", "payments", "shipments"
+    };
+    static const char *actions[] = {
+        "details", "history", "items", "settings", "status", "events"
+    };
+
+    char *key = tmalloc(128);
+    size_t nres = sizeof(resources) / sizeof(*resources);
+    size_t nact = sizeof(actions) / sizeof(*actions);
+
+    snprintf(key, 128, "/api/v%u/%s/%llu/%s/%llu/%s",
+             (unsigned) (rnd() % 2 + 1), resources[rnd() % nres],
+             (unsigned long long) (rnd() % 10000), resources[rnd() % nres],
+             (unsigned long long) i, actions[rnd() % nact]);
+
+    return key;
+}
+
+/* Pronounceable words, two to five syllables long */
+static char *gen_word(size_t i) {
+
+    static const char *syllables[] = {
+        "an", "be", "ca", "de", "el", "fo", "ga", "hi", "in", "jo", "ka",
+        "la", "me", "no", "or", "pa", "qui", "ra", "se", "ti", "un", "ve",
+        "wa", "xe", "yo", "za", "ter", "men", "tion", "ing", "est", "ous"
+    };
+
+    char *key = tmalloc(32);
+    size_t nsyl = sizeof(syllables) / sizeof(*syllables), len = 0;
+    unsigned n = 2 + rnd() % 4;
+
+    (void) i;
+
+    key[0] = '\0';
+    for (unsigned s = 0; s < n; ++s)
+        len += snprintf(key + len, 32 - len, "%s", syllables[rnd() % nsyl]);
+
+    return key;
+}
+
+
+static char *gen_seq(size_t i) {
+    char *key = tmalloc(21);
+    snprintf(key, 21, "%zu", i);
+    return key;
+}
+
+/* Read up to n words from a dictionary file, one per line */
+static size_t read_words(const char *path, char **keys, size_t n) {
+
+    FILE *fp = fopen(path, "r");
+
+    if (!fp)
+        return 0;
+
+    char line[256];
+    size_t count = 0;
+
+    while (count < n && fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0])
+            keys[count++] = tstrdup(line);
+    }
+
+    fclose(fp);
+
+    return count;
+}
+
+
+static void dataset_init(struct dataset *d, const char *name,
+                         char *(*gen)(size_t), size_t n, size_t nprefixes,
+                         const char *words) {
+
+    d->name = name;
+    d->keys = tcalloc(n, sizeof(char *));
+    d->nkeys = words ? read_words(words, d->keys, n) : 0;
+
+    /*
+     * Keys are unique, the way a dictionary has them, or inserting them
+     * again would just replace their values
+     */
+    Trie *seen = trie_new(NULL);
+    void *val = NULL;
+
+    for (size_t i = 0; i < d->nkeys; ++i)
+        trie_insert(seen, d->keys[i], tmalloc(1));
+
+    for (size_t i = d->nkeys; i < n; ++i) {
+        char *key = gen(i);
+        if (trie_find(seen, key, &val)) {
+            tfree(key);
+            --i;
+            continue;
+        }
+        trie_insert(seen, key, tmalloc(1));
+        d->keys[i] = key;
+    }
+
+    d->nkeys = n;
+    trie_destroy(seen);
+
+    /*
+     * Prefixes are taken from random keys, cut at half of their length, the
+     * same prefix is never picked twice, for trie_prefix_delete to have
+     * something to delete each time
+     */
+    d->prefixes = tcalloc(nprefixes, sizeof(char *));
+    d->nprefixes = 0;
+
+    for (size_t tries = 0; d->nprefixes < nprefixes && tries < nprefixes * 4;
+         ++tries) {
+        const char *key = d->keys[rnd() % n];
+        size_t len = strlen(key) / 2 + 1;
+        char *prefix = tmalloc(len + 1);
+        memcpy(prefix, key, len);
+        prefix[len] = '\0';
+        bool dup = false;
+        for (size_t j = 0; j < d->nprefixes && !dup; ++j)
+            dup = strncmp(d->prefixes[j], prefix, len + 1) == 0;
+        if (dup)
+            tfree(prefix);
+        else
+            d->prefixes[d->nprefixes++] = prefix;
+    }
+}
+
+
+static void dataset_destroy(struct dataset *d) {
+    for (size_t i = 0; i < d->nkeys; ++i)
+        tfree(d->keys[i]);
+    for (size_t i = 0; i < d->nprefixes; ++i)
+        tfree(d->prefixes[i]);
+    tfree(d->keys);
+    tfree(d->prefixes);
+}
+
+/* Values are tiny and allocated beforehand, out of the measures */
+static void **values_new(size_t n) {
+    void **values = tcalloc(n, sizeof(void *));
+    for (size_t i = 0; i < n; ++i)
+        values[i] = tmalloc(sizeof(uint64_t));
+    return values;
+}
+
+
+static Trie *trie_load(const struct dataset *d, struct result *r,
+                       size_t *bytes) {
+
+    void **values = values_new(d->nkeys);
+    Trie *trie = trie_new(NULL);
+
+    size_t mem = memory_used();
+    size_t allocs = alloc_count();
+    uint64_t start = nanotime();
+
+    for (size_t i = 0; i < d->nkeys; ++i)
+        trie_insert(trie, d->keys[i], values[i]);
+
+    if (r) {
+        r->ns = nanotime() - start;
+        r->allocs = alloc_count() - allocs;
+        r->ops = d->nkeys;
+    }
+
+    if (bytes)
+        *bytes = memory_used() - mem;
+
+    // Values are owned by the trie now
+    tfree(values);
+
+    return trie;
+}
+
+
+static void bench_find(const struct dataset *d, Trie *trie,
+                       struct result *r) {
+
+    void *val = NULL;
+    size_t allocs = alloc_count();
+    uint64_t start = nanotime();
+
+    for (size_t i = 0; i < d->nkeys; ++i)
+        trie_find(trie, d->keys[i], &val);
+
+    r->ns = nanotime() - start;
+    r->allocs = alloc_count() - allocs;
+    r->ops = d->nkeys;
+}
+
+
+static void bench_delete(const struct dataset *d, Trie *trie,
+                         struct result *r) {
+
+    size_t allocs = alloc_count();
+    uint64_t start = nanotime();
+
+    for (size_t i = 0; i < d->nkeys; ++i)
+        trie_delete(trie, d->keys[i]);
+
+    r->ns = nanotime() - start;
+    r->allocs = alloc_count() - allocs;
+    r->ops = d->nkeys;
+}
+
+
+static void bench_prefix_count(const struct dataset *d, Trie *trie,
+                               struct result *r) {
+
+    size_t allocs = alloc_count();
+    uint64_t start = nanotime();
+
+    for (size_t i = 0; i < d->nprefixes; ++i)
+        trie_prefix_count(trie, d->prefixes[i]);
+
+    r->ns = nanotime() - start;
+    r->allocs = alloc_count() - allocs;
+    r->ops = d->nprefixes;
+}
+
+/* The results are released out of the measure, by the caller of the search */
+static void bench_prefix_find(const struct dataset *d, Trie *trie,
+                              struct result *r) {
+
+    r->ns = 0;
+    r->allocs = 0;
+    r->ops = d->nprefixes;
+
+    for (size_t i = 0; i < d->nprefixes; ++i) {
+
+        size_t allocs = alloc_count();
+        uint64_t start = nanotime();
+
+        Vector *v = trie_prefix_find(trie, d->prefixes[i]);
+
+        r->ns += nanotime() - start;
+        r->allocs += alloc_count() - allocs;
+
+        if (!v)
+            continue;
+
+        for (size_t j = 0; j < vector_size(v); ++j) {
+            struct kv_obj *kv = vector_get(v, j);
+            tfree((char *) kv->key);
+        }
+        vector_destroy(v);
+    }
+}
+
+
+static void bench_prefix_delete(const struct dataset *d, Trie *trie,
+                                struct result *r) {
+
+    size_t allocs = alloc_count();
+    uint64_t start = nanotime();
+
+    for (size_t i = 0; i < d->nprefixes; ++i)
+        trie_prefix_delete(trie, d->prefixes[i]);
+
+    r->ns = nanotime() - start;
+    r->allocs = alloc_count() - allocs;
+    r->ops = d->nprefixes;
+}
+
+
+static void print_result(const char *op, const struct result *r, bool last) {
+    printf("        \"%s\": { \"ops\": %zu, \"ns_per_op\": %.1f, "
+           "\"allocs_per_op\": %.2f }%s\n", op, r->ops,
+           r->ops ? (double) r->ns / r->ops : 0,
+           r->ops ? (double) r->allocs / r->ops : 0, last ? "" : ",");
+}
+
+
+static void bench_dataset(const struct dataset *d, bool last) {
+
+    struct result insert, find, delete, pcount, pfind, pdelete;
+    size_t bytes = 0;
+
+    Trie *trie = trie_load(d, &insert, &bytes);
+
+    bench_find(d, trie, &find);
+    bench_prefix_count(d, trie, &pcount);
+    bench_prefix_find(d, trie, &pfind);
+    bench_delete(d, trie, &delete);
+    trie_destroy(trie);
+
+    // A fresh trie for the prefix deletions, the other one is left empty
+    trie = trie_load(d, NULL, NULL);
+    bench_prefix_delete(d, trie, &pdelete);
+    trie_destroy(trie);
+
+    printf("    {\n");
+    printf("      \"dataset\": \"%s\",\n", d->name);
+    printf("      \"keys\": %zu,\n", d->nkeys);
+    printf("      \"prefixes\": %zu,\n", d->nprefixes);
+    printf("      \"bytes_per_key\": %.1f,\n", (double) bytes / d->nkeys);
+    printf("      \"ops\": {\n");
+    print_result("trie_insert", &insert, false);
+    print_result("trie_find", &find, false);
+    print_result("trie_delete", &delete, false);
+    print_result("trie_prefix_find", &pfind, false);
+    print_result("trie_prefix_count", &pcount, false);
+    print_result("trie_prefix_delete", &pdelete, true);
+    printf("      }\n");
+    printf("    }%s\n", last ? "" : ",");
+}
+
+
+int main(int argc, char **argv) {
+
+    size_t nkeys = DEFAULT_KEYS, nprefixes = DEFAULT_PREFIXES;
+    const char *words = DEFAULT_WORDS_PATH;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:p:w:")) != -1) {
+        switch (opt) {
+            case 'n':
+                nkeys = strtoull(optarg, NULL, 10);
+                break;
+            case 'p':
+                nprefixes = strtoull(optarg, NULL, 10);
+                break;
+            case 'w':
+                words = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-n keys] [-p prefixes] "
+                        "[-w words file]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (nkeys == 0 || nprefixes == 0) {
+        fprintf(stderr, "Keys and prefixes must be more than 0\n");
+        exit(EXIT_FAILURE);
+    }
+
+    struct dataset datasets[4];
+
+    dataset_init(&datasets[0], "uuid", gen_uuid, nkeys, nprefixes, NULL);
+    dataset_init(&datasets[1], "url", gen_url, nkeys, nprefixes, NULL);
+    dataset_init(&datasets[2], "words", gen_word, nkeys, nprefixes, words);
+    dataset_init(&datasets[3], "seq", gen_seq, nkeys, nprefixes, NULL);
+
+    // Keys are looked up and deleted in a different order they're inserted
+    for (int i = 0; i < 4; ++i)
+        shuffle(datasets[i].keys, datasets[i].nkeys);
+
+    printf("{\n  \"keys\": %zu,\n  \"results\": [\n", nkeys);
+
+    for (int i = 0; i < 4; ++i) {
+        bench_dataset(&datasets[i], i == 3);
+        dataset_destroy(&datasets[i]);
+    }
+
+    printf("  ]\n}\n");
+
+    return 0;
+}
@@ -0,0 +1,567 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <math.h>
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include "../../src/util.h"
+#include "../../src/client.h"
+#include "../../src/histogram.h"
+
+/*
+ * YCSB core workloads, run against a server started on a UNIX socket of its
+ * own, or against a running one. Each workload loads its own records, keys
+ * prefixed by the workload letter, then runs for a time with a number of
+ * client threads, each one doing a single request at a time:
+ *
+ * - A: update heavy, 50% reads and 50% updates, zipfian
+ * - B: read mostly, 95% reads and 5% updates, zipfian
+ * - C: read only, zipfian
+ * - D: read latest, 95% reads and 5% inserts, reads skewed to the latest
+ *   records inserted
+ * - E: short ranges, 95% scans and 5% inserts, zipfian; scans are prefix
+ *   GETs of a key with the last two digits cut, up to 100 records
+ * - F: read-modify-write, 50% reads and 50% INC, zipfian; records hold
+ *   numbers instead of the usual values
+ *
+ * Records are inserted in order, as with the ordered insertorder of YCSB,
+ * for scans to cover consecutive records.
+ */
+
+#define DEFAULT_RECORDS     100000
+#define DEFAULT_DURATION    10
+#define DEFAULT_THREADS     16
+#define DEFAULT_VALSIZE     100
+#define DEFAULT_BINARY      "bin/triedb"
+
+/* Number of records put in a single MPUT by the load phase */
+#define LOAD_BATCH          512
+
+/* Time allowed to the server to start listening */
+#define STARTUP_TIMEOUT     5
+
+#define ZIPFIAN_THETA       0.99
+
+enum ycsb_op {
+    OP_READ,
+    OP_UPDATE,
+    OP_INSERT,
+    OP_SCAN,
+    OP_RMW,
+    OPS
+};
+
+static const char *op_names[OPS] = {
+    "read", "update", "insert", "scan", "rmw"
+};
+
+enum ycsb_dist {
+    DIST_ZIPFIAN,
+    DIST_LATEST
+};
+
+struct workload {
+    char name;
+    const char *description;
+    unsigned mix[OPS];
+    enum ycsb_dist dist;
+    /* Records hold numbers, for INC to work on them */
+    bool numbers;
+};
+
+static const struct workload workloads[] = {
+    { 'A', "update heavy", { [OP_READ] = 50, [OP_UPDATE] = 50 },
+        DIST_ZIPFIAN, false },
+    { 'B', "read mostly", { [OP_READ] = 95, [OP_UPDATE] = 5 },
+        DIST_ZIPFIAN, false },
+    { 'C', "read only", { [OP_READ] = 100 }, DIST_ZIPFIAN, false },
+    { 'D', "read latest", { [OP_READ] = 95, [OP_INSERT] = 5 },
+        DIST_LATEST, false },
+    { 'E', "short ranges", { [OP_SCAN] = 95, [OP_INSERT] = 5 },
+        DIST_ZIPFIAN, false },
+    { 'F', "read-modify-write", { [OP_READ] = 50, [OP_RMW] = 50 },
+        DIST_ZIPFIAN, true }
+};
+
+static struct {
+    const char *host;
+    const char *port;
+    int family;
+    uint64_t records;
+    double duration;
+    unsigned threads;
+    unsigned valsize;
+    char *value;
+    /* Zipfian constants, computed once over the records loaded */
+    double zetan;
+    double eta;
+    double alpha;
+} ycsb = {
+    .family = UNIX,
+    .records = DEFAULT_RECORDS,
+    .duration = DEFAULT_DURATION,
+    .threads = DEFAULT_THREADS,
+    .valsize = DEFAULT_VALSIZE
+};
+
+struct ycsb_thread {
+    pthread_t id;
+    const struct workload *w;
+    struct triedb_conn *conn;
+    uint64_t rng;
+    uint64_t ops;
+    uint64_t misses;
+    uint64_t errors;
+    struct histogram latency[OPS];
+};
+
+/* Records inserted so far by the running workload */
+static uint64_t inserted;
+
+static uint64_t end_time;
+
+
+static inline uint64_t rnd(uint64_t *s) {
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 2685821657736338717ULL;
+}
+
+
+static inline double rnd01(uint64_t *s) {
+    return (rnd(s) >> 11) * 0x1.0p-53;
+}
+
+
+static inline uint64_t fnv64(uint64_t v) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < 8; ++i) {
+        h ^= v & 0xff;
+        h *= 0x100000001b3ULL;
+        v >>= 8;
+    }
+    return h;
+}
+
+
+static void zipfian_init(uint64_t n) {
+    double zeta2 = 1 + pow(0.5, ZIPFIAN_THETA);
+    ycsb.zetan = 0;
+    for (uint64_t i = 1; i <= n; ++i)
+        ycsb.zetan += 1 / pow((double) i, ZIPFIAN_THETA);
+    ycsb.alpha = 1 / (1 - ZIPFIAN_THETA);
+    ycsb.eta = (1 - pow(2.0 / n, 1 - ZIPFIAN_THETA)) / (1 - zeta2 / ycsb.zetan);
+}
+
+/*
+ * Rank of a zipfian distributed record out of n, following Gray et al. as
+ * YCSB does; the constants are the ones of the records loaded, inserts grow
+ * them too little during a run to matter
+ */
+static uint64_t zipfian_next(uint64_t *s, uint64_t n) {
+    double u = rnd01(s);
+    double uz = u * ycsb.zetan;
+    if (uz < 1)
+        return 0;
+    if (uz < 1 + pow(0.5, ZIPFIAN_THETA))
+        return 1;
+    uint64_t rank = n * pow(ycsb.eta * u - ycsb.eta + 1, ycsb.alpha);
+    return rank < n ? rank : n - 1;
+}
+
+
+static uint64_t next_record(struct ycsb_thread *t) {
+
+    uint64_t n = __atomic_load_n(&inserted, __ATOMIC_RELAXED);
+    uint64_t rank = zipfian_next(&t->rng, n);
+
+    // Latest: the most popular records are the ones inserted last
+    if (t->w->dist == DIST_LATEST)
+        return n - 1 - rank;
+
+    // Scrambled, for the popular records not to be clustered together
+    return fnv64(rank) % n;
+}
+
+
+static void format_key(char *buf, char workload, uint64_t record) {
+    snprintf(buf, 32, "%c:user%012llu", workload, (unsigned long long) record);
+}
+
+
+static int load(const struct workload *w) {
+
+    struct triedb_conn *c = triedb_connect(ycsb.host, ycsb.port, ycsb.family);
+
+    if (!c)
+        return -1;
+
+    struct tuple tuples[LOAD_BATCH];
+    char (*keys)[32] = tmalloc(LOAD_BATCH * sizeof(*keys));
+    int rc = 0;
+
+    for (uint64_t i = 0; i < ycsb.records; i += LOAD_BATCH) {
+        unsigned short n = 0;
+        for (; n < LOAD_BATCH && i + n < ycsb.records; ++n) {
+            format_key(keys[n], w->name, i + n);
+            tuples[n] = (struct tuple) {
+                .ttl = -1,
+                .key = (unsigned char *) keys[n],
+                .keylen = strlen(keys[n]),
+                .val = (unsigned char *) (w->numbers ? "0" : ycsb.value),
+                .vallen = w->numbers ? 1 : ycsb.valsize
+            };
+        }
+        triedb_mput(c, tuples, n, NULL, NULL);
+        if (triedb_wait(c) < 0) {
+            rc = -1;
+            break;
+        }
+    }
+
+    tfree(keys);
+    triedb_close(c);
+
+    inserted = ycsb.records;
+
+    return rc;
+}
+
+
+static void on_reply(const struct triedb_reply *reply, void *arg) {
+
+    struct ycsb_thread *t = arg;
+
+    if (!reply)
+        t->errors++;
+    else if (triedb_reply_rc(reply) != OK)
+        t->misses++;
+}
+
+
+static void *ycsb_thread(void *arg) {
+
+    struct ycsb_thread *t = arg;
+    const struct workload *w = t->w;
+    char key[32];
+
+    while (nanotime() < end_time) {
+
+        unsigned r = rnd(&t->rng) % 100;
+        enum ycsb_op op = 0;
+
+        while (r >= w->mix[op])
+            r -= w->mix[op++];
+
+        uint64_t start = nanotime();
+
+        switch (op) {
+            case OP_READ:
+                format_key(key, w->name, next_record(t));
+                triedb_get(t->conn, key, false, on_reply, t);
+                break;
+            case OP_UPDATE:
+                format_key(key, w->name, next_record(t));
+                triedb_put(t->conn, key, ycsb.value, ycsb.valsize, -1,
+                           on_reply, t);
+                break;
+            case OP_INSERT:
+                format_key(key, w->name,
+                           __atomic_fetch_add(&inserted, 1, __ATOMIC_RELAXED));
+                triedb_put(t->conn, key, ycsb.value, ycsb.valsize, -1,
+                           on_reply, t);
+                break;
+            case OP_SCAN:
+                format_key(key, w->name, next_record(t));
+                key[strlen(key) - 2] = '\0';
+                triedb_get(t->conn, key, true, on_reply, t);
+                break;
+            default:
+                format_key(key, w->name, next_record(t));
+                triedb_incr(t->conn, key, 1, false, on_reply, t);
+                break;
+        }
+
+        if (triedb_wait(t->conn) < 0)
+            break;
+
+        histogram_record(&t->latency[op], nanotime() - start);
+        t->ops++;
+    }
+
+    return NULL;
+}
+
+
+static int run(const struct workload *w) {
+
+    if (load(w) < 0) {
+        fprintf(stderr, "Workload %c: load failed\n", w->name);
+        return -1;
+    }
+
+    struct ycsb_thread *threads = tcalloc(ycsb.threads, sizeof(*threads));
+    int rc = 0;
+
+    for (unsigned i = 0; i < ycsb.threads; ++i) {
+        threads[i].w = w;
+        threads[i].rng = nanotime() ^ fnv64(i + 1);
+        threads[i].conn = triedb_connect(ycsb.host, ycsb.port, ycsb.family);
+        if (!threads[i].conn) {
+            fprintf(stderr, "Workload %c: unable to connect\n", w->name);
+            exit(EXIT_FAILURE);
+        }
+        for (int op = 0; op < OPS; ++op)
+            histogram_init(&threads[i].latency[op]);
+    }
+
+    uint64_t start = nanotime();
+    end_time = start + (uint64_t) (ycsb.duration * 1e9);
+
+    for (unsigned i = 0; i < ycsb.threads; ++i)
+        pthread_create(&threads[i].id, NULL, ycsb_thread, &threads[i]);
+
+    for (unsigned i = 0; i < ycsb.threads; ++i)
+        pthread_join(threads[i].id, NULL);
+
+    double secs = (nanotime() - start) / 1e9;
+    uint64_t ops = 0, misses = 0, errors = 0;
+    struct histogram latency[OPS];
+
+    for (int op = 0; op < OPS; ++op)
+        histogram_init(&latency[op]);
+
+    for (unsigned i = 0; i < ycsb.threads; ++i) {
+        ops += threads[i].ops;
+        misses += threads[i].misses;
+        errors += threads[i].errors;
+        for (int op = 0; op < OPS; ++op)
+            histogram_merge(&latency[op], &threads[i].latency[op]);
+        triedb_close(threads[i].conn);
+    }
+
+    printf("\nWorkload %c, %s: %.2f ops/s, %llu ops, %llu not found, "
+           "%llu errors\n", w->name, w->description, ops / secs,
+           (unsigned long long) ops, (unsigned long long) misses,
+           (unsigned long long) errors);
+
+    for (int op = 0; op < OPS; ++op) {
+        const struct histogram *h = &latency[op];
+        if (h->count == 0)
+            continue;
+        printf("  %-6s %10llu ops  p50 %8.1f us  p95 %8.1f us  "
+               "p99 %8.1f us  p99.9 %8.1f us  max %8.1f us\n", op_names[op],
+               (unsigned long long) h->count,
+               histogram_percentile(h, 50) / 1e3,
+               histogram_percentile(h, 95) / 1e3,
+               histogram_percentile(h, 99) / 1e3,
+               histogram_percentile(h, 99.9) / 1e3, h->max / 1e3);
+    }
+
+    if (errors > 0)
+        rc = -1;
+
+    tfree(threads);
+
+    return rc;
+}
+
+/*
+ * Start a server listening on a UNIX socket in a directory of its own,
+ * waiting for it to accept connections. Return its pid, -1 on failure.
+ */
+static pid_t spawn_server(const char *binary, char *dir) {
+
+    char conf[256], sock[256], log[256];
+
+    if (!mkdtemp(dir))
+        return -1;
+
+    snprintf(conf, sizeof(conf), "%s/triedb.conf", dir);
+    snprintf(sock, sizeof(sock), "%s/triedb.sock", dir);
+    snprintf(log, sizeof(log), "%s/triedb.log", dir);
+
+    FILE *fp = fopen(conf, "w");
+    if (!fp)
+        return -1;
+    fprintf(fp, "unix_socket %s\nlog_path %s\n", sock, log);
+    fclose(fp);
+
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        // Keep the output of the benchmark clean, the server logs to a file
+        if (!freopen("/dev/null", "w", stdout)
+            || !freopen("/dev/null", "w", stderr))
+            _exit(EXIT_FAILURE);
+        execl(binary, binary, "-c", conf, (char *) NULL);
+        _exit(EXIT_FAILURE);
+    }
+
+    if (pid < 0)
+        return -1;
+
+    ycsb.host = tstrdup(sock);
+
+    for (int i = 0; i < STARTUP_TIMEOUT * 100; ++i) {
+        struct triedb_conn *c = triedb_connect(ycsb.host, NULL, UNIX);
+        if (c) {
+            triedb_close(c);
+            return pid;
+        }
+        if (waitpid(pid, NULL, WNOHANG) == pid)
+            return -1;
+        usleep(10000);
+    }
+
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+
+    return -1;
+}
+
+
+static void kill_server(pid_t pid, const char *dir) {
+
+    char path[256];
+
+    kill(pid, SIGINT);
+    waitpid(pid, NULL, 0);
+
+    const char *files[] = { "triedb.conf", "triedb.sock", "triedb.log" };
+    for (int i = 0; i < 3; ++i) {
+        snprintf(path, sizeof(path), "%s/%s", dir, files[i]);
+        unlink(path);
+    }
+    rmdir(dir);
+    tfree((char *) ycsb.host);
+}
+
+
+int main(int argc, char **argv) {
+
+    const char *binary = DEFAULT_BINARY;
+    const char *selected = "ABCDEF";
+    bool external = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:a:p:s:r:d:c:V:w:")) != -1) {
+        switch (opt) {
+            case 'b':
+                binary = optarg;
+                break;
+            case 'a':
+                ycsb.host = optarg;
+                ycsb.family = INET;
+                external = true;
+                break;
+            case 'p':
+                ycsb.port = optarg;
+                ycsb.family = INET;
+                external = true;
+                break;
+            case 's':
+                ycsb.host = optarg;
+                ycsb.family = UNIX;
+                external = true;
+                break;
+            case 'r':
+                ycsb.records = strtoull(optarg, NULL, 10);
+                break;
+            case 'd':
+                ycsb.duration = atof(optarg);
+                break;
+            case 'c':
+                ycsb.threads = atoi(optarg);
+                break;
+            case 'V':
+                ycsb.valsize = atoi(optarg);
+                break;
+            case 'w':
+                selected = optarg;
+                break;
+            default:
+                fprintf(stderr,
+                        "Usage: %s [-b triedb binary | -s unix socket | "
+                        "-a addr -p port]\n"
+                        "       [-r records] [-d seconds] [-c threads] "
+                        "[-V value size] [-w workloads]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (ycsb.records == 0 || ycsb.threads == 0 || ycsb.valsize == 0
+        || ycsb.duration <= 0) {
+        fprintf(stderr, "Records, threads, value size and duration must be "
+                "more than 0\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (ycsb.family == INET) {
+        if (!ycsb.host)
+            ycsb.host = DEFAULT_HOSTNAME;
+        if (!ycsb.port)
+            ycsb.port = DEFAULT_PORT;
+    }
+
+    char dir[] = "/tmp/triedb-ycsb-XXXXXX";
+    pid_t pid = -1;
+
+    if (!external && (pid = spawn_server(binary, dir)) < 0) {
+        fprintf(stderr, "Unable to start %s\n", binary);
+        exit(EXIT_FAILURE);
+    }
+
+    ycsb.value = tmalloc(ycsb.valsize);
+    memset(ycsb.value, 'x', ycsb.valsize);
+
+    zipfian_init(ycsb.records);
+
+    printf("%llu records, %u threads, %.0fs per workload, values %u bytes\n",
+           (unsigned long long) ycsb.records, ycsb.threads, ycsb.duration,
+           ycsb.valsize);
+
+    int rc = 0;
+    size_t nworkloads = sizeof(workloads) / sizeof(*workloads);
+
+    for (size_t i = 0; i < nworkloads; ++i)
+        if (strchr(selected, workloads[i].name) && run(&workloads[i]) < 0)
+            rc = -1;
+
+    if (!external)
+        kill_server(pid, dir);
+
+    tfree(ycsb.value);
+
+    return rc < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
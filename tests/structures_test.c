@@ -36,7 +36,14 @@
 #include "../src/server.h"
 #include "../src/cluster.h"
 #include "../src/vector.h"
+#include "../src/hash.h"
 #include "../src/hashtable.h"
+#include "../src/histogram.h"
+#include "../src/slowlog.h"
+#include "../src/wheel.h"
+#include "../src/lzf.h"
+#include "../src/pubsub.h"
+#include "../src/protocol.h"
 
 
 /*
@@ -245,6 +252,45 @@ static char *test_trie_prefix_delete(void) {
     return 0;
 }
 
+/*
+ * Tests the release of the nodes left empty, many siblings exercise the
+ * deletion from the children tree
+ */
+static char *test_trie_prune(void) {
+    struct Trie *root = trie_new(NULL);
+    char key[] = { 'k', 0, 'x', 0 };
+    void *payload = NULL;
+    bool ok = true;
+    for (int c = 1; c < 256; ++c) {
+        key[1] = c;
+        trie_insert(root, key, tstrdup("v"));
+    }
+    trie_insert(root, "k", tstrdup("v"));
+    for (int c = 1; c < 256; c += 2) {
+        key[1] = c;
+        trie_delete(root, key);
+        trie_prune(root, key);
+    }
+    for (int c = 1; c < 256; ++c) {
+        key[1] = c;
+        ok = ok && trie_find(root, key, &payload) == (c % 2 == 0)
+            && (c % 2 == 0 || !trie_node_find(root->root, key));
+    }
+    ASSERT("[! trie_prune]: Wrong keys left", ok && trie_size(root) == 128);
+    for (int c = 2; c < 256; c += 2) {
+        key[1] = c;
+        trie_delete(root, key);
+        trie_prune(root, key);
+    }
+    trie_delete(root, "k");
+    trie_prune(root, "k");
+    ASSERT("[! trie_prune]: Nodes left",
+           trie_size(root) == 0 && root->root->children == NULL);
+    trie_destroy(root);
+    printf(" [trie::trie_prune]: OK\n");
+    return 0;
+}
+
 /*
  * Tests the prefix count on the trie
  */
@@ -274,6 +320,43 @@ static char *test_trie_prefix_count(void) {
 }
 
 
+/*
+ * Tests the prefix find feature of the trie on keys longer than the buffer
+ * the matching keys are first built into
+ */
+static char *test_trie_prefix_find(void) {
+    struct Trie *root = trie_new(NULL);
+    char key1[101], key2[101];
+    memset(key1, 'a', 100);
+    key1[100] = '\0';
+    memcpy(key2, key1, 101);
+    key2[99] = 'b';
+    trie_insert(root, key1, tstrdup("x"));
+    trie_insert(root, key2, tstrdup("y"));
+    trie_insert(root, "aab", tstrdup("z"));
+    Vector *v = trie_prefix_find(root, "aaa");
+    ASSERT("[! trie_prefix_find]: Trie prefix find on prefix \"aaa\" failed",
+           v && vector_size(v) == 2);
+    for (size_t i = 0; i < vector_size(v); ++i) {
+        struct kv_obj *kv = vector_get(v, i);
+        ASSERT("[! trie_prefix_find]: Trie prefix find returned a wrong key",
+               strcmp(kv->key, key1) == 0 || strcmp(kv->key, key2) == 0);
+        tfree((char *) kv->key);
+    }
+    vector_destroy(v);
+    trie_destroy(root);
+    printf(" [trie::trie_prefix_find]: OK\n");
+    return 0;
+}
+
+/* Value of an item in string form, valid till the next call */
+static const char *item_value(const struct db_item *item) {
+    static unsigned char buf[DB_FORMAT_MAX];
+    size_t len;
+    return (const char *) db_item_format(item, buf, &len);
+}
+
+
 static inline bool trie_node_destructor(struct trie_node *node,
                                         bool dataonly) {
     bool ret = false;
@@ -286,12 +369,7 @@ static inline bool trie_node_destructor(struct trie_node *node,
     if (!item)
         goto exit;
 
-    if (item->data) {
-        tfree(item->data);
-        item->data = NULL;
-    }
-
-    tfree(node->data);
+    db_item_free(item);
     node->data = NULL;
 
     ret = true;
@@ -323,13 +401,13 @@ static char *test_database_prefix_inc(void) {
     char *val3 = "2";
     char *val4 = "9";
 
-    database_insert(&db, key1, tstrdup(val1), -1);
-    database_insert(&db, key2, tstrdup(val2), -1);
-    database_insert(&db, key3, tstrdup(val3), -1);
-    database_insert(&db, key4, tstrdup(val4), -1);
+    database_insert(&db, key1, val1, strlen(val1), -1);
+    database_insert(&db, key2, val2, strlen(val2), -1);
+    database_insert(&db, key3, val3, strlen(val3), -1);
+    database_insert(&db, key4, val4, strlen(val4), -1);
 
     // Inc prefix call
-    database_prefix_inc(&db, "key");
+    database_prefix_inc(&db, "key", 1);
 
     // read data
     database_search(&db, key1, &retval1);
@@ -343,8 +421,10 @@ static char *test_database_prefix_inc(void) {
     struct db_item *item4 = (struct db_item *) retval4;
 
     ASSERT("[! trie_prefix_inc]: Trie prefix inc on prefix \"key\" failed",
-            strcmp(item1->data, "1") == 0 && strcmp(item2->data, "2") == 0 &&
-            strcmp(item3->data, "3") == 0 && strcmp(item4->data, "10") == 0);
+            strcmp(item_value(item1), "1") == 0 &&
+            strcmp(item_value(item2), "2") == 0 &&
+            strcmp(item_value(item3), "3") == 0 &&
+            strcmp(item_value(item4), "10") == 0);
 
     trie_destroy(root);
     printf(" [trie::trie_prefix_inc]: OK\n");
@@ -370,12 +450,12 @@ static char *test_trie_prefix_dec(void) {
     char *val3 = "2";
     char *val4 = "10";
 
-    database_insert(&db, key1, tstrdup(val1), -1);
-    database_insert(&db, key2, tstrdup(val2), -1);
-    database_insert(&db, key3, tstrdup(val3), -1);
-    database_insert(&db, key4, tstrdup(val4), -1);
+    database_insert(&db, key1, val1, strlen(val1), -1);
+    database_insert(&db, key2, val2, strlen(val2), -1);
+    database_insert(&db, key3, val3, strlen(val3), -1);
+    database_insert(&db, key4, val4, strlen(val4), -1);
 
-    database_prefix_dec(&db, "key");
+    database_prefix_dec(&db, "key", 1);
 
     // read data
     database_search(&db, key1, &retval1);
@@ -389,8 +469,10 @@ static char *test_trie_prefix_dec(void) {
     struct db_item *item4 = (struct db_item *) retval4;
 
     ASSERT("[! trie_prefix_dec]: Trie prefix dec on prefix \"key\" failed",
-            strcmp(item1->data, "-1") == 0 && strcmp(item2->data, "0") == 0 &&
-            strcmp(item3->data, "1") == 0 && strcmp(item4->data, "9") == 0);
+            strcmp(item_value(item1), "-1") == 0 &&
+            strcmp(item_value(item2), "0") == 0 &&
+            strcmp(item_value(item3), "1") == 0 &&
+            strcmp(item_value(item4), "9") == 0);
 
     trie_destroy(root);
     printf(" [trie::trie_prefix_dec]: OK\n");
@@ -398,6 +480,143 @@ static char *test_trie_prefix_dec(void) {
 }
 
 
+/*
+ * Tests that a value pinned by a reader survives the update of its key
+ */
+static char *test_database_insert_pinned(void) {
+    struct database db;
+    database_init(&db, "test", trie_node_destructor);
+    struct Trie *root = db.data;
+    const char *key = "key";
+    void *retval = NULL;
+
+    const char *old = "old value, stored as a blob";
+    const char *new = "new value, stored as a blob";
+
+    database_insert(&db, key, old, strlen(old), -1);
+    database_search(&db, key, &retval);
+
+    struct db_value *pinned = db_value_ref(((struct db_item *) retval)->val);
+
+    database_insert(&db, key, new, strlen(new), -1);
+    database_search(&db, key, &retval);
+
+    struct db_item *item = retval;
+
+    ASSERT("[! database_insert]: Pinned value modified by an update",
+           strcmp((char *) pinned->data, old) == 0 &&
+           strcmp((char *) item->val->data, new) == 0 &&
+           item->val->len == strlen(new) && database_size(&db) == 1);
+
+    db_value_release(pinned);
+    trie_destroy(root);
+    printf(" [database::database_insert_pinned]: OK\n");
+    return 0;
+}
+
+
+/*
+ * Tests that the version of an item grows on every write, even after its key
+ * is removed and inserted again
+ */
+static char *test_database_insert_version(void) {
+    struct database db;
+    database_init(&db, "test", trie_node_destructor);
+    struct Trie *root = db.data;
+    const char *key = "key";
+
+    struct db_item *item = database_insert(&db, key, "1", 1, -1);
+    uint64_t v1 = item->version;
+    item = database_insert(&db, key, "2", 1, -1);
+    uint64_t v2 = item->version;
+    database_prefix_inc(&db, key, 1);
+    uint64_t v3 = item->version;
+    database_remove(&db, key);
+    item = database_insert(&db, key, "4", 1, -1);
+    uint64_t v4 = item->version;
+
+    ASSERT("[! database_insert]: Item version not increasing",
+           v1 > 0 && v2 > v1 && v3 > v2 && v4 > v3);
+
+    trie_destroy(root);
+    printf(" [database::database_insert_version]: OK\n");
+    return 0;
+}
+
+
+/*
+ * Tests that integers are added natively, by any delta, refusing to overflow
+ * and to touch values which are not integers
+ */
+static char *test_db_item_add(void) {
+    struct database db;
+    database_init(&db, "test", trie_node_destructor);
+    struct Trie *root = db.data;
+
+    struct db_item *item = database_insert(&db, "n", "9223372036854775800",
+                                           19, -1);
+    struct db_item *text = database_insert(&db, "s", "12a", 3, -1);
+
+    bool added = db_item_add(item, 7) && db_item_add(item, -2) &&
+        db_item_add(item, 2);
+    bool overflow = db_item_add(item, 1);
+    bool not_integer = db_item_add(text, 1);
+
+    ASSERT("[! db_item_add]: Integer add failed",
+           added && !overflow && !not_integer &&
+           item->encoding == DB_INTEGER && item->number == INT64_MAX &&
+           strcmp(item_value(item), "9223372036854775807") == 0 &&
+           strcmp(item_value(text), "12a") == 0);
+
+    trie_destroy(root);
+    printf(" [database::db_item_add]: OK\n");
+    return 0;
+}
+
+
+/*
+ * Tests that values are stored with the most compact encoding and rendered
+ * back identical, binary values included
+ */
+static char *test_db_item_encoding(void) {
+    struct database db;
+    database_init(&db, "test", trie_node_destructor);
+    struct Trie *root = db.data;
+
+    const char *values[] = {
+        "-42", "007", "-0", "short string", "3.141592653589793",
+        "0.10000000000000001", "a string too long to be embedded"
+    };
+    enum db_encoding encodings[] = {
+        DB_INTEGER, DB_EMBSTR, DB_EMBSTR, DB_EMBSTR, DB_DOUBLE,
+        DB_BLOB, DB_BLOB
+    };
+    const unsigned char binary[] = { 'b', 0, 'i', 0, 'n' };
+    bool ok = true;
+
+    for (int i = 0; i < 7; ++i) {
+        struct db_item *item = database_insert(&db, "key", values[i],
+                                               strlen(values[i]), -1);
+        ok = ok && item->encoding == encodings[i] &&
+            strcmp(item_value(item), values[i]) == 0;
+    }
+
+    struct db_item *item = database_insert(&db, "bin", binary,
+                                           sizeof(binary), -1);
+    unsigned char buf[DB_FORMAT_MAX];
+    size_t len = 0;
+    const unsigned char *data = db_item_format(item, buf, &len);
+
+    ASSERT("[! db_item_update]: Value encoding failed",
+           ok && item->encoding == DB_EMBSTR && len == sizeof(binary) &&
+           memcmp(data, binary, len) == 0);
+
+    trie_destroy(root);
+    printf(" [database::db_item_encoding]: OK\n");
+    return 0;
+}
+
+
 static bool compare(void *ptr1, void *ptr2) {
 
     int *a = ptr1;
@@ -593,6 +812,104 @@ static char *test_hashtable_del(void) {
 }
 
 
+/*
+ * Tests the growth of the hashtable, with deletions in between
+ */
+static char *test_hashtable_resize(void) {
+    HashTable *m = hashtable_new(NULL);
+    char key[32];
+    for (int i = 0; i < 10000; ++i) {
+        snprintf(key, sizeof(key), "key-%d", i);
+        hashtable_put(m, tstrdup(key), tstrdup(key));
+    }
+    for (int i = 0; i < 10000; i += 2) {
+        snprintf(key, sizeof(key), "key-%d", i);
+        hashtable_del(m, key);
+    }
+    ASSERT("[! hashtable_resize]: hashtable size != 5000", m->size == 5000);
+    for (int i = 0; i < 10000; ++i) {
+        snprintf(key, sizeof(key), "key-%d", i);
+        char *ret = hashtable_get(m, key);
+        ASSERT("[! hashtable_resize]: hashtable_get didn't work as expected",
+               i % 2 == 0 ? ret == NULL : strcmp(ret, key) == 0);
+    }
+    ASSERT("[! hashtable_resize]: keys are not case-sensitive",
+           hashtable_get(m, "KEY-1") == NULL);
+    hashtable_destroy(m);
+    printf(" [hashtable::hashtable_resize]: OK\n");
+    return 0;
+}
+
+
+/*
+ * Tests the incremental resize of the hashtable, with lookups, updates and
+ * deletions while it's going on
+ */
+static char *test_hashtable_rehash_step(void) {
+    HashTable *m = hashtable_new(NULL);
+    char key[32];
+    int i = 0;
+    for (; !hashtable_rehashing(m) || m->slots.table_size < 4096; ++i) {
+        snprintf(key, sizeof(key), "key-%d", i);
+        hashtable_put(m, tstrdup(key), tstrdup(key));
+    }
+    ASSERT("[! hashtable_rehash_step]: resize completed by a single write",
+           hashtable_rehashing(m) && m->old.used > 0);
+    snprintf(key, sizeof(key), "key-%d", i - 2);
+    ASSERT("[! hashtable_rehash_step]: hashtable_del didn't work as expected",
+           hashtable_del(m, key) == HASHTABLE_OK);
+    ASSERT("[! hashtable_rehash_step]: deleted key still found",
+           hashtable_get(m, key) == NULL);
+    snprintf(key, sizeof(key), "key-%d", i - 1);
+    char *val = tstrdup("updated");
+    struct hashtable_entry *e = hashtable_get_entry(m, key);
+    void *old = e->val;
+    hashtable_put(m, e->key, val);
+    tfree(old);
+    ASSERT("[! hashtable_rehash_step]: hashtable_put didn't update the value",
+           hashtable_get(m, key) == val);
+    ASSERT("[! hashtable_rehash_step]: hashtable size mismatch",
+           m->size == (size_t) i - 1);
+    while (hashtable_rehash_step(m, 1));
+    ASSERT("[! hashtable_rehash_step]: old slots not released",
+           !hashtable_rehashing(m) && m->old.ctrl == NULL);
+    for (int j = 0; j < i - 2; ++j) {
+        snprintf(key, sizeof(key), "key-%d", j);
+        char *ret = hashtable_get(m, key);
+        ASSERT("[! hashtable_rehash_step]: key lost by the resize",
+               ret && strcmp(ret, key) == 0);
+    }
+    hashtable_destroy(m);
+    printf(" [hashtable::hashtable_rehash_step]: OK\n");
+    return 0;
+}
+
+
+/*
+ * Tests the hashing functions, both must tell apart the prefixes of a buffer
+ * and the stable one must never change
+ */
+static char *test_hash(void) {
+    unsigned char buf[64];
+    uint64_t bytes[65], stable[65];
+    for (int i = 0; i < 64; ++i)
+        buf[i] = i * 7;
+    for (int i = 0; i <= 64; ++i) {
+        bytes[i] = hash_bytes(buf, i);
+        stable[i] = hash_stable(buf, i);
+        ASSERT("[! hash]: hash_bytes is not deterministic",
+               bytes[i] == hash_bytes(buf, i));
+        for (int j = 0; j < i; ++j)
+            ASSERT("[! hash]: prefixes collide",
+                   bytes[i] != bytes[j] && stable[i] != stable[j]);
+    }
+    ASSERT("[! hash]: hash_stable changed",
+           hash_stable("triedb", 6) == 0xbde5d53f0676199bULL);
+    printf(" [hash::hash (%s)]: OK\n", hash_bytes_impl());
+    return 0;
+}
+
+
 static char *test_cluster_add_new_node(void) {
 
     struct cluster cluster = { 0, 4, list_new(NULL) };
@@ -679,6 +996,470 @@ static char *test_cluster_get_node(void) {
 }
 
 
+/*
+ * Tests the percentiles of the histogram, within its relative error
+ */
+static char *test_histogram_percentile(void) {
+
+    struct histogram h;
+    histogram_init(&h);
+
+    for (uint64_t i = 1; i <= 1000; ++i)
+        histogram_record(&h, i * 1000);
+
+    uint64_t p50 = histogram_percentile(&h, 50.0);
+    uint64_t p99 = histogram_percentile(&h, 99.0);
+    uint64_t p999 = histogram_percentile(&h, 99.9);
+
+    ASSERT("[! histogram_percentile]: wrong percentiles",
+           h.count == 1000 &&
+           p50 >= 500000 && p50 <= 500000 + 500000 / 16 &&
+           p99 >= 990000 && p99 <= 990000 + 990000 / 16 &&
+           p999 >= 999000 && p999 <= 1000000 &&
+           histogram_percentile(&h, 100.0) == 1000000);
+
+    printf(" [histogram::histogram_percentile]: OK\n");
+
+    return 0;
+}
+
+
+/*
+ * Tests the slow log ring buffer, once full the oldest entries are dropped
+ */
+static char *test_slowlog_push(void) {
+
+    struct slowlog log;
+    slowlog_init(&log, 4);
+
+    for (int i = 0; i < 6; ++i) {
+        struct slowlog_entry entry = { .duration = i, .opcode = 2 };
+        slowlog_push(&log, &entry, "hello", 5);
+    }
+
+    const struct slowlog_entry *first = slowlog_get(&log, 0);
+    const struct slowlog_entry *last = slowlog_get(&log, 3);
+
+    ASSERT("[! slowlog_push]: wrong entries",
+           slowlog_len(&log) == 4 && first->id == 2 && first->duration == 2 &&
+           last->id == 5 && last->keylen == 5 &&
+           strncmp(last->key, "hello", 5) == 0 && !slowlog_get(&log, 4));
+
+    slowlog_reset(&log);
+
+    ASSERT("[! slowlog_push]: log not reset", slowlog_len(&log) == 0);
+
+    slowlog_destroy(&log);
+
+    printf(" [slowlog::slowlog_push]: OK\n");
+
+    return 0;
+}
+
+
+static void wheel_collect(struct wheel_node *node, uint64_t now, void *arg) {
+    (void) node;
+    (void) now;
+    (*(int *) arg)++;
+}
+
+/*
+ * Tests the timing wheel, timers fire once their tick has passed, even when
+ * the wheel is moved forward by more than a whole turn
+ */
+static char *test_wheel_advance(void) {
+
+    struct wheel wheel;
+    struct wheel_node a, b, c;
+    int fired = 0;
+
+    wheel_init(&wheel, 100);
+    wheel_node_init(&a);
+    wheel_node_init(&b);
+    wheel_node_init(&c);
+
+    wheel_add(&wheel, &a, 105);
+    wheel_add(&wheel, &b, 110);
+    wheel_add(&wheel, &c, 110);
+    wheel_del(&c);
+
+    wheel_advance(&wheel, 104, wheel_collect, &fired);
+    ASSERT("[! wheel_advance]: timer fired too early",
+           fired == 0 && wheel_pending(&a));
+
+    wheel_advance(&wheel, 105, wheel_collect, &fired);
+    ASSERT("[! wheel_advance]: timer not fired",
+           fired == 1 && !wheel_pending(&a) && wheel_pending(&b));
+
+    wheel_advance(&wheel, 105 + 3 * WHEEL_SLOTS, wheel_collect, &fired);
+    ASSERT("[! wheel_advance]: timer not fired after a whole turn",
+           fired == 2 && !wheel_pending(&b) && !wheel_pending(&c));
+
+    printf(" [wheel::wheel_advance]: OK\n");
+
+    return 0;
+}
+
+
+/*
+ * Tests the LZF codec, compressible data goes back and forth unchanged, and
+ * outputs which don't fit or corrupted inputs are refused
+ */
+static char *test_lzf_compress(void) {
+    size_t len = 64 * 1024;
+    unsigned char *in = tmalloc(len);
+    unsigned char *packed = tmalloc(len);
+    unsigned char *out = tmalloc(len);
+
+    // Repeated records with a counter, matches both near and far
+    size_t n = 0;
+    for (int i = 0; n < len; ++i)
+        n += snprintf((char *) in + n, len - n,
+                      "{\"id\": %d, \"name\": \"item\"}", i % 1000);
+
+    size_t plen = lzf_compress(in, len, packed, len);
+    size_t olen = lzf_decompress(packed, plen, out, len);
+
+    ASSERT("[! lzf_compress]: Round trip failed",
+           plen > 0 && plen < len / 4 && olen == len &&
+           memcmp(in, out, len) == 0 &&
+           lzf_compress(in, len, packed, 16) == 0 &&
+           lzf_decompress(packed, plen, out, len - 1) == 0);
+
+    tfree(in);
+    tfree(packed);
+    tfree(out);
+    printf(" [lzf::lzf_compress]: OK\n");
+    return 0;
+}
+
+
+/*
+ * Tests that values past the compression threshold of a database are stored
+ * compressed, only if it pays off, and still read back unchanged
+ */
+static char *test_database_compression(void) {
+    struct database db;
+    database_init(&db, "test", trie_node_destructor);
+    db.compress_min = 256;
+    struct Trie *root = db.data;
+
+    char doc[4096];
+    size_t n = 0;
+    for (int i = 0; n < sizeof(doc) - 64; ++i)
+        n += snprintf(doc + n, sizeof(doc) - n, "{\"key\": \"value-%d\"}", i);
+
+    // Xorshift noise, not compressible
+    unsigned char noise[512];
+    uint32_t x = 2463534242u;
+    for (size_t i = 0; i < sizeof(noise); ++i) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        noise[i] = x;
+    }
+
+    struct db_item *item = database_insert(&db, "doc", doc, n, -1);
+    struct db_item *raw = database_insert(&db, "noise", noise,
+                                          sizeof(noise), -1);
+    struct db_item *small = database_insert(&db, "small", doc, 100, -1);
+
+    uint64_t rawlen, len;
+    database_compression_stats(&rawlen, &len);
+
+    unsigned char *buf = tmalloc(db_item_format_size(item));
+    size_t outlen = 0;
+    const unsigned char *out = db_item_format(item, buf, &outlen);
+    struct db_value *value =
+        db_value_uncompress(db_value_ref(item->val));
+
+    ASSERT("[! database_insert]: Value compression failed",
+           item->encoding == DB_COMPRESSED && item->val->len < n / 2 &&
+           rawlen == n && len == item->val->len &&
+           outlen == n && memcmp(out, doc, n) == 0 &&
+           value->len == n && memcmp(value->data, doc, n) == 0 &&
+           raw->encoding == DB_BLOB && small->encoding == DB_BLOB);
+
+    db_value_release(value);
+    tfree(buf);
+    trie_destroy(root);
+
+    database_compression_stats(&rawlen, &len);
+    ASSERT("[! database_insert]: Compression stats not released",
+           rawlen == 0 && len == 0);
+
+    printf(" [database::database_compression]: OK\n");
+    return 0;
+}
+
+
+/* Count the matches, dropping the subscriptions of the subscriber passed */
+static bool pubsub_collect(struct subscription *s, void *arg) {
+    int *matches = arg;
+    matches[0]++;
+    return s->subscriber != (void *) (intptr_t) matches[1];
+}
+
+/*
+ * Tests the subscriptions index, keys match the subscriptions to themselves
+ * and to their prefixes, prefix events the ones below them as well
+ */
+static char *test_pubsub_publish(void) {
+    struct pubsub *pubsub = pubsub_new();
+    struct subscription *a = NULL, *b = NULL;
+    int matches[2] = { 0, 0 };
+
+    pubsub_subscribe(pubsub, "foo", false, (void *) 1, &a);
+    pubsub_subscribe(pubsub, "fo", true, (void *) 1, &a);
+    pubsub_subscribe(pubsub, "", true, (void *) 2, &b);
+    pubsub_subscribe(pubsub, "bar", false, (void *) 2, &b);
+
+    ASSERT("[! pubsub_subscribe]: Subscribed twice",
+           !pubsub_subscribe(pubsub, "foo", false, (void *) 1, &a) &&
+           pubsub->size == 4);
+
+    pubsub_publish(pubsub, "foo", false, pubsub_collect, matches);
+    ASSERT("[! pubsub_publish]: Wrong matches on a key", matches[0] == 3);
+
+    matches[0] = 0;
+    pubsub_publish(pubsub, "fob", false, pubsub_collect, matches);
+    ASSERT("[! pubsub_publish]: Wrong matches on a prefix", matches[0] == 2);
+
+    matches[0] = 0;
+    pubsub_publish(pubsub, "f", true, pubsub_collect, matches);
+    ASSERT("[! pubsub_publish]: Wrong matches on a prefix event",
+           matches[0] == 3);
+
+    // Subscriptions rejected by the callback are dropped
+    matches[0] = 0;
+    matches[1] = 2;
+    pubsub_publish(pubsub, "bar", false, pubsub_collect, matches);
+    ASSERT("[! pubsub_publish]: Subscriptions not dropped",
+           matches[0] == 2 && b == NULL && pubsub->size == 2);
+    ASSERT("[! pubsub_publish]: Patterns dropped not pruned",
+           trie_size(pubsub->patterns) == 2
+           && !trie_node_find(pubsub->patterns->root, "b"));
+
+    ASSERT("[! pubsub_unsubscribe]: Unsubscribe failed",
+           pubsub_unsubscribe(pubsub, "fo", true, (void *) 1) &&
+           !pubsub_unsubscribe(pubsub, "fo", true, (void *) 1) &&
+           a && a->snext == NULL && pubsub->size == 1);
+
+    pubsub_unsubscribe_all(&a);
+
+    matches[0] = 0;
+    pubsub_publish(pubsub, "foo", true, pubsub_collect, matches);
+    ASSERT("[! pubsub_unsubscribe_all]: Subscriptions left",
+           a == NULL && pubsub->size == 0 && matches[0] == 0);
+    ASSERT("[! pubsub_unsubscribe_all]: Patterns not pruned",
+           trie_size(pubsub->patterns) == 0
+           && pubsub->patterns->root->children == NULL);
+
+    pubsub_destroy(pubsub);
+
+    printf(" [pubsub::pubsub_publish]: OK\n");
+    return 0;
+}
+
+
+static char *test_pubsub_covered(void) {
+    struct pubsub *pubsub = pubsub_new();
+    struct subscription *a = NULL;
+
+    pubsub_subscribe(pubsub, "foo", false, (void *) 1, &a);
+    pubsub_subscribe(pubsub, "ba", true, (void *) 1, &a);
+    pubsub_subscribe(pubsub, "", true, (void *) 2, &a);
+
+    ASSERT("[! pubsub_covered]: Key not covered by its prefix",
+           pubsub_covered(pubsub, "bar", (void *) 1)
+           && pubsub_covered(pubsub, "ba", (void *) 1)
+           && pubsub_covered(pubsub, "foo", (void *) 2));
+
+    ASSERT("[! pubsub_covered]: Key covered without a prefix",
+           !pubsub_covered(pubsub, "foo", (void *) 1)
+           && !pubsub_covered(pubsub, "b", (void *) 1)
+           && !pubsub_covered(pubsub, "bar", (void *) 3));
+
+    pubsub_destroy(pubsub);
+
+    printf(" [pubsub::pubsub_covered]: OK\n");
+    return 0;
+}
+
+
+/*
+ * Tests finding the oldest subscription of a subscriber, and dropping it
+ */
+static char *test_pubsub_oldest(void) {
+    struct pubsub *pubsub = pubsub_new();
+    struct subscription *a = NULL;
+
+    ASSERT("[! pubsub_oldest]: Oldest of an empty list",
+           pubsub_oldest(a) == NULL);
+
+    pubsub_subscribe(pubsub, "foo", false, (void *) 1, &a);
+    pubsub_subscribe(pubsub, "ba", true, (void *) 1, &a);
+    pubsub_subscribe(pubsub, "baz", false, (void *) 1, &a);
+
+    struct subscription *s = pubsub_oldest(a);
+    ASSERT("[! pubsub_oldest]: Wrong oldest subscription",
+           s && !s->prefix && strcmp(pubsub_pattern(s), "foo") == 0);
+
+    pubsub_drop(s);
+    s = pubsub_oldest(a);
+    ASSERT("[! pubsub_drop]: Oldest subscription not dropped",
+           pubsub->size == 2 && !trie_node_find(pubsub->patterns->root, "f")
+           && s && s->prefix && strcmp(pubsub_pattern(s), "ba") == 0);
+
+    pubsub_unsubscribe(pubsub, "baz", false, (void *) 1);
+    ASSERT("[! pubsub_oldest]: Oldest changed by dropping the newest",
+           pubsub_oldest(a) == s && a == s);
+
+    pubsub_drop(s);
+    ASSERT("[! pubsub_drop]: Subscriptions left",
+           a == NULL && pubsub->size == 0
+           && trie_size(pubsub->patterns) == 0);
+
+    pubsub_destroy(pubsub);
+
+    printf(" [pubsub::pubsub_oldest]: OK\n");
+    return 0;
+}
+
+/*
+ * Tests the decoding of requests whose payload doesn't match their command,
+ * alone and inside a transaction
+ */
+static char *test_unpack_triedb_request(void) {
+    union triedb_request req;
+    unsigned char put[] = { 0, 0, 0, 0, 0, 3, 'f', 'o', 'o', 'v', 0 };
+    unsigned char shortput[] = { 0, 0, 0, 0, 0xff, 0xff, 0 };
+    unsigned char ttl[] = { 0, 0, 0, 60, 'f', 'o', 'o', 0 };
+    unsigned char txn[] = { 0, 1, PUT << 4, 7, 0, 0, 0, 0, 0x7f, 0xff, 'x', 0 };
+
+    ASSERT("[! unpack_triedb_request]: PUT not decoded",
+           unpack_triedb_request(put, &req, PUT << 4, 10) == 0
+           && req.put.keylen == 3 && req.put.vallen == 1
+           && strcmp((char *) req.put.key, "foo") == 0
+           && req.put.val[0] == 'v');
+    ASSERT("[! unpack_triedb_request]: key past the payload decoded",
+           unpack_triedb_request(shortput, &req, PUT << 4, 6) < 0);
+    ASSERT("[! unpack_triedb_request]: TTL not decoded",
+           unpack_triedb_request(ttl, &req, TTL << 4, 7) == 0
+           && req.ttl.ttl == 60 && req.ttl.keylen == 3
+           && strcmp((char *) req.ttl.key, "foo") == 0);
+    ASSERT("[! unpack_triedb_request]: TTL with no room for the ttl decoded",
+           unpack_triedb_request(ttl, &req, TTL << 4, 3) < 0);
+    ASSERT("[! unpack_triedb_request]: command with no decoder decoded",
+           unpack_triedb_request(put, &req, CNT << 4, 10) < 0);
+
+    union triedb_request *reqs = NULL;
+    ASSERT("[! unpack_transaction]: malformed command decoded",
+           unpack_transaction(txn, 11, &reqs) < 0 && reqs == NULL);
+
+    printf(" [protocol::unpack_triedb_request]: OK\n");
+    return 0;
+}
+
+
+/*
+ * Tests a prefix GET once all the keys under the prefix are deleted, their
+ * trie nodes are still there but no key is found
+ */
+static char *test_get_response_empty(void) {
+    struct database db;
+    database_init(&db, "test", trie_node_destructor);
+    struct Trie *root = db.data;
+    database_insert(&db, "abc", "x", 1, -1);
+    database_insert(&db, "abd", "y", 1, -1);
+    database_remove(&db, "abc");
+    database_remove(&db, "abd");
+
+    const char *prefixes[] = { "ab", "" };
+
+    for (int i = 0; i < 2; ++i) {
+        Vector *v = database_prefix_search(&db, prefixes[i]);
+        ASSERT("[! get_response]: keys deleted found under the prefix",
+               v && vector_size(v) == 0);
+        ASSERT("[! get_response]: response built without keys",
+               get_response((GET << 4) | 0x08, v) == NULL);
+        ASSERT("[! join_response]: response built without keys",
+               join_response(JOIN << 4, v) == NULL);
+        tfree(v->items);
+        tfree(v);
+    }
+
+    trie_destroy(root);
+    printf(" [protocol::get_response]: OK\n");
+    return 0;
+}
+
+static char *test_pack_response_get(void) {
+    struct database db;
+    database_init(&db, "test", trie_node_destructor);
+    struct Trie *root = db.data;
+    const unsigned char binary[] = { 'b', 0, 'i', 0, 'n' };
+    static unsigned char big[70000];
+    memset(big, 'x', sizeof(big));
+    big[0] = 0;
+    static unsigned char zip[4096];
+    memset(zip, 'z', sizeof(zip));
+    database_insert(&db, "kbin", binary, sizeof(binary), -1);
+    database_insert(&db, "kbig", big, sizeof(big), -1);
+    db.compress_min = 1024;
+    database_insert(&db, "kzip", zip, sizeof(zip), -1);
+
+    Vector *v = database_prefix_search(&db, "k");
+    struct get_response *response = get_response((GET << 4) | 0x08, v);
+
+    // Values are pinned, the items can go away before the reply is packed
+    database_remove(&db, "kbig");
+    database_remove(&db, "kzip");
+    get_response_expand(response);
+
+    union triedb_response r = { .get_res = *response };
+    unsigned char *raw = pack_response(&r, GET);
+
+    const unsigned char *p = raw + 1;
+    unsigned pos = 0;
+    size_t len = decode_length(&p, &pos);
+    const unsigned char *end = p + len;
+    bool ok = unpacku16((unsigned char *) p) == 3;
+    int found = 0;
+
+    for (p += 2; ok && p < end; ++found) {
+        unsigned short keylen = unpacku16((unsigned char *) p + 4);
+        const unsigned char *key = p + 6;
+        size_t vallen = unpacku32((unsigned char *) key + keylen);
+        const unsigned char *val = key + keylen + 4;
+        if (keylen == 4 && memcmp(key, "kbin", 4) == 0)
+            ok = vallen == sizeof(binary) && memcmp(val, binary, vallen) == 0;
+        else if (keylen == 4 && memcmp(key, "kzip", 4) == 0)
+            ok = vallen == sizeof(zip) && memcmp(val, zip, vallen) == 0;
+        else
+            ok = keylen == 4 && memcmp(key, "kbig", 4) == 0
+                && vallen == sizeof(big) && memcmp(val, big, vallen) == 0;
+        p = val + vallen;
+    }
+
+    ASSERT("[! pack_response]: prefix GET values not packed whole",
+           ok && found == 3 && p == end);
+
+    for (int i = 0; i < vector_size(v); ++i) {
+        struct kv_obj *kv = vector_get(v, i);
+        tfree((void *) kv->key);
+        tfree(kv);
+    }
+    tfree(v->items);
+    tfree(v);
+    get_response_destroy(response);
+    tfree(raw);
+    trie_destroy(root);
+    printf(" [protocol::pack_response]: OK\n");
+    return 0;
+}
+
+
 /*
  * All datastructure tests
  */
@@ -691,9 +1472,16 @@ char *structures_test() {
     RUN_TEST(test_trie_find);
     RUN_TEST(test_trie_delete);
     RUN_TEST(test_trie_prefix_delete);
+    RUN_TEST(test_trie_prune);
     RUN_TEST(test_trie_prefix_count);
+    RUN_TEST(test_trie_prefix_find);
     RUN_TEST(test_database_prefix_inc);
     RUN_TEST(test_trie_prefix_dec);
+    RUN_TEST(test_database_insert_pinned);
+    RUN_TEST(test_database_insert_version);
+    RUN_TEST(test_db_item_add);
+    RUN_TEST(test_db_item_encoding);
+    RUN_TEST(test_database_compression);
     RUN_TEST(test_vector_append);
     RUN_TEST(test_vector_set);
     RUN_TEST(test_vector_get);
@@ -702,8 +1490,21 @@ char *structures_test() {
     RUN_TEST(test_hashtable_put);
     RUN_TEST(test_hashtable_get);
     RUN_TEST(test_hashtable_del);
+    RUN_TEST(test_hashtable_resize);
+    RUN_TEST(test_hashtable_rehash_step);
+    RUN_TEST(test_hash);
     RUN_TEST(test_cluster_add_new_node);
     RUN_TEST(test_cluster_get_node);
+    RUN_TEST(test_histogram_percentile);
+    RUN_TEST(test_slowlog_push);
+    RUN_TEST(test_wheel_advance);
+    RUN_TEST(test_lzf_compress);
+    RUN_TEST(test_pubsub_publish);
+    RUN_TEST(test_pubsub_covered);
+    RUN_TEST(test_pubsub_oldest);
+    RUN_TEST(test_unpack_triedb_request);
+    RUN_TEST(test_get_response_empty);
+    RUN_TEST(test_pack_response_get);
 
     return 0;
 }